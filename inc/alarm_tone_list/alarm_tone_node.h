@@ -25,6 +25,7 @@ int del_alarm_tone(uint32_t time_stamp);
 void clean_alarm_tone_list();
 void show_alarm_tone_list();
 int init_alarm_tone_hash_engine();
+int load_alarm_tone_hash_engine();
 
 #endif
 
@@ -3,9 +3,22 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
 
 #define safe_free(p) do { if (p) { free(p); p = NULL; } } while(0)
 
+#define HASH_ALL_SLOTS ((uint32_t)-1)	// 遍历、批量删除时表示所有哈希槽，哈希槽个数会增长，不要用初始个数代替
+#define HASH_MAX_SLOT_CNT (1 << 20)
+
+#define HASH_MAGIC 0x48534846		// "FHSH"，哈希文件头部的前4个字节
+#define HASH_VERSION 1				// 文件格式改变时加1，旧版本的文件在 GENTLE_INIT 时重建
+
+#define HASH_BLOB_ALIGN 16			// 变长存储时数据块按16字节取整
+#define HASH_BLOB_CLASS_CNT 32		// 空闲数据块按容量分级，超过 HASH_BLOB_ALIGN * HASH_BLOB_CLASS_CNT 的都放在最后一级
+#define HASH_BLOB_EXTENT_SIZE 4096	// 数据块区每次在末尾扩展的长度
+#define HASH_AUX_CNT 4				// 每个文件可以保存的附加数据个数
+#define HASH_RANK_LEAF_CAP 128		// 位置索引每个叶子最多记录的节点个数
+
 // 遍历拿到所需数据后采取的动作，可以通过 “|” 的方式叠加动作
 typedef enum {
 	TRAVERSE_ACTION_DO_NOTHING = 1,
@@ -26,8 +39,8 @@ typedef enum {
 } traverse_by_what_t;
 
 typedef enum {
-	GENTLE_INIT,
-	FORCE_INIT,
+	GENTLE_INIT,	// 已有文件的版本、格式和配置都一致时直接使用，否则重建
+	FORCE_INIT,		// 总是删除已有文件后重建
 } init_method_t;
 
 typedef struct {
@@ -46,6 +59,7 @@ typedef struct {
 typedef struct {
 	bool is_first_node;	// 表示是否是逻辑第一个节点
 	uint32_t key;	
+	uint64_t index_key;	// 索引键，由上层填充，0表示不建索引；声明了键字段时由引擎计算
 	void* value;
 } hash_node_data_t;
 
@@ -54,6 +68,7 @@ typedef struct {
 	uint8_t used;
 	offset_t offsets;		//每个节点的偏移量信息
 	hash_node_data_t data;
+	off_t rank_leaf;		// 位置索引中记录该节点的叶子，没有位置索引时为0
 } hash_node_t;
 
 /*****************************************************/
@@ -72,19 +87,316 @@ typedef struct {
 typedef struct {
 	off_t first_logic_node_offset;	// 记录排序后第一个节点位置
 	uint32_t node_cnt;				// 记录每个槽中节点个数
+	off_t free_node_offset;			// 空闲节点栈顶，0表示没有。空闲节点之间用 offsets.logic_next 串起来
+	off_t first_physic_node_offset;	// 物理链表的第一个节点，分裂时可能换成其他节点
+	off_t rank_dir_offset;			// 位置索引的叶子目录，0表示还没有分配，见 hash_config_t.rank_index
+	uint32_t rank_dir_cap;			// 叶子目录的容量（项数）
+	uint32_t rank_leaf_cnt;			// 叶子个数
 } slot_info_t;
 
-// 记录哈希链表的一些属性，由上层填充
+/*
+ * 变长存储时节点后面只保存数据块的位置，节点数据按实际长度保存在数据块区中。
+ * 数据块属于节点，节点删除后仍然留着，复用时放得下就直接覆盖；放不下时换一个更大的，旧的按容量放回空闲链表
+ */
+typedef struct {
+	off_t offset;		// 0表示还没有分配
+	uint32_t cap;		// 数据块容量，实际长度由节点数据的内容决定
+} hash_blob_t;
+
+// 附加数据：上层自己解释的一段变长数据（比如字典、排列），同样保存在数据块区中
+typedef struct {
+	off_t offset;
+	uint32_t cap;
+	uint32_t len;		// 实际长度，0表示没有
+} hash_aux_t;
+
+/*
+ * 记录哈希链表的一些属性，由上层填充
+ * 哈希槽按线性哈希增长：每轮从第0个槽开始依次分裂，第 split_slot 个槽分裂出第 (base_slot_cnt << split_level) + split_slot 个槽，
+ * 一轮分裂完 split_level 加1。key 小于 slot_cnt 时所在的哈希槽就是 key 本身，没有分裂过时和 key % slot_cnt 一致
+ */
 typedef struct {
+	uint32_t magic;					// HASH_MAGIC
+	uint32_t version;				// 创建文件时的 HASH_VERSION
+	uint32_t format_crc;			// 版本及创建后不再变化的配置字段的 CRC32，打开文件时校验
 	uint32_t slot_cnt;
+	uint32_t base_slot_cnt;			// 初始化时的哈希槽个数
+	uint32_t split_level;
+	uint32_t split_slot;			// 下一个要分裂的哈希槽
+	uint32_t split_threshold;		// 哈希槽的平均节点数超过它时插入后自动分裂，0表示不自动分裂
+	uint32_t slot_cap;				// 目录（哈希槽信息数组）的容量，不够时在末尾重建
+	off_t slots_offset;				// 目录在文件中的位置
+	off_t header_data_offset;		// 头部附加数据的位置，不随目录移动
 	uint32_t header_data_value_size;
 	uint32_t node_data_value_size;
+	off_t file_size;				// 已使用区域的长度，新节点从这里分配。mmap模式下文件按块预分配，实际长度可能更大
+	off_t index_offset;				// 索引表位置，容量不够时在末尾重建
+	uint32_t index_cap;				// 索引表容量，0表示没有索引
+	uint32_t index_cnt;
+	uint32_t index_tombstone_cnt;
+	uint32_t key_field_offset;		// 键字段，见 hash_config_t
+	uint32_t key_field_size;
+	uint32_t key_field_flags;
+	bool varlen_value;				// 变长存储，见 hash_config_t
+	uint32_t value_tail_offset;
+	bool rank_index;				// 位置索引，见 hash_config_t
+	off_t blob_extent_offset;		// 当前数据块区中下一个可分配的位置
+	uint32_t blob_extent_left;		// 当前数据块区剩余的长度
+	off_t blob_free[HASH_BLOB_CLASS_CNT];	// 各级空闲数据块链表，0表示没有
+	hash_aux_t aux[HASH_AUX_CNT];
 	slot_info_t *slots;
 	hash_header_data_t data;
 } hash_header_t;
 
+// 索引表项，offset 为0表示空位
+typedef struct {
+	uint64_t index_key;
+	off_t offset;
+} hash_index_entry_t;
+
+/*
+ * 键字段：节点数据中用来区分节点的一段内容（比如歌曲路径）。声明后 index_key 由引擎对这段内容做哈希得到，
+ * 上层不用再自己计算；加上 HASH_KEY_FIELD_SLOT 时 key 也由哈希值决定，节点均匀分布到各个哈希槽，
+ * 只适合不关心节点先后顺序的集合，按 key 分组的链表（比如播放列表）不要加
+ */
+typedef enum {
+	HASH_KEY_FIELD_BYTES  = 0,			// 定长的字节串
+	HASH_KEY_FIELD_STRING = (1 << 0),	// 以'\0'结尾的字符串，最多 key_field_size 字节
+	HASH_KEY_FIELD_SLOT   = (1 << 1),	// 按内容分配哈希槽，上层填的 key 被忽略
+} hash_key_field_flag_t;
+
+// 初始化哈希引擎所需的配置
+typedef struct {
+	uint32_t slot_cnt;
+	uint32_t node_data_value_size;
+	uint32_t header_data_value_size;
+	uint32_t index_cap;		// 索引表初始容量，0表示不建索引，装满前会自动扩展
+	uint32_t split_threshold;	// 哈希槽平均节点数超过它时自动分裂，0表示哈希槽个数固定
+	uint32_t key_field_offset;	// 键字段在节点数据中的偏移量
+	uint32_t key_field_size;	// 键字段的长度，0表示不声明键字段
+	uint32_t key_field_flags;	// hash_key_field_flag_t 的组合
+	bool varlen_value;			// 节点数据变长存储：节点数据从 value_tail_offset 开始是以'\0'结尾的字符串，
+	uint32_t value_tail_offset;	// 字符串之后的部分不保存，读出时补0。适合末尾是一个长字符串缓冲区的节点数据
+	bool rank_index;			// 位置索引：按逻辑顺序的第几个节点直接定位，不用沿逻辑链表走
+} hash_config_t;
+
 /*****************************************************/
 
+typedef enum {
+	HASH_OPEN_RDONLY = 1,
+	HASH_OPEN_RDWR   = (1 << 1),
+	HASH_OPEN_MMAP   = (1 << 2),	// 将文件映射到内存，节点读写直接访问映射区
+	HASH_OPEN_NOLOCK = (1 << 3),	// 不加多进程锁，只有确定没有其他句柄同时访问文件时才能使用
+} hash_open_flag_t;
+
+// 打开的哈希文件句柄，常驻文件描述符、头部信息及哈希槽信息，
+// 同一文件的多次操作共用一个句柄，避免每次都重新打开、解析文件
+typedef struct {
+	int fd;
+	uint32_t flags;
+	char* path;
+	hash_header_t header;	// header.slots 指向常驻内存的哈希槽信息
+	void* map;				// HASH_OPEN_MMAP 模式下的映射区
+	size_t map_size;
+	uint64_t write_seq;		// 每写一次文件加1，预读缓冲区据此判断是否过期
+	void* locks;			// 线程锁：每个哈希槽一把读写锁，另有头部、映射区的锁
+} hash_handle_t;
+
+// 游标，位于两个节点之间：next 返回后一个节点，prev 返回前一个节点
+typedef struct {
+	hash_handle_t* handle;
+	uint32_t which_slot;
+	traverse_by_what_t by_what;
+	uint32_t slot_cnt;		// 定位时的哈希槽个数，之后有哈希槽分裂过，节点可能已经移走，需要重新定位
+	off_t next_offset;		// next 将要返回的节点，0表示已经到末尾
+	off_t prev_offset;		// prev 将要返回的节点，0表示已经到开头
+	void* ra;				// 预读缓冲区
+} hash_cursor_t;
+
+// 快照导入前后节点位置的对照，按 old_offset 排好序，见 hash_import_snapshot
+typedef struct {
+	off_t old_offset;
+	off_t new_offset;
+} hash_offset_pair_t;
+
+typedef struct {
+	hash_offset_pair_t* pairs;
+	uint32_t cnt;
+} hash_snapshot_map_t;
+
+/************************************************
+ * 统计信息：进程内所有句柄累计，用来找出哪些调用在扫描整条链
+ ***********************************************/
+
+#define HASH_STATS_BUCKETS 24	// 耗时直方图：第0个桶小于1微秒，第 i 个桶在 [2^(i-1), 2^i) 微秒，最后一个桶不设上限
+
+// 统计耗时的接口
+typedef enum {
+	HASH_API_OPEN,
+	HASH_API_GET_HEADER_DATA,
+	HASH_API_SET_HEADER_DATA,
+	HASH_API_GET_NODE,
+	HASH_API_FIND_NODE,
+	HASH_API_UPDATE_NODE,
+	HASH_API_INSERT_NODE,
+	HASH_API_INSERT_NODES,
+	HASH_API_DEL_NODE,
+	HASH_API_DEL_NODES,
+	HASH_API_TRAVERSE,
+	HASH_API_TRAVERSE_PARALLEL,
+	HASH_API_CURSOR,		// hash_cursor_next/prev/seek
+	HASH_API_GET_AUX,
+	HASH_API_UPDATE_AUX,
+	HASH_API_GET_NODE_AT,
+	HASH_API_CNT,
+} hash_api_t;
+
+typedef struct {
+	uint64_t calls;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t histogram[HASH_STATS_BUCKETS];
+} hash_api_stats_t;
+
+// 所有字段都是 uint64_t
+typedef struct {
+	uint64_t read_calls;		// pread/preadv 系统调用次数
+	uint64_t write_calls;		// pwrite/pwritev 系统调用次数
+	uint64_t lock_calls;		// fcntl 文件锁系统调用次数
+	uint64_t remaps;			// mmap 模式下重新映射的次数
+	uint64_t bytes_read;		// 含 mmap 模式下从映射区拷出的字节数
+	uint64_t bytes_written;
+	uint64_t nodes_visited;		// 读取的节点个数（含预读缓冲区中取到的）
+	uint64_t callbacks;			// 调用上层回调的次数
+	hash_api_stats_t apis[HASH_API_CNT];
+} hash_stats_t;
+
+void hash_get_stats(hash_stats_t* output_stats);
+
+void hash_reset_stats(void);
+
+// 打印统计信息
+void hash_dump_stats(void);
+
+/************************************************
+ * 句柄接口：hash_open 之后可以反复调用，最后 hash_close
+ * 默认对文件加锁，多个进程（或同一进程的多个句柄）可以同时操作同一个文件：
+ * 读操作共享、写操作独占各自的哈希槽，不同哈希槽的写操作互不阻塞；分裂哈希槽时短暂独占整个目录
+ * 同一个句柄也可以在多个线程中同时使用，加锁规则相同；遍历的回调中不能再用同一句柄操作正在遍历的哈希槽
+ ***********************************************/
+
+// 打开哈希文件，flags 为 hash_open_flag_t 的组合，失败返回NULL
+hash_handle_t* hash_open(const char* path, uint32_t flags);
+
+void hash_close(hash_handle_t* handle);
+
+int hash_get_slot_node_cnt(hash_handle_t* handle, uint32_t which_slot);
+
+bool hash_is_slot_empty(hash_handle_t* handle, uint32_t which_slot);
+
+int hash_get_header_data(hash_handle_t* handle, hash_header_data_t* output_header_data);
+
+int hash_set_header_data(hash_handle_t* handle, hash_header_data_t* input_header_data);
+
+// 读取第 which 个附加数据，最多读 size 字节，返回附加数据的实际长度，出错返回-1
+int hash_get_aux(hash_handle_t* handle, uint32_t which, void* buf, uint32_t size);
+
+// 同 hash_get_aux，但从附加数据的第 from 个字节开始读，只需要其中一段时不用整个读出来
+int hash_get_aux_at(hash_handle_t* handle, uint32_t which, uint32_t from, void* buf, uint32_t size);
+
+// 独占头部，把第 which 个附加数据读到缓冲区交给 cb 修改，cb 返回新的长度（不超过 size）后写回
+// cb 返回负数表示不用修改。返回修改后的长度，出错返回-1；其他句柄同时修改也不会丢失更新
+int hash_update_aux(hash_handle_t* handle, uint32_t which, uint32_t size,
+		int (*cb)(void* buf, uint32_t len, void* input_arg), void* input_arg);
+
+int hash_get_node(hash_handle_t* handle, uint32_t which_slot, off_t offset, hash_node_t* output_node);
+
+// 按逻辑顺序取第 index 个节点（从0开始），返回节点偏移量，index 超出节点个数返回0，出错返回-1
+// 有位置索引时只读叶子目录和一个叶子，否则沿逻辑链表从较近的一端走过去
+off_t hash_get_node_at(hash_handle_t* handle, uint32_t which_slot, uint32_t index, hash_node_t* output_node);
+
+// 按 input_node_data->index_key 查找节点（没有索引时用cb扫描 key 对应的哈希槽）
+// 找到返回节点偏移量，没找到返回0，出错返回-1
+off_t hash_find_node(hash_handle_t* handle, hash_node_data_t* input_node_data, hash_node_t* output_node,
+		bool (*cb)(hash_node_data_t*, hash_node_data_t*));
+
+// 更新指定偏移量节点的数据部分
+int hash_update_node(hash_handle_t* handle, off_t offset, hash_node_t* input_node);
+
+// 有索引且 input_prev_node_data->index_key 不为0时，通过索引查找前驱节点
+int hash_insert_node(hash_handle_t* handle,
+		hash_node_data_t* input_prev_node_data, hash_node_data_t* input_curr_node_data,
+		bool (*cb)(hash_node_data_t*, hash_node_data_t*));
+
+// 批量插入，cnt 个节点按数组顺序接在前驱节点之后，必须属于同一个哈希槽
+// 新节点在文件末尾连续分配，哈希槽信息只保存一次；按内容分槽时逐个插入
+int hash_insert_nodes(hash_handle_t* handle, hash_node_data_t* input_prev_node_data,
+		hash_node_data_t* input_node_datas, uint32_t cnt,
+		bool (*cb)(hash_node_data_t*, hash_node_data_t*));
+
+// 有索引且 input_node_data->index_key 不为0时，通过索引查找待删除节点
+int hash_del_node(hash_handle_t* handle, hash_node_data_t* input_node_data,
+		bool (*cb)(hash_node_data_t*, hash_node_data_t*));
+
+// 批量删除，沿逻辑链表走一遍，删除所有 cb 返回true的节点，哈希槽信息只保存一次
+// which_slot 的含义同 hash_traverse_nodes，返回删除的节点个数，出错返回-1
+int hash_del_nodes(hash_handle_t* handle, uint32_t which_slot,
+		bool (*cb)(hash_node_data_t* file_node_data, void* input_arg), void* input_arg);
+
+uint8_t hash_traverse_nodes(hash_handle_t* handle, traverse_by_what_t by_what,
+		uint32_t which_slot, printable_t printable, void* input_arg,
+		traverse_action_t (*cb)(hash_node_data_t* file_node_data, void* input_arg));
+
+// 并行遍历所有哈希槽，每个线程每次领取一个哈希槽，thread_cnt 为0时按CPU个数
+// cb 会在多个线程中同时被调用，需要自己保证线程安全；每个线程独占正在遍历的哈希槽，更新、删除节点可以并行
+// 返回1表示回调要求停止遍历，有线程出错时其他线程尽快停下并返回-1
+int hash_traverse_nodes_parallel(hash_handle_t* handle, traverse_by_what_t by_what,
+		uint32_t thread_cnt, void* input_arg,
+		traverse_action_t (*cb)(hash_node_data_t* file_node_data, void* input_arg));
+
+// 依次分裂 cnt 个哈希槽，每次只短暂独占目录，期间其他句柄可以正常读写
+// 节点在文件中的位置不变，只是挂到新的哈希槽上，返回分裂后的哈希槽个数，出错返回-1
+int hash_split_slots(hash_handle_t* handle, uint32_t cnt);
+
+/************************************************
+ * 游标接口：在打开的句柄上逐个访问某个哈希槽的节点，可以随时暂停
+ * 游标使用期间句柄不能关闭
+ ***********************************************/
+
+// 打开游标，位于第一个节点之前，失败返回NULL
+hash_cursor_t* hash_cursor_open(hash_handle_t* handle, uint32_t which_slot, traverse_by_what_t by_what);
+
+// 返回下一个（上一个）节点的偏移量，节点内容读到 output_node，到末尾（开头）返回0，出错返回-1
+// 定位之后有哈希槽分裂过也返回-1，需要重新 seek
+off_t hash_cursor_next(hash_cursor_t* cursor, hash_node_t* output_node);
+off_t hash_cursor_prev(hash_cursor_t* cursor, hash_node_t* output_node);
+
+// 移动到 offset 处的节点之前，之后 next 返回该节点。offset 为0时回到第一个节点之前
+int hash_cursor_seek(hash_cursor_t* cursor, off_t offset);
+
+void hash_cursor_close(hash_cursor_t* cursor);
+
+/************************************************
+ * 快照接口：把哈希文件导出成紧凑的顺序格式（节点按逻辑顺序紧密排列，带校验和），
+ * 导入时映射整个快照、顺序写出一个可以直接使用的哈希文件，比逐个节点插入重建快得多
+ ***********************************************/
+
+// 导出到 snapshot_path，期间所有哈希槽只读。先写临时文件再改名，不会留下不完整的快照
+int hash_export_snapshot(hash_handle_t* handle, const char* snapshot_path);
+
+// 导入后节点的位置会变化，上层记录的节点位置通过它换算，快照中没有这个节点时返回0
+off_t hash_snapshot_map_offset(const hash_snapshot_map_t* map, off_t old_offset);
+
+// 用快照重建 path，原来的内容被替换，校验失败或出错时 path 保持原样
+// cb 不为NULL时在新文件建好、换掉旧文件之前调用，用 map 修正上层保存的节点位置（头部附加数据、附加数据等），返回负数表示失败
+// path 上已经打开的句柄要重新打开才能看到导入的内容
+int hash_import_snapshot(const char* snapshot_path, const char* path,
+		int (*cb)(hash_handle_t* handle, const hash_snapshot_map_t* map, void* input_arg), void* input_arg);
+
+/************************************************
+ * 路径接口：每次调用都会打开、关闭一次文件
+ ***********************************************/
+
 // 指定哈希槽节点个数，异常时返回-1
 int get_slot_node_cnt(const char* path, uint32_t which_slot);
 
@@ -102,22 +414,48 @@ int set_header_data(const char* path, hash_header_data_t* input_header);
 // 获取指定偏移量节点信息
 int get_node(const char* path, uint32_t which_slot, off_t offset, hash_node_t* output_node);
 
+// 获取逻辑顺序第 index 个节点信息，返回值同 hash_get_node_at
+off_t get_node_at(const char* path, uint32_t which_slot, uint32_t index, hash_node_t* output_node);
+
 // 添加节点
 int insert_node(const char* path,
 		hash_node_data_t* input_prev_node_data, hash_node_data_t* input_curr_node_data,
 		bool (*cb)(hash_node_data_t*, hash_node_data_t*));
 
+// 批量添加节点
+int insert_nodes(const char* path, hash_node_data_t* input_prev_node_data,
+		hash_node_data_t* input_node_datas, uint32_t cnt,
+		bool (*cb)(hash_node_data_t*, hash_node_data_t*));
+
 // 删除节点
 int del_node(const char* path, hash_node_data_t* input_node_data,
 		bool (*cb)(hash_node_data_t*, hash_node_data_t*));
 
-// which_slot小于slot_cnt则遍历指定哈希槽，如果大于slot_cnt则遍历所有哈希槽
+// 批量删除节点，返回删除的节点个数
+int del_nodes(const char* path, uint32_t which_slot,
+		bool (*cb)(hash_node_data_t* file_node_data, void* input_arg), void* input_arg);
+
+// which_slot小于slot_cnt则遍历指定哈希槽，否则遍历所有哈希槽（可以用 HASH_ALL_SLOTS）
 uint8_t traverse_nodes(const char* list_path, traverse_by_what_t by_what,
 		uint32_t which_slot, printable_t printable, void* input_arg,
 		traverse_action_t (*cb)(hash_node_data_t* file_node_data, void* input_arg));
 
+// 并行遍历所有哈希槽，cb 需要线程安全，返回值同 hash_traverse_nodes_parallel
+int traverse_nodes_parallel(const char* list_path, traverse_by_what_t by_what,
+		void* input_arg, traverse_action_t (*cb)(hash_node_data_t* file_node_data, void* input_arg));
+
+// 打开 path 导出快照，见 hash_export_snapshot
+int export_snapshot(const char* path, const char* snapshot_path);
+
+// 根据内容计算64位哈希值（xxHash64 算法，种子为0），可以用作 index_key
+uint64_t hash_key64(const void* data, size_t len);
+
 // 初始化哈希引擎，告知所需信息
 int init_hash_engine(const char* path, init_method_t rebuild,
 		int hash_slot_cnt, int node_data_value_size, int header_data_value_size);
 
+// 初始化哈希引擎，通过 config 指定索引等可选功能
+// GENTLE_INIT 时只读一次已有文件的头部，版本、校验和及 config 中的格式字段都一致就直接使用，不重建
+int init_hash_engine_ex(const char* path, init_method_t rebuild, hash_config_t* config);
+
 #endif
@@ -0,0 +1,60 @@
+#ifndef __HASH_LOG_H__
+#define __HASH_LOG_H__
+
+#include <stdint.h>
+
+/************************************************
+ * 分级日志：低于编译期阈值 HASH_LOG_LEVEL 的日志整条编译掉，参数也不会求值；
+ * 其余日志在调用线程里格式化成定长记录，写入无锁环形缓冲区后立即返回，
+ * 由后台线程统一输出到 stdout，插入等路径不再被串口上的同步 printf 拖慢
+ ***********************************************/
+
+#define HASH_LOG_LEVEL_DEBUG 0
+#define HASH_LOG_LEVEL_INFO 1
+#define HASH_LOG_LEVEL_WARN 2
+#define HASH_LOG_LEVEL_ERROR 3
+#define HASH_LOG_LEVEL_NONE 4
+
+// 编译时用 -DHASH_LOG_LEVEL=0 打开所有日志
+#ifndef HASH_LOG_LEVEL
+#define HASH_LOG_LEVEL HASH_LOG_LEVEL_WARN
+#endif
+
+#define HASH_LOG_MSG_SIZE 224		// 每条日志消息的最大长度，超出部分被截断
+#define HASH_LOG_RING_SIZE 512		// 环形缓冲区的记录个数，必须是2的幂；写满后调试、信息日志被丢弃并计数，警告、错误同步输出
+
+// module 和 func 只保存指针，必须是字符串常量
+void hash_log_write(uint8_t level, const char* module, const char* func, uint32_t line, const char* fmt, ...)
+	__attribute__((format(printf, 5, 6)));
+
+// 等待缓冲区中已有的日志全部输出。进程退出时先停止后台线程再输出剩下的日志，之后的日志同步输出
+void hash_log_flush(void);
+
+// 因缓冲区写满而丢弃的日志条数
+uint64_t hash_log_dropped(void);
+
+#if HASH_LOG_LEVEL <= HASH_LOG_LEVEL_DEBUG
+#define hash_log_debug(module, fmt, ...) hash_log_write(HASH_LOG_LEVEL_DEBUG, module, __func__, __LINE__, fmt, ##__VA_ARGS__)
+#else
+#define hash_log_debug(module, fmt, ...)
+#endif
+
+#if HASH_LOG_LEVEL <= HASH_LOG_LEVEL_INFO
+#define hash_log_info(module, fmt, ...) hash_log_write(HASH_LOG_LEVEL_INFO, module, __func__, __LINE__, fmt, ##__VA_ARGS__)
+#else
+#define hash_log_info(module, fmt, ...)
+#endif
+
+#if HASH_LOG_LEVEL <= HASH_LOG_LEVEL_WARN
+#define hash_log_warn(module, fmt, ...) hash_log_write(HASH_LOG_LEVEL_WARN, module, __func__, __LINE__, fmt, ##__VA_ARGS__)
+#else
+#define hash_log_warn(module, fmt, ...)
+#endif
+
+#if HASH_LOG_LEVEL <= HASH_LOG_LEVEL_ERROR
+#define hash_log_error(module, fmt, ...) hash_log_write(HASH_LOG_LEVEL_ERROR, module, __func__, __LINE__, fmt, ##__VA_ARGS__)
+#else
+#define hash_log_error(module, fmt, ...)
+#endif
+
+#endif
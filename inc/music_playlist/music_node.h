@@ -35,6 +35,9 @@ typedef struct {
 	off_t next;
 	off_t saved_offset;	// 记录上一次播放记录
 	char name[MAX_PLAYLIST_NAME_LEN];
+	bool shuffle;			// 随机播放，上下首按随机排列切换
+	uint32_t shuffle_pos;	// 当前歌曲在随机排列中的位置
+	uint32_t shuffle_seed;	// 随机排列用的随机数状态
 } playlist_t;
 
 typedef struct {
@@ -47,7 +50,7 @@ typedef struct {
 typedef struct {
 	action_t delete_or_not;		// 判断歌曲是否删除
 	uint32_t which_slot;
-	char path[MAX_MUSIC_PATH_LEN];
+	char path[MAX_MUSIC_PATH_LEN];	// 接口中总是完整路径，文件中保存的是压缩了目录前缀的编码
 } music_data_value_t;
 
 typedef enum {
@@ -59,14 +62,25 @@ void _show_playlist(const char* list_path);
 void _clean_playlist(const char* list_path);
 void _pre_diff_playlist(const char* list_path, uint32_t slot_cnt, const char* download_list_path, const char* delete_list_path);
 void _post_diff_playlist(const char* list_path, const char* download_list_path, const char* delete_list_path);
+int _diff_playlist(const char* list_path, const music_data_value_t* musics, uint32_t cnt,
+		const char* download_list_path, const char* delete_list_path);
 int _get_first_node(const char* list_path, uint32_t which_slot, music_data_value_t* music_data_value);
 int _get_playlist_music_cnt(const char* list_path, uint32_t which_slot);
 int _get_playlist_header(const char* func, const int line, const char* path, playlist_header_data_value_t* header_data_value);
 int _set_playlist_header(const char* func, const int line, const char* path, playlist_header_data_value_t* header_data_value);
 int _get_music(const char* list_path, uint32_t which_slot, direction_t prev_or_next);
+int _set_shuffle(const char* list_path, uint32_t which_slot, bool shuffle);
+int _get_music_at(const char* list_path, uint32_t which_slot, uint32_t index, music_data_value_t* music_data_value);
+int _list_musics(const char* list_path, uint32_t which_slot, off_t* from_offset, music_data_value_t* musics, uint32_t cnt);
 int _insert_music(const char* list_path, uint32_t which_slot, const music_data_value_t* prev_music_data_value, const music_data_value_t* curr_music_data_value);
+int _insert_musics(const char* list_path, uint32_t which_slot, const music_data_value_t* prev_music_data_value, const music_data_value_t* musics, uint32_t cnt);
+int _import_playlist(const char* list_path, uint32_t which_slot, const char* file_path);
 int _delete_music(const char* list_path, uint32_t which_slot, const char* path);
+int _delete_musics(const char* list_path, uint32_t which_slot, const char** paths, uint32_t cnt);
+int _save_playlist(const char* list_path, const char* snapshot_path);
+int _restore_playlist(const char* list_path, const char* snapshot_path);
 int _init_music_hash_engine(const char* path, uint32_t slot_cnt);
+int _load_music_hash_engine(const char* path, uint32_t slot_cnt);
 
 /********************** 故事收藏 调用这些函数 **********************/
 #define show_story_playlist() _show_playlist(STORY_PLAYLIST_PATH)
@@ -77,6 +91,7 @@ int _init_music_hash_engine(const char* path, uint32_t slot_cnt);
 
 #define pre_diff_story_playlist() _pre_diff_playlist(STORY_PLAYLIST_PATH, STORY_SLOT_CNT, STORY_DOWNLOAD_LIST_PATH, STORY_DELETE_LIST_PATH)
 #define post_diff_story_playlist() _post_diff_playlist(STORY_PLAYLIST_PATH, STORY_DOWNLOAD_LIST_PATH, STORY_DELETE_LIST_PATH)
+#define sync_story_playlist(musics, cnt) _diff_playlist(STORY_PLAYLIST_PATH, musics, cnt, STORY_DOWNLOAD_LIST_PATH, STORY_DELETE_LIST_PATH)
 
 #define get_story_playlist_music_cnt() _get_playlist_music_cnt(STORY_PLAYLIST_PATH, 0)
 
@@ -85,14 +100,22 @@ int _init_music_hash_engine(const char* path, uint32_t slot_cnt);
 
 #define get_story_prev_music() _get_music(STORY_PLAYLIST_PATH, 0, PREV_MUSIC)
 #define get_story_next_music() _get_music(STORY_PLAYLIST_PATH, 0, NEXT_MUSIC)
+#define set_story_shuffle(shuffle) _set_shuffle(STORY_PLAYLIST_PATH, 0, shuffle)
+#define get_story_music_at(index, music_data_value) _get_music_at(STORY_PLAYLIST_PATH, 0, index, music_data_value)
+#define list_story_musics(from_offset, musics, cnt) _list_musics(STORY_PLAYLIST_PATH, 0, from_offset, musics, cnt)
 
 #define insert_story_music(prev_music_data_value, curr_music_data_value) _insert_music(STORY_PLAYLIST_PATH, 0, prev_music_data_value, curr_music_data_value)
+#define import_story_playlist(file_path) _import_playlist(STORY_PLAYLIST_PATH, 0, file_path)
 #define delete_story_music(music_path) _delete_music(STORY_PLAYLIST_PATH, 0, music_path)
+#define delete_story_musics(music_paths, cnt) _delete_musics(STORY_PLAYLIST_PATH, 0, music_paths, cnt)
 
 #define insert_story_music_to_delete_list(prev_music_data_value, curr_music_data_value) _insert_music(STORY_DELETE_LIST_PATH, 0, prev_music_data_value, curr_music_data_value)
 #define insert_story_music_to_download_list(prev_music_data_value, curr_music_data_value) _insert_music(STORY_DOWNLOAD_LIST_PATH, 0, prev_music_data_value, curr_music_data_value)
 
 #define init_story_playlist_hash_engine() _init_music_hash_engine(STORY_PLAYLIST_PATH, STORY_SLOT_CNT)
+#define load_story_playlist_hash_engine() _load_music_hash_engine(STORY_PLAYLIST_PATH, STORY_SLOT_CNT)
+#define save_story_playlist(snapshot_path) _save_playlist(STORY_PLAYLIST_PATH, snapshot_path)
+#define restore_story_playlist(snapshot_path) _restore_playlist(STORY_PLAYLIST_PATH, snapshot_path)
 /*******************************************************************/
 
 /********************** 专辑收藏 调用这些函数 **********************/
@@ -104,6 +127,7 @@ int _init_music_hash_engine(const char* path, uint32_t slot_cnt);
 
 #define pre_diff_album_playlist() _pre_diff_playlist(ALBUM_PLAYLIST_PATH, ALBUM_SLOT_CNT, ALBUM_DOWNLOAD_LIST_PATH, ALBUM_DELETE_LIST_PATH)
 #define post_diff_album_playlist() _post_diff_playlist(ALBUM_PLAYLIST_PATH, ALBUM_DOWNLOAD_LIST_PATH, ALBUM_DELETE_LIST_PATH)
+#define sync_album_playlist(musics, cnt) _diff_playlist(ALBUM_PLAYLIST_PATH, musics, cnt, ALBUM_DOWNLOAD_LIST_PATH, ALBUM_DELETE_LIST_PATH)
 
 #define get_album_music_cnt_in_slot(which_slot) _get_playlist_music_cnt(ALBUM_PLAYLIST_PATH, which_slot)
 
@@ -112,14 +136,22 @@ int _init_music_hash_engine(const char* path, uint32_t slot_cnt);
 
 #define get_album_prev_music_in_slot(which_slot) _get_music(ALBUM_PLAYLIST_PATH, which_slot, PREV_MUSIC)
 #define get_album_next_music_in_slot(which_slot) _get_music(ALBUM_PLAYLIST_PATH, which_slot, NEXT_MUSIC)
+#define set_album_shuffle_in_slot(which_slot, shuffle) _set_shuffle(ALBUM_PLAYLIST_PATH, which_slot, shuffle)
+#define get_album_music_at_in_slot(which_slot, index, music_data_value) _get_music_at(ALBUM_PLAYLIST_PATH, which_slot, index, music_data_value)
+#define list_album_musics_in_slot(which_slot, from_offset, musics, cnt) _list_musics(ALBUM_PLAYLIST_PATH, which_slot, from_offset, musics, cnt)
 
 #define insert_album_music_in_slot(which_slot, prev_music_data_value, curr_music_data_value) _insert_music(ALBUM_PLAYLIST_PATH, which_slot, prev_music_data_value, curr_music_data_value)
+#define import_album_playlist_in_slot(which_slot, file_path) _import_playlist(ALBUM_PLAYLIST_PATH, which_slot, file_path)
 #define delete_album_music_in_slot(which_slot, music_data_value) _delete_music(ALBUM_PLAYLIST_PATH, which_slot, music_data_value)
+#define delete_album_musics_in_slot(which_slot, music_paths, cnt) _delete_musics(ALBUM_PLAYLIST_PATH, which_slot, music_paths, cnt)
 
 #define insert_album_music_to_delete_list_in_slot(which_slot, prev_music_data_value, curr_music_data_value) _insert_music(ALBUM_DELETE_LIST_PATH, which_slot, prev_music_data_value, curr_music_data_value)
 #define insert_album_music_to_download_list_in_slot(which_slot, prev_music_data_value, curr_music_data_value) _insert_music(ALBUM_DOWNLOAD_LIST_PATH, which_slot, prev_music_data_value, curr_music_data_value)
 
 #define init_album_playlist_hash_engine() _init_music_hash_engine(ALBUM_PLAYLIST_PATH, ALBUM_SLOT_CNT)
+#define load_album_playlist_hash_engine() _load_music_hash_engine(ALBUM_PLAYLIST_PATH, ALBUM_SLOT_CNT)
+#define save_album_playlist(snapshot_path) _save_playlist(ALBUM_PLAYLIST_PATH, snapshot_path)
+#define restore_album_playlist(snapshot_path) _restore_playlist(ALBUM_PLAYLIST_PATH, snapshot_path)
 /*******************************************************************/
 
 #endif
@@ -1,36 +1,16 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include "alarm_tone_node.h"
+#include "hash_log.h"
 
-#define ALARM_TONE_INFO 1
-#define ALARM_TONE_DBUG 1
-#define ALARM_TONE_WARN 1
-#define ALARM_TONE_EROR 1
-
-#if ALARM_TONE_INFO
-#define at_info(fmt, ...) printf("\e[0;32m[ALARM_TONE_INFO] [%s %d] : "fmt"\e[0m\n", __func__, __LINE__, ##__VA_ARGS__);
-#else
-#define at_info(fmt, ...)
-#endif
-
-#if ALARM_TONE_DBUG
-#define at_debug(fmt, ...) printf("\e[0m[ALARM_TONE_DBUG] [%s %d] : "fmt"\e[0m\n", __func__, __LINE__, ##__VA_ARGS__);
-#else
-#define at_debug(fmt, ...)
-#endif
-
-#if ALARM_TONE_WARN
-#define at_warn(fmt, ...) printf("\e[0;33m[ALARM_TONE_WARN] [%s %d] : "fmt"\e[0m\n", __func__, __LINE__, ##__VA_ARGS__);
-#else
-#define at_warn(fmt, ...)
-#endif
-
-#if ALARM_TONE_EROR
-#define at_error(fmt, ...) printf("\e[0;31m[ALARM_TONE_EROR] [%s %d] : "fmt"\e[0m\n", __func__, __LINE__, ##__VA_ARGS__);
-#else
-#define at_error(fmt, ...)
-#endif
+#define ALARM_TONE_INDEX_CAP 16
+
+#define at_debug(fmt, ...) hash_log_debug("ALARM_TONE", fmt, ##__VA_ARGS__)
+#define at_info(fmt, ...) hash_log_info("ALARM_TONE", fmt, ##__VA_ARGS__)
+#define at_warn(fmt, ...) hash_log_warn("ALARM_TONE", fmt, ##__VA_ARGS__)
+#define at_error(fmt, ...) hash_log_error("ALARM_TONE", fmt, ##__VA_ARGS__)
 
 bool _add_alarm_tone_cb(hash_node_data_t* file_node_data, hash_node_data_t* input_prev_node_data) {
 	alarm_tone_data_value_t *file_alarm_tone_data_value = (alarm_tone_data_value_t*)(file_node_data->value);
@@ -65,41 +45,60 @@ traverse_action_t _print_alarm_tone_list_cb(hash_node_data_t* file_node_data, vo
 	return TRAVERSE_ACTION_DO_NOTHING;
 }
 
-traverse_action_t _find_alarm_tone_cb(hash_node_data_t* file_node_data, void* input_arg) {
-	int action = TRAVERSE_ACTION_DO_NOTHING;
-	alarm_tone_data_value_t* file_alarm_tone_data_value = (alarm_tone_data_value_t*)(file_node_data->value);
-	alarm_tone_data_value_t* input_alarm_tone_data_value = (alarm_tone_data_value_t*)input_arg;
+int _find_alarm_tone(hash_handle_t* handle, uint32_t time_stamp) {
+	int ret = -1;
+	off_t offset = 0;
+	hash_node_t node;
+	hash_node_data_t node_data;
+	alarm_tone_data_value_t alarm_tone_data_value;
+	alarm_tone_data_value_t file_alarm_tone_data_value;
 
-	if (file_alarm_tone_data_value->time_stamp == input_alarm_tone_data_value->time_stamp) {
-		strncpy(input_alarm_tone_data_value->path, file_alarm_tone_data_value->path, MAX_ALARM_TONE_PATH_LEN);
-		action = TRAVERSE_ACTION_BREAK;
+	memset(&node, 0, sizeof(node));
+	memset(&node_data, 0, sizeof(node_data));
+	memset(&alarm_tone_data_value, 0, sizeof(alarm_tone_data_value));
+	memset(&file_alarm_tone_data_value, 0, sizeof(file_alarm_tone_data_value));
+
+	alarm_tone_data_value.time_stamp = time_stamp;
+
+	node_data.key = 0;
+	node_data.value = &alarm_tone_data_value;
+
+	node.data.value = &file_alarm_tone_data_value;
+
+	if ((offset = hash_find_node(handle, &node_data, &node, _del_alarm_tone_cb)) < 0) {
+		goto exit;
+	}
+
+	if ((ret = offset > 0 ? 1 : 0) > 0) {
+		at_info("found '%d', tone is '%s'", time_stamp, file_alarm_tone_data_value.path);
 	}
 
-	return action;
+exit:
+	return ret;
 }
 
 // 如果返回值大于0，说明找到了节点，再取alarm_tone_path
 int find_alarm_tone(uint32_t time_stamp) {
 	int ret = -1;
-	alarm_tone_data_value_t alarm_tone_data_value;
+	hash_handle_t* handle = NULL;
 
-	memset(&alarm_tone_data_value, 0, sizeof(alarm_tone_data_value));
+	if (NULL == (handle = hash_open(ALARM_TONE_LIST_PATH, HASH_OPEN_RDONLY))) {
+		at_error("open '%s' failed.", ALARM_TONE_LIST_PATH);
+		goto exit;
+	}
 
-	alarm_tone_data_value.time_stamp = time_stamp;
+	ret = _find_alarm_tone(handle, time_stamp);
 
-	if ((ret = traverse_nodes(ALARM_TONE_LIST_PATH,
-					TRAVERSE_BY_LOGIC,
-					0, WITHOUT_PRINT,
-					(void*)&alarm_tone_data_value, _find_alarm_tone_cb)) > 0) {
-		at_info("found '%d', tone is '%s'", time_stamp, alarm_tone_data_value.path);
-	}
+	hash_close(handle);
 
+exit:
 	return ret;
 }
 
 int insert_alarm_tone(const alarm_tone_data_value_t* prev_alarm_tone_data_value,
 		const alarm_tone_data_value_t* curr_alarm_tone_data_value) {
 	int ret = -1;
+	hash_handle_t* handle = NULL;
 	hash_node_data_t prev_node_data;
 	hash_node_data_t curr_node_data;
 
@@ -112,19 +111,28 @@ int insert_alarm_tone(const alarm_tone_data_value_t* prev_alarm_tone_data_value,
 	curr_node_data.key = 0;
 	curr_node_data.value = (void*)curr_alarm_tone_data_value;
 
-	if (find_alarm_tone(curr_alarm_tone_data_value->time_stamp) > 0) {
+	// 查找和插入共用一个句柄，两者都要扫描整条链，使用mmap模式
+	if (NULL == (handle = hash_open(ALARM_TONE_LIST_PATH, HASH_OPEN_RDWR | HASH_OPEN_MMAP))) {
+		at_error("open '%s' failed.", ALARM_TONE_LIST_PATH);
+		goto exit;
+	}
+
+	if (_find_alarm_tone(handle, curr_alarm_tone_data_value->time_stamp) > 0) {
 		at_debug("already exist '%s'", curr_alarm_tone_data_value->path);
 		ret = 0;
-		goto exit;
+		goto close_handle;
 	}
 
-	if (0 != (ret = insert_node(ALARM_TONE_LIST_PATH, &prev_node_data, &curr_node_data, _add_alarm_tone_cb))) {
+	if (0 != (ret = hash_insert_node(handle, &prev_node_data, &curr_node_data, _add_alarm_tone_cb))) {
 		at_error("[ + ] '%s' to '%s' failed!", curr_alarm_tone_data_value->path, ALARM_TONE_LIST_PATH);
-		goto exit;
+		goto close_handle;
 	}
 
 	at_info("[ + ] '%s' to '%s' success.", curr_alarm_tone_data_value->path, ALARM_TONE_LIST_PATH);
 
+close_handle:
+	hash_close(handle);
+
 exit:
 	return ret;
 }
@@ -156,15 +164,41 @@ exit:
 
 void clean_alarm_tone_list() {
 	traverse_nodes(ALARM_TONE_LIST_PATH, TRAVERSE_BY_LOGIC,
-			ALARM_TONE_LIST_SLOT_CNT, WITHOUT_PRINT, NULL, _clean_alarm_tone_list_cb);
+			HASH_ALL_SLOTS, WITHOUT_PRINT, NULL, _clean_alarm_tone_list_cb);
 }
 
 void show_alarm_tone_list() {
 	traverse_nodes(ALARM_TONE_LIST_PATH, TRAVERSE_BY_LOGIC,
-			ALARM_TONE_LIST_SLOT_CNT, WITH_PRINT, NULL, _print_alarm_tone_list_cb);
+			HASH_ALL_SLOTS, WITH_PRINT, NULL, _print_alarm_tone_list_cb);
+}
+
+int _init_alarm_tone_hash_engine(init_method_t rebuild) {
+	hash_config_t config;
+
+	memset(&config, 0, sizeof(hash_config_t));
+
+	config.slot_cnt = ALARM_TONE_LIST_SLOT_CNT;
+	config.node_data_value_size = sizeof(alarm_tone_data_value_t);
+	config.header_data_value_size = 0;
+	config.index_cap = ALARM_TONE_INDEX_CAP;
+
+	// 索引键由引擎根据时间戳计算
+	config.key_field_offset = offsetof(alarm_tone_data_value_t, time_stamp);
+	config.key_field_size = sizeof(uint32_t);
+	config.key_field_flags = HASH_KEY_FIELD_BYTES;
+
+	// 铃声路径按实际长度保存
+	config.varlen_value = true;
+	config.value_tail_offset = offsetof(alarm_tone_data_value_t, path);
+
+	return init_hash_engine_ex(ALARM_TONE_LIST_PATH, rebuild, &config);
 }
 
 int init_alarm_tone_hash_engine() {
-	return init_hash_engine(ALARM_TONE_LIST_PATH, FORCE_INIT,
-			ALARM_TONE_LIST_SLOT_CNT, sizeof(alarm_tone_data_value_t), 0);
+	return _init_alarm_tone_hash_engine(FORCE_INIT);
+}
+
+// 已有的铃声列表格式正确就直接使用，否则重建
+int load_alarm_tone_hash_engine() {
+	return _init_alarm_tone_hash_engine(GENTLE_INIT);
 }
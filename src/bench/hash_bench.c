@@ -0,0 +1,591 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include "hash.h"
+#include "music_node.h"
+
+/*
+ * 哈希引擎性能测试：生成不同规模的链表，统计各个操作的吞吐量和 p50/p99 延迟
+ * 结果以 CSV 或 JSON 输出，方便版本之间对比
+ *
+ *   hash_bench [-n 最大节点数] [-f csv|json] [-o 输出文件] [-m]
+ *
+ * 节点数从 1k 开始每次乘10直到 -n（默认 100k，最大 1M），-m 表示用 mmap 模式打开
+ */
+
+#define BENCH_PATH "hash_bench.db"
+#define BENCH_PLAYLIST_PATH "bench_playlist"
+#define BENCH_DOWNLOAD_LIST_PATH "bench_download_list"
+#define BENCH_DELETE_LIST_PATH "bench_delete_list"
+
+#define BENCH_MIN_NODES 1000
+#define BENCH_MAX_NODES 1000000
+#define BENCH_TRAVERSE_ROUNDS 5
+#define BENCH_MUSIC_MAX_NODES 10000		// 音乐层每首歌都要打开一次文件，规模太大时跑不完
+#define BENCH_INDEX_CAP 1024			// 没有索引时插入、删除都要扫描整条链，规模大了没法测
+#define BENCH_SPLIT_SLOT_CNT 4
+#define BENCH_SPLIT_THRESHOLD 8
+
+#define bench_error(fmt, ...) fprintf(stderr, "\e[0;31m[BENCH_EROR] [%s %d] : "fmt"\e[0m\n", __func__, __LINE__, ##__VA_ARGS__);
+#define bench_info(fmt, ...) fprintf(stderr, "\e[0;32m[BENCH_INFO] : "fmt"\e[0m\n", ##__VA_ARGS__);
+
+typedef enum {
+	BENCH_OUTPUT_CSV,
+	BENCH_OUTPUT_JSON,
+} bench_output_t;
+
+// 一组测试的参数
+typedef struct {
+	uint32_t node_cnt;
+	uint32_t slot_cnt;
+	uint32_t value_size;
+	uint32_t open_flags;
+} bench_case_t;
+
+// 一个操作的测试结果，latencies 为每次操作的耗时（纳秒）
+typedef struct {
+	const char* op;
+	uint64_t* latencies;
+	uint32_t cnt;
+	uint64_t total_ns;
+	uint64_t items;			// 处理的节点数，遍历时一次操作处理整条链
+} bench_result_t;
+
+static const uint32_t s_slot_cnts[] = { 1, 16 };
+static const uint32_t s_value_sizes[] = { 32, 256 };
+
+static FILE* s_out = NULL;
+static bench_output_t s_format = BENCH_OUTPUT_CSV;
+static uint32_t s_row_cnt = 0;
+static uint64_t s_visited = 0;
+
+uint64_t _now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int _cmp_u64(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// 排序后取百分位，单位微秒
+double _percentile_us(uint64_t* sorted, uint32_t cnt, uint32_t pct) {
+	if (0 == cnt) {
+		return 0;
+	}
+
+	return sorted[(uint64_t)(cnt - 1) * pct / 100] / 1000.0;
+}
+
+bool _bench_eq_cb(hash_node_data_t* file_node_data, hash_node_data_t* input_node_data) {
+	return *(uint32_t*)file_node_data->value == *(uint32_t*)input_node_data->value;
+}
+
+traverse_action_t _bench_visit_cb(hash_node_data_t* file_node_data, void* input_arg) {
+	++s_visited;
+	return TRAVERSE_ACTION_DO_NOTHING;
+}
+
+int _result_init(bench_result_t* result, const char* op, uint32_t cap) {
+	memset(result, 0, sizeof(bench_result_t));
+
+	result->op = op;
+
+	if (NULL == (result->latencies = (uint64_t*)calloc(cap > 0 ? cap : 1, sizeof(uint64_t)))) {
+		bench_error("calloc failed.");
+		return -1;
+	}
+
+	return 0;
+}
+
+void _result_add(bench_result_t* result, uint64_t ns, uint64_t items) {
+	result->latencies[result->cnt++] = ns;
+	result->total_ns += ns;
+	result->items += items;
+}
+
+void _emit_result(bench_case_t* bench_case, bench_result_t* result) {
+	double total_ms = result->total_ns / 1000000.0;
+	double items_per_sec = result->total_ns > 0 ? result->items * 1e9 / result->total_ns : 0;
+	double p50 = 0;
+	double p99 = 0;
+
+	qsort(result->latencies, result->cnt, sizeof(uint64_t), _cmp_u64);
+	p50 = _percentile_us(result->latencies, result->cnt, 50);
+	p99 = _percentile_us(result->latencies, result->cnt, 99);
+
+	if (BENCH_OUTPUT_CSV == s_format) {
+		if (0 == s_row_cnt) {
+			fprintf(s_out, "op,nodes,slot_cnt,value_size,mmap,ops,items,total_ms,items_per_sec,p50_us,p99_us\n");
+		}
+
+		fprintf(s_out, "%s,%u,%u,%u,%d,%u,%lu,%.3f,%.1f,%.3f,%.3f\n",
+				result->op, bench_case->node_cnt, bench_case->slot_cnt, bench_case->value_size,
+				(HASH_OPEN_MMAP & bench_case->open_flags) ? 1 : 0,
+				result->cnt, result->items, total_ms, items_per_sec, p50, p99);
+	} else {
+		fprintf(s_out, "%s\n  {\"op\": \"%s\", \"nodes\": %u, \"slot_cnt\": %u, \"value_size\": %u, \"mmap\": %s, "
+				"\"ops\": %u, \"items\": %lu, \"total_ms\": %.3f, \"items_per_sec\": %.1f, \"p50_us\": %.3f, \"p99_us\": %.3f}",
+				0 == s_row_cnt ? "" : ",",
+				result->op, bench_case->node_cnt, bench_case->slot_cnt, bench_case->value_size,
+				(HASH_OPEN_MMAP & bench_case->open_flags) ? "true" : "false",
+				result->cnt, result->items, total_ms, items_per_sec, p50, p99);
+	}
+
+	fflush(s_out);
+	++s_row_cnt;
+
+	bench_info("%-16s nodes %7u slots %2u value %3u : %10.1f items/s, p50 %8.3f us, p99 %8.3f us",
+			result->op, bench_case->node_cnt, bench_case->slot_cnt, bench_case->value_size, items_per_sec, p50, p99);
+
+	safe_free(result->latencies);
+}
+
+void _fill_node_data(hash_node_data_t* node_data, void* value, uint32_t id, uint32_t slot_cnt) {
+	memset(node_data, 0, sizeof(hash_node_data_t));
+
+	*(uint32_t*)value = id;
+
+	node_data->key = id % slot_cnt;
+	node_data->index_key = (uint64_t)id + 1;
+	node_data->value = value;
+}
+
+// 洗牌，决定随机访问、删除的顺序
+void _shuffle(uint32_t* ids, uint32_t cnt) {
+	uint32_t i = 0;
+	uint32_t j = 0;
+	uint32_t tmp = 0;
+
+	for (i = 0; i < cnt; i++) {
+		ids[i] = i;
+	}
+
+	for (i = cnt - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		tmp = ids[i];
+		ids[i] = ids[j];
+		ids[j] = tmp;
+	}
+}
+
+/*
+ * 引擎接口：插入 node_cnt 个节点（每个节点接在同一哈希槽上一个节点之后），
+ * 然后随机读取、按两种顺序遍历，最后随机删除全部节点
+ */
+int _bench_engine(bench_case_t* bench_case) {
+	int ret = -1;
+	uint32_t i = 0;
+	uint32_t id = 0;
+	uint32_t node_cnt = bench_case->node_cnt;
+	uint32_t slot_cnt = bench_case->slot_cnt;
+	uint64_t start = 0;
+	hash_config_t config;
+	hash_handle_t* handle = NULL;
+	hash_cursor_t* cursor = NULL;
+	hash_node_data_t prev_node_data;
+	hash_node_data_t curr_node_data;
+	hash_node_t node;
+	bench_result_t result;
+	void* prev_value = NULL;
+	void* curr_value = NULL;
+	off_t* offsets = NULL;
+	uint32_t* ids = NULL;
+	off_t offset = 0;
+
+	memset(&config, 0, sizeof(hash_config_t));
+	memset(&node, 0, sizeof(hash_node_t));
+	memset(&result, 0, sizeof(bench_result_t));
+
+	config.slot_cnt = slot_cnt;
+	config.node_data_value_size = bench_case->value_size;
+	config.index_cap = BENCH_INDEX_CAP;
+
+	if (NULL == (prev_value = calloc(1, bench_case->value_size))
+			|| NULL == (curr_value = calloc(1, bench_case->value_size))
+			|| NULL == (offsets = (off_t*)calloc(node_cnt, sizeof(off_t)))
+			|| NULL == (ids = (uint32_t*)calloc(node_cnt, sizeof(uint32_t)))) {
+		bench_error("calloc failed.");
+		goto exit;
+	}
+
+	if (init_hash_engine_ex(BENCH_PATH, FORCE_INIT, &config) < 0
+			|| NULL == (handle = hash_open(BENCH_PATH, HASH_OPEN_RDWR | bench_case->open_flags))) {
+		bench_error("prepare %s failed.", BENCH_PATH);
+		goto exit;
+	}
+
+	/* START insert_node */
+	if (_result_init(&result, "insert_node", node_cnt) < 0) {
+		goto exit;
+	}
+
+	for (i = 0; i < node_cnt; i++) {
+		// 前驱是同一哈希槽中上一个插入的节点，第一轮时不存在，插到尾部
+		_fill_node_data(&prev_node_data, prev_value, i >= slot_cnt ? i - slot_cnt : node_cnt, slot_cnt);
+		_fill_node_data(&curr_node_data, curr_value, i, slot_cnt);
+		prev_node_data.key = curr_node_data.key;
+
+		start = _now_ns();
+		if (hash_insert_node(handle, &prev_node_data, &curr_node_data, _bench_eq_cb) < 0) {
+			bench_error("insert %u failed.", i);
+			goto exit;
+		}
+		_result_add(&result, _now_ns() - start, 1);
+	}
+
+	_emit_result(bench_case, &result);
+	/* END insert_node */
+
+	// 记录各个节点的偏移量，供随机读取使用
+	node.data.value = curr_value;
+
+	for (i = 0; i < slot_cnt; i++) {
+		if (NULL == (cursor = hash_cursor_open(handle, i, TRAVERSE_BY_PHYSIC))) {
+			goto exit;
+		}
+
+		while ((offset = hash_cursor_next(cursor, &node)) > 0) {
+			offsets[*(uint32_t*)curr_value] = offset;
+		}
+
+		hash_cursor_close(cursor);
+	}
+
+	/* START get_node */
+	if (_result_init(&result, "get_node", node_cnt) < 0) {
+		goto exit;
+	}
+
+	_shuffle(ids, node_cnt);
+
+	for (i = 0; i < node_cnt; i++) {
+		id = ids[i];
+
+		start = _now_ns();
+		if (hash_get_node(handle, id % slot_cnt, offsets[id], &node) < 0) {
+			bench_error("get %u failed.", id);
+			goto exit;
+		}
+		_result_add(&result, _now_ns() - start, 1);
+	}
+
+	_emit_result(bench_case, &result);
+	/* END get_node */
+
+	/* START traverse_nodes */
+	if (_result_init(&result, "traverse_logic", BENCH_TRAVERSE_ROUNDS) < 0) {
+		goto exit;
+	}
+
+	for (i = 0; i < BENCH_TRAVERSE_ROUNDS; i++) {
+		s_visited = 0;
+
+		start = _now_ns();
+		hash_traverse_nodes(handle, TRAVERSE_BY_LOGIC, slot_cnt, WITHOUT_PRINT, NULL, _bench_visit_cb);
+		_result_add(&result, _now_ns() - start, s_visited);
+	}
+
+	_emit_result(bench_case, &result);
+
+	if (_result_init(&result, "traverse_physic", BENCH_TRAVERSE_ROUNDS) < 0) {
+		goto exit;
+	}
+
+	for (i = 0; i < BENCH_TRAVERSE_ROUNDS; i++) {
+		s_visited = 0;
+
+		start = _now_ns();
+		hash_traverse_nodes(handle, TRAVERSE_BY_PHYSIC, slot_cnt, WITHOUT_PRINT, NULL, _bench_visit_cb);
+		_result_add(&result, _now_ns() - start, s_visited);
+	}
+
+	_emit_result(bench_case, &result);
+	/* END traverse_nodes */
+
+	/* START del_node */
+	if (_result_init(&result, "del_node", node_cnt) < 0) {
+		goto exit;
+	}
+
+	_shuffle(ids, node_cnt);
+
+	for (i = 0; i < node_cnt; i++) {
+		_fill_node_data(&curr_node_data, curr_value, ids[i], slot_cnt);
+
+		start = _now_ns();
+		if (hash_del_node(handle, &curr_node_data, _bench_eq_cb) < 0) {
+			bench_error("del %u failed.", ids[i]);
+			goto exit;
+		}
+		_result_add(&result, _now_ns() - start, 1);
+	}
+
+	_emit_result(bench_case, &result);
+	/* END del_node */
+
+	ret = 0;
+
+exit:
+	safe_free(result.latencies);
+	hash_close(handle);
+	unlink(BENCH_PATH);
+	safe_free(prev_value);
+	safe_free(curr_value);
+	safe_free(offsets);
+	safe_free(ids);
+	return ret;
+}
+
+// 插入一个节点，前驱不存在时接到哈希槽尾部
+int _insert_id(hash_handle_t* handle, uint32_t id, uint32_t slot_cnt) {
+	uint32_t prev_value = 0;
+	uint32_t curr_value = 0;
+	hash_node_data_t prev_node_data;
+	hash_node_data_t curr_node_data;
+
+	_fill_node_data(&prev_node_data, &prev_value, (uint32_t)-1, slot_cnt);
+	_fill_node_data(&curr_node_data, &curr_value, id, slot_cnt);
+	prev_node_data.key = curr_node_data.key;
+
+	return hash_insert_node(handle, &prev_node_data, &curr_node_data, _bench_eq_cb);
+}
+
+/*
+ * 自动分裂按所有哈希槽的平均节点数判断：节点集中插到一个哈希槽时，平均数没超过阈值就不分裂；
+ * 再往其他哈希槽插到平均数超过阈值，应该分裂
+ */
+int _check_auto_split() {
+	int ret = -1;
+	int slot_cnt = 0;
+	uint32_t i = 0;
+	hash_config_t config;
+	hash_handle_t* handle = NULL;
+
+	memset(&config, 0, sizeof(hash_config_t));
+
+	config.slot_cnt = BENCH_SPLIT_SLOT_CNT;
+	config.node_data_value_size = sizeof(uint32_t);
+	config.split_threshold = BENCH_SPLIT_THRESHOLD;
+
+	if (init_hash_engine_ex(BENCH_PATH, FORCE_INIT, &config) < 0
+			|| NULL == (handle = hash_open(BENCH_PATH, HASH_OPEN_RDWR))) {
+		bench_error("prepare %s failed.", BENCH_PATH);
+		goto exit;
+	}
+
+	// 都插到0号哈希槽，它的节点数超过阈值的两倍，平均数仍然不到阈值
+	for (i = 0; i < BENCH_SPLIT_THRESHOLD * 2 + 1; i++) {
+		if (_insert_id(handle, i * BENCH_SPLIT_SLOT_CNT, BENCH_SPLIT_SLOT_CNT) < 0) {
+			bench_error("insert %u failed.", i);
+			goto exit;
+		}
+	}
+
+	if (BENCH_SPLIT_SLOT_CNT != (slot_cnt = hash_split_slots(handle, 0))) {
+		bench_error("skewed insert split the table : %d slots.", slot_cnt);
+		goto exit;
+	}
+
+	// 轮流插到其他哈希槽，直到平均数超过阈值
+	for (i = 0; i < BENCH_SPLIT_THRESHOLD * BENCH_SPLIT_SLOT_CNT; i++) {
+		if (_insert_id(handle, i * BENCH_SPLIT_SLOT_CNT + 1 + i % (BENCH_SPLIT_SLOT_CNT - 1), BENCH_SPLIT_SLOT_CNT) < 0) {
+			bench_error("insert %u failed.", i);
+			goto exit;
+		}
+	}
+
+	if ((slot_cnt = hash_split_slots(handle, 0)) <= BENCH_SPLIT_SLOT_CNT) {
+		bench_error("overloaded table did not split : %d slots.", slot_cnt);
+		goto exit;
+	}
+
+	bench_info("auto split : skewed insert kept %d slots, %d slots after average load exceeded %d.",
+			BENCH_SPLIT_SLOT_CNT, slot_cnt, BENCH_SPLIT_THRESHOLD);
+
+	ret = 0;
+
+exit:
+	hash_close(handle);
+	unlink(BENCH_PATH);
+	return ret;
+}
+
+/*
+ * 音乐层 diff 流程：旧播放列表 node_cnt 首，新列表保留后一半并新增同样多的歌
+ * 统计整个流程的耗时，以及新列表中每首歌插入（查找并标记）的延迟
+ */
+int _bench_music_diff(bench_case_t* bench_case) {
+	int ret = -1;
+	uint32_t i = 0;
+	uint32_t node_cnt = bench_case->node_cnt;
+	uint64_t start = 0;
+	uint64_t pipeline_start = 0;
+	music_data_value_t* musics = NULL;
+	music_data_value_t prev_music_data_value;
+	music_data_value_t curr_music_data_value;
+	bench_result_t result;
+	bench_result_t pipeline;
+
+	memset(&prev_music_data_value, 0, sizeof(music_data_value_t));
+	memset(&curr_music_data_value, 0, sizeof(music_data_value_t));
+	memset(&result, 0, sizeof(bench_result_t));
+	memset(&pipeline, 0, sizeof(bench_result_t));
+
+	if (NULL == (musics = (music_data_value_t*)calloc(node_cnt, sizeof(music_data_value_t)))) {
+		bench_error("calloc failed.");
+		goto exit;
+	}
+
+	for (i = 0; i < node_cnt; i++) {
+		musics[i].delete_or_not = MUSIC_KEEP;
+		snprintf(musics[i].path, MAX_MUSIC_PATH_LEN, "/music/bench/%08u.mp3", i);
+	}
+
+	if (_init_music_hash_engine(BENCH_PLAYLIST_PATH, 1) < 0
+			|| _insert_musics(BENCH_PLAYLIST_PATH, 0, &prev_music_data_value, musics, node_cnt) < 0) {
+		bench_error("prepare %s failed.", BENCH_PLAYLIST_PATH);
+		goto exit;
+	}
+
+	if (_result_init(&result, "music_diff_insert", node_cnt) < 0
+			|| _result_init(&pipeline, "music_diff", 1) < 0) {
+		goto exit;
+	}
+
+	pipeline_start = _now_ns();
+
+	_pre_diff_playlist(BENCH_PLAYLIST_PATH, 1, BENCH_DOWNLOAD_LIST_PATH, BENCH_DELETE_LIST_PATH);
+
+	for (i = node_cnt / 2; i < node_cnt + node_cnt / 2; i++) {
+		curr_music_data_value.delete_or_not = MUSIC_TO_BE_DOWNLOAD;
+		snprintf(curr_music_data_value.path, MAX_MUSIC_PATH_LEN, "/music/bench/%08u.mp3", i);
+
+		start = _now_ns();
+		_insert_music(BENCH_PLAYLIST_PATH, 0, &prev_music_data_value, &curr_music_data_value);
+		_result_add(&result, _now_ns() - start, 1);
+
+		prev_music_data_value = curr_music_data_value;
+	}
+
+	_post_diff_playlist(BENCH_PLAYLIST_PATH, BENCH_DOWNLOAD_LIST_PATH, BENCH_DELETE_LIST_PATH);
+
+	_result_add(&pipeline, _now_ns() - pipeline_start, node_cnt);
+
+	_emit_result(bench_case, &result);
+	_emit_result(bench_case, &pipeline);
+
+	ret = 0;
+
+exit:
+	safe_free(result.latencies);
+	safe_free(pipeline.latencies);
+	safe_free(musics);
+	unlink(BENCH_PLAYLIST_PATH);
+	unlink(BENCH_DOWNLOAD_LIST_PATH);
+	unlink(BENCH_DELETE_LIST_PATH);
+	return ret;
+}
+
+void _usage(const char* name) {
+	fprintf(stderr, "usage : %s [-n max_nodes] [-f csv|json] [-o output] [-m]\n", name);
+}
+
+int main(int argc, char** argv) {
+	int ret = 1;
+	int opt = 0;
+	uint32_t i = 0;
+	uint32_t j = 0;
+	uint32_t max_nodes = 100000;
+	uint32_t open_flags = 0;
+	const char* output_path = NULL;
+	bench_case_t bench_case;
+
+	while (-1 != (opt = getopt(argc, argv, "n:f:o:m"))) {
+		switch (opt) {
+			case 'n':
+				max_nodes = strtoul(optarg, NULL, 10);
+				break;
+			case 'f':
+				s_format = 0 == strcmp(optarg, "json") ? BENCH_OUTPUT_JSON : BENCH_OUTPUT_CSV;
+				break;
+			case 'o':
+				output_path = optarg;
+				break;
+			case 'm':
+				open_flags |= HASH_OPEN_MMAP;
+				break;
+			default:
+				_usage(argv[0]);
+				goto exit;
+		}
+	}
+
+	if (max_nodes < BENCH_MIN_NODES) { max_nodes = BENCH_MIN_NODES; }
+	if (max_nodes > BENCH_MAX_NODES) { max_nodes = BENCH_MAX_NODES; }
+
+	// 引擎和音乐层的日志打在标准输出，结果默认写文件，不和日志混在一起
+	if (NULL == output_path) {
+		output_path = BENCH_OUTPUT_CSV == s_format ? "hash_bench.csv" : "hash_bench.json";
+	}
+
+	if (NULL == (s_out = fopen(output_path, "w"))) {
+		bench_error("open %s failed.", output_path);
+		goto exit;
+	}
+
+	if (BENCH_OUTPUT_JSON == s_format) {
+		fprintf(s_out, "[");
+	}
+
+	if (_check_auto_split() < 0) {
+		goto close_output;
+	}
+
+	srand(1);
+	memset(&bench_case, 0, sizeof(bench_case_t));
+	bench_case.open_flags = open_flags;
+
+	for (bench_case.node_cnt = BENCH_MIN_NODES; bench_case.node_cnt <= max_nodes; bench_case.node_cnt *= 10) {
+		for (i = 0; i < sizeof(s_slot_cnts) / sizeof(s_slot_cnts[0]); i++) {
+			for (j = 0; j < sizeof(s_value_sizes) / sizeof(s_value_sizes[0]); j++) {
+				bench_case.slot_cnt = s_slot_cnts[i];
+				bench_case.value_size = s_value_sizes[j];
+
+				if (_bench_engine(&bench_case) < 0) {
+					goto close_output;
+				}
+			}
+		}
+
+		if (bench_case.node_cnt <= BENCH_MUSIC_MAX_NODES) {
+			bench_case.slot_cnt = 1;
+			bench_case.value_size = sizeof(music_data_value_t);
+
+			if (_bench_music_diff(&bench_case) < 0) {
+				goto close_output;
+			}
+		}
+	}
+
+	ret = 0;
+
+close_output:
+	if (BENCH_OUTPUT_JSON == s_format) {
+		fprintf(s_out, "\n]\n");
+	}
+
+	fclose(s_out);
+	bench_info("results written to %s.", output_path);
+
+exit:
+	return ret;
+}
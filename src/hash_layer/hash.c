@@ -1,48 +1,156 @@
+#define _GNU_SOURCE	// F_OFD_SETLKW
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <time.h>
 #include "hash.h"
+#include "hash_log.h"
 
-#define HASH_INFO 1
-#define HASH_DBUG 1
-#define HASH_WARN 1
-#define HASH_EROR 1
+#define HASH_STATS 1	// 统计读写次数、字节数及各接口耗时，关掉后没有额外开销
 
-#if HASH_INFO
-#define hash_info(fmt, ...) printf("\e[0;32m[HASH_INFO] [%s %d] : "fmt"\e[0m\n", __func__, __LINE__, ##__VA_ARGS__);
-#else
-#define hash_info(fmt, ...)
-#endif
+#define HASH_MMAP_CHUNK_SIZE (64 * 1024)	// mmap模式下文件每次扩展的长度
+#define HASH_READAHEAD_SIZE (64 * 1024)		// 遍历时每次预读的长度
+#define HASH_READAHEAD_ALIGN 4096
+#define HASH_TRAVERSE_MAX_THREADS 8		// 并行遍历的最大线程数
+#define HASH_INDEX_MIN_CAP 16
+#define HASH_INDEX_TOMBSTONE ((off_t)-1)	// 索引表项被删除后的标记，探测时不能当作空位
+
+// 日志级别由 HASH_LOG_LEVEL 在编译期决定，见 hash_log.h
+#define hash_debug(fmt, ...) hash_log_debug("HASH", fmt, ##__VA_ARGS__)
+#define hash_info(fmt, ...) hash_log_info("HASH", fmt, ##__VA_ARGS__)
+#define hash_warn(fmt, ...) hash_log_warn("HASH", fmt, ##__VA_ARGS__)
+#define hash_error(fmt, ...) hash_log_error("HASH", fmt, ##__VA_ARGS__)
+
+/************************************************
+ * 统计信息：各线程原子地累加，读取、清零时按 uint64_t 数组逐个处理
+ ***********************************************/
 
-#if HASH_DBUG
-#define hash_debug(fmt, ...) printf("\e[0m[HASH_DBUG] [%s %d] : "fmt"\e[0m\n", __func__, __LINE__, ##__VA_ARGS__);
+static hash_stats_t s_stats;
+
+static const char* s_api_names[HASH_API_CNT] = {
+	"open", "get_header_data", "set_header_data", "get_node", "find_node", "update_node",
+	"insert_node", "insert_nodes", "del_node", "del_nodes", "traverse", "traverse_parallel", "cursor",
+	"get_aux", "update_aux", "get_node_at",
+};
+
+#if HASH_STATS
+#define hash_stat_add(field, n) __atomic_add_fetch(&s_stats.field, (n), __ATOMIC_RELAXED)
 #else
-#define hash_debug(fmt, ...)
+#define hash_stat_add(field, n)
 #endif
 
-#if HASH_WARN
-#define hash_warn(fmt, ...) printf("\e[0;33m[HASH_WARN] [%s %d] : "fmt"\e[0m\n", __func__, __LINE__, ##__VA_ARGS__);
+static uint64_t hash_stat_now() {
+#if HASH_STATS
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 #else
-#define hash_warn(fmt, ...)
+	return 0;
 #endif
+}
 
-#if HASH_EROR
-#define hash_error(fmt, ...) printf("\e[0;31m[HASH_EROR] [%s %d] : "fmt"\e[0m\n", __func__, __LINE__, ##__VA_ARGS__);
-#else
-#define hash_error(fmt, ...)
+// 接口返回前调用，start_ns 为进入接口时 hash_stat_now() 的返回值
+static void hash_stat_api(hash_api_t api, uint64_t start_ns) {
+#if HASH_STATS
+	uint32_t bucket = 0;
+	uint64_t us = 0;
+	uint64_t ns = hash_stat_now() - start_ns;
+	uint64_t max_ns = __atomic_load_n(&s_stats.apis[api].max_ns, __ATOMIC_RELAXED);
+	hash_api_stats_t* api_stats = &s_stats.apis[api];
+
+	for (us = ns / 1000; us > 0 && bucket < HASH_STATS_BUCKETS - 1; us >>= 1) {
+		++bucket;
+	}
+
+	__atomic_add_fetch(&api_stats->calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&api_stats->total_ns, ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&api_stats->histogram[bucket], 1, __ATOMIC_RELAXED);
+
+	while (ns > max_ns && !__atomic_compare_exchange_n(&api_stats->max_ns, &max_ns, ns,
+				false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 #endif
+}
+
+void hash_get_stats(hash_stats_t* output_stats) {
+	uint32_t i = 0;
+	uint64_t* src = (uint64_t*)&s_stats;
+	uint64_t* dst = (uint64_t*)output_stats;
+
+	for (i = 0; i < sizeof(hash_stats_t) / sizeof(uint64_t); i++) {
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	}
+}
+
+void hash_reset_stats(void) {
+	uint32_t i = 0;
+	uint64_t* p = (uint64_t*)&s_stats;
+
+	for (i = 0; i < sizeof(hash_stats_t) / sizeof(uint64_t); i++) {
+		__atomic_store_n(&p[i], 0, __ATOMIC_RELAXED);
+	}
+}
+
+void hash_dump_stats(void) {
+	uint32_t i = 0;
+	uint32_t j = 0;
+	hash_stats_t stats;
+	hash_api_stats_t* api_stats = NULL;
+
+	hash_get_stats(&stats);
+
+	// 直接打印，先把异步日志输出完，保持先后顺序
+	hash_log_flush();
+
+	printf("read_calls %lu, write_calls %lu, lock_calls %lu, remaps %lu\n",
+			stats.read_calls, stats.write_calls, stats.lock_calls, stats.remaps);
+	printf("bytes_read %lu, bytes_written %lu, nodes_visited %lu, callbacks %lu\n",
+			stats.bytes_read, stats.bytes_written, stats.nodes_visited, stats.callbacks);
+
+	for (i = 0; i < HASH_API_CNT; i++) {
+		api_stats = &stats.apis[i];
+
+		if (0 == api_stats->calls) {
+			continue;
+		}
 
-ssize_t happy_write(const char* func, const int line, int fd, void *buf, size_t count) {
+		printf("%-18s calls %8lu, avg %10.3f us, max %10.3f us |", s_api_names[i], api_stats->calls,
+				api_stats->total_ns / 1000.0 / api_stats->calls, api_stats->max_ns / 1000.0);
+
+		// 只打印非空的桶，"<2^j" 表示耗时小于 2^j 微秒
+		for (j = 0; j < HASH_STATS_BUCKETS; j++) {
+			if (api_stats->histogram[j] > 0) {
+				if (HASH_STATS_BUCKETS - 1 == j) {
+					printf(" >=2^%d:%lu", j - 1, api_stats->histogram[j]);
+				} else {
+					printf(" <2^%d:%lu", j, api_stats->histogram[j]);
+				}
+			}
+		}
+
+		printf("\n");
+	}
+}
+
+// 所有文件读写都带上偏移量，不再依赖文件位置，一次系统调用完成定位和读写
+ssize_t happy_pwrite(const char* func, const int line, int fd, const void *buf, size_t count, off_t offset) {
 	int ret = -1;
 	ssize_t n_w = 0;
 
-	if ((n_w = write(fd, buf, count)) < 0) {
-		hash_error("(%s : %d calls) write error.", func, line);
+	hash_stat_add(write_calls, 1);
+	hash_stat_add(bytes_written, count);
+
+	if ((n_w = pwrite(fd, buf, count, offset)) < 0) {
+		hash_error("(%s : %d calls) write 0x%lX error : %s.", func, line, offset, strerror(errno));
 		goto exit;
 	}
 
@@ -57,12 +165,15 @@ exit:
 	return ret;
 }
 
-ssize_t happy_read(const char* func, const int line, int fd, void *buf, size_t count) {
+ssize_t happy_pread(const char* func, const int line, int fd, void *buf, size_t count, off_t offset) {
 	int ret = -1;
 	ssize_t n_r = 0;
 
-	if ((n_r = read(fd, buf, count)) < 0) {
-		hash_error("(%s : %d calls) read error.", func, line);
+	hash_stat_add(read_calls, 1);
+	hash_stat_add(bytes_read, count);
+
+	if ((n_r = pread(fd, buf, count, offset)) < 0) {
+		hash_error("(%s : %d calls) read 0x%lX error : %s.", func, line, offset, strerror(errno));
 		goto exit;
 	}
 
@@ -77,1196 +188,6121 @@ exit:
 	return ret;
 }
 
-#define write(fd, buf, count)	happy_write(__func__, __LINE__, fd, buf, count)
-#define read(fd, buf, count)	happy_read(__func__, __LINE__, fd, buf, count)
+size_t _iov_len(const struct iovec* iov, int iovcnt) {
+	int i = 0;
+	size_t len = 0;
 
-int get_slot_node_cnt(const char* path, uint32_t which_slot) {
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+
+	return len;
+}
+
+ssize_t happy_pwritev(const char* func, const int line, int fd, const struct iovec* iov, int iovcnt, off_t offset) {
 	int ret = -1;
-	int fd = 0;
-	hash_header_t header;
-	slot_info_t* slots = NULL;
-	uint32_t slot_cnt = 0;
-	uint32_t node_cnt = 0;
+	ssize_t n_w = 0;
+	size_t count = _iov_len(iov, iovcnt);
 
-	memset(&header, 0, sizeof(hash_header_t));
+	hash_stat_add(write_calls, 1);
+	hash_stat_add(bytes_written, count);
 
-	if ((fd = open(path, O_RDONLY)) < 0) {
-		hash_error("open file %s fail : %s.", path, strerror(errno));
+	if ((n_w = pwritev(fd, iov, iovcnt, offset)) < 0) {
+		hash_error("(%s : %d calls) writev 0x%lX error : %s.", func, line, offset, strerror(errno));
 		goto exit;
 	}
 
-	// 先读取头部的哈希信息
-	if (read(fd, &header, sizeof(hash_header_t)) < 0) {
-		hash_error("read header error : %s.", strerror(errno));
-		goto close_file;
+	if (n_w != count) {
+		hash_error("(%s : %d calls) writev incomplete, n_w = %ld, count = %ld.", func, line, n_w, count);
+		goto exit;
 	}
 
-	slot_cnt = header.slot_cnt;
+	ret = 0;
 
-	// 为0表示获取第一个逻辑节点地址
-	if (NULL == (slots = (void*)calloc(slot_cnt, sizeof(slot_info_t)))) {
-		hash_error("calloc failed.");
+exit:
+	return ret;
+}
+
+ssize_t happy_preadv(const char* func, const int line, int fd, const struct iovec* iov, int iovcnt, off_t offset) {
+	int ret = -1;
+	ssize_t n_r = 0;
+	size_t count = _iov_len(iov, iovcnt);
+
+	hash_stat_add(read_calls, 1);
+	hash_stat_add(bytes_read, count);
+
+	if ((n_r = preadv(fd, iov, iovcnt, offset)) < 0) {
+		hash_error("(%s : %d calls) readv 0x%lX error : %s.", func, line, offset, strerror(errno));
 		goto exit;
 	}
 
-	if (read(fd, slots, slot_cnt * sizeof(slot_info_t)) < 0) {
-		hash_error("read slot_info error : %s.", strerror(errno));
-		goto close_file;
+	if (n_r < count) {
+		hash_error("(%s : %d calls) readv incomplete, n_r = %ld, count = %ld.", func, line, n_r, count);
+		goto exit;
 	}
 
-	header.slots = slots;
+	ret = 0;
 
-	which_slot %= slot_cnt;
-	node_cnt = header.slots[which_slot].node_cnt;
+exit:
+	return ret;
+}
 
-	ret = 0;
+/************************************************
+ * 线程锁：同一句柄可以被多个线程同时使用，每个哈希槽一把读写锁，不同哈希槽的操作可以并行；
+ * 头部和头部附加数据各一把。文件锁属于打开的文件描述符，同一句柄的线程共用，
+ * 读锁由第一个拿到的线程加文件锁、最后一个释放的线程解文件锁
+ ***********************************************/
+
+typedef struct {
+	pthread_rwlock_t rwlock;
+	pthread_mutex_t mutex;		// 保护 shared_cnt 及文件锁的加锁、解锁
+	uint32_t shared_cnt;		// 持有读锁的线程数
+} hash_lock_t;
+
+typedef struct {
+	pthread_rwlock_t map_lock;	// 读写映射区时持有读锁，重新映射时持有写锁
+	hash_lock_t dir;			// 哈希槽目录：普通操作共享，分裂哈希槽时独占
+	hash_lock_t header;
+	hash_lock_t header_data;
+	uint32_t slot_cnt;			// slots 的个数，跟随目录容量增长
+	hash_lock_t* slots;
+} hash_locks_t;
+
+#define pwrite(fd, buf, count, offset)		happy_pwrite(__func__, __LINE__, fd, buf, count, offset)
+#define pread(fd, buf, count, offset)		happy_pread(__func__, __LINE__, fd, buf, count, offset)
+#define pwritev(fd, iov, iovcnt, offset)	happy_pwritev(__func__, __LINE__, fd, iov, iovcnt, offset)
+#define preadv(fd, iov, iovcnt, offset)		happy_preadv(__func__, __LINE__, fd, iov, iovcnt, offset)
+
+// 头部附加数据（header.data.value）在文件中的偏移量
+off_t _header_data_offset(hash_handle_t* handle) {
+	return handle->header.header_data_offset;
+}
 
-close_file:
-	close(fd);
+// 节点头部之后保存的内容的长度：定长存储时是节点数据本身，变长存储时是数据块的位置
+size_t _node_value_size(hash_handle_t* handle) {
+	return handle->header.varlen_value ? sizeof(hash_blob_t) : handle->header.node_data_value_size;
+}
 
-exit:
-	safe_free(slots);
-	return (0 == ret ? node_cnt : ret);
+// 一个节点（含数据部分）在文件中占用的长度
+size_t _node_size(hash_handle_t* handle) {
+	return sizeof(hash_node_t) + _node_value_size(handle);
+}
 
+// 指定哈希槽第一个物理节点的偏移量，初始化时按槽号依次排列，分裂出的哈希槽在末尾分配
+off_t _first_physic_node_offset(hash_handle_t* handle, uint32_t which_slot) {
+	return handle->header.slots[which_slot].first_physic_node_offset;
 }
 
-bool is_slot_empty(const char* path, uint32_t which_slot) {
-	return (0 == get_slot_node_cnt(path, which_slot));
+// key 所在的哈希槽，调用者负责锁住目录
+uint32_t _slot_of(hash_handle_t* handle, uint32_t key) {
+	hash_header_t* header = &handle->header;
+	uint32_t round_slot_cnt = header->base_slot_cnt << header->split_level;
+	uint32_t which_slot = key % round_slot_cnt;
+
+	// 本轮已经分裂过的哈希槽按下一轮的个数取模
+	if (which_slot < header->split_slot) {
+		which_slot = key % (round_slot_cnt << 1);
+	}
+
+	return which_slot;
 }
 
-#define DEBUG_GET_HEADER 1
-// 外部调用时需填充header结构体，包括其中的header.data.value内容
-int get_header_data(const char* path, hash_header_data_t* output_header_data) {
-	int fd = 0;
+/************************************************
+ * 文件读写层：mmap模式下直接访问映射区，否则走 pread/pwrite，节点头部和数据部分用 preadv/pwritev 一次读写
+ ***********************************************/
+
+// 重新映射整个文件，new_size 为映射长度
+int _remap(hash_handle_t* handle, size_t new_size) {
 	int ret = -1;
-	hash_header_t header;
-	uint32_t slot_cnt = 0;
-	uint32_t header_data_value_size = 0;
-	off_t header_data_value_offset = 0;
+	void* map = NULL;
+	int prot = PROT_READ | ((HASH_OPEN_RDWR & handle->flags) ? PROT_WRITE : 0);
 
-	memset(&header, 0, sizeof(hash_header_t));
+	if (NULL != handle->map) {
+		munmap(handle->map, handle->map_size);
+		handle->map = NULL;
+		handle->map_size = 0;
+	}
 
-	if ((fd = open(path, O_RDONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
-		hash_error("open file %s fail : %s.", path, strerror(errno));
+	hash_stat_add(remaps, 1);
+
+	if (MAP_FAILED == (map = mmap(NULL, new_size, prot, MAP_SHARED, handle->fd, 0))) {
+		hash_error("mmap %s (%ld bytes) fail : %s.", handle->path, new_size, strerror(errno));
 		goto exit;
 	}
 
-	// 先读取头部的哈希信息
-	if (read(fd, &header, sizeof(hash_header_t)) < 0) {
-		hash_error("read header error : %s.", strerror(errno));
-		goto close_file;
+	handle->map = map;
+	handle->map_size = new_size;
+
+	ret = 0;
+
+exit:
+	return ret;
+}
+
+// 保证映射区覆盖 [0, end)，不够时按块扩展文件后重新映射
+int _ensure_mapped(hash_handle_t* handle, off_t end) {
+	int ret = -1;
+	struct stat st;
+	size_t new_size = 0;
+
+	if (end <= handle->map_size) {
+		ret = 0;
+		goto exit;
 	}
 
-	slot_cnt = header.slot_cnt;
-	header_data_value_size = header.header_data_value_size;
-	header_data_value_offset = sizeof(hash_header_t) + slot_cnt * sizeof(slot_info_t);
+	if (fstat(handle->fd, &st) < 0) {
+		hash_error("fstat %s fail : %s.", handle->path, strerror(errno));
+		goto exit;
+	}
 
-	if (header_data_value_size > 0) {
-		if (lseek(fd, header_data_value_offset, SEEK_SET) < 0) {
-			hash_error("seek to %ld fail : %s.", header_data_value_offset, strerror(errno));
-			goto close_file;
+	new_size = st.st_size;
+
+	// 文件本身不够长时才扩展，只读句柄不能扩展
+	if (end > new_size) {
+		if (0 == (HASH_OPEN_RDWR & handle->flags)) {
+			hash_error("0x%lX is beyond %s (%ld bytes).", end, handle->path, new_size);
+			goto exit;
 		}
 
-		if (read(fd, output_header_data->value, header_data_value_size) < 0) {
-			hash_error("read output_header->value error : %s.", strerror(errno));
-			goto close_file;
+		new_size = (end + HASH_MMAP_CHUNK_SIZE - 1) / HASH_MMAP_CHUNK_SIZE * HASH_MMAP_CHUNK_SIZE;
+
+		if (ftruncate(handle->fd, new_size) < 0) {
+			hash_error("grow %s to %ld bytes fail : %s.", handle->path, new_size, strerror(errno));
+			goto exit;
 		}
 	}
 
-close_file:
-	close(fd);
+	ret = _remap(handle, new_size);
 
 exit:
 	return ret;
 }
-#undef DEBUG_GET_HEADER
 
-#define DEBUG_SET_HEADER 1
-// 外部调用时需填充header结构体，包括其中的header.data.value内容
-int set_header_data(const char* path, hash_header_data_t* input_header_data) {
-	int fd = 0;
+bool _is_mapped(hash_handle_t* handle) {
+	return 0 != (HASH_OPEN_MMAP & handle->flags);
+}
+
+/*
+ * 访问映射区之前调用，返回时持有映射区的读锁，并且映射区覆盖 [0, end)
+ * 其他线程可能正在访问映射区，重新映射前要先拿到写锁
+ */
+int _map_acquire(hash_handle_t* handle, off_t end) {
 	int ret = -1;
-	hash_header_t header;
-	uint32_t slot_cnt = 0;
-	uint32_t header_data_value_size = 0;
-	off_t header_data_value_offset = 0;
+	hash_locks_t* locks = (hash_locks_t*)handle->locks;
 
-	memset(&header, 0, sizeof(hash_header_t));
+	pthread_rwlock_rdlock(&locks->map_lock);
 
-	if ((fd = open(path, O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
-		hash_error("open file %s fail : %s.", path, strerror(errno));
+	if (end <= handle->map_size) {
+		ret = 0;
 		goto exit;
 	}
 
-	// 先读取头部的哈希信息
-	if (read(fd, &header, sizeof(hash_header_t)) < 0) {
-		hash_error("read header error : %s.", strerror(errno));
-		goto close_file;
+	pthread_rwlock_unlock(&locks->map_lock);
+
+	pthread_rwlock_wrlock(&locks->map_lock);
+	ret = _ensure_mapped(handle, end);
+	pthread_rwlock_unlock(&locks->map_lock);
+
+	if (ret < 0) {
+		goto exit;
 	}
 
-	slot_cnt = header.slot_cnt;
-	header_data_value_size = header.header_data_value_size;
-	header_data_value_offset = sizeof(hash_header_t) + slot_cnt * sizeof(slot_info_t);
+	// 映射区只会变大，重新拿到读锁后仍然覆盖 end
+	pthread_rwlock_rdlock(&locks->map_lock);
 
-	if (header_data_value_size > 0) {
-		if (lseek(fd, header_data_value_offset, SEEK_SET) < 0) {
-			hash_error("seek to %ld fail : %s.", header_data_value_offset, strerror(errno));
-			goto close_file;
+exit:
+	return ret;
+}
+
+void _map_release(hash_handle_t* handle) {
+	pthread_rwlock_unlock(&((hash_locks_t*)handle->locks)->map_lock);
+}
+
+// 从 offset 开始依次读到 iov 的各个缓冲区
+int _readv_at(hash_handle_t* handle, off_t offset, const struct iovec* iov, int iovcnt) {
+	int ret = -1;
+	int i = 0;
+	off_t pos = offset;
+
+	if (_is_mapped(handle)) {
+		if (_map_acquire(handle, offset + _iov_len(iov, iovcnt)) < 0) {
+			goto exit;
 		}
 
-		if (write(fd, input_header_data->value, header_data_value_size) < 0) {
-			hash_error("write input_header_data->value error : %s.", strerror(errno));
-			goto close_file;
+		for (i = 0; i < iovcnt; i++) {
+			memcpy(iov[i].iov_base, (char*)handle->map + pos, iov[i].iov_len);
+			pos += iov[i].iov_len;
 		}
+
+		hash_stat_add(bytes_read, pos - offset);
+
+		_map_release(handle);
+	} else if (preadv(handle->fd, iov, iovcnt, offset) < 0) {
+		goto exit;
 	}
 
-close_file:
-	close(fd);
+	ret = 0;
 
 exit:
 	return ret;
 }
-#undef DEBUG_SET_HEADER
 
-#define DEBUG_GET_NODE 0
-int get_node(const char* path, uint32_t which_slot, off_t offset, hash_node_t* output_node) {
+// 将 iov 的各个缓冲区依次写到 offset 开始的位置
+int _writev_at(hash_handle_t* handle, off_t offset, const struct iovec* iov, int iovcnt) {
 	int ret = -1;
-	int fd = 0;
-	hash_header_t header;
-	slot_info_t* slots = NULL;
-	void* node_data_value = NULL;
-	uint32_t slot_cnt = 0;
-	uint32_t node_data_value_size = 0;
-	void *addr = NULL;	// 防止在memcpy中，文件中保存的上一次指针值覆盖了当前正在运行的指针
+	int i = 0;
+	off_t pos = offset;
 
-	memset(&header, 0, sizeof(hash_header_t));
+	// 并行遍历时多个线程会同时读写
+	__atomic_add_fetch(&handle->write_seq, 1, __ATOMIC_RELAXED);
 
-	if ((fd = open(path, O_RDONLY)) < 0) {
-		hash_error("open file %s fail : %s.", path, strerror(errno));
+	// 只读句柄的映射区不可写，直接写会导致段错误
+	if (0 == (HASH_OPEN_RDWR & handle->flags)) {
+		hash_error("%s is opened read only.", handle->path);
 		goto exit;
 	}
 
-	// 先读取头部的哈希信息
-	if (read(fd, &header, sizeof(hash_header_t)) < 0) {
-		hash_error("read header error : %s.", strerror(errno));
-		goto close_file;
-	}
-
-	slot_cnt = header.slot_cnt;
-	node_data_value_size = header.node_data_value_size;
-
-	// 为0表示获取第一个逻辑节点地址
-	if (0 == offset) {
-		if (NULL == (slots = (void*)calloc(slot_cnt, sizeof(slot_info_t)))) {
-			hash_error("calloc failed.");
+	if (_is_mapped(handle)) {
+		if (_map_acquire(handle, offset + _iov_len(iov, iovcnt)) < 0) {
 			goto exit;
 		}
 
-		if (read(fd, slots, slot_cnt * sizeof(slot_info_t)) < 0) {
-			hash_error("read slot_info error : %s.", strerror(errno));
-			goto close_file;
+		for (i = 0; i < iovcnt; i++) {
+			memcpy((char*)handle->map + pos, iov[i].iov_base, iov[i].iov_len);
+			pos += iov[i].iov_len;
 		}
 
-		header.slots = slots;
+		hash_stat_add(bytes_written, pos - offset);
 
-		which_slot %= slot_cnt;
-		offset = header.slots[which_slot].first_logic_node_offset;
+		_map_release(handle);
+	} else if (pwritev(handle->fd, iov, iovcnt, offset) < 0) {
+		goto exit;
 	}
 
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		hash_error("seek to %ld fail : %s.", offset, strerror(errno));
-		goto close_file;
-	}
+	ret = 0;
 
-	addr = output_node->data.value;
-	if (read(fd, output_node, sizeof(hash_node_t)) < 0) {
-		hash_error("read node failed : %s.", strerror(errno));
-		goto close_file;
-	}
+exit:
+	return ret;
+}
 
-#if DEBUG_GET_NODE
-	hash_debug("0x%lX <- 0x%lX -> 0x%lX.", output_node->offsets.logic_prev, offset, output_node->offsets.logic_next);
-#endif
+int _read_at(hash_handle_t* handle, off_t offset, void* buf, size_t count) {
+	int ret = -1;
 
-	output_node->data.value = addr;
-	if (node_data_value_size > 0
-			&& read(fd, output_node->data.value, node_data_value_size) < 0) {
-		hash_error("read output_node->data.value failed : %s.", strerror(errno));
-		goto close_file;
+	if (_is_mapped(handle)) {
+		if (_map_acquire(handle, offset + count) < 0) {
+			goto exit;
+		}
+
+		memcpy(buf, (char*)handle->map + offset, count);
+		hash_stat_add(bytes_read, count);
+
+		_map_release(handle);
+	} else if (pread(handle->fd, buf, count, offset) < 0) {
+		goto exit;
 	}
 
 	ret = 0;
 
-close_file:
-	close(fd);
-
 exit:
-	safe_free(slots);
-	safe_free(node_data_value);
 	return ret;
 }
-#undef DEBUG_GET_NODE
 
-#define DEBUG_ADD_NODE 0
-int insert_node(const char* path,
-		hash_node_data_t* input_prev_node_data, hash_node_data_t* input_curr_node_data,
-		bool (*cb)(hash_node_data_t*, hash_node_data_t*)) {
+int _write_at(hash_handle_t* handle, off_t offset, void* buf, size_t count) {
 	int ret = -1;
-	int fd = 0;
-	bool find_prev_node = false;
-	bool is_first_node = false;
-	uint32_t which_slot = 0;
-	off_t physic_offset = 0;
-	off_t first_physic_node_offset = 0;
-	off_t first_logic_node_offset = 0;
-	off_t prev_logic_node_offset = 0;
-	off_t tail_logic_node_offset = 0;
-	off_t next_logic_node_offset = 0;
-	off_t new_physic_node_offset = 0;
-	hash_header_t header;
-	slot_info_t* slots = NULL;
-	hash_node_t first_physic_node;
-	hash_node_t curr_physic_node;
-	hash_node_t prev_logic_node;
-	hash_node_t next_logic_node;
-	void* node_data_value = NULL;
-	uint32_t slot_cnt = 0;
-	uint32_t header_data_value_size = 0;
-	uint32_t node_data_value_size = 0;
-	void *addr = NULL;	// 防止在memcpy中，文件中保存的上一次指针值覆盖了当前正在运行的指针
 
-	memset(&header, 0, sizeof(hash_header_t));
-	memset(&first_physic_node, 0, sizeof(hash_node_t));
-	memset(&curr_physic_node, 0, sizeof(hash_node_t));
-	memset(&prev_logic_node, 0, sizeof(hash_node_t));
-	memset(&next_logic_node, 0, sizeof(hash_node_t));
+	// 并行遍历时多个线程会同时读写
+	__atomic_add_fetch(&handle->write_seq, 1, __ATOMIC_RELAXED);
 
-	if ((fd = open(path, O_RDWR)) < 0) {
-		hash_error("open file %s fail : %s.", path, strerror(errno));
+	// 只读句柄的映射区不可写，直接写会导致段错误
+	if (0 == (HASH_OPEN_RDWR & handle->flags)) {
+		hash_error("%s is opened read only.", handle->path);
 		goto exit;
 	}
 
-	// 先读取头部的哈希信息
-	if (read(fd, &header, sizeof(hash_header_t)) < 0) {
-		hash_error("read header error : %s.", strerror(errno));
-		goto close_file;
-	}
+	if (_is_mapped(handle)) {
+		if (_map_acquire(handle, offset + count) < 0) {
+			goto exit;
+		}
 
-	slot_cnt = header.slot_cnt;
-	header_data_value_size = header.header_data_value_size;
-	node_data_value_size = header.node_data_value_size;
+		memcpy((char*)handle->map + offset, buf, count);
+		hash_stat_add(bytes_written, count);
 
-	if (NULL == (slots = (void*)calloc(slot_cnt, sizeof(slot_info_t)))) {
-		hash_error("calloc failed.");
+		_map_release(handle);
+	} else if (pwrite(handle->fd, buf, count, offset) < 0) {
 		goto exit;
 	}
 
-	if (read(fd, slots, slot_cnt * sizeof(slot_info_t)) < 0) {
-		hash_error("read slot_info error : %s.", strerror(errno));
-		goto close_file;
-	}
+	ret = 0;
 
-	header.slots = slots;
+exit:
+	return ret;
+}
 
-	which_slot = input_curr_node_data->key % slot_cnt;
-	first_physic_node_offset = sizeof(hash_header_t) + slot_cnt * sizeof(slot_info_t) + header_data_value_size\
-		 + which_slot * (sizeof(hash_node_t) + node_data_value_size);
-	first_logic_node_offset = header.slots[which_slot].first_logic_node_offset;
+// 在已使用区域末尾分配 size 字节，返回分配到的偏移量，失败返回-1
+off_t _alloc_tail(hash_handle_t* handle, size_t size) {
+	off_t offset = handle->header.file_size;
 
-	if (node_data_value_size > 0
-			&& NULL == (node_data_value = (void*)calloc(1, node_data_value_size))) {
-		hash_error("calloc failed.");
-		goto exit;
-	}
+	if (_is_mapped(handle)) {
+		if (_map_acquire(handle, offset + size) < 0) {
+			return -1;
+		}
 
-	// 读取第一个逻辑节点
-	if (lseek(fd, first_logic_node_offset, SEEK_SET) < 0) {
-		hash_error("seek to %ld fail : %s.", physic_offset, strerror(errno));
-		goto close_file;
+		_map_release(handle);
 	}
 
-	if (read(fd, &prev_logic_node, sizeof(hash_node_t)) < 0) {
-		hash_error("read curr_physic_node failed : %s.", strerror(errno));
-		goto close_file;
-	}
+	handle->header.file_size += size;
 
-	tail_logic_node_offset = prev_logic_node.offsets.logic_prev;
+	return offset;
+}
 
-	physic_offset = first_physic_node_offset;
-	do {
-		// 先找到上一个节点的位置
-		if (lseek(fd, physic_offset, SEEK_SET) < 0) {
-			hash_error("seek to %ld fail : %s.", physic_offset, strerror(errno));
-			goto close_file;
-		}
+// 只读取节点头部，保留 node->data.value 指针
+int _read_node_header(hash_handle_t* handle, off_t offset, hash_node_t* node) {
+	int ret = -1;
+	void *addr = node->data.value;	// 防止文件中保存的上一次指针值覆盖了当前正在运行的指针
 
-		if (read(fd, &curr_physic_node, sizeof(hash_node_t)) < 0) {
-			hash_error("read curr_physic_node failed : %s.", strerror(errno));
-			goto close_file;
+	ret = _read_at(handle, offset, node, sizeof(hash_node_t));
+
+	node->data.value = addr;
+	return ret;
+}
+
+int _write_node_header(hash_handle_t* handle, off_t offset, hash_node_t* node) {
+	return _write_at(handle, offset, node, sizeof(hash_node_t));
+}
+
+// 第 which_slot 个哈希槽信息在文件中的偏移量
+off_t _slot_info_offset(hash_handle_t* handle, uint32_t which_slot) {
+	return handle->header.slots_offset + which_slot * sizeof(slot_info_t);
+}
+
+// 将常驻内存的头部写回文件，哈希槽信息各自保存
+int _save_header(hash_handle_t* handle) {
+	int ret = -1;
+
+	if (_write_at(handle, 0, &handle->header, sizeof(hash_header_t)) < 0) {
+		hash_error("write header error.");
+		goto exit;
+	}
+
+	ret = 0;
+
+exit:
+	return ret;
+}
+
+// 将常驻内存的一个哈希槽信息写回文件
+int _save_slot(hash_handle_t* handle, uint32_t which_slot) {
+	int ret = -1;
+
+	if (_write_at(handle, _slot_info_offset(handle, which_slot),
+				&handle->header.slots[which_slot], sizeof(slot_info_t)) < 0) {
+		hash_error("write slot %d error.", which_slot);
+		goto exit;
+	}
+
+	ret = 0;
+
+exit:
+	return ret;
+}
+
+/************************************************
+ * 多进程锁：用 OFD 记录锁锁住文件中的字节区间，同一文件的不同句柄之间（不论是否在同一进程）互斥
+ * 每个哈希槽各占一段，读共享、写独占，不同哈希槽的写操作可以同时进行；
+ * 头部的 file_size 和索引是所有哈希槽共用的，修改时短暂独占。
+ * 哈希槽目录（个数、位置）另有一把锁，普通操作共享，分裂哈希槽时独占。加锁顺序固定为目录、哈希槽、头部
+ * 其他句柄可能改过文件，加锁后重新读取常驻内存的信息
+ ***********************************************/
+
+#ifdef F_OFD_SETLKW
+#define HASH_SETLKW F_OFD_SETLKW
+#define HASH_SETLK F_OFD_SETLK
+#else
+#define HASH_SETLKW F_SETLKW	// 没有 OFD 锁时退化为进程级的记录锁，同一进程的句柄之间不互斥
+#define HASH_SETLK F_SETLK
+#endif
+
+// 目录会在文件中移动，目录和哈希槽的锁不对应文件内容，放在文件末尾之后很远的地方
+#define HASH_DIR_LOCK_OFFSET ((off_t)1 << 40)
+#define HASH_SLOT_LOCK_OFFSET(which_slot) (HASH_DIR_LOCK_OFFSET + 1 + (which_slot))
+
+bool _lock_enabled(hash_handle_t* handle) {
+	return 0 == (HASH_OPEN_NOLOCK & handle->flags);
+}
+
+// type 为 F_RDLCK、F_WRLCK 或 F_UNLCK，拿不到锁时阻塞等待
+int _lock_range(hash_handle_t* handle, off_t start, off_t len, short type) {
+	int ret = -1;
+	struct flock fl;
+
+	if (!_lock_enabled(handle)) {
+		ret = 0;
+		goto exit;
+	}
+
+	// OFD 锁要求 l_pid 为0
+	memset(&fl, 0, sizeof(struct flock));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = start;
+	fl.l_len = len;
+
+	hash_stat_add(lock_calls, 1);
+
+	while (fcntl(handle->fd, HASH_SETLKW, &fl) < 0) {
+		if (EINTR != errno) {
+			hash_error("lock %s [0x%lX, +%ld) type %d fail : %s.", handle->path, start, len, type, strerror(errno));
+			goto exit;
 		}
+	}
 
-		// 未使用的节点直接跳过
-		if (0 == curr_physic_node.used) {
-			//hash_debug("continue");
-			goto next_loop;
+	ret = 0;
+
+exit:
+	return ret;
+}
+
+// 同 _lock_range，但是拿不到锁时不等待，返回1
+int _try_lock_range(hash_handle_t* handle, off_t start, off_t len, short type) {
+	int ret = -1;
+	struct flock fl;
+
+	if (!_lock_enabled(handle)) {
+		ret = 0;
+		goto exit;
+	}
+
+	memset(&fl, 0, sizeof(struct flock));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = start;
+	fl.l_len = len;
+
+	hash_stat_add(lock_calls, 1);
+
+	if (fcntl(handle->fd, HASH_SETLK, &fl) < 0) {
+		if (EAGAIN == errno || EACCES == errno) {
+			ret = 1;
+		} else {
+			hash_error("lock %s [0x%lX, +%ld) type %d fail : %s.", handle->path, start, len, type, strerror(errno));
 		}
+		goto exit;
+	}
 
-		if (node_data_value_size > 0
-				&& read(fd, node_data_value, node_data_value_size) < 0) {
-			hash_error("read node_data_value error : %s.", strerror(errno));
-			goto close_file;
+	ret = 0;
+
+exit:
+	return ret;
+}
+
+// 重新读取哈希槽信息
+int _load_slot(hash_handle_t* handle, uint32_t which_slot) {
+	if (_read_at(handle, _slot_info_offset(handle, which_slot), &handle->header.slots[which_slot], sizeof(slot_info_t)) < 0) {
+		hash_error("read slot %d error.", which_slot);
+		return -1;
+	}
+
+	return 0;
+}
+
+// 重新读取头部中会变化的字段，常驻内存的指针保持不变
+int _load_header(hash_handle_t* handle, uint32_t unused) {
+	hash_header_t header;
+
+	if (_read_at(handle, 0, &header, sizeof(hash_header_t)) < 0) {
+		hash_error("read header error.");
+		return -1;
+	}
+
+	handle->header.file_size = header.file_size;
+	handle->header.index_offset = header.index_offset;
+	__atomic_store_n(&handle->header.index_cap, header.index_cap, __ATOMIC_RELAXED);
+	handle->header.index_cnt = header.index_cnt;
+	handle->header.index_tombstone_cnt = header.index_tombstone_cnt;
+	handle->header.blob_extent_offset = header.blob_extent_offset;
+	handle->header.blob_extent_left = header.blob_extent_left;
+	memcpy(handle->header.blob_free, header.blob_free, sizeof(header.blob_free));
+	memcpy(handle->header.aux, header.aux, sizeof(header.aux));
+
+	return 0;
+}
+
+// 常驻内存的哈希槽信息及线程锁按目录容量分配，调用者独占目录，没有线程持有哈希槽的锁
+int _resize_slots(hash_handle_t* handle, uint32_t slot_cap) {
+	int ret = -1;
+	uint32_t i = 0;
+	slot_info_t* slots = NULL;
+	hash_lock_t* slot_locks = NULL;
+	hash_locks_t* locks = (hash_locks_t*)handle->locks;
+
+	if (NULL == (slots = (slot_info_t*)realloc(handle->header.slots, slot_cap * sizeof(slot_info_t)))) {
+		hash_error("realloc failed.");
+		goto exit;
+	}
+
+	handle->header.slots = slots;
+
+	if (slot_cap <= locks->slot_cnt) {
+		ret = 0;
+		goto exit;
+	}
+
+	if (NULL == (slot_locks = (hash_lock_t*)calloc(slot_cap, sizeof(hash_lock_t)))) {
+		hash_error("calloc failed.");
+		goto exit;
+	}
+
+	for (i = 0; i < slot_cap; i++) {
+		pthread_rwlock_init(&slot_locks[i].rwlock, NULL);
+		pthread_mutex_init(&slot_locks[i].mutex, NULL);
+	}
+
+	for (i = 0; i < locks->slot_cnt; i++) {
+		pthread_rwlock_destroy(&locks->slots[i].rwlock);
+		pthread_mutex_destroy(&locks->slots[i].mutex);
+	}
+
+	free(locks->slots);
+	locks->slots = slot_locks;
+	locks->slot_cnt = slot_cap;
+
+	ret = 0;
+
+exit:
+	return ret;
+}
+
+// 重新读取目录，其他句柄分裂过哈希槽时整个目录重新读入
+int _load_dir(hash_handle_t* handle, uint32_t unused) {
+	int ret = -1;
+	bool changed = false;
+	hash_header_t header;
+	hash_header_t* curr = &handle->header;
+
+	if (_read_at(handle, 0, &header, sizeof(hash_header_t)) < 0) {
+		hash_error("read header error.");
+		goto exit;
+	}
+
+	changed = header.slot_cnt != curr->slot_cnt || header.slots_offset != curr->slots_offset;
+
+	if (header.slot_cap > curr->slot_cap && _resize_slots(handle, header.slot_cap) < 0) {
+		goto exit;
+	}
+
+	curr->slot_cnt = header.slot_cnt;
+	curr->split_level = header.split_level;
+	curr->split_slot = header.split_slot;
+	curr->split_threshold = header.split_threshold;
+	curr->slot_cap = header.slot_cap;
+	curr->slots_offset = header.slots_offset;
+
+	if (changed && _read_at(handle, curr->slots_offset, curr->slots, curr->slot_cnt * sizeof(slot_info_t)) < 0) {
+		hash_error("read slot_info error.");
+		goto exit;
+	}
+
+	ret = 0;
+
+exit:
+	return ret;
+}
+
+/*
+ * 先拿线程锁再拿文件锁。真正加上文件锁之后调用 load（可以为NULL）重新读取常驻内存的信息，
+ * 同一句柄的其他线程已经持有读锁时，文件锁还在，不需要重新读取
+ */
+int _acquire(hash_handle_t* handle, hash_lock_t* lock, off_t start, off_t len, short type,
+		int (*load)(hash_handle_t*, uint32_t), uint32_t load_arg) {
+	int ret = -1;
+
+	if (F_WRLCK == type) {
+		pthread_rwlock_wrlock(&lock->rwlock);
+
+		if (_lock_range(handle, start, len, F_WRLCK) < 0) {
+			pthread_rwlock_unlock(&lock->rwlock);
+			goto exit;
 		}
 
-		curr_physic_node.data.value = node_data_value;
-		if (true == cb(&(curr_physic_node.data), input_prev_node_data)) {
-			find_prev_node = true;
-			prev_logic_node = curr_physic_node;
-			prev_logic_node_offset = physic_offset;
-#if DEBUG_ADD_NODE
-			hash_debug("prev node at 0x%lX.", prev_logic_node_offset);
-#endif
-			break;
+		if (_lock_enabled(handle) && NULL != load && load(handle, load_arg) < 0) {
+			_lock_range(handle, start, len, F_UNLCK);
+			pthread_rwlock_unlock(&lock->rwlock);
+			goto exit;
 		}
 
-next_loop:
-		physic_offset = curr_physic_node.offsets.physic_next;
-	} while (physic_offset != first_physic_node_offset);
+		ret = 0;
+		goto exit;
+	}
 
-	if (false == find_prev_node) {
-		// 链表中有节点，但是没找到前驱节点，将curr插到尾部
-		if (header.slots[which_slot].node_cnt > 0) {
-			prev_logic_node_offset = tail_logic_node_offset;
-			hash_warn("didn't find prev node, node cnt is %d, add curr to tail (0x%lX).", header.slots[which_slot].node_cnt, prev_logic_node_offset);
+	pthread_rwlock_rdlock(&lock->rwlock);
+	pthread_mutex_lock(&lock->mutex);
+
+	if (0 == lock->shared_cnt) {
+		if (_lock_range(handle, start, len, F_RDLCK) < 0) {
+			goto fail;
 		}
 
-		// 链表为空，当作第一个节点插入
-		else {
-			hash_warn("didn't find prev, no node in this slot, treat curr as first node.");
-			is_first_node = true;
+		if (_lock_enabled(handle) && NULL != load && load(handle, load_arg) < 0) {
+			_lock_range(handle, start, len, F_UNLCK);
+			goto fail;
+		}
+	}
+
+	++lock->shared_cnt;
+	pthread_mutex_unlock(&lock->mutex);
+
+	ret = 0;
+	goto exit;
+
+fail:
+	pthread_mutex_unlock(&lock->mutex);
+	pthread_rwlock_unlock(&lock->rwlock);
+
+exit:
+	return ret;
+}
+
+// 持有写锁时 shared_cnt 一定为0
+void _release(hash_handle_t* handle, hash_lock_t* lock, off_t start, off_t len) {
+	pthread_mutex_lock(&lock->mutex);
+
+	if (0 == lock->shared_cnt || 0 == --lock->shared_cnt) {
+		_lock_range(handle, start, len, F_UNLCK);
+	}
+
+	pthread_mutex_unlock(&lock->mutex);
+	pthread_rwlock_unlock(&lock->rwlock);
+}
+
+// 锁住目录，之后 slot_cnt 及 _slot_of 的结果在解锁前不会变化
+int _lock_dir(hash_handle_t* handle, short type) {
+	return _acquire(handle, &((hash_locks_t*)handle->locks)->dir, HASH_DIR_LOCK_OFFSET, 1, type, _load_dir, 0);
+}
+
+void _unlock_dir(hash_handle_t* handle) {
+	_release(handle, &((hash_locks_t*)handle->locks)->dir, HASH_DIR_LOCK_OFFSET, 1);
+}
+
+// 不等待地独占目录，拿到返回0，有其他线程或句柄在用返回1。当前线程自己持有目录（比如在遍历的回调中）时也返回1
+int _try_lock_dir(hash_handle_t* handle) {
+	int ret = -1;
+	hash_lock_t* lock = &((hash_locks_t*)handle->locks)->dir;
+
+	if (0 != pthread_rwlock_trywrlock(&lock->rwlock)) {
+		ret = 1;
+		goto exit;
+	}
+
+	if (0 != (ret = _try_lock_range(handle, HASH_DIR_LOCK_OFFSET, 1, F_WRLCK))) {
+		pthread_rwlock_unlock(&lock->rwlock);
+		goto exit;
+	}
+
+	if (_lock_enabled(handle) && _load_dir(handle, 0) < 0) {
+		_lock_range(handle, HASH_DIR_LOCK_OFFSET, 1, F_UNLCK);
+		pthread_rwlock_unlock(&lock->rwlock);
+		ret = -1;
+	}
+
+exit:
+	return ret;
+}
+
+// 锁住哈希槽，type 为 F_RDLCK 或 F_WRLCK，调用者已经锁住目录
+int _lock_slot(hash_handle_t* handle, uint32_t which_slot, short type) {
+	return _acquire(handle, &((hash_locks_t*)handle->locks)->slots[which_slot],
+			HASH_SLOT_LOCK_OFFSET(which_slot), 1, type, _load_slot, which_slot);
+}
+
+void _unlock_slot(hash_handle_t* handle, uint32_t which_slot) {
+	_release(handle, &((hash_locks_t*)handle->locks)->slots[which_slot],
+			HASH_SLOT_LOCK_OFFSET(which_slot), 1);
+}
+
+int _lock_header(hash_handle_t* handle, short type) {
+	return _acquire(handle, &((hash_locks_t*)handle->locks)->header,
+			0, sizeof(hash_header_t), type, _load_header, 0);
+}
+
+void _unlock_header(hash_handle_t* handle) {
+	_release(handle, &((hash_locks_t*)handle->locks)->header, 0, sizeof(hash_header_t));
+}
+
+int _lock_header_data(hash_handle_t* handle, short type) {
+	return _acquire(handle, &((hash_locks_t*)handle->locks)->header_data,
+			_header_data_offset(handle), handle->header.header_data_value_size, type, NULL, 0);
+}
+
+void _unlock_header_data(hash_handle_t* handle) {
+	_release(handle, &((hash_locks_t*)handle->locks)->header_data,
+			_header_data_offset(handle), handle->header.header_data_value_size);
+}
+
+// 句柄上的线程锁，哈希槽的锁随目录容量增长
+hash_locks_t* _create_locks(uint32_t slot_cnt) {
+	uint32_t i = 0;
+	hash_locks_t* locks = NULL;
+
+	if (NULL == (locks = (hash_locks_t*)calloc(1, sizeof(hash_locks_t)))
+			|| NULL == (locks->slots = (hash_lock_t*)calloc(slot_cnt, sizeof(hash_lock_t)))) {
+		hash_error("calloc failed.");
+		safe_free(locks);
+		goto exit;
+	}
+
+	locks->slot_cnt = slot_cnt;
+
+	pthread_rwlock_init(&locks->map_lock, NULL);
+	pthread_rwlock_init(&locks->dir.rwlock, NULL);
+	pthread_mutex_init(&locks->dir.mutex, NULL);
+	pthread_rwlock_init(&locks->header.rwlock, NULL);
+	pthread_mutex_init(&locks->header.mutex, NULL);
+	pthread_rwlock_init(&locks->header_data.rwlock, NULL);
+	pthread_mutex_init(&locks->header_data.mutex, NULL);
+
+	for (i = 0; i < slot_cnt; i++) {
+		pthread_rwlock_init(&locks->slots[i].rwlock, NULL);
+		pthread_mutex_init(&locks->slots[i].mutex, NULL);
+	}
+
+exit:
+	return locks;
+}
+
+void _destroy_locks(hash_locks_t* locks) {
+	uint32_t i = 0;
+
+	if (NULL == locks) {
+		return;
+	}
+
+	pthread_rwlock_destroy(&locks->map_lock);
+	pthread_rwlock_destroy(&locks->dir.rwlock);
+	pthread_mutex_destroy(&locks->dir.mutex);
+	pthread_rwlock_destroy(&locks->header.rwlock);
+	pthread_mutex_destroy(&locks->header.mutex);
+	pthread_rwlock_destroy(&locks->header_data.rwlock);
+	pthread_mutex_destroy(&locks->header_data.mutex);
+
+	for (i = 0; i < locks->slot_cnt; i++) {
+		pthread_rwlock_destroy(&locks->slots[i].rwlock);
+		pthread_mutex_destroy(&locks->slots[i].mutex);
+	}
+
+	free(locks->slots);
+	free(locks);
+}
+
+// 独占头部后在末尾分配，其他句柄随后就能看到新的 file_size
+off_t _alloc_tail_locked(hash_handle_t* handle, size_t size) {
+	off_t ret = -1;
+
+	if (_lock_header(handle, F_WRLCK) < 0) {
+		goto exit;
+	}
+
+	if ((ret = _alloc_tail(handle, size)) >= 0 && _save_header(handle) < 0) {
+		ret = -1;
+	}
+
+	_unlock_header(handle);
+
+exit:
+	return ret;
+}
+
+/************************************************
+ * 变长存储：节点数据按实际长度保存在数据块区中，节点后面只留数据块的位置。
+ * 数据块按 HASH_BLOB_ALIGN 取整，优先从同级的空闲链表中取，其次在当前数据块区中顺序分配，
+ * 用完后在末尾再扩展一块。空闲链表和数据块区都记录在头部中，分配、释放时独占头部
+ ***********************************************/
+
+// 空闲数据块开头保存的信息
+typedef struct {
+	off_t next;
+	uint32_t cap;
+} hash_free_blob_t;
+
+uint32_t _blob_cap(uint32_t len) {
+	return (len + HASH_BLOB_ALIGN - 1) & ~(HASH_BLOB_ALIGN - 1);
+}
+
+uint32_t _blob_class(uint32_t cap) {
+	uint32_t which_class = cap / HASH_BLOB_ALIGN - 1;
+
+	return which_class < HASH_BLOB_CLASS_CNT ? which_class : HASH_BLOB_CLASS_CNT - 1;
+}
+
+// 节点数据需要保存的长度：尾部字符串之后的部分都是0，不保存
+uint32_t _value_len(hash_handle_t* handle, const void* value) {
+	uint32_t size = handle->header.node_data_value_size;
+	uint32_t tail = handle->header.value_tail_offset;
+	uint32_t len = tail + strnlen((const char*)value + tail, size - tail) + 1;
+
+	return len < size ? len : size;
+}
+
+// 读出的数据块可能比实际长度长（取整的部分、以前更长的内容），尾部字符串之后全部清0
+void _decode_value(hash_handle_t* handle, void* value, uint32_t len) {
+	uint32_t size = handle->header.node_data_value_size;
+	uint32_t tail = handle->header.value_tail_offset;
+	char* str = (char*)value + tail;
+
+	if (len <= tail) {
+		memset((char*)value + len, 0, size - len);
+		return;
+	}
+
+	len = tail + strnlen(str, len - tail);
+	memset((char*)value + len, 0, size - len);
+}
+
+// 分配一个容量为 cap 的数据块，调用者独占头部，出错返回-1
+off_t _alloc_blob(hash_handle_t* handle, uint32_t cap) {
+	off_t offset = 0;
+	uint32_t which_class = _blob_class(cap);
+	hash_header_t* header = &handle->header;
+	hash_free_blob_t free_blob;
+
+	// 最后一级的容量不一，只看链表头
+	if (0 != (offset = header->blob_free[which_class])) {
+		if (_read_at(handle, offset, &free_blob, sizeof(hash_free_blob_t)) < 0) {
+			hash_error("read free blob 0x%lX error.", offset);
+			return -1;
+		}
+
+		if (free_blob.cap >= cap) {
+			header->blob_free[which_class] = free_blob.next;
+			return offset;
+		}
+	}
+
+	// 太大的数据块直接在末尾分配
+	if (cap > HASH_BLOB_EXTENT_SIZE / 2) {
+		return _alloc_tail(handle, cap);
+	}
+
+	if (header->blob_extent_left < cap) {
+		if ((offset = _alloc_tail(handle, HASH_BLOB_EXTENT_SIZE)) < 0) {
+			return -1;
+		}
+
+		header->blob_extent_offset = offset;
+		header->blob_extent_left = HASH_BLOB_EXTENT_SIZE;
+	}
+
+	offset = header->blob_extent_offset;
+	header->blob_extent_offset += cap;
+	header->blob_extent_left -= cap;
+
+	return offset;
+}
+
+// 数据块放回对应的空闲链表，调用者独占头部
+int _free_blob(hash_handle_t* handle, hash_blob_t* blob) {
+	uint32_t which_class = _blob_class(blob->cap);
+	hash_header_t* header = &handle->header;
+	hash_free_blob_t free_blob;
+
+	free_blob.next = header->blob_free[which_class];
+	free_blob.cap = blob->cap;
+
+	if (_write_at(handle, blob->offset, &free_blob, sizeof(hash_free_blob_t)) < 0) {
+		hash_error("write free blob 0x%lX error.", blob->offset);
+		return -1;
+	}
+
+	header->blob_free[which_class] = blob->offset;
+
+	return 0;
+}
+
+// 把 blob 换成容量至少为 len 的数据块，旧的放回空闲链表
+int _realloc_blob(hash_handle_t* handle, hash_blob_t* blob, uint32_t len) {
+	int ret = -1;
+	off_t offset = 0;
+	uint32_t cap = _blob_cap(len);
+
+	if (_lock_header(handle, F_WRLCK) < 0) {
+		goto exit;
+	}
+
+	if ((offset = _alloc_blob(handle, cap)) < 0) {
+		goto unlock_header;
+	}
+
+	if (blob->cap > 0 && _free_blob(handle, blob) < 0) {
+		goto unlock_header;
+	}
+
+	blob->offset = offset;
+	blob->cap = cap;
+
+	ret = _save_header(handle);
+
+unlock_header:
+	_unlock_header(handle);
+
+exit:
+	return ret;
+}
+
+/*
+ * 数据块只写实际长度，刚在末尾分配、还没有写过的节点也可能在文件末尾之后，
+ * 读不满的部分按0处理，不能用 happy_pread
+ */
+int _read_tail_at(hash_handle_t* handle, off_t offset, void* buf, size_t count) {
+	ssize_t n_r = 0;
+
+	memset(buf, 0, count);
+
+	if (_is_mapped(handle)) {
+		return _read_at(handle, offset, buf, count);
+	}
+
+	hash_stat_add(read_calls, 1);
+
+	if ((n_r = (pread)(handle->fd, buf, count, offset)) < 0) {
+		hash_error("read 0x%lX error : %s.", offset, strerror(errno));
+		return -1;
+	}
+
+	hash_stat_add(bytes_read, n_r);
+
+	return 0;
+}
+
+// 读取节点的数据块位置
+int _read_blob_ref(hash_handle_t* handle, off_t offset, hash_blob_t* blob) {
+	return _read_tail_at(handle, offset + sizeof(hash_node_t), blob, sizeof(hash_blob_t));
+}
+
+// 从数据块读出节点数据，还没有分配数据块时全部为0
+int _read_blob(hash_handle_t* handle, hash_blob_t* blob, void* value) {
+	uint32_t size = handle->header.node_data_value_size;
+	uint32_t len = blob->cap < size ? blob->cap : size;
+
+	if (len > 0 && _read_tail_at(handle, blob->offset, value, len) < 0) {
+		hash_error("read blob 0x%lX error.", blob->offset);
+		return -1;
+	}
+
+	_decode_value(handle, value, len);
+
+	return 0;
+}
+
+// 写入 offset 处节点的数据部分，变长存储时放不下就换一个数据块
+int _write_value(hash_handle_t* handle, off_t offset, void* value) {
+	int ret = -1;
+	uint32_t len = 0;
+	hash_blob_t blob;
+
+	if (!handle->header.varlen_value) {
+		return _write_at(handle, offset + sizeof(hash_node_t), value, handle->header.node_data_value_size);
+	}
+
+	if (_read_blob_ref(handle, offset, &blob) < 0) {
+		goto exit;
+	}
+
+	len = _value_len(handle, value);
+
+	if (len > blob.cap) {
+		if (_realloc_blob(handle, &blob, len) < 0) {
+			goto exit;
+		}
+
+		if (_write_at(handle, offset + sizeof(hash_node_t), &blob, sizeof(hash_blob_t)) < 0) {
+			hash_error("write blob ref of 0x%lX error.", offset);
+			goto exit;
+		}
+	}
+
+	if (_write_at(handle, blob.offset, value, len) < 0) {
+		hash_error("write blob 0x%lX error.", blob.offset);
+		goto exit;
+	}
+
+	ret = 0;
+
+exit:
+	return ret;
+}
+
+// 读取整个节点，数据部分读到 node->data.value 指向的缓冲区。定长存储时头部和数据部分一次读完
+int _read_node(hash_handle_t* handle, off_t offset, hash_node_t* node) {
+	int ret = -1;
+	void *addr = node->data.value;
+	hash_blob_t blob;
+	struct iovec iov[2];
+
+	iov[0].iov_base = node;
+	iov[0].iov_len = sizeof(hash_node_t);
+
+	if (handle->header.varlen_value) {
+		iov[1].iov_base = &blob;
+		iov[1].iov_len = sizeof(hash_blob_t);
+	} else {
+		iov[1].iov_base = addr;
+		iov[1].iov_len = handle->header.node_data_value_size;
+	}
+
+	ret = _readv_at(handle, offset, iov, iov[1].iov_len > 0 ? 2 : 1);
+	hash_stat_add(nodes_visited, 1);
+
+	node->data.value = addr;
+
+	if (0 == ret && handle->header.varlen_value) {
+		ret = _read_blob(handle, &blob, addr);
+	}
+
+	return ret;
+}
+
+// 写入整个节点。变长存储时未使用节点的数据没有意义，只写头部，数据块留给以后复用
+int _write_node(hash_handle_t* handle, off_t offset, hash_node_t* node) {
+	struct iovec iov[2];
+
+	if (handle->header.varlen_value) {
+		if (1 == node->used && _write_value(handle, offset, node->data.value) < 0) {
+			return -1;
+		}
+
+		return _write_node_header(handle, offset, node);
+	}
+
+	iov[0].iov_base = node;
+	iov[0].iov_len = sizeof(hash_node_t);
+	iov[1].iov_base = node->data.value;
+	iov[1].iov_len = handle->header.node_data_value_size;
+
+	return _writev_at(handle, offset, iov, iov[1].iov_len > 0 ? 2 : 1);
+}
+
+// 调用上层的比较回调，顺便计数
+bool _match_cb(bool (*cb)(hash_node_data_t*, hash_node_data_t*),
+		hash_node_data_t* file_node_data, hash_node_data_t* input_node_data) {
+	hash_stat_add(callbacks, 1);
+	return cb(file_node_data, input_node_data);
+}
+
+/************************************************
+ * 内容哈希：xxHash64，每次处理32字节、4路互不依赖的累加，比逐字节的 FNV-1a 快得多，
+ * 编译器也能把4路展开成向量指令。按本机字节序读入，文件不能在大小端不同的机器间共用
+ ***********************************************/
+
+#define HASH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME64_3 0x165667B19E3779F9ULL
+#define HASH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define HASH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define hash_rotl64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline uint64_t _read64(const uint8_t* p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t _read32(const uint8_t* p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t _xxh64_round(uint64_t acc, uint64_t input) {
+	acc += input * HASH_PRIME64_2;
+	acc = hash_rotl64(acc, 31);
+	return acc * HASH_PRIME64_1;
+}
+
+static inline uint64_t _xxh64_merge(uint64_t acc, uint64_t val) {
+	acc ^= _xxh64_round(0, val);
+	return acc * HASH_PRIME64_1 + HASH_PRIME64_4;
+}
+
+uint64_t hash_key64(const void* data, size_t len) {
+	const uint8_t* p = (const uint8_t*)data;
+	const uint8_t* end = p + len;
+	uint64_t h = 0;
+	uint64_t v1 = HASH_PRIME64_1 + HASH_PRIME64_2;
+	uint64_t v2 = HASH_PRIME64_2;
+	uint64_t v3 = 0;
+	uint64_t v4 = -HASH_PRIME64_1;
+
+	if (len >= 32) {
+		do {
+			v1 = _xxh64_round(v1, _read64(p));
+			v2 = _xxh64_round(v2, _read64(p + 8));
+			v3 = _xxh64_round(v3, _read64(p + 16));
+			v4 = _xxh64_round(v4, _read64(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+
+		h = hash_rotl64(v1, 1) + hash_rotl64(v2, 7) + hash_rotl64(v3, 12) + hash_rotl64(v4, 18);
+		h = _xxh64_merge(h, v1);
+		h = _xxh64_merge(h, v2);
+		h = _xxh64_merge(h, v3);
+		h = _xxh64_merge(h, v4);
+	} else {
+		h = HASH_PRIME64_5;
+	}
+
+	h += (uint64_t)len;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= _xxh64_round(0, _read64(p));
+		h = hash_rotl64(h, 27) * HASH_PRIME64_1 + HASH_PRIME64_4;
+	}
+
+	if (p + 4 <= end) {
+		h ^= (uint64_t)_read32(p) * HASH_PRIME64_1;
+		h = hash_rotl64(h, 23) * HASH_PRIME64_2 + HASH_PRIME64_3;
+		p += 4;
+	}
+
+	for (; p < end; p++) {
+		h ^= (*p) * HASH_PRIME64_5;
+		h = hash_rotl64(h, 11) * HASH_PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= HASH_PRIME64_2;
+	h ^= h >> 29;
+	h *= HASH_PRIME64_3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+// 声明了键字段时根据节点内容填写 index_key，按内容分槽时同时填写 key
+void _fill_key(hash_handle_t* handle, hash_node_data_t* node_data) {
+	hash_header_t* header = &handle->header;
+	const char* field = NULL;
+	size_t len = header->key_field_size;
+	uint64_t h = 0;
+
+	if (0 == header->key_field_size || NULL == node_data || NULL == node_data->value) {
+		return;
+	}
+
+	field = (const char*)node_data->value + header->key_field_offset;
+
+	if (HASH_KEY_FIELD_STRING & header->key_field_flags) {
+		len = strnlen(field, len);
+	}
+
+	h = hash_key64(field, len);
+
+	// index_key 为0表示不建索引
+	node_data->index_key = 0 == h ? 1 : h;
+
+	if (HASH_KEY_FIELD_SLOT & header->key_field_flags) {
+		node_data->key = (uint32_t)(h >> 32);
+	}
+}
+
+/************************************************
+ * 文件校验：头部开头是 magic、格式版本和格式字段的校验和，打开文件及 GENTLE_INIT 时只读一次头部就能判断
+ * 是不是当前版本的哈希文件、能不能直接使用。快照也用同样的 CRC32 校验
+ ***********************************************/
+
+static uint32_t s_crc_table[256];
+static pthread_once_t s_crc_once = PTHREAD_ONCE_INIT;
+
+static void _crc32_init() {
+	uint32_t i = 0;
+	uint32_t j = 0;
+	uint32_t c = 0;
+
+	for (i = 0; i < 256; i++) {
+		for (c = i, j = 0; j < 8; j++) {
+			c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		}
+
+		s_crc_table[i] = c;
+	}
+}
+
+// CRC32（IEEE 802.3），crc 为前面部分的结果，第一次传0
+uint32_t _crc32(uint32_t crc, const void* data, size_t len) {
+	const uint8_t* p = (const uint8_t*)data;
+
+	pthread_once(&s_crc_once, _crc32_init);
+
+	crc = ~crc;
+
+	while (len-- > 0) {
+		crc = s_crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
+
+// 创建后不再变化的字段：格式版本和初始化时的配置。哈希槽个数、索引容量等会增长，不参与校验
+uint32_t _format_crc(const hash_header_t* header) {
+	uint32_t fields[] = {
+		header->magic, header->version, header->base_slot_cnt,
+		header->node_data_value_size, header->header_data_value_size, (uint32_t)header->header_data_offset,
+		header->key_field_offset, header->key_field_size, header->key_field_flags,
+		header->varlen_value, header->value_tail_offset, header->rank_index,
+	};
+
+	return _crc32(0, fields, sizeof(fields));
+}
+
+void _seal_header(hash_header_t* header) {
+	header->magic = HASH_MAGIC;
+	header->version = HASH_VERSION;
+	header->format_crc = _format_crc(header);
+}
+
+// 读出的头部是不是当前版本的哈希文件
+bool _header_valid(const char* path, const hash_header_t* header) {
+	if (HASH_MAGIC != header->magic) {
+		hash_warn("%s is not a hash file.", path);
+		return false;
+	}
+
+	if (HASH_VERSION != header->version) {
+		hash_warn("%s is version %d, expect %d.", path, header->version, HASH_VERSION);
+		return false;
+	}
+
+	if (_format_crc(header) != header->format_crc) {
+		hash_warn("%s header is corrupted, crc mismatch.", path);
+		return false;
+	}
+
+	return true;
+}
+
+/************************************************
+ * 键值索引：开放寻址（线性探测）的哈希表，保存 index_key -> 节点偏移量，
+ * 插入、删除时同步维护，查找时只需探测几个表项，不用扫描整条链
+ ***********************************************/
+
+// 没有锁住头部时也会调用，index_cap 只会在0以外的值之间变化
+bool _index_enabled(hash_handle_t* handle) {
+	return __atomic_load_n(&handle->header.index_cap, __ATOMIC_RELAXED) > 0;
+}
+
+// 索引表的探测起点，index_key 可能是连续的小整数，先打散再取模
+uint32_t _index_pos(hash_handle_t* handle, uint64_t index_key) {
+	index_key ^= index_key >> 33;
+	index_key *= 0xFF51AFD7ED558CCDULL;
+	index_key ^= index_key >> 33;
+	index_key *= 0xC4CEB9FE1A85EC53ULL;
+	index_key ^= index_key >> 33;
+
+	return (uint32_t)(index_key & (handle->header.index_cap - 1));
+}
+
+off_t _index_entry_offset(hash_handle_t* handle, uint32_t pos) {
+	return handle->header.index_offset + pos * sizeof(hash_index_entry_t);
+}
+
+// 在内存中的索引表里放入一个表项，调用者保证表中有空位
+void _index_place(hash_index_entry_t* entries, uint32_t cap, uint32_t pos, hash_index_entry_t* entry) {
+	while (0 != entries[pos].offset) {
+		pos = (pos + 1) & (cap - 1);
+	}
+
+	entries[pos] = *entry;
+}
+
+/*
+ * 重建一张容量为 new_cap 的索引表，同时清除所有删除标记，调用者独占头部。
+ * 容量不变时就地重写；扩容时新表从数据块区分配，旧表放回空闲链表，反复插入删除时文件不会一直变大
+ */
+int _index_rebuild(hash_handle_t* handle, uint32_t new_cap) {
+	int ret = -1;
+	uint32_t i = 0;
+	uint32_t old_cap = handle->header.index_cap;
+	off_t new_index_offset = handle->header.index_offset;
+	hash_blob_t old_blob;
+	hash_index_entry_t* old_entries = NULL;
+	hash_index_entry_t* new_entries = NULL;
+
+	if (NULL == (old_entries = (hash_index_entry_t*)calloc(old_cap, sizeof(hash_index_entry_t)))
+			|| NULL == (new_entries = (hash_index_entry_t*)calloc(new_cap, sizeof(hash_index_entry_t)))) {
+		hash_error("calloc failed.");
+		goto exit;
+	}
+
+	if (_read_at(handle, handle->header.index_offset, old_entries, old_cap * sizeof(hash_index_entry_t)) < 0) {
+		hash_error("read index error.");
+		goto exit;
+	}
+
+	old_blob.offset = handle->header.index_offset;
+	old_blob.cap = old_cap * sizeof(hash_index_entry_t);
+
+	if (new_cap != old_cap
+			&& (new_index_offset = _alloc_blob(handle, _blob_cap(new_cap * sizeof(hash_index_entry_t)))) < 0) {
+		goto exit;
+	}
+
+	__atomic_store_n(&handle->header.index_cap, new_cap, __ATOMIC_RELAXED);
+	handle->header.index_offset = new_index_offset;
+	handle->header.index_tombstone_cnt = 0;
+
+	for (i = 0; i < old_cap; i++) {
+		if (0 != old_entries[i].offset && HASH_INDEX_TOMBSTONE != old_entries[i].offset) {
+			_index_place(new_entries, new_cap, _index_pos(handle, old_entries[i].index_key), &old_entries[i]);
+		}
+	}
+
+	if (_write_at(handle, new_index_offset, new_entries, new_cap * sizeof(hash_index_entry_t)) < 0) {
+		hash_error("write index error.");
+		goto exit;
+	}
+
+	// 头部指向新表之后才能改写旧表，中途掉电最多少回收一块
+	if (new_cap != old_cap && (_save_header(handle) < 0 || _free_blob(handle, &old_blob) < 0)) {
+		goto exit;
+	}
+
+	hash_debug("rebuild index of %s, cap %d -> %d, %d entries.", handle->path, old_cap, new_cap, handle->header.index_cnt);
+
+	ret = 0;
+
+exit:
+	safe_free(old_entries);
+	safe_free(new_entries);
+	return ret;
+}
+
+// 添加索引，期间独占头部，完成后保存头部信息
+int _index_add(hash_handle_t* handle, uint64_t index_key, off_t node_offset) {
+	int ret = -1;
+	uint32_t pos = 0;
+	uint32_t cap = 0;
+	hash_index_entry_t entry;
+
+	if (_lock_header(handle, F_WRLCK) < 0) {
+		goto exit;
+	}
+
+	cap = handle->header.index_cap;
+
+	// 装载率（含删除标记）超过 3/4 时重建，有效表项超过一半时容量翻倍
+	if ((handle->header.index_cnt + handle->header.index_tombstone_cnt + 1) * 4 > cap * 3) {
+		if (_index_rebuild(handle, (handle->header.index_cnt + 1) * 2 > cap ? cap * 2 : cap) < 0) {
+			goto unlock;
+		}
+		cap = handle->header.index_cap;
+	}
+
+	pos = _index_pos(handle, index_key);
+	do {
+		if (_read_at(handle, _index_entry_offset(handle, pos), &entry, sizeof(hash_index_entry_t)) < 0) {
+			hash_error("read index entry error.");
+			goto unlock;
+		}
+
+		if (0 == entry.offset || HASH_INDEX_TOMBSTONE == entry.offset) {
+			if (HASH_INDEX_TOMBSTONE == entry.offset) {
+				--handle->header.index_tombstone_cnt;
+			}
+
+			entry.index_key = index_key;
+			entry.offset = node_offset;
+
+			if (_write_at(handle, _index_entry_offset(handle, pos), &entry, sizeof(hash_index_entry_t)) < 0) {
+				hash_error("write index entry error.");
+				goto unlock;
+			}
+
+			++handle->header.index_cnt;
+			ret = _save_header(handle);
+			goto unlock;
+		}
+
+		pos = (pos + 1) & (cap - 1);
+	} while (1);
+
+unlock:
+	_unlock_header(handle);
+
+exit:
+	return ret;
+}
+
+// 删除索引，表项替换为删除标记，不打断其他键的探测序列。期间独占头部，完成后保存头部信息
+int _index_remove(hash_handle_t* handle, uint64_t index_key, off_t node_offset) {
+	int ret = -1;
+	uint32_t i = 0;
+	uint32_t pos = 0;
+	uint32_t cap = 0;
+	hash_index_entry_t entry;
+
+	if (_lock_header(handle, F_WRLCK) < 0) {
+		goto exit;
+	}
+
+	pos = _index_pos(handle, index_key);
+	cap = handle->header.index_cap;
+
+	for (i = 0; i < cap; i++) {
+		if (_read_at(handle, _index_entry_offset(handle, pos), &entry, sizeof(hash_index_entry_t)) < 0) {
+			hash_error("read index entry error.");
+			goto unlock;
+		}
+
+		if (0 == entry.offset) {
+			break;
+		}
+
+		if (index_key == entry.index_key && node_offset == entry.offset) {
+			entry.offset = HASH_INDEX_TOMBSTONE;
+
+			if (_write_at(handle, _index_entry_offset(handle, pos), &entry, sizeof(hash_index_entry_t)) < 0) {
+				hash_error("write index entry error.");
+				goto unlock;
+			}
+
+			--handle->header.index_cnt;
+			++handle->header.index_tombstone_cnt;
+			ret = _save_header(handle);
+			goto unlock;
+		}
+
+		pos = (pos + 1) & (cap - 1);
+	}
+
+	hash_warn("index 0x%lX -> 0x%lX not found.", index_key, node_offset);
+
+unlock:
+	_unlock_header(handle);
+
+exit:
+	return ret;
+}
+
+// 通过索引查找节点，返回值同 _find_node，调用者负责锁住头部
+off_t _index_find(hash_handle_t* handle, uint32_t which_slot, hash_node_data_t* input_node_data,
+		hash_node_t* output_node, bool (*cb)(hash_node_data_t*, hash_node_data_t*)) {
+	off_t ret = -1;
+	uint32_t i = 0;
+	uint32_t pos = _index_pos(handle, input_node_data->index_key);
+	uint32_t cap = handle->header.index_cap;
+	hash_index_entry_t entry;
+
+	for (i = 0; i < cap; i++) {
+		if (_read_at(handle, _index_entry_offset(handle, pos), &entry, sizeof(hash_index_entry_t)) < 0) {
+			hash_error("read index entry error.");
+			goto exit;
+		}
+
+		if (0 == entry.offset) {
+			break;
+		}
+
+		// 探测到的可能是其他哈希槽的节点，其他线程可能正在改，只有属于 which_slot 的才交给 cb
+		if (HASH_INDEX_TOMBSTONE != entry.offset && input_node_data->index_key == entry.index_key) {
+			if (_read_node(handle, entry.offset, output_node) < 0) {
+				goto exit;
+			}
+
+			if (1 == output_node->used
+					&& which_slot == _slot_of(handle, output_node->data.key)
+					&& (NULL == cb || true == _match_cb(cb, &(output_node->data), input_node_data))) {
+				ret = entry.offset;
+				goto exit;
+			}
+		}
+
+		pos = (pos + 1) & (cap - 1);
+	}
+
+	ret = 0;
+
+exit:
+	return ret;
+}
+
+/*
+ * 在 which_slot 中查找节点，找到返回节点偏移量，节点内容读到 output_node，没找到返回0，出错返回-1
+ * 有索引且 input_node_data->index_key 不为0时只探测索引，否则沿逻辑链扫描
+ * cb 用来确认节点（索引键冲突时继续探测），走索引时可以为NULL
+ * 调用者负责锁住 which_slot
+ */
+off_t _find_node(hash_handle_t* handle, uint32_t which_slot, hash_node_data_t* input_node_data,
+		hash_node_t* output_node, bool (*cb)(hash_node_data_t*, hash_node_data_t*)) {
+	off_t ret = -1;
+	off_t offset = 0;
+	off_t first_logic_node_offset = 0;
+
+	if (_index_enabled(handle) && 0 != input_node_data->index_key) {
+		if (_lock_header(handle, F_RDLCK) < 0) {
+			goto exit;
+		}
+
+		ret = _index_find(handle, which_slot, input_node_data, output_node, cb);
+
+		_unlock_header(handle);
+		goto exit;
+	}
+
+	if (NULL == cb) {
+		hash_error("no index and no cb, can't find node.");
+		goto exit;
+	}
+
+	first_logic_node_offset = handle->header.slots[which_slot].first_logic_node_offset;
+
+	offset = first_logic_node_offset;
+	do {
+		if (_read_node(handle, offset, output_node) < 0) {
+			goto exit;
+		}
+
+		if (1 == output_node->used && true == _match_cb(cb, &(output_node->data), input_node_data)) {
+			ret = offset;
+			goto exit;
+		}
+
+		offset = output_node->offsets.logic_next;
+	} while (offset != first_logic_node_offset);
+
+	ret = 0;
+
+exit:
+	return ret;
+}
+
+/************************************************
+ * 位置索引：每个哈希槽的节点按逻辑顺序分段记在叶子（数据块）里，每个叶子最多 HASH_RANK_LEAF_CAP 个节点偏移量，
+ * 叶子目录按顺序记录各个叶子的位置和节点个数，节点头部记录自己所在的叶子（rank_leaf）。
+ * 取第 index 个节点时读目录累加个数找到叶子，再从叶子中读一个偏移量，不用沿逻辑链表走。
+ * 插入、删除只改一个叶子和目录；叶子满了从插入位置拆开，删除后太空就并到相邻的叶子上，
+ * 换了叶子的节点改写头部的 rank_leaf。只在独占哈希槽时修改，分配、释放数据块时独占头部
+ ***********************************************/
+
+#define HASH_RANK_LEAF_FILL (HASH_RANK_LEAF_CAP * 3 / 4)	// 新建、拆开的叶子只填到这么多，给后面的插入留位置
+#define HASH_RANK_LEAF_MIN (HASH_RANK_LEAF_CAP / 4)		// 删除后少于这么多时尝试并到相邻的叶子上
+#define HASH_RANK_DIR_MIN_CAP 8
+
+// 叶子目录项，leaf 为0表示已经删掉、等待压缩
+typedef struct {
+	off_t leaf;
+	uint32_t cnt;
+} hash_rank_entry_t;
+
+bool _rank_enabled(hash_handle_t* handle) {
+	return handle->header.rank_index;
+}
+
+uint32_t _rank_leaf_cap() {
+	return _blob_cap(HASH_RANK_LEAF_CAP * sizeof(off_t));
+}
+
+// 读入 which_slot 的叶子目录，后面多留 extra 项的位置，调用者负责释放，出错返回NULL
+hash_rank_entry_t* _rank_load_dir(hash_handle_t* handle, uint32_t which_slot, uint32_t extra) {
+	slot_info_t* slot = &handle->header.slots[which_slot];
+	hash_rank_entry_t* dir = NULL;
+
+	if (NULL == (dir = (hash_rank_entry_t*)calloc(slot->rank_leaf_cnt + extra + 1, sizeof(hash_rank_entry_t)))) {
+		hash_error("calloc failed.");
+		goto exit;
+	}
+
+	if (slot->rank_leaf_cnt > 0 && _read_at(handle, slot->rank_dir_offset, dir,
+				slot->rank_leaf_cnt * sizeof(hash_rank_entry_t)) < 0) {
+		hash_error("read rank dir of slot %d error.", which_slot);
+		safe_free(dir);
+	}
+
+exit:
+	return dir;
+}
+
+// 目录从第 from 项开始写回，leaf_cnt 为新的叶子个数。容量不够时换一个更大的数据块整个写入
+int _rank_save_dir(hash_handle_t* handle, uint32_t which_slot, hash_rank_entry_t* dir, uint32_t leaf_cnt, uint32_t from) {
+	int ret = -1;
+	uint32_t cap = 0;
+	slot_info_t* slot = &handle->header.slots[which_slot];
+	hash_blob_t blob;
+
+	if (leaf_cnt > slot->rank_dir_cap) {
+		cap = slot->rank_dir_cap << 1;
+		cap = cap < HASH_RANK_DIR_MIN_CAP ? HASH_RANK_DIR_MIN_CAP : cap;
+		cap = cap < leaf_cnt ? leaf_cnt : cap;
+
+		blob.offset = slot->rank_dir_offset;
+		blob.cap = slot->rank_dir_cap * sizeof(hash_rank_entry_t);
+
+		if (_realloc_blob(handle, &blob, cap * sizeof(hash_rank_entry_t)) < 0) {
+			goto exit;
+		}
+
+		slot->rank_dir_offset = blob.offset;
+		slot->rank_dir_cap = cap;
+		from = 0;
+	}
+
+	if (leaf_cnt > from && _write_at(handle, slot->rank_dir_offset + from * sizeof(hash_rank_entry_t),
+				dir + from, (leaf_cnt - from) * sizeof(hash_rank_entry_t)) < 0) {
+		hash_error("write rank dir of slot %d error.", which_slot);
+		goto exit;
+	}
+
+	slot->rank_leaf_cnt = leaf_cnt;
+	ret = 0;
+
+exit:
+	return ret;
+}
+
+// 独占头部分配一个叶子，出错返回-1
+off_t _rank_alloc_leaf(hash_handle_t* handle) {
+	hash_blob_t blob;
+
+	memset(&blob, 0, sizeof(hash_blob_t));
+
+	if (_realloc_blob(handle, &blob, _rank_leaf_cap()) < 0) {
+		return -1;
+	}
+
+	return blob.offset;
+}
+
+// 独占头部释放一个叶子
+int _rank_free_leaf(hash_handle_t* handle, off_t leaf) {
+	int ret = -1;
+	hash_blob_t blob;
+
+	blob.offset = leaf;
+	blob.cap = _rank_leaf_cap();
+
+	if (_lock_header(handle, F_WRLCK) < 0) {
+		goto exit;
+	}
+
+	if (0 == _free_blob(handle, &blob)) {
+		ret = _save_header(handle);
+	}
+
+	_unlock_header(handle);
+
+exit:
+	return ret;
+}
+
+// 只改写节点头部的 rank_leaf
+int _rank_set_leaf(hash_handle_t* handle, off_t offset, off_t leaf) {
+	if (_write_at(handle, offset + offsetof(hash_node_t, rank_leaf), &leaf, sizeof(off_t)) < 0) {
+		hash_error("write rank leaf of 0x%lX error.", offset);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * 把 cnt 个新节点按顺序登记在 prev_offset 之后，prev_offset 为0表示哈希槽原来是空的。
+ * 新节点所在的叶子填到 leaves 中，由调用者和节点一起写入。拆开叶子时会改写其他节点头部，
+ * 必须在读入前后节点的头部之前调用
+ */
+int _rank_insert(hash_handle_t* handle, uint32_t which_slot, off_t prev_offset,
+		off_t* offsets, uint32_t cnt, off_t* leaves) {
+	int ret = -1;
+	uint32_t i = 0;
+	uint32_t j = 0;
+	uint32_t k = 0;
+	uint32_t d = 0;
+	uint32_t at = 0;
+	uint32_t n = 0;
+	uint32_t pos = 0;		// prev 和它前面的节点个数，新节点从这里开始
+	uint32_t len = 0;
+	uint32_t keep = 0;		// 留在 prev 所在叶子中的个数
+	uint32_t chunk_cnt = 0;
+	uint32_t chunk_len = 0;
+	uint32_t leaf_cnt = 0;
+	off_t prev_leaf = 0;
+	off_t leaf = 0;
+	off_t* seq = NULL;
+	slot_info_t* slot = &handle->header.slots[which_slot];
+	hash_rank_entry_t* dir = NULL;
+
+	// 拆出来的部分不超过 HASH_RANK_LEAF_CAP + cnt 个，按 HASH_RANK_LEAF_FILL 分成新叶子
+	chunk_cnt = (HASH_RANK_LEAF_CAP + cnt) / HASH_RANK_LEAF_FILL + 1;
+
+	if (NULL == (dir = _rank_load_dir(handle, which_slot, chunk_cnt))) {
+		goto exit;
+	}
+
+	if (NULL == (seq = (off_t*)malloc((HASH_RANK_LEAF_CAP + cnt) * sizeof(off_t)))) {
+		hash_error("malloc failed.");
+		goto exit;
+	}
+
+	leaf_cnt = slot->rank_leaf_cnt;
+
+	/* START 1. 在 prev 所在叶子中找到 prev，新节点接在后面 */
+	if (prev_offset > 0) {
+		if (_read_at(handle, prev_offset + offsetof(hash_node_t, rank_leaf), &prev_leaf, sizeof(off_t)) < 0) {
+			hash_error("read rank leaf of 0x%lX error.", prev_offset);
+			goto exit;
+		}
+
+		for (d = 0; d < leaf_cnt && dir[d].leaf != prev_leaf; d++);
+
+		if (d == leaf_cnt || 0 == prev_leaf) {
+			hash_error("rank leaf 0x%lX of node 0x%lX not found in slot %d.", prev_leaf, prev_offset, which_slot);
+			goto exit;
+		}
+
+		n = dir[d].cnt;
+
+		if (_read_at(handle, prev_leaf, seq, n * sizeof(off_t)) < 0) {
+			hash_error("read rank leaf 0x%lX error.", prev_leaf);
+			goto exit;
+		}
+
+		for (pos = 0; pos < n && seq[pos] != prev_offset; pos++);
+
+		if (pos++ == n) {
+			hash_error("node 0x%lX not found in rank leaf 0x%lX.", prev_offset, prev_leaf);
+			goto exit;
+		}
+
+		at = d + 1;
+	}
+
+	memmove(seq + pos + cnt, seq + pos, (n - pos) * sizeof(off_t));
+	memcpy(seq + pos, offsets, cnt * sizeof(off_t));
+	len = n + cnt;
+	/* END 1. 找到插入位置 */
+
+	/* START 2. 放得下就留在原来的叶子里，否则从插入位置拆开，prev 和前面的节点不动 */
+	if (0 == prev_leaf) {
+		keep = 0;
+	} else if (len <= HASH_RANK_LEAF_CAP) {
+		keep = len;
+	} else {
+		keep = pos > HASH_RANK_LEAF_FILL ? pos : HASH_RANK_LEAF_FILL;
+	}
+
+	if (keep > pos) {
+		if (_write_at(handle, prev_leaf + pos * sizeof(off_t), seq + pos, (keep - pos) * sizeof(off_t)) < 0) {
+			hash_error("write rank leaf 0x%lX error.", prev_leaf);
+			goto exit;
+		}
+
+		for (i = pos; i < keep && i < pos + cnt; i++) {
+			leaves[i - pos] = prev_leaf;
+		}
+	}
+
+	if (prev_leaf > 0) {
+		dir[d].cnt = keep;
+	}
+	/* END 2. 原来的叶子 */
+
+	/* START 3. 剩下的节点平均分到新叶子中 */
+	chunk_cnt = (len - keep + HASH_RANK_LEAF_FILL - 1) / HASH_RANK_LEAF_FILL;
+
+	for (k = 0, i = keep; k < chunk_cnt; k++, i += chunk_len) {
+		chunk_len = (len - keep) * (k + 1) / chunk_cnt - (i - keep);
+
+		if ((leaf = _rank_alloc_leaf(handle)) < 0) {
+			goto exit;
+		}
+
+		if (_write_at(handle, leaf, seq + i, chunk_len * sizeof(off_t)) < 0) {
+			hash_error("write rank leaf 0x%lX error.", leaf);
+			goto exit;
+		}
+
+		memmove(dir + at + 1, dir + at, (leaf_cnt - at) * sizeof(hash_rank_entry_t));
+		dir[at].leaf = leaf;
+		dir[at].cnt = chunk_len;
+		++at;
+		++leaf_cnt;
+
+		for (j = i; j < i + chunk_len; j++) {
+			if (j >= pos && j < pos + cnt) {
+				leaves[j - pos] = leaf;
+			} else if (_rank_set_leaf(handle, seq[j], leaf) < 0) {
+				goto exit;
+			}
+		}
+	}
+	/* END 3. 新叶子 */
+
+	if (_rank_save_dir(handle, which_slot, dir, leaf_cnt, prev_leaf > 0 ? d : 0) < 0) {
+		goto exit;
+	}
+
+	ret = 0;
+
+exit:
+	safe_free(seq);
+	safe_free(dir);
+	return ret;
+}
+
+/*
+ * 从位置索引中去掉 cnt 个节点，offsets 按逻辑顺序排列，leaves 是它们头部记录的叶子，空了的叶子直接释放。
+ * merge 为 true 时太空的叶子并到相邻的叶子上，会改写其他节点头部的 rank_leaf：
+ * 调用者手里还留着其他节点的头部、之后要写回时不能合并
+ */
+int _rank_remove(hash_handle_t* handle, uint32_t which_slot, off_t* offsets, off_t* leaves, uint32_t cnt, bool merge) {
+	int ret = -1;
+	uint32_t i = 0;
+	uint32_t j = 0;
+	uint32_t k = 0;
+	uint32_t d = 0;
+	uint32_t n = 0;
+	uint32_t m = 0;
+	uint32_t to = 0;
+	uint32_t from = 0;
+	uint32_t leaf_cnt = 0;
+	off_t* items = NULL;
+	slot_info_t* slot = &handle->header.slots[which_slot];
+	hash_rank_entry_t* dir = NULL;
+
+	if (NULL == (dir = _rank_load_dir(handle, which_slot, 0))) {
+		goto exit;
+	}
+
+	if (NULL == (items = (off_t*)malloc(HASH_RANK_LEAF_CAP * sizeof(off_t)))) {
+		hash_error("malloc failed.");
+		goto exit;
+	}
+
+	leaf_cnt = slot->rank_leaf_cnt;
+	from = leaf_cnt;
+
+	// 同一个叶子中的节点一起处理
+	for (i = 0; i < cnt; i = j) {
+		for (j = i + 1; j < cnt && leaves[j] == leaves[i]; j++);
+
+		for (d = 0; d < leaf_cnt && dir[d].leaf != leaves[i]; d++);
+
+		if (d == leaf_cnt || 0 == leaves[i]) {
+			hash_error("rank leaf 0x%lX of node 0x%lX not found in slot %d.", leaves[i], offsets[i], which_slot);
+			goto exit;
+		}
+
+		n = dir[d].cnt;
+
+		if (_read_at(handle, dir[d].leaf, items, n * sizeof(off_t)) < 0) {
+			hash_error("read rank leaf 0x%lX error.", dir[d].leaf);
+			goto exit;
+		}
+
+		for (k = 0, m = 0; k < n; k++) {
+			for (to = i; to < j && offsets[to] != items[k]; to++);
+
+			if (to == j) {
+				items[m++] = items[k];
+			}
+		}
+
+		if (n - m != j - i) {
+			hash_warn("%d of %d nodes not found in rank leaf 0x%lX.", (j - i) - (n - m), j - i, dir[d].leaf);
+		}
+
+		if (0 == m) {
+			if (_rank_free_leaf(handle, dir[d].leaf) < 0) {
+				goto exit;
+			}
+
+			dir[d].leaf = 0;
+		} else if (_write_at(handle, dir[d].leaf, items, m * sizeof(off_t)) < 0) {
+			hash_error("write rank leaf 0x%lX error.", dir[d].leaf);
+			goto exit;
+		}
+
+		dir[d].cnt = m;
+		from = d < from ? d : from;
+	}
+
+	/* START 太空的叶子并到前一个或后一个叶子上，只需要改写这个叶子中节点的 rank_leaf */
+	if (merge && 1 == cnt && m > 0 && m < HASH_RANK_LEAF_MIN) {
+		if (d > 0 && dir[d - 1].cnt + m <= HASH_RANK_LEAF_CAP) {
+			to = d - 1;
+
+			if (_write_at(handle, dir[to].leaf + dir[to].cnt * sizeof(off_t), items, m * sizeof(off_t)) < 0) {
+				hash_error("write rank leaf 0x%lX error.", dir[to].leaf);
+				goto exit;
+			}
+		} else if (d + 1 < leaf_cnt && dir[d + 1].cnt + m <= HASH_RANK_LEAF_CAP) {
+			to = d + 1;
+
+			if (_read_at(handle, dir[to].leaf, items + m, dir[to].cnt * sizeof(off_t)) < 0) {
+				hash_error("read rank leaf 0x%lX error.", dir[to].leaf);
+				goto exit;
+			}
+
+			if (_write_at(handle, dir[to].leaf, items, (m + dir[to].cnt) * sizeof(off_t)) < 0) {
+				hash_error("write rank leaf 0x%lX error.", dir[to].leaf);
+				goto exit;
+			}
+		} else {
+			goto compact;
+		}
+
+		for (k = 0; k < m; k++) {
+			if (_rank_set_leaf(handle, items[k], dir[to].leaf) < 0) {
+				goto exit;
+			}
+		}
+
+		if (_rank_free_leaf(handle, dir[d].leaf) < 0) {
+			goto exit;
+		}
+
+		dir[to].cnt += m;
+		dir[d].leaf = 0;
+		from = to < from ? to : from;
+	}
+	/* END 合并叶子 */
+
+compact:
+	for (d = from, k = from; d < leaf_cnt; d++) {
+		if (0 != dir[d].leaf) {
+			dir[k++] = dir[d];
+		}
+	}
+
+	if (_rank_save_dir(handle, which_slot, dir, k, from) < 0) {
+		goto exit;
+	}
+
+	ret = 0;
+
+exit:
+	safe_free(items);
+	safe_free(dir);
+	return ret;
+}
+
+/*
+ * 哈希槽分裂后按 idxs 的顺序（逻辑顺序）重建 which_slot 的位置索引，旧的叶子和目录先释放，
+ * 节点的 rank_leaf 填在 nodes 中，由调用者写回。调用者独占头部
+ */
+int _rank_build(hash_handle_t* handle, uint32_t which_slot, hash_node_t* nodes, off_t* offsets,
+		uint32_t* idxs, uint32_t cnt) {
+	int ret = -1;
+	uint32_t i = 0;
+	uint32_t k = 0;
+	uint32_t n = 0;
+	uint32_t leaf_cnt = 0;
+	off_t* seq = NULL;
+	slot_info_t* slot = &handle->header.slots[which_slot];
+	hash_rank_entry_t* dir = NULL;
+	hash_blob_t blob;
+
+	/* START 释放旧的叶子和目录 */
+	if (NULL == (dir = _rank_load_dir(handle, which_slot, 0))) {
+		goto exit;
+	}
+
+	blob.cap = _rank_leaf_cap();
+
+	for (k = 0; k < slot->rank_leaf_cnt; k++) {
+		blob.offset = dir[k].leaf;
+
+		if (_free_blob(handle, &blob) < 0) {
+			goto exit;
+		}
+	}
+
+	if (slot->rank_dir_cap > 0) {
+		blob.offset = slot->rank_dir_offset;
+		blob.cap = slot->rank_dir_cap * sizeof(hash_rank_entry_t);
+
+		if (_free_blob(handle, &blob) < 0) {
+			goto exit;
+		}
+	}
+
+	slot->rank_dir_offset = 0;
+	slot->rank_dir_cap = 0;
+	slot->rank_leaf_cnt = 0;
+	safe_free(dir);
+	/* END 释放 */
+
+	if (0 == cnt) {
+		ret = 0;
+		goto exit;
+	}
+
+	leaf_cnt = (cnt + HASH_RANK_LEAF_FILL - 1) / HASH_RANK_LEAF_FILL;
+
+	if (NULL == (dir = (hash_rank_entry_t*)calloc(leaf_cnt, sizeof(hash_rank_entry_t)))
+			|| NULL == (seq = (off_t*)malloc(HASH_RANK_LEAF_FILL * sizeof(off_t)))) {
+		hash_error("calloc failed.");
+		goto exit;
+	}
+
+	for (k = 0, i = 0; k < leaf_cnt; k++) {
+		if ((dir[k].leaf = _alloc_blob(handle, _rank_leaf_cap())) < 0) {
+			goto exit;
+		}
+
+		for (n = 0; n < HASH_RANK_LEAF_FILL && i < cnt; n++, i++) {
+			seq[n] = offsets[idxs[i]];
+			nodes[idxs[i]].rank_leaf = dir[k].leaf;
+		}
+
+		dir[k].cnt = n;
+
+		if (_write_at(handle, dir[k].leaf, seq, n * sizeof(off_t)) < 0) {
+			hash_error("write rank leaf 0x%lX error.", dir[k].leaf);
+			goto exit;
+		}
+	}
+
+	slot->rank_dir_cap = leaf_cnt < HASH_RANK_DIR_MIN_CAP ? HASH_RANK_DIR_MIN_CAP : leaf_cnt;
+
+	if ((slot->rank_dir_offset = _alloc_blob(handle, slot->rank_dir_cap * sizeof(hash_rank_entry_t))) < 0) {
+		goto exit;
+	}
+
+	if (_write_at(handle, slot->rank_dir_offset, dir, leaf_cnt * sizeof(hash_rank_entry_t)) < 0) {
+		hash_error("write rank dir of slot %d error.", which_slot);
+		goto exit;
+	}
+
+	slot->rank_leaf_cnt = leaf_cnt;
+	ret = 0;
+
+exit:
+	safe_free(seq);
+	safe_free(dir);
+	return ret;
+}
+
+// 按逻辑顺序取第 index 个节点，返回值同 hash_get_node_at，调用者负责锁住 which_slot
+off_t _get_node_at(hash_handle_t* handle, uint32_t which_slot, uint32_t index, hash_node_t* output_node) {
+	off_t ret = -1;
+	off_t offset = 0;
+	uint32_t i = 0;
+	uint32_t d = 0;
+	slot_info_t* slot = &handle->header.slots[which_slot];
+	hash_rank_entry_t* dir = NULL;
+
+	if (index >= slot->node_cnt) {
+		ret = 0;
+		goto exit;
+	}
+
+	if (_rank_enabled(handle)) {
+		if (NULL == (dir = _rank_load_dir(handle, which_slot, 0))) {
+			goto exit;
+		}
+
+		for (d = 0; d < slot->rank_leaf_cnt && index >= dir[d].cnt; d++) {
+			index -= dir[d].cnt;
+		}
+
+		if (d == slot->rank_leaf_cnt) {
+			hash_error("rank index of slot %d is broken.", which_slot);
+			goto exit;
+		}
+
+		if (_read_at(handle, dir[d].leaf + index * sizeof(off_t), &offset, sizeof(off_t)) < 0) {
+			hash_error("read rank leaf 0x%lX error.", dir[d].leaf);
+			goto exit;
+		}
+	} else {
+		// 没有位置索引时只读头部，从较近的一端走过去
+		offset = slot->first_logic_node_offset;
+
+		if (index < slot->node_cnt / 2) {
+			for (i = 0; i < index; i++) {
+				if (_read_node_header(handle, offset, output_node) < 0) {
+					goto exit;
+				}
+
+				offset = output_node->offsets.logic_next;
+			}
+		} else {
+			for (i = slot->node_cnt; i > index; i--) {
+				if (_read_node_header(handle, offset, output_node) < 0) {
+					goto exit;
+				}
+
+				offset = output_node->offsets.logic_prev;
+			}
+		}
+	}
+
+	if (_read_node(handle, offset, output_node) < 0) {
+		goto exit;
+	}
+
+	if (1 != output_node->used) {
+		hash_error("node 0x%lX at %d of slot %d is unused.", offset, index, which_slot);
+		goto exit;
+	}
+
+	ret = offset;
+
+exit:
+	safe_free(dir);
+	return ret;
+}
+
+hash_handle_t* hash_open(const char* path, uint32_t flags) {
+	hash_handle_t* handle = NULL;
+	uint64_t start_ns = hash_stat_now();
+	slot_info_t* slots = NULL;
+	uint32_t slot_cnt = 0;
+	struct stat st;
+
+	if (NULL == (handle = (hash_handle_t*)calloc(1, sizeof(hash_handle_t)))) {
+		hash_error("calloc failed.");
+		goto exit;
+	}
+
+	handle->fd = -1;
+	handle->flags = flags;
+
+	if (NULL == (handle->path = strdup(path))) {
+		hash_error("strdup failed.");
+		goto fail;
+	}
+
+	if ((handle->fd = open(path, (HASH_OPEN_RDWR & flags) ? O_RDWR : O_RDONLY)) < 0) {
+		hash_error("open file %s fail : %s.", path, strerror(errno));
+		goto fail;
+	}
+
+	// 先读取头部的哈希信息，防止读到其他句柄写了一半的头部
+	if (_lock_range(handle, 0, sizeof(hash_header_t), F_RDLCK) < 0) {
+		goto fail;
+	}
+
+	if (pread(handle->fd, &handle->header, sizeof(hash_header_t), 0) < 0) {
+		hash_error("read header error.");
+		_lock_range(handle, 0, sizeof(hash_header_t), F_UNLCK);
+		goto fail;
+	}
+
+	_lock_range(handle, 0, sizeof(hash_header_t), F_UNLCK);
+
+	// 文件中保存的指针值没有意义，重新建立关联
+	handle->header.slots = NULL;
+	handle->header.data.value = NULL;
+
+	if (!_header_valid(path, &handle->header)) {
+		goto fail;
+	}
+
+	slot_cnt = handle->header.slot_cnt;
+
+	if (0 == slot_cnt || slot_cnt > handle->header.slot_cap) {
+		hash_error("%s has %d slots, cap %d.", path, slot_cnt, handle->header.slot_cap);
+		goto fail;
+	}
+
+	// 按目录容量分配，分裂出新的哈希槽时不用马上重新分配
+	if (NULL == (slots = (void*)calloc(handle->header.slot_cap, sizeof(slot_info_t)))) {
+		hash_error("calloc failed.");
+		goto fail;
+	}
+
+	handle->header.slots = slots;
+
+	if (NULL == (handle->locks = _create_locks(handle->header.slot_cap))) {
+		goto fail;
+	}
+
+	if (pread(handle->fd, slots, slot_cnt * sizeof(slot_info_t), handle->header.slots_offset) < 0) {
+		hash_error("read slot_info error.");
+		goto fail;
+	}
+
+	if (HASH_OPEN_MMAP & flags) {
+		if (fstat(handle->fd, &st) < 0) {
+			hash_error("fstat %s fail : %s.", path, strerror(errno));
+			goto fail;
+		}
+
+		if (_remap(handle, st.st_size) < 0) {
+			goto fail;
+		}
+	}
+
+	goto exit;
+
+fail:
+	hash_close(handle);
+	handle = NULL;
+
+exit:
+	hash_stat_api(HASH_API_OPEN, start_ns);
+	return handle;
+}
+
+void hash_close(hash_handle_t* handle) {
+	if (NULL == handle) {
+		return;
+	}
+
+	if (NULL != handle->map) {
+		munmap(handle->map, handle->map_size);
+	}
+
+	if (handle->fd >= 0) {
+		close(handle->fd);
+	}
+
+	_destroy_locks((hash_locks_t*)handle->locks);
+	safe_free(handle->header.slots);
+	safe_free(handle->path);
+	free(handle);
+}
+
+int hash_get_slot_node_cnt(hash_handle_t* handle, uint32_t which_slot) {
+	int ret = -1;
+
+	if (_lock_dir(handle, F_RDLCK) < 0) {
+		goto exit;
+	}
+
+	which_slot = _slot_of(handle, which_slot);
+
+	if (_lock_slot(handle, which_slot, F_RDLCK) < 0) {
+		goto unlock_dir;
+	}
+
+	ret = handle->header.slots[which_slot].node_cnt;
+
+	_unlock_slot(handle, which_slot);
+
+unlock_dir:
+	_unlock_dir(handle);
+
+exit:
+	return ret;
+}
+
+bool hash_is_slot_empty(hash_handle_t* handle, uint32_t which_slot) {
+	return (0 == hash_get_slot_node_cnt(handle, which_slot));
+}
+
+// 外部调用时需填充header结构体，包括其中的header.data.value内容
+int hash_get_header_data(hash_handle_t* handle, hash_header_data_t* output_header_data) {
+	int ret = -1;
+	uint64_t start_ns = hash_stat_now();
+	uint32_t header_data_value_size = handle->header.header_data_value_size;
+
+	if (0 == header_data_value_size) {
+		ret = 0;
+		goto exit;
+	}
+
+	if (_lock_header_data(handle, F_RDLCK) < 0) {
+		goto exit;
+	}
+
+	if (_read_at(handle, _header_data_offset(handle), output_header_data->value, header_data_value_size) < 0) {
+		hash_error("read output_header->value error.");
+	} else {
+		ret = 0;
+	}
+
+	_unlock_header_data(handle);
+
+exit:
+	hash_stat_api(HASH_API_GET_HEADER_DATA, start_ns);
+	return ret;
+}
+
+// 外部调用时需填充header结构体，包括其中的header.data.value内容
+int hash_set_header_data(hash_handle_t* handle, hash_header_data_t* input_header_data) {
+	int ret = -1;
+	uint64_t start_ns = hash_stat_now();
+	uint32_t header_data_value_size = handle->header.header_data_value_size;
+
+	if (0 == header_data_value_size) {
+		ret = 0;
+		goto exit;
+	}
+
+	if (_lock_header_data(handle, F_WRLCK) < 0) {
+		goto exit;
+	}
+
+	if (_write_at(handle, _header_data_offset(handle), input_header_data->value, header_data_value_size) < 0) {
+		hash_error("write input_header_data->value error.");
+	} else {
+		ret = 0;
+	}
+
+	_unlock_header_data(handle);
+
+exit:
+	hash_stat_api(HASH_API_SET_HEADER_DATA, start_ns);
+	return ret;
+}
+
+int hash_get_aux_at(hash_handle_t* handle, uint32_t which, uint32_t from, void* buf, uint32_t size) {
+	int ret = -1;
+	uint64_t start_ns = hash_stat_now();
+	hash_aux_t aux;
+
+	if (which >= HASH_AUX_CNT) {
+		hash_error("aux %d is out of range.", which);
+		goto exit;
+	}
+
+	if (_lock_header(handle, F_RDLCK) < 0) {
+		goto exit;
+	}
+
+	aux = handle->header.aux[which];
+
+	if (aux.len > from && size > 0
+			&& _read_tail_at(handle, aux.offset + from, buf, aux.len - from < size ? aux.len - from : size) < 0) {
+		hash_error("read aux %d error.", which);
+	} else {
+		ret = aux.len;
+	}
+
+	_unlock_header(handle);
+
+exit:
+	hash_stat_api(HASH_API_GET_AUX, start_ns);
+	return ret;
+}
+
+int hash_get_aux(hash_handle_t* handle, uint32_t which, void* buf, uint32_t size) {
+	return hash_get_aux_at(handle, which, 0, buf, size);
+}
+
+int hash_update_aux(hash_handle_t* handle, uint32_t which, uint32_t size,
+		int (*cb)(void* buf, uint32_t len, void* input_arg), void* input_arg) {
+	int ret = -1;
+	int len = 0;
+	uint32_t cap = 0;
+	uint64_t start_ns = hash_stat_now();
+	char* buf = NULL;
+	off_t offset = 0;
+	hash_aux_t* aux = NULL;
+	hash_blob_t blob;
+
+	if (which >= HASH_AUX_CNT) {
+		hash_error("aux %d is out of range.", which);
+		goto exit;
+	}
+
+	if (_lock_header(handle, F_WRLCK) < 0) {
+		goto exit;
+	}
+
+	aux = &handle->header.aux[which];
+
+	if (NULL == (buf = (char*)calloc(1, (aux->len > size ? aux->len : size) + 1))) {
+		hash_error("calloc failed.");
+		goto unlock_header;
+	}
+
+	if (aux->len > 0 && _read_tail_at(handle, aux->offset, buf, aux->len) < 0) {
+		hash_error("read aux %d error.", which);
+		goto unlock_header;
+	}
+
+	// 回调没有修改
+	if ((len = cb(buf, aux->len, input_arg)) < 0) {
+		ret = aux->len;
+		goto unlock_header;
+	}
+
+	if ((uint32_t)len > size) {
+		hash_error("aux %d length %d exceeds %d.", which, len, size);
+		goto unlock_header;
+	}
+
+	// 放不下时换一个至少大一倍的数据块，旧的放回空闲链表，逐步追加时不会反复搬动
+	if ((uint32_t)len > aux->cap) {
+		cap = _blob_cap((uint32_t)len > aux->cap * 2 ? (uint32_t)len : aux->cap * 2);
+
+		if ((offset = _alloc_blob(handle, cap)) < 0) {
+			goto unlock_header;
+		}
+
+		blob.offset = aux->offset;
+		blob.cap = aux->cap;
+
+		if (blob.cap > 0 && _free_blob(handle, &blob) < 0) {
+			goto unlock_header;
+		}
+
+		aux->offset = offset;
+		aux->cap = cap;
+	}
+
+	if (len > 0 && _write_at(handle, aux->offset, buf, len) < 0) {
+		hash_error("write aux %d error.", which);
+		goto unlock_header;
+	}
+
+	aux->len = len;
+
+	if (_save_header(handle) < 0) {
+		goto unlock_header;
+	}
+
+	ret = len;
+
+unlock_header:
+	_unlock_header(handle);
+
+exit:
+	safe_free(buf);
+	hash_stat_api(HASH_API_UPDATE_AUX, start_ns);
+	return ret;
+}
+
+#define DEBUG_GET_NODE 0
+int hash_get_node(hash_handle_t* handle, uint32_t which_slot, off_t offset, hash_node_t* output_node) {
+	int ret = -1;
+	uint64_t start_ns = hash_stat_now();
+
+	if (_lock_dir(handle, F_RDLCK) < 0) {
+		goto exit;
+	}
+
+	which_slot = _slot_of(handle, which_slot);
+
+	if (_lock_slot(handle, which_slot, F_RDLCK) < 0) {
+		goto unlock_dir;
+	}
+
+	// 为0表示获取第一个逻辑节点地址
+	if (0 == offset) {
+		offset = handle->header.slots[which_slot].first_logic_node_offset;
+	}
+
+	if (_read_node(handle, offset, output_node) < 0) {
+		hash_error("read node failed.");
+		goto unlock;
+	}
+
+#if DEBUG_GET_NODE
+	hash_debug("0x%lX <- 0x%lX -> 0x%lX.", output_node->offsets.logic_prev, offset, output_node->offsets.logic_next);
+#endif
+
+	ret = 0;
+
+unlock:
+	_unlock_slot(handle, which_slot);
+
+unlock_dir:
+	_unlock_dir(handle);
+
+exit:
+	hash_stat_api(HASH_API_GET_NODE, start_ns);
+	return ret;
+}
+#undef DEBUG_GET_NODE
+
+off_t hash_get_node_at(hash_handle_t* handle, uint32_t which_slot, uint32_t index, hash_node_t* output_node) {
+	off_t ret = -1;
+	uint64_t start_ns = hash_stat_now();
+
+	if (_lock_dir(handle, F_RDLCK) < 0) {
+		goto exit;
+	}
+
+	which_slot = _slot_of(handle, which_slot);
+
+	if (_lock_slot(handle, which_slot, F_RDLCK) < 0) {
+		goto unlock_dir;
+	}
+
+	ret = _get_node_at(handle, which_slot, index, output_node);
+
+	_unlock_slot(handle, which_slot);
+
+unlock_dir:
+	_unlock_dir(handle);
+
+exit:
+	hash_stat_api(HASH_API_GET_NODE_AT, start_ns);
+	return ret;
+}
+
+off_t hash_find_node(hash_handle_t* handle, hash_node_data_t* input_node_data, hash_node_t* output_node,
+		bool (*cb)(hash_node_data_t*, hash_node_data_t*)) {
+	off_t ret = -1;
+	uint64_t start_ns = hash_stat_now();
+	uint32_t which_slot = 0;
+
+	_fill_key(handle, input_node_data);
+
+	if (_lock_dir(handle, F_RDLCK) < 0) {
+		goto exit;
+	}
+
+	which_slot = _slot_of(handle, input_node_data->key);
+
+	if (_lock_slot(handle, which_slot, F_RDLCK) < 0) {
+		goto unlock_dir;
+	}
+
+	ret = _find_node(handle, which_slot, input_node_data, output_node, cb);
+
+	_unlock_slot(handle, which_slot);
+
+unlock_dir:
+	_unlock_dir(handle);
+
+exit:
+	hash_stat_api(HASH_API_FIND_NODE, start_ns);
+	return ret;
+}
+
+// 只写数据部分，节点的链接关系及键值保持不变，input_node->data.key 决定锁哪个哈希槽
+int hash_update_node(hash_handle_t* handle, off_t offset, hash_node_t* input_node) {
+	int ret = -1;
+	uint64_t start_ns = hash_stat_now();
+	uint32_t which_slot = 0;
+	uint32_t node_data_value_size = handle->header.node_data_value_size;
+
+	if (0 == node_data_value_size) {
+		ret = 0;
+		goto exit;
+	}
+
+	if (_lock_dir(handle, F_RDLCK) < 0) {
+		goto exit;
+	}
+
+	which_slot = _slot_of(handle, input_node->data.key);
+
+	if (_lock_slot(handle, which_slot, F_WRLCK) < 0) {
+		goto unlock_dir;
+	}
+
+	if (_write_value(handle, offset, input_node->data.value) < 0) {
+		hash_error("update node 0x%lX error.", offset);
+	} else {
+		ret = 0;
+	}
+
+	_unlock_slot(handle, which_slot);
+
+unlock_dir:
+	_unlock_dir(handle);
+
+exit:
+	hash_stat_api(HASH_API_UPDATE_NODE, start_ns);
+	return ret;
+}
+
+/************************************************
+ * 哈希槽分裂（线性哈希）：按顺序每次分裂一个哈希槽，把其中按下一轮个数取模后属于新槽的节点挂到新槽上。
+ * 节点在文件中的位置不变，只重新链接，索引中保存的偏移量不受影响。
+ * 分裂期间独占目录和头部，其他操作都先共享目录，所以看不到分裂到一半的哈希槽
+ ***********************************************/
+
+typedef struct {
+	off_t offset;
+	uint32_t i;			// 在按物理顺序读入的数组中的下标
+} hash_split_entry_t;
+
+int _split_entry_cmp(const void* a, const void* b) {
+	off_t x = ((const hash_split_entry_t*)a)->offset;
+	off_t y = ((const hash_split_entry_t*)b)->offset;
+
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// 目录已满时在末尾另建一个两倍容量的目录，旧目录所在区域放回空闲链表，调用者独占目录和头部
+int _grow_dir(hash_handle_t* handle) {
+	int ret = -1;
+	off_t offset = 0;
+	hash_header_t* header = &handle->header;
+	uint32_t slot_cap = header->slot_cap << 1;
+	hash_blob_t old_blob;
+
+	if (slot_cap > HASH_MAX_SLOT_CNT) {
+		slot_cap = HASH_MAX_SLOT_CNT;
+	}
+
+	if (_resize_slots(handle, slot_cap) < 0) {
+		goto exit;
+	}
+
+	if ((offset = _alloc_tail(handle, slot_cap * sizeof(slot_info_t))) < 0) {
+		goto exit;
+	}
+
+	if (_write_at(handle, offset, header->slots, header->slot_cnt * sizeof(slot_info_t)) < 0) {
+		hash_error("write slot_info error.");
+		goto exit;
+	}
+
+	hash_info("slot directory moves from 0x%lX to 0x%lX, cap %d -> %d.",
+			header->slots_offset, offset, header->slot_cap, slot_cap);
+
+	old_blob.offset = header->slots_offset;
+	old_blob.cap = (header->slot_cap * sizeof(slot_info_t)) & ~(HASH_BLOB_ALIGN - 1);
+
+	header->slots_offset = offset;
+	header->slot_cap = slot_cap;
+
+	// 头部指向新目录之后才能改写旧目录，中途掉电最多少回收一块
+	if (_save_header(handle) < 0 || _free_blob(handle, &old_blob) < 0) {
+		goto exit;
+	}
+
+	ret = 0;
+
+exit:
+	return ret;
+}
+
+// 在末尾分配一个未使用的节点，四个方向都指向自己，用作空哈希槽里留下的那个节点，返回偏移量，出错返回-1
+off_t _alloc_anchor(hash_handle_t* handle) {
+	off_t ret = -1;
+	off_t offset = 0;
+	hash_node_t node;
+	void* node_data_value = NULL;
+	uint32_t node_data_value_size = handle->header.node_data_value_size;
+	hash_blob_t blob;
+
+	memset(&node, 0, sizeof(hash_node_t));
+	memset(&blob, 0, sizeof(hash_blob_t));
+
+	if (node_data_value_size > 0
+			&& NULL == (node_data_value = (void*)calloc(1, node_data_value_size))) {
+		hash_error("calloc failed.");
+		goto exit;
+	}
+
+	if ((offset = _alloc_tail(handle, _node_size(handle))) < 0) {
+		goto exit;
+	}
+
+	node.data.value = node_data_value;
+	node.offsets.physic_prev = node.offsets.physic_next = offset;
+	node.offsets.logic_prev = node.offsets.logic_next = offset;
+
+	if (_write_node(handle, offset, &node) < 0) {
+		hash_error("write node 0x%lX error.", offset);
+		goto exit;
+	}
+
+	// 变长存储时未使用节点只写头部，新节点还要写上空的数据块位置
+	if (handle->header.varlen_value && _write_at(handle, offset + sizeof(hash_node_t), &blob, sizeof(hash_blob_t)) < 0) {
+		hash_error("write blob ref of 0x%lX error.", offset);
+		goto exit;
+	}
+
+	ret = offset;
+
+exit:
+	safe_free(node_data_value);
+	return ret;
+}
+
+// 把 idxs 中的节点按顺序连成物理链表（首尾相接）
+void _link_physic(hash_node_t* nodes, off_t* offsets, uint32_t* idxs, uint32_t cnt) {
+	uint32_t k = 0;
+
+	for (k = 0; k < cnt; k++) {
+		nodes[idxs[k]].offsets.physic_prev = offsets[idxs[(k + cnt - 1) % cnt]];
+		nodes[idxs[k]].offsets.physic_next = offsets[idxs[(k + 1) % cnt]];
+	}
+}
+
+// 把 idxs 中的节点按顺序连成逻辑链表（首尾相接）
+void _link_logic(hash_node_t* nodes, off_t* offsets, uint32_t* idxs, uint32_t cnt) {
+	uint32_t k = 0;
+
+	for (k = 0; k < cnt; k++) {
+		nodes[idxs[k]].offsets.logic_prev = offsets[idxs[(k + cnt - 1) % cnt]];
+		nodes[idxs[k]].offsets.logic_next = offsets[idxs[(k + 1) % cnt]];
+	}
+}
+
+/*
+ * 分裂第 split_slot 个哈希槽，调用者独占目录和头部，常驻内存的目录是最新的
+ * 1. 沿物理链表读入旧槽所有节点的头部
+ * 2. 按下一轮的个数取模，挑出属于新槽的已使用节点，两边各自保持原来的物理顺序和逻辑顺序
+ * 3. 旧槽的未使用节点：旧槽还有已使用节点时全部压入空闲节点栈，否则第一个留作槽里剩下的那个节点
+ */
+int _split_slot(hash_handle_t* handle) {
+	int ret = -1;
+	uint32_t i = 0;
+	uint32_t k = 0;
+	off_t offset = 0;
+	off_t first_offset = 0;
+	hash_header_t* header = &handle->header;
+	uint32_t round_slot_cnt = header->base_slot_cnt << header->split_level;
+	uint32_t from_slot = header->split_slot;
+	uint32_t to_slot = header->slot_cnt;
+	slot_info_t* from = NULL;
+	slot_info_t* to = NULL;
+	uint32_t cnt = 0;
+	uint32_t cap = 0;
+	off_t* offsets = NULL;
+	hash_node_t* nodes = NULL;
+	hash_split_entry_t* entries = NULL;
+	hash_split_entry_t entry;
+	hash_split_entry_t* found = NULL;
+	uint32_t* keep_physic = NULL;
+	uint32_t* move_physic = NULL;
+	uint32_t* keep_logic = NULL;
+	uint32_t* move_logic = NULL;
+	uint32_t keep_physic_cnt = 0;
+	uint32_t move_physic_cnt = 0;
+	uint32_t keep_logic_cnt = 0;
+	uint32_t move_logic_cnt = 0;
+	uint32_t top = 0;
+	uint8_t* moving = NULL;
+	off_t anchor_offset = 0;
+	off_t free_offset = 0;
+	void* p = NULL;
+
+	if (header->slot_cnt >= HASH_MAX_SLOT_CNT) {
+		hash_error("too many slots (%d).", header->slot_cnt);
+		goto exit;
+	}
+
+	if (header->slot_cnt == header->slot_cap && _grow_dir(handle) < 0) {
+		goto exit;
+	}
+
+	from = &header->slots[from_slot];
+	to = &header->slots[to_slot];
+	memset(to, 0, sizeof(slot_info_t));
+
+	/* START 读入旧槽的所有节点头部 */
+	first_offset = from->first_physic_node_offset;
+	offset = first_offset;
+	do {
+		if (cnt == cap) {
+			cap = 0 == cap ? 64 : cap << 1;
+
+			if (NULL == (p = realloc(offsets, cap * sizeof(off_t)))) {
+				hash_error("realloc failed.");
+				goto exit;
+			}
+			offsets = (off_t*)p;
+
+			if (NULL == (p = realloc(nodes, cap * sizeof(hash_node_t)))) {
+				hash_error("realloc failed.");
+				goto exit;
+			}
+			nodes = (hash_node_t*)p;
+		}
+
+		nodes[cnt].data.value = NULL;
+
+		if (_read_node_header(handle, offset, &nodes[cnt]) < 0) {
+			hash_error("read node 0x%lX failed.", offset);
+			goto exit;
+		}
+
+		offsets[cnt] = offset;
+		offset = nodes[cnt].offsets.physic_next;
+		++cnt;
+	} while (offset != first_offset);
+	/* END 读入旧槽的所有节点头部 */
+
+	if (NULL == (moving = (uint8_t*)calloc(cnt, sizeof(uint8_t)))
+			|| NULL == (keep_physic = (uint32_t*)calloc(cnt, sizeof(uint32_t)))
+			|| NULL == (move_physic = (uint32_t*)calloc(cnt, sizeof(uint32_t)))
+			|| NULL == (keep_logic = (uint32_t*)calloc(cnt, sizeof(uint32_t)))
+			|| NULL == (move_logic = (uint32_t*)calloc(cnt, sizeof(uint32_t)))
+			|| NULL == (entries = (hash_split_entry_t*)calloc(cnt, sizeof(hash_split_entry_t)))) {
+		hash_error("calloc failed.");
+		goto exit;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		moving[i] = 1 == nodes[i].used && to_slot == nodes[i].data.key % (round_slot_cnt << 1);
+
+		if (moving[i]) {
+			move_physic[move_physic_cnt++] = i;
+		} else {
+			keep_physic[keep_physic_cnt++] = i;
+		}
+	}
+
+	// 没有要移走的节点，新槽只需要一个未使用的节点
+	if (0 == move_physic_cnt) {
+		if ((anchor_offset = _alloc_anchor(handle)) < 0) {
+			goto exit;
+		}
+
+		to->first_logic_node_offset = to->first_physic_node_offset = anchor_offset;
+		goto save;
+	}
+
+	/* START 按逻辑顺序分开已使用的节点 */
+	for (i = 0; i < cnt; i++) {
+		entries[i].offset = offsets[i];
+		entries[i].i = i;
+	}
+
+	qsort(entries, cnt, sizeof(hash_split_entry_t), _split_entry_cmp);
+
+	offset = from->first_logic_node_offset;
+	for (k = 0; k < from->node_cnt; k++) {
+		entry.offset = offset;
+
+		if (NULL == (found = (hash_split_entry_t*)bsearch(&entry, entries, cnt,
+						sizeof(hash_split_entry_t), _split_entry_cmp))
+				|| 1 != nodes[found->i].used) {
+			hash_error("logic node 0x%lX of slot %d is broken.", offset, from_slot);
+			goto exit;
+		}
+
+		if (moving[found->i]) {
+			move_logic[move_logic_cnt++] = found->i;
+		} else {
+			keep_logic[keep_logic_cnt++] = found->i;
+		}
+
+		offset = nodes[found->i].offsets.logic_next;
+	}
+	/* END 按逻辑顺序分开已使用的节点 */
+
+	// 新槽
+	_link_physic(nodes, offsets, move_physic, move_physic_cnt);
+	_link_logic(nodes, offsets, move_logic, move_logic_cnt);
+	to->first_physic_node_offset = offsets[move_physic[0]];
+	to->first_logic_node_offset = offsets[move_logic[0]];
+	to->node_cnt = move_logic_cnt;
+
+	// 旧槽的节点全部移走，另外分配一个留在槽里
+	if (0 == keep_physic_cnt) {
+		if ((anchor_offset = _alloc_anchor(handle)) < 0) {
+			goto exit;
+		}
+
+		from->first_logic_node_offset = from->first_physic_node_offset = anchor_offset;
+		from->free_node_offset = 0;
+		from->node_cnt = 0;
+		goto write;
+	}
+
+	_link_physic(nodes, offsets, keep_physic, keep_physic_cnt);
+	from->first_physic_node_offset = offsets[keep_physic[0]];
+	from->node_cnt = keep_logic_cnt;
+
+	if (keep_logic_cnt > 0) {
+		_link_logic(nodes, offsets, keep_logic, keep_logic_cnt);
+		from->first_logic_node_offset = offsets[keep_logic[0]];
+	}
+
+	// 未使用的节点按物理顺序重新组成空闲节点栈
+	for (k = keep_physic_cnt; k > 0; k--) {
+		i = keep_physic[k - 1];
+
+		if (1 == nodes[i].used) {
+			continue;
+		}
+
+		nodes[i].offsets.logic_prev = 0;
+		nodes[i].offsets.logic_next = free_offset;
+		free_offset = offsets[i];
+		top = i;
+	}
+
+	// 旧槽只剩未使用的节点，栈顶的那个留在槽里
+	if (0 == keep_logic_cnt) {
+		free_offset = nodes[top].offsets.logic_next;
+		nodes[top].offsets.logic_prev = nodes[top].offsets.logic_next = offsets[top];
+		from->first_logic_node_offset = offsets[top];
+	}
+
+	from->free_node_offset = free_offset;
+
+write:
+	// 两边的位置索引都按新的逻辑顺序重建，节点的 rank_leaf 随头部一起写回
+	if (_rank_enabled(handle)
+			&& (_rank_build(handle, from_slot, nodes, offsets, keep_logic, keep_logic_cnt) < 0
+				|| _rank_build(handle, to_slot, nodes, offsets, move_logic, move_logic_cnt) < 0)) {
+		goto exit;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		if (_write_node_header(handle, offsets[i], &nodes[i]) < 0) {
+			hash_error("write node 0x%lX error.", offsets[i]);
+			goto exit;
+		}
+	}
+
+save:
+	hash_debug("split slot %d -> %d, %d nodes moved.", from_slot, to_slot, move_logic_cnt);
+
+	++header->slot_cnt;
+	if (++header->split_slot == round_slot_cnt) {
+		header->split_slot = 0;
+		++header->split_level;
+	}
+
+	if (_save_slot(handle, from_slot) < 0 || _save_slot(handle, to_slot) < 0 || _save_header(handle) < 0) {
+		goto exit;
+	}
+
+	ret = 0;
+
+exit:
+	safe_free(offsets);
+	safe_free(nodes);
+	safe_free(entries);
+	safe_free(moving);
+	safe_free(keep_physic);
+	safe_free(move_physic);
+	safe_free(keep_logic);
+	safe_free(move_logic);
+	return ret;
+}
+
+// 重新读入整个目录，其他句柄改过的哈希槽信息 _load_dir 不会读，调用者独占目录
+int _reload_slots(hash_handle_t* handle) {
+	int ret = -1;
+	hash_header_t* header = &handle->header;
+
+	if (_lock_enabled(handle)
+			&& _read_at(handle, header->slots_offset, header->slots, header->slot_cnt * sizeof(slot_info_t)) < 0) {
+		hash_error("read slot_info error.");
+		goto exit;
+	}
+
+	ret = 0;
+
+exit:
+	return ret;
+}
+
+// 所有哈希槽的平均节点数是否超过阈值，调用者独占目录
+bool _overloaded(hash_handle_t* handle) {
+	uint32_t i = 0;
+	uint64_t total_cnt = 0;
+	hash_header_t* header = &handle->header;
+
+	if (0 == header->split_threshold || header->slot_cnt >= HASH_MAX_SLOT_CNT) {
+		return false;
+	}
+
+	for (i = 0; i < header->slot_cnt; i++) {
+		total_cnt += header->slots[i].node_cnt;
+	}
+
+	return total_cnt > (uint64_t)header->split_threshold * header->slot_cnt;
+}
+
+// 插入了 added 个节点之后 which_slot 的节点数跨过阈值的整数倍时才去检查要不要分裂，调用者锁住哈希槽
+bool _need_split(hash_handle_t* handle, uint32_t which_slot, uint32_t added) {
+	uint32_t threshold = handle->header.split_threshold;
+	uint32_t node_cnt = handle->header.slots[which_slot].node_cnt;
+
+	return threshold > 0 && node_cnt / threshold != (node_cnt - added) / threshold;
+}
+
+/*
+ * 依次分裂 cnt 个哈希槽，每分裂一个都重新独占一次目录，返回分裂后的哈希槽个数，出错返回-1
+ * automatic 为 true 时是插入后自动触发：目录被占用就放弃，平均节点数没有超过阈值也不分裂
+ */
+int _split_slots(hash_handle_t* handle, uint32_t cnt, bool automatic) {
+	int ret = -1;
+	int err = 0;
+	uint32_t i = 0;
+
+	for (i = 0; i < cnt; i++) {
+		if (automatic) {
+			if (0 != (err = _try_lock_dir(handle))) {
+				ret = err < 0 ? -1 : 0;
+				goto exit;
+			}
+		} else if (_lock_dir(handle, F_WRLCK) < 0) {
+			goto exit;
+		}
+
+		if (_reload_slots(handle) < 0) {
+			_unlock_dir(handle);
+			goto exit;
+		}
+
+		if (automatic && !_overloaded(handle)) {
+			ret = handle->header.slot_cnt;
+			_unlock_dir(handle);
+			goto exit;
+		}
+
+		if (_lock_header(handle, F_WRLCK) < 0) {
+			_unlock_dir(handle);
+			goto exit;
+		}
+
+		err = _split_slot(handle);
+		ret = handle->header.slot_cnt;
+
+		_unlock_header(handle);
+		_unlock_dir(handle);
+
+		if (err < 0) {
+			ret = -1;
+			goto exit;
+		}
+	}
+
+exit:
+	return ret;
+}
+
+int hash_split_slots(hash_handle_t* handle, uint32_t cnt) {
+	int ret = -1;
+
+	if (0 == (HASH_OPEN_RDWR & handle->flags)) {
+		hash_error("%s is opened read only.", handle->path);
+		goto exit;
+	}
+
+	if (0 == cnt) {
+		if (_lock_dir(handle, F_RDLCK) < 0) {
+			goto exit;
+		}
+
+		ret = handle->header.slot_cnt;
+
+		_unlock_dir(handle);
+		goto exit;
+	}
+
+	ret = _split_slots(handle, cnt, false);
+
+exit:
+	return ret;
+}
+
+/*
+ * 为 which_slot 分配一个节点，节点头部读到 node 中，物理链表已经连好，返回节点偏移量，出错返回-1
+ * 槽为空时复用槽里留下的那个节点；否则优先从空闲节点栈中弹出；都没有再在文件末尾追加并接到物理链表尾部
+ */
+off_t _alloc_node(hash_handle_t* handle, uint32_t which_slot, hash_node_t* node) {
+	off_t ret = -1;
+	off_t first_physic_node_offset = _first_physic_node_offset(handle, which_slot);
+	off_t tail_physic_node_offset = 0;
+	off_t new_physic_node_offset = 0;
+	slot_info_t* slot = &handle->header.slots[which_slot];
+	hash_node_t first_physic_node;
+	hash_node_t tail_physic_node;
+
+	memset(&first_physic_node, 0, sizeof(hash_node_t));
+	memset(&tail_physic_node, 0, sizeof(hash_node_t));
+
+	// 1. 槽为空，first_logic_node_offset 指向的节点未使用，直接用它
+	if (0 == slot->node_cnt) {
+		new_physic_node_offset = slot->first_logic_node_offset;
+	}
+
+	// 2. 空闲节点出栈
+	else if (0 != slot->free_node_offset) {
+		new_physic_node_offset = slot->free_node_offset;
+	}
+
+	if (new_physic_node_offset > 0) {
+		if (_read_node_header(handle, new_physic_node_offset, node) < 0) {
+			hash_error("read free node 0x%lX error.", new_physic_node_offset);
+			goto exit;
+		}
+
+		if (new_physic_node_offset == slot->free_node_offset) {
+			slot->free_node_offset = node->offsets.logic_next;
+		}
+
+		ret = new_physic_node_offset;
+		goto exit;
+	}
+
+	if (_read_node_header(handle, first_physic_node_offset, &first_physic_node) < 0) {
+		hash_error("read first_physic_node error.");
+		goto exit;
+	}
+
+	// 3. 在已使用区域末尾分配新节点，插到物理链表尾部
+	if ((new_physic_node_offset = _alloc_tail_locked(handle, _node_size(handle))) < 0) {
+		hash_error("prepare new node fail.");
+		goto exit;
+	}
+
+	tail_physic_node_offset = first_physic_node.offsets.physic_prev;
+
+	if (_read_node_header(handle, tail_physic_node_offset, &tail_physic_node) < 0) {
+		hash_error("read tail_physic_node error.");
+		goto exit;
+	}
+
+	tail_physic_node.offsets.physic_next = new_physic_node_offset;
+
+	if (_write_node_header(handle, tail_physic_node_offset, &tail_physic_node) < 0) {
+		hash_error("write tail_physic_node error.");
+		goto exit;
+	}
+
+	// 只有一个节点时尾节点就是头节点，需要重新读取
+	if (_read_node_header(handle, first_physic_node_offset, &first_physic_node) < 0) {
+		hash_error("read first_physic_node error.");
+		goto exit;
+	}
+
+	first_physic_node.offsets.physic_prev = new_physic_node_offset;
+
+	if (_write_node_header(handle, first_physic_node_offset, &first_physic_node) < 0) {
+		hash_error("write first_physic_node error.");
+		goto exit;
+	}
+
+	node->used = 0;
+	node->offsets.physic_prev = tail_physic_node_offset;
+	node->offsets.physic_next = first_physic_node_offset;
+
+	ret = new_physic_node_offset;
+
+exit:
+	return ret;
+}
+
+#define DEBUG_ADD_NODE 0
+int _insert_node(hash_handle_t* handle,
+		hash_node_data_t* input_prev_node_data, hash_node_data_t* input_curr_node_data,
+		bool (*cb)(hash_node_data_t*, hash_node_data_t*)) {
+	int ret = -1;
+	bool find_prev_node = false;
+	bool is_first_node = false;
+	uint32_t which_slot = 0;
+	off_t physic_offset = 0;
+	off_t first_physic_node_offset = 0;
+	off_t first_logic_node_offset = 0;
+	off_t prev_logic_node_offset = 0;
+	off_t tail_logic_node_offset = 0;
+	off_t next_logic_node_offset = 0;
+	off_t new_physic_node_offset = 0;
+	hash_header_t* header = &handle->header;
+	hash_node_t curr_physic_node;
+	hash_node_t prev_logic_node;
+	hash_node_t next_logic_node;
+	void* node_data_value = NULL;
+	uint32_t node_data_value_size = header->node_data_value_size;
+	void *addr = NULL;	// 防止在memcpy中，文件中保存的上一次指针值覆盖了当前正在运行的指针
+
+	memset(&curr_physic_node, 0, sizeof(hash_node_t));
+	memset(&prev_logic_node, 0, sizeof(hash_node_t));
+	memset(&next_logic_node, 0, sizeof(hash_node_t));
+
+	which_slot = _slot_of(handle, input_curr_node_data->key);
+	first_physic_node_offset = _first_physic_node_offset(handle, which_slot);
+	first_logic_node_offset = header->slots[which_slot].first_logic_node_offset;
+
+	if (node_data_value_size > 0
+			&& NULL == (node_data_value = (void*)calloc(1, node_data_value_size))) {
+		hash_error("calloc failed.");
+		goto exit;
+	}
+
+	curr_physic_node.data.value = node_data_value;
+
+	// 读取第一个逻辑节点
+	if (_read_node_header(handle, first_logic_node_offset, &prev_logic_node) < 0) {
+		hash_error("read first logic node failed.");
+		goto exit;
+	}
+
+	tail_logic_node_offset = prev_logic_node.offsets.logic_prev;
+
+	physic_offset = first_physic_node_offset;
+
+	// 有索引时直接定位前驱节点，不再扫描整条链
+	if (_index_enabled(handle) && 0 != input_prev_node_data->index_key) {
+		if ((prev_logic_node_offset = _find_node(handle, which_slot, input_prev_node_data, &curr_physic_node, cb)) < 0) {
+			goto exit;
+		}
+
+		if (prev_logic_node_offset > 0) {
+			find_prev_node = true;
+			prev_logic_node = curr_physic_node;
+#if DEBUG_ADD_NODE
+			hash_debug("prev node at 0x%lX (index).", prev_logic_node_offset);
+#endif
+		}
+
+		goto find_free_node;
+	}
+
+	do {
+		// 先找到上一个节点的位置
+		if (_read_node(handle, physic_offset, &curr_physic_node) < 0) {
+			hash_error("read curr_physic_node failed.");
+			goto exit;
+		}
+
+		// 未使用的节点直接跳过
+		if (0 == curr_physic_node.used) {
+			//hash_debug("continue");
+			goto next_loop;
+		}
+
+		if (true == _match_cb(cb, &(curr_physic_node.data), input_prev_node_data)) {
+			find_prev_node = true;
+			prev_logic_node = curr_physic_node;
+			prev_logic_node_offset = physic_offset;
+#if DEBUG_ADD_NODE
+			hash_debug("prev node at 0x%lX.", prev_logic_node_offset);
+#endif
+			break;
+		}
+
+next_loop:
+		physic_offset = curr_physic_node.offsets.physic_next;
+	} while (physic_offset != first_physic_node_offset);
+
+find_free_node:
+	if (false == find_prev_node) {
+		// 链表中有节点，但是没找到前驱节点，将curr插到尾部
+		if (header->slots[which_slot].node_cnt > 0) {
+			prev_logic_node_offset = tail_logic_node_offset;
+			hash_warn("didn't find prev node, node cnt is %d, add curr to tail (0x%lX).", header->slots[which_slot].node_cnt, prev_logic_node_offset);
+		}
+
+		// 链表为空，当作第一个节点插入
+		else {
+			hash_warn("didn't find prev, no node in this slot, treat curr as first node.");
+			is_first_node = true;
+		}
+	}
+
+	if ((new_physic_node_offset = _alloc_node(handle, which_slot, &curr_physic_node)) < 0) {
+		hash_error("alloc node failed.");
+		goto exit;
+	}
+
+	// 位置索引可能改写前后节点的头部，要在下面读入它们之前登记
+	curr_physic_node.rank_leaf = 0;
+
+	if (_rank_enabled(handle) && _rank_insert(handle, which_slot, is_first_node ? 0 : prev_logic_node_offset,
+				&new_physic_node_offset, 1, &curr_physic_node.rank_leaf) < 0) {
+		goto exit;
+	}
+
+	/**** 4. START 写入新节点的其他信息 ****/
+	++header->slots[which_slot].node_cnt;
+
+	curr_physic_node.used = 1;
+
+	addr = curr_physic_node.data.value;
+	memcpy(&(curr_physic_node.data), input_curr_node_data, sizeof(hash_node_data_t));
+
+	curr_physic_node.data.value = addr;
+	memcpy(curr_physic_node.data.value, input_curr_node_data->value, node_data_value_size);
+
+	/* START 调整逻辑链表。上面已完成调整物理链表 */
+	// 第一个节点。
+	if (true == is_first_node) {
+		header->slots[which_slot].first_logic_node_offset = new_physic_node_offset;
+		curr_physic_node.offsets.logic_prev = curr_physic_node.offsets.logic_next = new_physic_node_offset;
+#if DEBUG_ADD_NODE
+		hash_debug("first node offset 0x%lX.", new_physic_node_offset);
+#endif
+	} else {
+		/*
+		 * 双向链表插入，curr为待插入节点
+		 * nextNode->prev = curr;
+		 * prevNode->next = curr;
+		 * currNode->next = nextNode;
+		 * currNode->prev = prevNode;
+		 */
+
+		/* START 4.1. 读取 next prev 节点操作 */
+#if DEBUG_ADD_NODE
+		hash_debug("new node 0x%lX inset behind 0x%lX, before add 0x%lX <- 0x%lX -> 0x%lX.",
+				new_physic_node_offset, prev_logic_node_offset,
+				prev_logic_node.offsets.logic_prev, prev_logic_node_offset, prev_logic_node.offsets.logic_next);
+#endif
+
+		// prev 节点
+		if (_read_node_header(handle, prev_logic_node_offset, &prev_logic_node) < 0) {
+			hash_error("read prev_logic_node error.");
+			goto exit;
+		}
+
+		// next 节点。如果prev和next相等，说明当前只有一个节点，后面会有多个这种判断
+		if (prev_logic_node_offset != (next_logic_node_offset = prev_logic_node.offsets.logic_next)) {
+			if (_read_node_header(handle, next_logic_node_offset, &next_logic_node) < 0) {
+				hash_error("read next_logic_node error.");
+				goto exit;
+			}
+		}
+		/* END 4.1. 读取 next prev 节点操作 */
+
+		/* START 4.2. 重新建立节点链接 */
+		prev_logic_node.offsets.logic_next = new_physic_node_offset;
+
+		if (prev_logic_node_offset != next_logic_node_offset) {
+			next_logic_node.offsets.logic_prev = new_physic_node_offset;
+		} else {		// 在只有一个节点的情况下插入
+			prev_logic_node.offsets.logic_next = new_physic_node_offset;
+			prev_logic_node.offsets.logic_prev = new_physic_node_offset;
+		}
+
+		curr_physic_node.offsets.logic_next = next_logic_node_offset;
+		curr_physic_node.offsets.logic_prev = prev_logic_node_offset;
+		/* END 4.2. 重新建立节点链接 */
+
+#if DEBUG_ADD_NODE
+		hash_debug("prevNode : 0x%lX <- (0x%lX) -> 0x%lX",
+				prev_logic_node.offsets.logic_prev, prev_logic_node_offset, prev_logic_node.offsets.logic_next);
+
+		hash_debug("currNode : 0x%lX <- (0x%lX) -> 0x%lX",
+				curr_physic_node.offsets.logic_prev, new_physic_node_offset, curr_physic_node.offsets.logic_next);
+
+		// 超过一个节点的情况下插入
+		if (prev_logic_node_offset != next_logic_node_offset) {
+			hash_debug("nextNode : 0x%lX <- (0x%lX) -> 0x%lX",
+					next_logic_node.offsets.logic_prev, next_logic_node_offset, next_logic_node.offsets.logic_next);
+		}
+#endif
+		/* START 4.3. 写回到文件 */
+		if (_write_node_header(handle, prev_logic_node_offset, &prev_logic_node) < 0) {
+			hash_error("write prev_logic_node error.");
+			goto exit;
+		}
+
+		if (prev_logic_node_offset != next_logic_node_offset) {
+			if (_write_node_header(handle, next_logic_node_offset, &next_logic_node) < 0) {
+				hash_error("write next_logic_node error.");
+				goto exit;
+			}
+		}
+		/* END 4.3. 写回到文件 */
+	}
+
+	/* END 完成调整逻辑链表 */
+
+	if (_write_node(handle, new_physic_node_offset, &curr_physic_node) < 0) {
+		hash_error("write curr_physic_node error.");
+		goto exit;
+	}
+
+	if (_index_enabled(handle) && 0 != input_curr_node_data->index_key
+			&& _index_add(handle, input_curr_node_data->index_key, new_physic_node_offset) < 0) {
+		goto exit;
+	}
+	/**** 4. END 写入新节点的其他信息 ****/
+
+	/* START 保存哈希槽信息 */
+	if (_save_slot(handle, which_slot) < 0) {
+		goto exit;
+	}
+	/* END 保存哈希槽信息 */
+
+	ret = 0;
+
+exit:
+	safe_free(node_data_value);
+	return ret;
+}
+#undef DEBUG_ADD_NODE
+
+int hash_insert_node(hash_handle_t* handle,
+		hash_node_data_t* input_prev_node_data, hash_node_data_t* input_curr_node_data,
+		bool (*cb)(hash_node_data_t*, hash_node_data_t*)) {
+	int ret = -1;
+	uint64_t start_ns = hash_stat_now();
+	uint32_t which_slot = 0;
+	bool need_split = false;
+
+	_fill_key(handle, input_prev_node_data);
+	_fill_key(handle, input_curr_node_data);
+
+	if (_lock_dir(handle, F_RDLCK) < 0) {
+		goto exit;
+	}
+
+	which_slot = _slot_of(handle, input_curr_node_data->key);
+
+	if (_lock_slot(handle, which_slot, F_WRLCK) < 0) {
+		goto unlock_dir;
+	}
+
+	if (0 == (ret = _insert_node(handle, input_prev_node_data, input_curr_node_data, cb))) {
+		need_split = _need_split(handle, which_slot, 1);
+	}
+
+	_unlock_slot(handle, which_slot);
+
+unlock_dir:
+	_unlock_dir(handle);
+
+	// 分裂要独占目录，先把目录解锁
+	if (need_split) {
+		_split_slots(handle, 1, true);
+	}
+
+exit:
+	hash_stat_api(HASH_API_INSERT_NODE, start_ns);
+	return ret;
+}
+
+/*
+ * 批量插入：input_node_datas 中的 cnt 个节点按数组顺序依次接在前驱节点之后，所有节点必须在同一个哈希槽
+ * 新节点在文件末尾连续分配、一次写入，哈希槽信息只在最后保存一次
+ * output_offsets 不为NULL时输出各个新节点的位置，至少能放下 cnt 个
+ */
+#define DEBUG_ADD_NODES 0
+int _insert_nodes(hash_handle_t* handle, hash_node_data_t* input_prev_node_data,
+		hash_node_data_t* input_node_datas, uint32_t cnt,
+		bool (*cb)(hash_node_data_t*, hash_node_data_t*), off_t* output_offsets) {
+	int ret = -1;
+	uint32_t i = 0;
+	uint32_t which_slot = 0;
+	uint32_t fresh_cnt = 0;
+	off_t block_offset = 0;
+	off_t anchor_offset = 0;
+	off_t first_physic_node_offset = 0;
+	off_t tail_physic_node_offset = 0;
+	off_t prev_logic_node_offset = 0;
+	off_t next_logic_node_offset = 0;
+	off_t* offsets = NULL;
+	off_t* leaves = NULL;
+	hash_header_t* header = &handle->header;
+	slot_info_t* slot = NULL;
+	hash_node_t prev_logic_node;
+	hash_node_t next_logic_node;
+	hash_node_t physic_node;
+	hash_node_t* node = NULL;
+	char* buf = NULL;
+	char* node_buf = NULL;
+	void* node_data_value = NULL;
+	size_t node_size = _node_size(handle);
+	size_t blob_size = 0;
+	uint32_t node_data_value_size = header->node_data_value_size;
+	hash_blob_t blob;
+
+	memset(&prev_logic_node, 0, sizeof(hash_node_t));
+	memset(&next_logic_node, 0, sizeof(hash_node_t));
+	memset(&physic_node, 0, sizeof(hash_node_t));
+
+	if (0 == cnt) {
+		ret = 0;
+		goto exit;
+	}
+
+	which_slot = _slot_of(handle, input_node_datas[0].key);
+	slot = &header->slots[which_slot];
+	first_physic_node_offset = _first_physic_node_offset(handle, which_slot);
+
+	for (i = 1; i < cnt; i++) {
+		if (which_slot != _slot_of(handle, input_node_datas[i].key)) {
+			hash_error("node %d is not in slot %d.", i, which_slot);
+			goto exit;
+		}
+	}
+
+	if (NULL == (offsets = (off_t*)calloc(cnt, sizeof(off_t)))
+			|| NULL == (leaves = (off_t*)calloc(cnt, sizeof(off_t)))
+			|| (node_data_value_size > 0 && NULL == (node_data_value = (void*)calloc(1, node_data_value_size)))) {
+		hash_error("calloc failed.");
+		goto exit;
+	}
+
+	/* START 1. 确定插入位置，新节点放在 prev 和 next 之间 */
+	prev_logic_node.data.value = node_data_value;
+
+	if (slot->node_cnt > 0) {
+		if ((prev_logic_node_offset = _find_node(handle, which_slot, input_prev_node_data, &prev_logic_node, cb)) < 0) {
+			goto exit;
+		}
+
+		// 没找到前驱节点，插到尾部
+		if (0 == prev_logic_node_offset) {
+			if (_read_node_header(handle, slot->first_logic_node_offset, &prev_logic_node) < 0) {
+				hash_error("read first logic node failed.");
+				goto exit;
+			}
+
+			prev_logic_node_offset = prev_logic_node.offsets.logic_prev;
+			hash_warn("didn't find prev node, node cnt is %d, add %d nodes to tail (0x%lX).", slot->node_cnt, cnt, prev_logic_node_offset);
+		}
+	} else {
+		// 槽为空，留下的节点给第一个新节点用
+		anchor_offset = slot->first_logic_node_offset;
+	}
+	/* END 1. 确定插入位置 */
+
+	/* START 2. 在末尾连续分配新节点，并接到物理链表尾部 */
+	fresh_cnt = anchor_offset > 0 ? cnt - 1 : cnt;
+
+	if (anchor_offset > 0) {
+		offsets[0] = anchor_offset;
+	}
+
+	if (fresh_cnt > 0) {
+		// 变长存储时新节点的数据块紧跟在新节点后面，和节点一起分配、一起写入
+		if (header->varlen_value) {
+			for (i = cnt - fresh_cnt; i < cnt; i++) {
+				blob_size += _blob_cap(_value_len(handle, input_node_datas[i].value));
+			}
+		}
+
+		if (NULL == (buf = (char*)calloc(1, fresh_cnt * node_size + blob_size))) {
+			hash_error("calloc failed.");
+			goto exit;
+		}
+
+		if ((block_offset = _alloc_tail_locked(handle, fresh_cnt * node_size + blob_size)) < 0) {
+			hash_error("prepare %d new nodes fail.", fresh_cnt);
+			goto exit;
+		}
+
+		for (i = 0; i < fresh_cnt; i++) {
+			offsets[cnt - fresh_cnt + i] = block_offset + i * node_size;
+		}
+
+		if (_read_node_header(handle, first_physic_node_offset, &physic_node) < 0) {
+			hash_error("read first_physic_node error.");
+			goto exit;
+		}
+
+		tail_physic_node_offset = physic_node.offsets.physic_prev;
+
+		if (_read_node_header(handle, tail_physic_node_offset, &physic_node) < 0) {
+			hash_error("read tail_physic_node error.");
+			goto exit;
+		}
+
+		physic_node.offsets.physic_next = block_offset;
+
+		if (_write_node_header(handle, tail_physic_node_offset, &physic_node) < 0) {
+			hash_error("write tail_physic_node error.");
+			goto exit;
+		}
+
+		// 只有一个节点时尾节点就是头节点，需要重新读取
+		if (_read_node_header(handle, first_physic_node_offset, &physic_node) < 0) {
+			hash_error("read first_physic_node error.");
+			goto exit;
+		}
+
+		physic_node.offsets.physic_prev = offsets[cnt - 1];
+
+		if (_write_node_header(handle, first_physic_node_offset, &physic_node) < 0) {
+			hash_error("write first_physic_node error.");
+			goto exit;
+		}
+	}
+	/* END 2. 分配新节点 */
+
+	// 位置索引可能改写前后节点的头部，要在下面读入它们之前登记
+	if (_rank_enabled(handle) && _rank_insert(handle, which_slot, prev_logic_node_offset, offsets, cnt, leaves) < 0) {
+		goto exit;
+	}
+
+	/* START 3. 调整前后节点的逻辑链表 */
+	if (0 == anchor_offset) {
+		if (_read_node_header(handle, prev_logic_node_offset, &prev_logic_node) < 0) {
+			hash_error("read prev_logic_node error.");
+			goto exit;
+		}
+
+		next_logic_node_offset = prev_logic_node.offsets.logic_next;
+		prev_logic_node.offsets.logic_next = offsets[0];
+
+		// 只有一个节点时 prev 和 next 是同一个节点
+		if (prev_logic_node_offset == next_logic_node_offset) {
+			prev_logic_node.offsets.logic_prev = offsets[cnt - 1];
+		} else {
+			if (_read_node_header(handle, next_logic_node_offset, &next_logic_node) < 0) {
+				hash_error("read next_logic_node error.");
+				goto exit;
+			}
+
+			next_logic_node.offsets.logic_prev = offsets[cnt - 1];
+
+			if (_write_node_header(handle, next_logic_node_offset, &next_logic_node) < 0) {
+				hash_error("write next_logic_node error.");
+				goto exit;
+			}
+		}
+
+		if (_write_node_header(handle, prev_logic_node_offset, &prev_logic_node) < 0) {
+			hash_error("write prev_logic_node error.");
+			goto exit;
+		}
+	} else {
+		// 新节点首尾相接
+		prev_logic_node_offset = offsets[cnt - 1];
+		next_logic_node_offset = offsets[0];
+		slot->first_logic_node_offset = offsets[0];
+	}
+	/* END 3. 调整前后节点的逻辑链表 */
+
+	/* START 4. 写入新节点 */
+	blob.offset = block_offset + fresh_cnt * node_size;
+	blob.cap = 0;
+
+	for (i = 0; i < cnt; i++) {
+		node = &physic_node;
+		memset(node, 0, sizeof(hash_node_t));
+
+		if (0 == i && anchor_offset > 0) {
+			if (_read_node_header(handle, anchor_offset, node) < 0) {
+				hash_error("read anchor node error.");
+				goto exit;
+			}
+		} else {
+			node->offsets.physic_prev = (offsets[i] == block_offset) ? tail_physic_node_offset : offsets[i] - node_size;
+			node->offsets.physic_next = (i == cnt - 1) ? first_physic_node_offset : offsets[i] + node_size;
+		}
+
+		node->used = 1;
+		node->rank_leaf = leaves[i];
+		node->offsets.logic_prev = (0 == i) ? prev_logic_node_offset : offsets[i - 1];
+		node->offsets.logic_next = (i == cnt - 1) ? next_logic_node_offset : offsets[i + 1];
+		memcpy(&(node->data), &input_node_datas[i], sizeof(hash_node_data_t));
+
+		if (0 == i && anchor_offset > 0) {
+			node->data.value = input_node_datas[i].value;
+
+			if (_write_node(handle, anchor_offset, node) < 0) {
+				hash_error("write anchor node error.");
+				goto exit;
+			}
+		} else {
+			// buf 中的节点不一定对齐，先在栈上填好再拷过去
+			node_buf = buf + (offsets[i] - block_offset);
+			memcpy(node_buf, node, sizeof(hash_node_t));
+
+			if (header->varlen_value) {
+				blob.offset += blob.cap;
+				blob.cap = _blob_cap(_value_len(handle, input_node_datas[i].value));
+				memcpy(node_buf + sizeof(hash_node_t), &blob, sizeof(hash_blob_t));
+				memcpy(buf + (blob.offset - block_offset), input_node_datas[i].value, _value_len(handle, input_node_datas[i].value));
+			} else if (node_data_value_size > 0) {
+				memcpy(node_buf + sizeof(hash_node_t), input_node_datas[i].value, node_data_value_size);
+			}
+		}
+
+#if DEBUG_ADD_NODES
+		hash_debug("<0x%lX> (0x%lX : %d) <0x%lX>", node->offsets.logic_prev, offsets[i], node->data.key, node->offsets.logic_next);
+#endif
+	}
+
+	if (fresh_cnt > 0 && _write_at(handle, block_offset, buf, fresh_cnt * node_size + blob_size) < 0) {
+		hash_error("write %d new nodes error.", fresh_cnt);
+		goto exit;
+	}
+	/* END 4. 写入新节点 */
+
+	slot->node_cnt += cnt;
+
+	for (i = 0; i < cnt; i++) {
+		if (_index_enabled(handle) && 0 != input_node_datas[i].index_key
+				&& _index_add(handle, input_node_datas[i].index_key, offsets[i]) < 0) {
+			goto exit;
+		}
+	}
+
+	/* START 保存哈希槽信息 */
+	if (_save_slot(handle, which_slot) < 0) {
+		goto exit;
+	}
+	/* END 保存哈希槽信息 */
+
+	if (NULL != output_offsets) {
+		memcpy(output_offsets, offsets, cnt * sizeof(off_t));
+	}
+
+	ret = 0;
+
+exit:
+	safe_free(offsets);
+	safe_free(leaves);
+	safe_free(buf);
+	safe_free(node_data_value);
+	return ret;
+}
+#undef DEBUG_ADD_NODES
+
+int hash_insert_nodes(hash_handle_t* handle, hash_node_data_t* input_prev_node_data,
+		hash_node_data_t* input_node_datas, uint32_t cnt,
+		bool (*cb)(hash_node_data_t*, hash_node_data_t*)) {
+	int ret = -1;
+	uint64_t start_ns = hash_stat_now();
+	uint32_t i = 0;
+	uint32_t which_slot = 0;
+	bool need_split = false;
+
+	if (0 == cnt) {
+		ret = 0;
+		goto exit;
+	}
+
+	// 按内容分槽时各个节点不在同一个哈希槽，逐个插入
+	if (HASH_KEY_FIELD_SLOT & handle->header.key_field_flags) {
+		for (i = 0; i < cnt; i++) {
+			if (0 != (ret = hash_insert_node(handle, 0 == i ? input_prev_node_data : &input_node_datas[i - 1],
+							&input_node_datas[i], cb))) {
+				goto exit;
+			}
+		}
+
+		goto exit;
+	}
+
+	_fill_key(handle, input_prev_node_data);
+
+	for (i = 0; i < cnt; i++) {
+		_fill_key(handle, &input_node_datas[i]);
+	}
+
+	if (_lock_dir(handle, F_RDLCK) < 0) {
+		goto exit;
+	}
+
+	which_slot = _slot_of(handle, input_node_datas[0].key);
+
+	if (_lock_slot(handle, which_slot, F_WRLCK) < 0) {
+		goto unlock_dir;
+	}
+
+	if (0 == (ret = _insert_nodes(handle, input_prev_node_data, input_node_datas, cnt, cb, NULL))) {
+		need_split = _need_split(handle, which_slot, cnt);
+	}
+
+	_unlock_slot(handle, which_slot);
+
+unlock_dir:
+	_unlock_dir(handle);
+
+	if (need_split) {
+		_split_slots(handle, 1, true);
+	}
+
+exit:
+	hash_stat_api(HASH_API_INSERT_NODES, start_ns);
+	return ret;
+}
+
+#define DEBUG_DEL_NODE 0
+int _del_node_hepler(hash_handle_t* handle, off_t curr_node_offset, uint32_t which_slot, hash_node_t *node) {
+	int ret = -1;
+	hash_header_t* header = &handle->header;
+	uint32_t node_data_value_size = 0;
+	hash_node_t prev_logic_node;
+	hash_node_t next_logic_node;
+	off_t first_logic_node_offset = 0;
+	off_t prev_logic_node_offset = 0;
+	off_t next_logic_node_offset = 0;
+	void *addr = NULL;	// 防止在memcpy中，文件中保存的上一次指针值覆盖了当前正在运行的指针
+
+	memset(&prev_logic_node, 0, sizeof(hash_node_t));
+	memset(&next_logic_node, 0, sizeof(hash_node_t));
+
+	node_data_value_size = header->node_data_value_size;
+	first_logic_node_offset = header->slots[which_slot].first_logic_node_offset;
+
+	node->used = 0;
+	--header->slots[which_slot].node_cnt;
+
+	// 合并叶子可能改写前后节点的头部，要在下面读入它们之前去掉
+	if (_rank_enabled(handle) && _rank_remove(handle, which_slot, &curr_node_offset, &node->rank_leaf, 1, true) < 0) {
+		goto exit;
+	}
+
+	node->rank_leaf = 0;
+
+	/*
+	 * 双向链表删除，curr为待插入节点
+	 * nextNode->prev = prevNode;
+	 * prevNode->next = nextNode;
+	 */
+	/* START 调整逻辑链表 */
+	/* START 1. 读取 prev next 节点信息*/
+	// prev 节点
+	prev_logic_node_offset = node->offsets.logic_prev;
+	if (_read_node_header(handle, prev_logic_node_offset, &prev_logic_node) < 0) {
+		hash_error("read prev_logic_node error.");
+		goto exit;
+	}
+
+	// next 节点。如果prev和next相等，说明当前只有一个节点，后面会有多个这种判断
+	next_logic_node_offset = node->offsets.logic_next;
+	if (_read_node_header(handle, next_logic_node_offset, &next_logic_node) < 0) {
+		hash_error("read next_logic_node error.");
+		goto exit;
+	}
+	/* END 1. 读取 prev next 节点信息*/
+	/* START 2. 修改节点链式关系 */
+
+	// 仅剩 一个 节点
+	if (curr_node_offset == prev_logic_node_offset && curr_node_offset == next_logic_node_offset) {
+#if DEBUG_DEL_NODE
+		hash_debug("only 1 node 0x%lX left.", curr_node_offset);
+#endif
+		header->slots[which_slot].first_logic_node_offset = node->offsets.logic_next;
+		goto clear_node;
+	} else {
+		if (curr_node_offset == first_logic_node_offset) {	// 删除逻辑第一个节点
+#if DEBUG_DEL_NODE
+			hash_debug("delete first logic node 0x%lX, update first logic node to 0x%lX.",
+					curr_node_offset, node->offsets.logic_next);
+#endif
+			header->slots[which_slot].first_logic_node_offset = node->offsets.logic_next;
+		} else {
+#if DEBUG_DEL_NODE
+			hash_debug("delete normal node 0x%lX.", curr_node_offset);
+#endif
+		}
+
+		// 剩两个节点
+		if (prev_logic_node_offset == next_logic_node_offset) {
+#if DEBUG_DEL_NODE
+			hash_debug("2 nodes left.");
+#endif
+			prev_logic_node.offsets.logic_prev = prev_logic_node_offset;
+			prev_logic_node.offsets.logic_next = prev_logic_node_offset;
+		}
+		
+		// 更多节点
+		else {
+			next_logic_node.offsets.logic_prev = prev_logic_node_offset;
+			prev_logic_node.offsets.logic_next = next_logic_node_offset;
+		}
+	}
+
+	/* END 2. 修改节点链式关系 */
+#if DEBUG_DEL_NODE
+	// 节点等于2时，只需看prev即可
+	hash_info("after del 0x%lX, prev = ( 0x%lX <- 0x%lX -> 0x%lX ), next = ( 0x%lX <- 0x%lX -> 0x%lX ).", curr_node_offset,
+			prev_logic_node.offsets.logic_prev, prev_logic_node_offset, prev_logic_node.offsets.logic_next,
+			next_logic_node.offsets.logic_prev, next_logic_node_offset, next_logic_node.offsets.logic_next);
+#endif
+	/* START 3. 写回到文件 */
+	if (_write_node_header(handle, prev_logic_node_offset, &prev_logic_node) < 0) {
+		hash_error("write prev_logic_node error.");
+		goto exit;
+	}
+
+	// 剩余节点大于 2 时
+	if (prev_logic_node_offset != next_logic_node_offset) {
+		if (_write_node_header(handle, next_logic_node_offset, &next_logic_node) < 0) {
+			hash_error("write next_logic_node error.");
+			goto exit;
+		}
+	}
+	/* END 3. 写回到文件 */
+	/* END 完成调整逻辑链表 */
+
+clear_node:
+	if (_index_enabled(handle) && 0 != node->data.index_key
+			&& _index_remove(handle, node->data.index_key, curr_node_offset) < 0) {
+		goto exit;
+	}
+
+	/* START 清空当前节点 */
+	addr = node->data.value;
+	node->used = 0;
+
+	// 槽里的最后一个节点保持自环，留给下次插入使用；其他节点压入空闲节点栈
+	if (header->slots[which_slot].node_cnt > 0) {
+		node->offsets.logic_prev = 0;
+		node->offsets.logic_next = header->slots[which_slot].free_node_offset;
+		header->slots[which_slot].free_node_offset = curr_node_offset;
+	}
+
+	memset(&(node->data), 0, sizeof(hash_node_data_t));
+	node->data.value = addr;
+	memset(node->data.value, 0, node_data_value_size);
+
+	if (_write_node(handle, curr_node_offset, node) < 0) {
+		hash_error("del node error.");
+		goto exit;
+	}
+	/* END 清空当前节点 */
+
+	/* START 保存哈希槽信息 */
+	if (_save_slot(handle, which_slot) < 0) {
+		goto exit;
+	}
+	/* END 保存哈希槽信息 */
+
+	ret = 0;
+
+exit:
+	return ret;
+}
+#undef DEBUG_DEL_NODE
+
+int _del_node(hash_handle_t* handle, hash_node_data_t* input_node_data,
+		bool (*cb)(hash_node_data_t*, hash_node_data_t*)) {
+	int ret = -1;
+	uint32_t which_slot = 0;
+	off_t offset = 0;
+	off_t first_logic_node_offset = 0;
+	hash_header_t* header = &handle->header;
+	hash_node_t node;
+	void* node_data_value = NULL;
+	uint32_t node_data_value_size = header->node_data_value_size;
+
+	memset(&node, 0, sizeof(hash_node_t));
+
+	which_slot = _slot_of(handle, input_node_data->key);
+	first_logic_node_offset = header->slots[which_slot].first_logic_node_offset;
+
+	if (node_data_value_size > 0
+			&& NULL == (node_data_value = (void*)calloc(1, node_data_value_size))) {
+		hash_error("calloc failed.");
+		goto exit;
+	}
+
+	// 建立关联，方便后面使用
+	node.data.value = node_data_value;
+
+	// 有索引时直接定位待删除节点
+	if (_index_enabled(handle) && 0 != input_node_data->index_key) {
+		if ((offset = _find_node(handle, which_slot, input_node_data, &node, cb)) > 0) {
+			ret = _del_node_hepler(handle, offset, which_slot, &node);
+		}
+		goto exit;
+	}
+
+	offset = first_logic_node_offset;
+	do {
+		if (_read_node(handle, offset, &node) < 0) {
+			hash_error("read node failed.");
+			goto exit;
+		}
+
+		// 找到了节点
+		if (true == _match_cb(cb, &(node.data), input_node_data)) {
+			if ((ret = _del_node_hepler(handle, offset, which_slot, &node)) < 0) {
+				goto exit;
+			}
+			break;
+		}
+
+		offset = node.offsets.logic_next;
+	} while (offset != first_logic_node_offset);
+
+exit:
+	safe_free(node_data_value);
+	return ret;
+}
+
+int hash_del_node(hash_handle_t* handle, hash_node_data_t* input_node_data,
+		bool (*cb)(hash_node_data_t*, hash_node_data_t*)) {
+	int ret = -1;
+	uint64_t start_ns = hash_stat_now();
+	uint32_t which_slot = 0;
+
+	_fill_key(handle, input_node_data);
+
+	if (_lock_dir(handle, F_RDLCK) < 0) {
+		goto exit;
+	}
+
+	which_slot = _slot_of(handle, input_node_data->key);
+
+	if (_lock_slot(handle, which_slot, F_WRLCK) < 0) {
+		goto unlock_dir;
+	}
+
+	ret = _del_node(handle, input_node_data, cb);
+
+	_unlock_slot(handle, which_slot);
+
+unlock_dir:
+	_unlock_dir(handle);
+
+exit:
+	hash_stat_api(HASH_API_DEL_NODE, start_ns);
+	return ret;
+}
+
+/*
+ * 沿逻辑链表走一遍 which_slot，删除所有 cb 返回true的节点，返回删除的个数，出错返回-1
+ * 连续被删除的一段节点只在两端的保留节点上重新链接一次
+ */
+int _del_nodes_in_slot(hash_handle_t* handle, uint32_t which_slot,
+		bool (*cb)(hash_node_data_t* file_node_data, void* input_arg), void* input_arg) {
+	int ret = -1;
+	int del_cnt = 0;
+	uint32_t i = 0;
+	uint32_t node_cnt = 0;
+	bool last_kept_dirty = false;
+	off_t offset = 0;
+	off_t next_offset = 0;
+	off_t first_kept_offset = 0;
+	off_t last_kept_offset = 0;
+	off_t anchor_offset = 0;
+	hash_header_t* header = &handle->header;
+	slot_info_t* slot = &header->slots[which_slot];
+	hash_node_t node;
+	hash_node_t last_kept_node;
+	void* node_data_value = NULL;
+	void* addr = NULL;
+	off_t* del_offsets = NULL;
+	off_t* del_leaves = NULL;
+	uint32_t node_data_value_size = header->node_data_value_size;
+
+	memset(&node, 0, sizeof(hash_node_t));
+	memset(&last_kept_node, 0, sizeof(hash_node_t));
+
+	if (0 == (node_cnt = slot->node_cnt)) {
+		ret = 0;
+		goto exit;
+	}
+
+	if (node_data_value_size > 0
+			&& NULL == (node_data_value = (void*)calloc(1, node_data_value_size))) {
+		hash_error("calloc failed.");
+		goto exit;
+	}
+
+	// 被删除的节点记下来，走完之后一次性从位置索引中去掉
+	if (_rank_enabled(handle)
+			&& (NULL == (del_offsets = (off_t*)calloc(node_cnt, sizeof(off_t)))
+				|| NULL == (del_leaves = (off_t*)calloc(node_cnt, sizeof(off_t))))) {
+		hash_error("calloc failed.");
+		goto exit;
+	}
+
+	node.data.value = node_data_value;
+
+	offset = slot->first_logic_node_offset;
+	for (i = 0; i < node_cnt; i++, offset = next_offset) {
+		if (_read_node(handle, offset, &node) < 0) {
+			hash_error("read node 0x%lX failed.", offset);
+			goto exit;
+		}
+
+		next_offset = node.offsets.logic_next;
+
+		// 保留的节点：只有前面删掉过节点时才需要和上一个保留节点重新链接
+		hash_stat_add(callbacks, 1);
+
+		if (false == cb(&(node.data), input_arg)) {
+			if (0 == first_kept_offset) {
+				first_kept_offset = offset;
+			} else if (last_kept_node.offsets.logic_next != offset) {
+				last_kept_node.offsets.logic_next = offset;
+				last_kept_dirty = true;
+
+				node.offsets.logic_prev = last_kept_offset;
+
+				if (_write_node_header(handle, offset, &node) < 0) {
+					hash_error("write node 0x%lX error.", offset);
+					goto exit;
+				}
+			}
+
+			if (last_kept_dirty && _write_node_header(handle, last_kept_offset, &last_kept_node) < 0) {
+				hash_error("write node 0x%lX error.", last_kept_offset);
+				goto exit;
+			}
+
+			last_kept_node = node;
+			last_kept_offset = offset;
+			last_kept_dirty = false;
+			continue;
+		}
+
+		/* START 删除节点，第一个被删的节点先留着，槽被删空时用作槽里剩下的那个节点 */
+		if (_index_enabled(handle) && 0 != node.data.index_key
+				&& _index_remove(handle, node.data.index_key, offset) < 0) {
+			goto exit;
+		}
+
+		if (_rank_enabled(handle)) {
+			del_offsets[del_cnt] = offset;
+			del_leaves[del_cnt] = node.rank_leaf;
+		}
+
+		addr = node.data.value;
+		node.used = 0;
+		node.rank_leaf = 0;
+		memset(&(node.data), 0, sizeof(hash_node_data_t));
+		node.data.value = addr;
+		memset(node.data.value, 0, node_data_value_size);
+
+		if (0 == anchor_offset) {
+			anchor_offset = offset;
+			node.offsets.logic_prev = node.offsets.logic_next = offset;
+		} else {
+			node.offsets.logic_prev = 0;
+			node.offsets.logic_next = slot->free_node_offset;
+			slot->free_node_offset = offset;
+		}
+
+		if (_write_node(handle, offset, &node) < 0) {
+			hash_error("del node 0x%lX error.", offset);
+			goto exit;
+		}
+
+		++del_cnt;
+		/* END 删除节点 */
+	}
+
+	slot->node_cnt -= del_cnt;
+
+	if (0 == del_cnt) {
+		ret = 0;
+		goto exit;
+	}
+
+	// 保留的节点还在手里，不能合并叶子
+	if (_rank_enabled(handle) && _rank_remove(handle, which_slot, del_offsets, del_leaves, del_cnt, false) < 0) {
+		goto exit;
+	}
+
+	// 全部删除，留下第一个被删除的节点
+	if (0 == first_kept_offset) {
+		slot->first_logic_node_offset = anchor_offset;
+		ret = del_cnt;
+		goto exit;
+	}
+
+	// 还有保留节点，第一个被删除的节点也压入空闲节点栈
+	if (_read_node_header(handle, anchor_offset, &node) < 0) {
+		hash_error("read node 0x%lX failed.", anchor_offset);
+		goto exit;
+	}
+
+	node.offsets.logic_prev = 0;
+	node.offsets.logic_next = slot->free_node_offset;
+	slot->free_node_offset = anchor_offset;
+
+	if (_write_node_header(handle, anchor_offset, &node) < 0) {
+		hash_error("write node 0x%lX error.", anchor_offset);
+		goto exit;
+	}
+
+	/* START 首尾相接 */
+	slot->first_logic_node_offset = first_kept_offset;
+
+	if (first_kept_offset == last_kept_offset) {
+		last_kept_node.offsets.logic_prev = last_kept_node.offsets.logic_next = first_kept_offset;
+	} else {
+		last_kept_node.offsets.logic_next = first_kept_offset;
+
+		if (_read_node_header(handle, first_kept_offset, &node) < 0) {
+			hash_error("read node 0x%lX failed.", first_kept_offset);
+			goto exit;
+		}
+
+		node.offsets.logic_prev = last_kept_offset;
+
+		if (_write_node_header(handle, first_kept_offset, &node) < 0) {
+			hash_error("write node 0x%lX error.", first_kept_offset);
+			goto exit;
+		}
+	}
+
+	if (_write_node_header(handle, last_kept_offset, &last_kept_node) < 0) {
+		hash_error("write node 0x%lX error.", last_kept_offset);
+		goto exit;
+	}
+	/* END 首尾相接 */
+
+	ret = del_cnt;
+
+exit:
+	safe_free(del_offsets);
+	safe_free(del_leaves);
+	safe_free(node_data_value);
+	return ret;
+}
+
+int hash_del_nodes(hash_handle_t* handle, uint32_t which_slot,
+		bool (*cb)(hash_node_data_t* file_node_data, void* input_arg), void* input_arg) {
+	int ret = -1;
+	uint64_t start_ns = hash_stat_now();
+	int del_cnt = 0;
+	int total_cnt = 0;
+	uint32_t i = 0;
+	uint32_t slot_cnt = 0;
+
+	if (_lock_dir(handle, F_RDLCK) < 0) {
+		goto exit;
+	}
+
+	slot_cnt = handle->header.slot_cnt;
+
+	for (i = 0; i < slot_cnt; i++) {
+		if (which_slot < slot_cnt && i != which_slot) {
+			continue;
+		}
+
+		if (_lock_slot(handle, i, F_WRLCK) < 0) {
+			goto unlock_dir;
+		}
+
+		// 每个哈希槽删完就保存，不用等其他哈希槽
+		if ((del_cnt = _del_nodes_in_slot(handle, i, cb, input_arg)) > 0 && _save_slot(handle, i) < 0) {
+			del_cnt = -1;
+		}
+
+		_unlock_slot(handle, i);
+
+		if (del_cnt < 0) {
+			goto unlock_dir;
+		}
+
+		total_cnt += del_cnt;
+	}
+
+	ret = total_cnt;
+
+unlock_dir:
+	_unlock_dir(handle);
+
+exit:
+	hash_stat_api(HASH_API_DEL_NODES, start_ns);
+	return ret;
+}
+
+// which_slot小于slot_cnt则遍历指定哈希槽，如果大于slot_cnt则遍历所有哈希槽
+/************************************************
+ * 预读：遍历时按块读入文件，顺序访问的节点直接从缓冲区取
+ * mmap模式下不需要，直接访问映射区
+ ***********************************************/
+
+typedef struct {
+	char* buf;		// NULL 表示不预读
+	off_t start;	// 缓冲区对应的文件偏移量
+	size_t len;		// 缓冲区中有效数据的长度，0表示没有数据
+	uint64_t write_seq;	// 读入时句柄的 write_seq，不一致说明文件被改过
+} hash_readahead_t;
+
+void _ra_init(hash_handle_t* handle, hash_readahead_t* ra) {
+	memset(ra, 0, sizeof(hash_readahead_t));
+
+	// 节点太大时预读没有意义
+	if (!_is_mapped(handle) && _node_size(handle) <= HASH_READAHEAD_SIZE / 2) {
+		ra->buf = (char*)malloc(HASH_READAHEAD_SIZE);
+	}
+}
+
+void _ra_free(hash_readahead_t* ra) {
+	safe_free(ra->buf);
+	ra->len = 0;
+}
+
+// 在 offset 所在的对齐位置重新读入一块，文件末尾可能读不满
+int _ra_fill(hash_handle_t* handle, hash_readahead_t* ra, off_t offset) {
+	ssize_t n_r = 0;
+
+	ra->start = offset & ~((off_t)HASH_READAHEAD_ALIGN - 1);
+	ra->len = 0;
+	ra->write_seq = __atomic_load_n(&handle->write_seq, __ATOMIC_RELAXED);
+
+	// 允许读不满，不能用 happy_pread
+	hash_stat_add(read_calls, 1);
+
+	if ((n_r = (pread)(handle->fd, ra->buf, HASH_READAHEAD_SIZE, ra->start)) < 0) {
+		hash_error("readahead 0x%lX error : %s.", ra->start, strerror(errno));
+		return -1;
+	}
+
+	hash_stat_add(bytes_read, n_r);
+
+	ra->len = n_r;
+	return 0;
+}
+
+// 读取整个节点，缓冲区中没有时：离缓冲区不远就预读下一块，否则直接读
+int _ra_read_node(hash_handle_t* handle, hash_readahead_t* ra, off_t offset, hash_node_t* node) {
+	void *addr = node->data.value;
+	size_t node_size = _node_size(handle);
+	off_t end = ra->start + ra->len;
+	uint32_t len = 0;
+	hash_blob_t blob;
+
+	if (NULL == ra->buf) {
+		return _read_node(handle, offset, node);
+	}
+
+	// 预读之后文件被改过，缓冲区作废
+	if (ra->write_seq != __atomic_load_n(&handle->write_seq, __ATOMIC_RELAXED)) {
+		ra->len = 0;
+		end = ra->start;
+	}
+
+	if (offset < ra->start || offset + node_size > end) {
+		// 向后跳得太远或者往回跳，说明不是顺序访问
+		if (ra->len > 0 && (offset < ra->start || offset >= end + HASH_READAHEAD_SIZE)) {
+			return _read_node(handle, offset, node);
+		}
+
+		if (_ra_fill(handle, ra, offset) < 0 || offset + node_size > ra->start + ra->len) {
+			return _read_node(handle, offset, node);
+		}
+	}
+
+	memcpy(node, ra->buf + (offset - ra->start), sizeof(hash_node_t));
+	node->data.value = addr;
+	hash_stat_add(nodes_visited, 1);
+
+	if (!handle->header.varlen_value) {
+		memcpy(addr, ra->buf + (offset - ra->start) + sizeof(hash_node_t), handle->header.node_data_value_size);
+		return 0;
+	}
+
+	// 批量插入的节点后面紧跟着它们的数据块，多数情况下也在缓冲区里
+	memcpy(&blob, ra->buf + (offset - ra->start) + sizeof(hash_node_t), sizeof(hash_blob_t));
+	len = blob.cap < handle->header.node_data_value_size ? blob.cap : handle->header.node_data_value_size;
+
+	if (len > 0 && (blob.offset < ra->start || blob.offset + len > ra->start + ra->len)) {
+		return _read_blob(handle, &blob, addr);
+	}
+
+	memcpy(addr, ra->buf + (blob.offset - ra->start), len);
+	_decode_value(handle, addr, len);
+
+	return 0;
+}
+
+/*
+ * 写回节点后同步更新缓冲区。定长存储只写一次；变长存储原地写数据块和头部共两次，
+ * 换了数据块时写入次数更多，这时不同步，下次读取时发现 write_seq 不一致自然作废
+ */
+void _ra_update_node(hash_handle_t* handle, hash_readahead_t* ra, off_t offset, hash_node_t* node) {
+	uint32_t writes = handle->header.varlen_value ? 2 : 1;
+	hash_blob_t blob;
+
+	if (NULL == ra->buf || ra->write_seq + writes != __atomic_load_n(&handle->write_seq, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	if (offset >= ra->start && offset + _node_size(handle) <= ra->start + ra->len) {
+		memcpy(ra->buf + (offset - ra->start), node, sizeof(hash_node_t));
+
+		if (!handle->header.varlen_value) {
+			memcpy(ra->buf + (offset - ra->start) + sizeof(hash_node_t), node->data.value, handle->header.node_data_value_size);
+		} else {
+			memcpy(&blob, ra->buf + (offset - ra->start) + sizeof(hash_node_t), sizeof(hash_blob_t));
+
+			if (blob.offset >= ra->start && blob.offset + blob.cap <= ra->start + ra->len) {
+				memcpy(ra->buf + (blob.offset - ra->start), node->data.value, _value_len(handle, node->data.value));
+			} else if (blob.offset < ra->start + ra->len && blob.offset + blob.cap > ra->start) {
+				// 数据块只有一部分在缓冲区里，不值得处理
+				ra->len = 0;
+			}
+		}
+	} else if (handle->header.varlen_value) {
+		// 不知道数据块在哪，缓冲区作废
+		ra->len = 0;
+	}
+
+	ra->write_seq += writes;
+}
+
+// 删除节点会改动多个节点，直接作废缓冲区
+void _ra_invalidate(hash_readahead_t* ra) {
+	ra->len = 0;
+}
+
+/*
+ * 遍历前锁住哈希槽：可写句柄的回调可能更新、删除节点，需要独占；只读句柄共享，多个读者可以同时遍历
+ * 没有拿锁期间其他句柄可能改过文件，缓冲区作废
+ */
+int _lock_traverse_slot(hash_handle_t* handle, uint32_t which_slot, hash_readahead_t* ra) {
+	if (_lock_slot(handle, which_slot, (HASH_OPEN_RDWR & handle->flags) ? F_WRLCK : F_RDLCK) < 0) {
+		return -1;
+	}
+
+	if (_lock_enabled(handle)) {
+		_ra_invalidate(ra);
+	}
+
+	return 0;
+}
+
+// 并行遍历时各线程共享的信息
+typedef struct {
+	hash_handle_t* handle;
+	traverse_by_what_t by_what;
+	void* input_arg;
+	traverse_action_t (*cb)(hash_node_data_t* file_node_data, void* input_arg);
+	uint32_t next_slot;			// 下一个待遍历的哈希槽，各线程原子地领取
+	uint8_t break_or_not;		// 有线程遇到 TRAVERSE_ACTION_BREAK 或出错后其他线程也尽快停下
+	uint8_t error;				// 有线程加锁、读节点等出错
+} hash_traverse_ctx_t;
+
+/*
+ * 遍历一个哈希槽，返回1表示回调要求停止遍历，出错返回-1
+ * ctx 不为NULL时是并行遍历，其他线程要求停止时提前返回
+ */
+int _traverse_slot(hash_handle_t* handle, uint32_t which_slot, traverse_by_what_t by_what,
+		printable_t printable, void* input_arg,
+		traverse_action_t (*cb)(hash_node_data_t* file_node_data, void* input_arg),
+		hash_readahead_t* ra, hash_node_t* node, hash_traverse_ctx_t* ctx) {
+	int ret = -1;
+	traverse_action_t action = TRAVERSE_ACTION_DO_NOTHING;
+	bool first_node = true;
+	off_t offset = 0;
+	off_t first_node_offset = 0;
+	off_t prev_offset = 0;
+	off_t next_offset = 0;
+	hash_header_t* header = &handle->header;
+
+	first_node_offset = TRAVERSE_BY_LOGIC == by_what ?\
+		header->slots[which_slot].first_logic_node_offset : _first_physic_node_offset(handle, which_slot);
+
+	// 直接打印链表，先把异步日志输出完，保持先后顺序
+	if (WITH_PRINT == printable) {
+		hash_log_flush();
+		printf("[%d] (%d) %s  ", which_slot, header->slots[which_slot].node_cnt,
+				TRAVERSE_BY_LOGIC == by_what ? " \e[7;32mLOGIC\e[0m" : "\e[7;34mPHYSIC\e[0m");
+	}
+
+	offset = first_node_offset;
+	do {
+		if (NULL != ctx && __atomic_load_n(&ctx->break_or_not, __ATOMIC_RELAXED)) {
+			ret = 1;
+			goto exit;
+		}
+
+		if (_ra_read_node(handle, ra, offset, node) < 0) {
+			hash_error("read node failed.");
+			goto exit;
+		}
+
+		// 遍历过程中的删除操作有可能会改变第 一个 逻辑节点的位置
+		if (TRAVERSE_BY_LOGIC == by_what) { first_node_offset = header->slots[which_slot].first_logic_node_offset; }
+
+		prev_offset = TRAVERSE_BY_LOGIC == by_what ? node->offsets.logic_prev : node->offsets.physic_prev;
+		next_offset = TRAVERSE_BY_LOGIC == by_what ? node->offsets.logic_next : node->offsets.physic_next;
+
+		if (first_node) {
+			first_node = false;
+		} else {
+			if (WITH_PRINT == printable) { printf(" --- "); }
+		}
+
+		if (WITH_PRINT == printable) { printf("<0x%lX> ( 0x%lX : ", prev_offset, offset); }
+
+		if (0 == node->used) {
+			if (WITH_PRINT == printable) { printf("* ) <0x%lX>", next_offset); }
+			goto next_loop;
+		}
+
+		hash_stat_add(callbacks, 1);
+		action = cb(&(node->data), input_arg);
+
+		if (WITH_PRINT == printable) { printf(" ) <0x%lX>", next_offset); }
+
+		// 调用者已经独占了这个哈希槽，头部由 _index_remove 等自己加锁
+		if (TRAVERSE_ACTION_UPDATE & action) {
+			if (_write_node(handle, offset, node) < 0) {
+				hash_error("write node error.");
+			} else {
+				_ra_update_node(handle, ra, offset, node);
+			}
+		}
+
+		if (TRAVERSE_ACTION_DELETE & action) {
+			_del_node_hepler(handle, offset, which_slot, node);
+			_ra_invalidate(ra);
+		}
+
+		if (TRAVERSE_ACTION_BREAK & action) {
+			if (NULL != ctx) { __atomic_store_n(&ctx->break_or_not, 1, __ATOMIC_RELAXED); }
+			ret = 1;
+			goto exit;
+		}
+
+next_loop:
+		offset = next_offset;
+	} while (offset != first_node_offset);
+
+	if (WITH_PRINT == printable) { printf("\n"); }
+
+	ret = 0;
+
+exit:
+	return ret;
+}
+
+uint8_t hash_traverse_nodes(hash_handle_t* handle, traverse_by_what_t by_what,
+		uint32_t which_slot, printable_t printable, void* input_arg,
+		traverse_action_t (*cb)(hash_node_data_t* file_node_data, void* input_arg)) {
+	uint32_t i = 0;
+	uint64_t start_ns = hash_stat_now();
+	hash_node_t node;
+	void* node_data_value = NULL;
+	uint32_t slot_cnt = 0;
+	uint32_t node_data_value_size = handle->header.node_data_value_size;
+	uint8_t break_or_not = 0;
+	hash_readahead_t ra;
+
+	memset(&node, 0, sizeof(hash_node_t));
+
+	_ra_init(handle, &ra);
+
+	if (node_data_value_size > 0
+			&& NULL == (node_data_value = (void*)calloc(1, node_data_value_size))) {
+		hash_error("calloc failed.");
+		goto exit;
+	}
+
+	node.data.value = node_data_value;
+
+	// 遍历期间哈希槽不会分裂
+	if (_lock_dir(handle, F_RDLCK) < 0) {
+		goto exit;
+	}
+
+	slot_cnt = handle->header.slot_cnt;
+
+	for (i = 0; i < slot_cnt; i++) {
+		if (which_slot < slot_cnt && i != which_slot) {
+			continue;
+		}
+
+		if (_lock_traverse_slot(handle, i, &ra) < 0) {
+			goto unlock_dir;
+		}
+
+		if (0 != _traverse_slot(handle, i, by_what, printable, input_arg, cb, &ra, &node, NULL)) {
+			break_or_not = 1;
+		}
+
+		_unlock_slot(handle, i);
+
+		if (break_or_not) {
+			goto unlock_dir;
+		}
+	}
+
+unlock_dir:
+	_unlock_dir(handle);
+
+exit:
+	_ra_free(&ra);
+	safe_free(node_data_value);
+	hash_stat_api(HASH_API_TRAVERSE, start_ns);
+	return break_or_not;
+}
+
+void* _traverse_worker(void* arg) {
+	hash_traverse_ctx_t* ctx = (hash_traverse_ctx_t*)arg;
+	hash_handle_t* handle = ctx->handle;
+	uint32_t which_slot = 0;
+	int ret = 0;
+	hash_node_t node;
+	void* node_data_value = NULL;
+	uint32_t node_data_value_size = handle->header.node_data_value_size;
+	hash_readahead_t ra;
+
+	memset(&node, 0, sizeof(hash_node_t));
+
+	_ra_init(handle, &ra);
+
+	if (node_data_value_size > 0
+			&& NULL == (node_data_value = (void*)calloc(1, node_data_value_size))) {
+		hash_error("calloc failed.");
+		goto fail;
+	}
+
+	node.data.value = node_data_value;
+
+	// 每次领取一个哈希槽，直到全部遍历完
+	while ((which_slot = __atomic_fetch_add(&ctx->next_slot, 1, __ATOMIC_RELAXED)) < handle->header.slot_cnt) {
+		if (_lock_traverse_slot(handle, which_slot, &ra) < 0) {
+			goto fail;
+		}
+
+		ret = _traverse_slot(handle, which_slot, ctx->by_what, WITHOUT_PRINT,
+				ctx->input_arg, ctx->cb, &ra, &node, ctx);
+
+		_unlock_slot(handle, which_slot);
+
+		if (ret < 0) {
+			goto fail;
+		}
+
+		if (0 != ret) {
+			__atomic_store_n(&ctx->break_or_not, 1, __ATOMIC_RELAXED);
+		}
+
+		if (__atomic_load_n(&ctx->break_or_not, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+
+	goto exit;
+
+fail:
+	__atomic_store_n(&ctx->error, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->break_or_not, 1, __ATOMIC_RELAXED);
+
+exit:
+	_ra_free(&ra);
+	safe_free(node_data_value);
+	return NULL;
+}
+
+int hash_traverse_nodes_parallel(hash_handle_t* handle, traverse_by_what_t by_what,
+		uint32_t thread_cnt, void* input_arg,
+		traverse_action_t (*cb)(hash_node_data_t* file_node_data, void* input_arg)) {
+	int ret = -1;
+	uint32_t i = 0;
+	uint64_t start_ns = hash_stat_now();
+	uint32_t started_cnt = 0;
+	int err = 0;
+	long cpu_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t threads[HASH_TRAVERSE_MAX_THREADS];
+	hash_traverse_ctx_t ctx;
+
+	memset(&ctx, 0, sizeof(hash_traverse_ctx_t));
+
+	if (0 == thread_cnt) {
+		thread_cnt = cpu_cnt > 0 ? cpu_cnt : 1;
+	}
+
+	if (thread_cnt > HASH_TRAVERSE_MAX_THREADS) { thread_cnt = HASH_TRAVERSE_MAX_THREADS; }
+
+	// 各个线程都在目录的共享锁下遍历，期间哈希槽不会分裂
+	if (_lock_dir(handle, F_RDLCK) < 0) {
+		goto exit;
+	}
+
+	if (thread_cnt > handle->header.slot_cnt) { thread_cnt = handle->header.slot_cnt; }
+
+	ctx.handle = handle;
+	ctx.by_what = by_what;
+	ctx.input_arg = input_arg;
+	ctx.cb = cb;
+
+	// 只有一个线程时不必创建线程
+	for (i = 0; thread_cnt > 1 && i < thread_cnt; i++) {
+		if (0 != (err = pthread_create(&threads[started_cnt], NULL, _traverse_worker, &ctx))) {
+			hash_warn("create traverse thread failed : %s.", strerror(err));
+			break;
+		}
+
+		++started_cnt;
+	}
+
+	// 一个线程都没有创建（成功），当前线程自己遍历
+	if (0 == started_cnt) {
+		_traverse_worker(&ctx);
+	}
+
+	for (i = 0; i < started_cnt; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	_unlock_dir(handle);
+
+	ret = ctx.error ? -1 : ctx.break_or_not;
+
+exit:
+	hash_stat_api(HASH_API_TRAVERSE_PARALLEL, start_ns);
+	return ret;
+}
+
+/************************************************
+ * 游标
+ ***********************************************/
+
+// 当前遍历方式下哈希槽的第一个节点，逻辑链表的第一个节点会随插入删除变化，每次重新取
+off_t _cursor_first_offset(hash_cursor_t* cursor) {
+	hash_handle_t* handle = cursor->handle;
+
+	if (TRAVERSE_BY_LOGIC == cursor->by_what) {
+		return 0 == handle->header.slots[cursor->which_slot].node_cnt ? 0 :\
+			handle->header.slots[cursor->which_slot].first_logic_node_offset;
+	}
+
+	return _first_physic_node_offset(handle, cursor->which_slot);
+}
+
+hash_cursor_t* hash_cursor_open(hash_handle_t* handle, uint32_t which_slot, traverse_by_what_t by_what) {
+	hash_cursor_t* cursor = NULL;
+	uint32_t slot_cnt = 0;
+
+	if (_lock_dir(handle, F_RDLCK) < 0) {
+		goto exit;
+	}
+
+	slot_cnt = handle->header.slot_cnt;
+
+	_unlock_dir(handle);
+
+	if (which_slot >= slot_cnt) {
+		hash_error("slot %d is out of range (%d).", which_slot, slot_cnt);
+		goto exit;
+	}
+
+	if (NULL == (cursor = (hash_cursor_t*)calloc(1, sizeof(hash_cursor_t)))
+			|| NULL == (cursor->ra = calloc(1, sizeof(hash_readahead_t)))) {
+		hash_error("calloc failed.");
+		safe_free(cursor);
+		goto exit;
+	}
+
+	cursor->handle = handle;
+	cursor->which_slot = which_slot;
+	cursor->by_what = by_what;
+
+	_ra_init(handle, (hash_readahead_t*)cursor->ra);
+
+	hash_cursor_seek(cursor, 0);
+
+exit:
+	return cursor;
+}
+
+void hash_cursor_close(hash_cursor_t* cursor) {
+	if (NULL == cursor) {
+		return;
+	}
+
+	if (NULL != cursor->ra) {
+		_ra_free((hash_readahead_t*)cursor->ra);
+		safe_free(cursor->ra);
+	}
+
+	free(cursor);
+}
+
+off_t _cursor_next(hash_cursor_t* cursor, hash_node_t* output_node) {
+	off_t ret = -1;
+	off_t offset = 0;
+	off_t first_offset = _cursor_first_offset(cursor);
+
+	if (cursor->slot_cnt != cursor->handle->header.slot_cnt) {
+		hash_error("slot %d has been split, seek again.", cursor->which_slot);
+		goto exit;
+	}
+
+	// 物理链表中可能有未使用的节点，跳过
+	do {
+		if (0 == (offset = cursor->next_offset)) {
+			ret = 0;
+			goto exit;
+		}
+
+		if (_ra_read_node(cursor->handle, (hash_readahead_t*)cursor->ra, offset, output_node) < 0) {
+			hash_error("read node 0x%lX failed.", offset);
+			goto exit;
+		}
+
+		cursor->prev_offset = offset;
+		cursor->next_offset = TRAVERSE_BY_LOGIC == cursor->by_what ?\
+			output_node->offsets.logic_next : output_node->offsets.physic_next;
+
+		if (cursor->next_offset == first_offset) {
+			cursor->next_offset = 0;
+		}
+	} while (0 == output_node->used);
+
+	ret = offset;
+
+exit:
+	return ret;
+}
+
+off_t _cursor_prev(hash_cursor_t* cursor, hash_node_t* output_node) {
+	off_t ret = -1;
+	off_t offset = 0;
+	off_t first_offset = _cursor_first_offset(cursor);
+
+	if (cursor->slot_cnt != cursor->handle->header.slot_cnt) {
+		hash_error("slot %d has been split, seek again.", cursor->which_slot);
+		goto exit;
+	}
+
+	do {
+		if (0 == (offset = cursor->prev_offset)) {
+			ret = 0;
+			goto exit;
+		}
+
+		if (_ra_read_node(cursor->handle, (hash_readahead_t*)cursor->ra, offset, output_node) < 0) {
+			hash_error("read node 0x%lX failed.", offset);
+			goto exit;
+		}
+
+		cursor->next_offset = offset;
+		cursor->prev_offset = offset == first_offset ? 0 : TRAVERSE_BY_LOGIC == cursor->by_what ?\
+			output_node->offsets.logic_prev : output_node->offsets.physic_prev;
+	} while (0 == output_node->used);
+
+	ret = offset;
+
+exit:
+	return ret;
+}
+
+int _cursor_seek(hash_cursor_t* cursor, off_t offset) {
+	int ret = -1;
+	off_t first_offset = _cursor_first_offset(cursor);
+	hash_node_t node;
+
+	memset(&node, 0, sizeof(hash_node_t));
+
+	cursor->slot_cnt = cursor->handle->header.slot_cnt;
+
+	// 回到第一个节点之前
+	if (0 == offset) {
+		cursor->next_offset = first_offset;
+		cursor->prev_offset = 0;
+		ret = 0;
+		goto exit;
+	}
+
+	if (_read_node_header(cursor->handle, offset, &node) < 0) {
+		goto exit;
+	}
+
+	if (1 != node.used || cursor->which_slot != _slot_of(cursor->handle, node.data.key)) {
+		hash_error("0x%lX is not a node of slot %d.", offset, cursor->which_slot);
+		goto exit;
+	}
+
+	cursor->next_offset = offset;
+	cursor->prev_offset = offset == first_offset ? 0 : TRAVERSE_BY_LOGIC == cursor->by_what ?\
+		node.offsets.logic_prev : node.offsets.physic_prev;
+
+	ret = 0;
+
+exit:
+	return ret;
+}
+
+// 每次调用期间共享锁住目录和哈希槽。两次调用之间其他句柄可能改过文件，缓冲区作废
+int _lock_cursor(hash_cursor_t* cursor) {
+	if (_lock_dir(cursor->handle, F_RDLCK) < 0) {
+		return -1;
+	}
+
+	if (_lock_slot(cursor->handle, cursor->which_slot, F_RDLCK) < 0) {
+		_unlock_dir(cursor->handle);
+		return -1;
+	}
+
+	if (_lock_enabled(cursor->handle)) {
+		_ra_invalidate((hash_readahead_t*)cursor->ra);
+	}
+
+	return 0;
+}
+
+void _unlock_cursor(hash_cursor_t* cursor) {
+	_unlock_slot(cursor->handle, cursor->which_slot);
+	_unlock_dir(cursor->handle);
+}
+
+off_t hash_cursor_next(hash_cursor_t* cursor, hash_node_t* output_node) {
+	off_t ret = -1;
+	uint64_t start_ns = hash_stat_now();
+
+	if (_lock_cursor(cursor) < 0) {
+		goto exit;
+	}
+
+	ret = _cursor_next(cursor, output_node);
+
+	_unlock_cursor(cursor);
+
+exit:
+	hash_stat_api(HASH_API_CURSOR, start_ns);
+	return ret;
+}
+
+off_t hash_cursor_prev(hash_cursor_t* cursor, hash_node_t* output_node) {
+	off_t ret = -1;
+	uint64_t start_ns = hash_stat_now();
+
+	if (_lock_cursor(cursor) < 0) {
+		goto exit;
+	}
+
+	ret = _cursor_prev(cursor, output_node);
+
+	_unlock_cursor(cursor);
+
+exit:
+	hash_stat_api(HASH_API_CURSOR, start_ns);
+	return ret;
+}
+
+int hash_cursor_seek(hash_cursor_t* cursor, off_t offset) {
+	int ret = -1;
+	uint64_t start_ns = hash_stat_now();
+
+	if (_lock_cursor(cursor) < 0) {
+		goto exit;
+	}
+
+	ret = _cursor_seek(cursor, offset);
+
+	_unlock_cursor(cursor);
+
+exit:
+	hash_stat_api(HASH_API_CURSOR, start_ns);
+	return ret;
+}
+
+/************************************************
+ * 以下接口每次调用都会打开、解析、关闭一次文件，
+ * 频繁操作同一个文件时请使用 hash_open 得到的句柄
+ ***********************************************/
+
+int get_slot_node_cnt(const char* path, uint32_t which_slot) {
+	int ret = -1;
+	hash_handle_t* handle = NULL;
+
+	if (NULL == (handle = hash_open(path, HASH_OPEN_RDONLY))) {
+		goto exit;
+	}
+
+	ret = hash_get_slot_node_cnt(handle, which_slot);
+
+	hash_close(handle);
+
+exit:
+	return ret;
+}
+
+bool is_slot_empty(const char* path, uint32_t which_slot) {
+	return (0 == get_slot_node_cnt(path, which_slot));
+}
+
+int get_header_data(const char* path, hash_header_data_t* output_header_data) {
+	int ret = -1;
+	hash_handle_t* handle = NULL;
+
+	if (NULL == (handle = hash_open(path, HASH_OPEN_RDONLY))) {
+		goto exit;
+	}
+
+	ret = hash_get_header_data(handle, output_header_data);
+
+	hash_close(handle);
+
+exit:
+	return ret;
+}
+
+int set_header_data(const char* path, hash_header_data_t* input_header_data) {
+	int ret = -1;
+	hash_handle_t* handle = NULL;
+
+	if (NULL == (handle = hash_open(path, HASH_OPEN_RDWR))) {
+		goto exit;
+	}
+
+	ret = hash_set_header_data(handle, input_header_data);
+
+	hash_close(handle);
+
+exit:
+	return ret;
+}
+
+int get_node(const char* path, uint32_t which_slot, off_t offset, hash_node_t* output_node) {
+	int ret = -1;
+	hash_handle_t* handle = NULL;
+
+	if (NULL == (handle = hash_open(path, HASH_OPEN_RDONLY))) {
+		goto exit;
+	}
+
+	ret = hash_get_node(handle, which_slot, offset, output_node);
+
+	hash_close(handle);
+
+exit:
+	return ret;
+}
+
+off_t get_node_at(const char* path, uint32_t which_slot, uint32_t index, hash_node_t* output_node) {
+	off_t ret = -1;
+	hash_handle_t* handle = NULL;
+
+	if (NULL == (handle = hash_open(path, HASH_OPEN_RDONLY))) {
+		goto exit;
+	}
+
+	ret = hash_get_node_at(handle, which_slot, index, output_node);
+
+	hash_close(handle);
+
+exit:
+	return ret;
+}
+
+int insert_node(const char* path,
+		hash_node_data_t* input_prev_node_data, hash_node_data_t* input_curr_node_data,
+		bool (*cb)(hash_node_data_t*, hash_node_data_t*)) {
+	int ret = -1;
+	hash_handle_t* handle = NULL;
+
+	if (NULL == (handle = hash_open(path, HASH_OPEN_RDWR))) {
+		goto exit;
+	}
+
+	ret = hash_insert_node(handle, input_prev_node_data, input_curr_node_data, cb);
+
+	hash_close(handle);
+
+exit:
+	return ret;
+}
+
+int insert_nodes(const char* path, hash_node_data_t* input_prev_node_data,
+		hash_node_data_t* input_node_datas, uint32_t cnt,
+		bool (*cb)(hash_node_data_t*, hash_node_data_t*)) {
+	int ret = -1;
+	hash_handle_t* handle = NULL;
+
+	if (NULL == (handle = hash_open(path, HASH_OPEN_RDWR))) {
+		goto exit;
+	}
+
+	ret = hash_insert_nodes(handle, input_prev_node_data, input_node_datas, cnt, cb);
+
+	hash_close(handle);
+
+exit:
+	return ret;
+}
+
+int del_node(const char* path, hash_node_data_t* input_node_data,
+		bool (*cb)(hash_node_data_t*, hash_node_data_t*)) {
+	int ret = -1;
+	hash_handle_t* handle = NULL;
+
+	if (NULL == (handle = hash_open(path, HASH_OPEN_RDWR))) {
+		goto exit;
+	}
+
+	ret = hash_del_node(handle, input_node_data, cb);
+
+	hash_close(handle);
+
+exit:
+	return ret;
+}
+
+int del_nodes(const char* path, uint32_t which_slot,
+		bool (*cb)(hash_node_data_t* file_node_data, void* input_arg), void* input_arg) {
+	int ret = -1;
+	hash_handle_t* handle = NULL;
+
+	if (NULL == (handle = hash_open(path, HASH_OPEN_RDWR))) {
+		goto exit;
+	}
+
+	ret = hash_del_nodes(handle, which_slot, cb, input_arg);
+
+	hash_close(handle);
+
+exit:
+	return ret;
+}
+
+int traverse_nodes_parallel(const char* list_path, traverse_by_what_t by_what,
+		void* input_arg, traverse_action_t (*cb)(hash_node_data_t* file_node_data, void* input_arg)) {
+	int ret = -1;
+	hash_handle_t* handle = NULL;
+
+	if (NULL == (handle = hash_open(list_path, HASH_OPEN_RDWR | HASH_OPEN_MMAP))) {
+		goto exit;
+	}
+
+	ret = hash_traverse_nodes_parallel(handle, by_what, 0, input_arg, cb);
+
+	hash_close(handle);
+
+exit:
+	return ret;
+}
+
+uint8_t traverse_nodes(const char* list_path, traverse_by_what_t by_what,
+		uint32_t which_slot, printable_t printable, void* input_arg,
+		traverse_action_t (*cb)(hash_node_data_t* file_node_data, void* input_arg)) {
+	uint8_t break_or_not = 0;
+	hash_handle_t* handle = NULL;
+
+	// 遍历会访问整条链，映射后逐节点读写不再需要系统调用
+	if (NULL == (handle = hash_open(list_path, HASH_OPEN_RDWR | HASH_OPEN_MMAP))) {
+		goto exit;
+	}
+
+	break_or_not = hash_traverse_nodes(handle, by_what, which_slot, printable, input_arg, cb);
+
+	hash_close(handle);
+
+exit:
+	return break_or_not;
+}
+
+/*
+ * GENTLE_INIT 时检查已有文件能不能直接使用：只读一次头部，版本、校验和正确，
+ * config 中的格式字段和文件一致，目录、索引表等也都在文件范围内
+ */
+bool _file_reusable(const char* path, hash_config_t* config) {
+	bool ret = false;
+	int fd = -1;
+	struct stat st;
+	hash_header_t header;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		hash_warn("open %s fail : %s.", path, strerror(errno));
+		goto exit;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(hash_header_t)) {
+		hash_warn("%s is too short.", path);
+		goto close_file;
+	}
+
+	if (pread(fd, &header, sizeof(hash_header_t), 0) < 0 || !_header_valid(path, &header)) {
+		goto close_file;
+	}
+
+	if (header.base_slot_cnt != config->slot_cnt
+			|| header.node_data_value_size != config->node_data_value_size
+			|| header.header_data_value_size != config->header_data_value_size
+			|| header.key_field_offset != config->key_field_offset
+			|| header.key_field_size != config->key_field_size
+			|| header.key_field_flags != config->key_field_flags
+			|| header.varlen_value != config->varlen_value
+			|| (config->varlen_value && header.value_tail_offset != config->value_tail_offset)
+			|| header.rank_index != config->rank_index
+			|| (header.index_cap > 0) != (config->index_cap > 0)) {
+		hash_warn("%s doesn't match the config.", path);
+		goto close_file;
+	}
+
+	if (header.slot_cnt < header.base_slot_cnt || header.slot_cnt > header.slot_cap || header.slot_cap > HASH_MAX_SLOT_CNT
+			|| header.slots_offset + (off_t)(header.slot_cnt * sizeof(slot_info_t)) > st.st_size
+			|| header.header_data_offset + header.header_data_value_size > st.st_size
+			|| header.index_offset + (off_t)(header.index_cap * sizeof(hash_index_entry_t)) > st.st_size) {
+		hash_warn("%s is truncated (%ld bytes).", path, st.st_size);
+		goto close_file;
+	}
+
+	hash_info("reuse %s, %d slots, %ld bytes.", path, header.slot_cnt, st.st_size);
+	ret = true;
+
+close_file:
+	close(fd);
+
+exit:
+	return ret;
+}
+
+int init_hash_engine_ex(const char* path, init_method_t rebuild, hash_config_t* config) {
+	int ret = -1;
+	int fd = -1;
+	uint32_t i = 0;
+	uint8_t file_exist = 0;
+	hash_header_t header;
+	slot_info_t* slots = NULL;
+	void* header_data_value = NULL;
+	hash_node_t node;
+	void* node_data_value = NULL;
+	hash_index_entry_t* index_entries = NULL;
+	off_t offset = 0;
+	struct iovec iov[3];
+	uint32_t slot_cnt = config->slot_cnt;
+	uint32_t node_data_value_size = config->node_data_value_size;
+	uint32_t header_data_value_size = config->header_data_value_size;
+	uint32_t index_cap = 0;
+	// 节点头部之后实际保存的长度，变长存储时只保存数据块的位置
+	uint32_t stored_value_size = config->varlen_value ? sizeof(hash_blob_t) : node_data_value_size;
+
+	hash_info("path = %s, rebuild = %d, "
+			"slot_cnt = %d, node_data_value_size = %d, header_data_value_size = %d, index_cap = %d.",
+			path, rebuild, slot_cnt, node_data_value_size, header_data_value_size, config->index_cap);
+
+	memset(&header, 0, sizeof(hash_header_t));
+	memset(&node, 0, sizeof(hash_node_t));
+
+	if (0 == slot_cnt || slot_cnt > HASH_MAX_SLOT_CNT) {
+		hash_error("slot_cnt %d is out of range.", slot_cnt);
+		goto exit;
+	}
+
+	if ((uint64_t)config->key_field_offset + config->key_field_size > node_data_value_size) {
+		hash_error("key field [%d, %d) is out of node data (%d).", config->key_field_offset,
+				config->key_field_offset + config->key_field_size, node_data_value_size);
+		goto exit;
+	}
+
+	if (config->varlen_value && config->value_tail_offset >= node_data_value_size) {
+		hash_error("value tail %d is out of node data (%d).", config->value_tail_offset, node_data_value_size);
+		goto exit;
+	}
+
+	// 索引表容量取2的幂，方便取模
+	if (config->index_cap > 0) {
+		for (index_cap = HASH_INDEX_MIN_CAP; index_cap < config->index_cap; index_cap <<= 1);
+	}
+
+	if (access(path, F_OK) < 0) {
+		hash_debug("%s not exist.", path);
+		file_exist = 0;
+	} else {
+		file_exist = 1;
+	}
+
+	if (1 == file_exist && (FORCE_INIT == rebuild || !_file_reusable(path, config))) {
+		if (unlink(path) < 0) {
+			hash_error("delete '%s' error : %s.", path, strerror(errno));
+			goto exit;
+		} else {
+			hash_info("delete old hash file '%s' success.", path);
+			file_exist = 0;
 		}
 	}
 
-	do {
-		/* START 拿一个节点数据，取完后文件指针不要挪动 */
-		if (lseek(fd, physic_offset, SEEK_SET) < 0) {
-			hash_error("seek to %ld fail : %s.", physic_offset, strerror(errno));
-			goto close_file;
-		}
-
-		if (read(fd, &curr_physic_node, sizeof(hash_node_t)) < 0) {
-			hash_error("read curr_physic_node failed : %s.", strerror(errno));
-			goto close_file;
+	if (0 == file_exist) {
+		if ((fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+			hash_error("create file %s fail : %s.", path, strerror(errno));
+			goto exit;
 		}
 
-		if (node_data_value_size > 0
-				&& read(fd, node_data_value, node_data_value_size) < 0) {
-			hash_error("read node_data_value failed : %s.", strerror(errno));
+		// 先写入头部信息
+		if (NULL == (slots = (void*)calloc(slot_cnt, sizeof(slot_info_t)))) {
+			hash_error("calloc failed.");
 			goto close_file;
 		}
 
-		// 建立关联，方便后面使用。之后不要破坏这种关联（比如read调用）
-		curr_physic_node.data.value = node_data_value;
-
-		if (lseek(fd, physic_offset, SEEK_SET) < 0) {
-			hash_error("seek back to %ld fail : %s.", physic_offset, strerror(errno));
+		if (header_data_value_size > 0
+				&& NULL == (header_data_value = (void*)calloc(1, header_data_value_size))) {
+			hash_error("calloc failed.");
 			goto close_file;
 		}
-		/* END 拿一个节点数据，取完后文件指针不要挪动 */
-
-		/*
-		 * used  next_offset  desc
-		 *  0         0        首次使用第一个节点
-		 *  0         1        被清空过的节点
-		 *  1         0        已被使用的最后一个节点
-		 */
 
-		if (0 == curr_physic_node.used || first_physic_node_offset == curr_physic_node.offsets.physic_next) {
-			// 0 0, 首次使用第一个节点
-			if (0 == curr_physic_node.used
-					&& first_physic_node_offset == curr_physic_node.offsets.physic_next
-					&& first_physic_node_offset == curr_physic_node.offsets.physic_prev) {
-#if DEBUG_ADD_NODE
-				hash_debug("(FIRST) <0x%lX> (0x%lX : %d) <0x%lX>",
-						curr_physic_node.offsets.physic_prev, physic_offset, input_curr_node_data->key, curr_physic_node.offsets.physic_next);
-#endif
-				curr_physic_node.offsets.physic_prev = curr_physic_node.offsets.physic_next = first_physic_node_offset;
-				new_physic_node_offset = physic_offset;
+		header.slot_cnt = slot_cnt;
+		header.base_slot_cnt = slot_cnt;
+		header.slot_cap = slot_cnt;
+		header.split_threshold = config->split_threshold;
+		header.key_field_offset = config->key_field_offset;
+		header.key_field_size = config->key_field_size;
+		header.key_field_flags = config->key_field_flags;
+		header.varlen_value = config->varlen_value;
+		header.value_tail_offset = config->value_tail_offset;
+		header.rank_index = config->rank_index;
+		header.slots_offset = sizeof(hash_header_t);
+		header.header_data_offset = sizeof(hash_header_t) + slot_cnt * sizeof(slot_info_t);
+		header.header_data_value_size = header_data_value_size;
+		header.node_data_value_size = node_data_value_size;
+		header.slots = slots;
+		header.data.value = header_data_value;
+		_seal_header(&header);
+		header.file_size = sizeof(hash_header_t) + slot_cnt * sizeof(slot_info_t) + header_data_value_size\
+			+ slot_cnt * (sizeof(hash_node_t) + stored_value_size);
+
+		// 索引表紧跟在各个槽的第一个节点之后
+		if (index_cap > 0) {
+			if (NULL == (index_entries = (hash_index_entry_t*)calloc(index_cap, sizeof(hash_index_entry_t)))) {
+				hash_error("calloc failed.");
+				goto close_file;
 			}
 
-			// 0 1, 被清空过的节点
-			else if (0 == curr_physic_node.used) {
-#if DEBUG_ADD_NODE
-				hash_debug(" (USED) <0x%lX> (0x%lX : %d) <0x%lX>",
-						curr_physic_node.offsets.physic_prev, physic_offset, input_curr_node_data->key, curr_physic_node.offsets.physic_next);
-#endif
-				new_physic_node_offset = physic_offset;
-			}
+			header.index_offset = header.file_size;
+			header.index_cap = index_cap;
+			header.file_size += index_cap * sizeof(hash_index_entry_t);
 
-			// 1 0, 正在使用的最后一个节点
-			else if (1 == curr_physic_node.used && first_physic_node_offset == curr_physic_node.offsets.physic_next) {
-				// 新节点在文件末尾插入，获取新节点偏移量
-				if ((new_physic_node_offset = lseek(fd, 0, SEEK_END)) < 0) {
-					hash_error("prepare new curr_physic_node, seek to %ld fail : %s.",
-							physic_offset, strerror(errno));
-					goto close_file;
-				}
+			if (pwrite(fd, index_entries, index_cap * sizeof(hash_index_entry_t), header.index_offset) < 0) {
+				hash_error("init index error.");
+				goto close_file;
+			}
+		}
 
-				/**** 1. START 修改 当前 节点的next_offset值，指向新节点 ****/
-				lseek(fd, physic_offset, SEEK_SET);
+		if (stored_value_size > 0
+				&& NULL == (node_data_value = (void*)calloc(1, stored_value_size))) {
+			hash_error("calloc failed.");
+			goto close_file;
+		}
 
-				curr_physic_node.offsets.physic_next = new_physic_node_offset;
+		node.data.value = node_data_value;
 
-				if (write(fd, &curr_physic_node, sizeof(hash_node_t)) < 0) {
-					hash_error("write curr_physic_node error : %s.", strerror(errno));
-					goto close_file;
-				}
-				/**** 1. END 修改 当前 节点的next_offset值，指向新节点 ****/
+		for (i = 0; i < slot_cnt; i++) {
+			offset = sizeof(hash_header_t) + slot_cnt * sizeof(slot_info_t) + header_data_value_size\
+				 + i * (sizeof(hash_node_t) + stored_value_size);
+			node.offsets.physic_prev = node.offsets.physic_next = offset;
+			node.offsets.logic_prev = node.offsets.logic_next = offset;
 
-				/**** 2. START 修改 头 节点的prev_offset值，指向新节点 ****/
-				lseek(fd, first_physic_node_offset, SEEK_SET);
+			header.slots[i].first_logic_node_offset = offset;
+			header.slots[i].first_physic_node_offset = offset;
 
+			iov[0].iov_base = &node;
+			iov[0].iov_len = sizeof(hash_node_t);
+			iov[1].iov_base = node.data.value;
+			iov[1].iov_len = stored_value_size;
 
-				if (read(fd, &first_physic_node, sizeof(hash_node_t)) < 0) {
-					hash_error("read first_physic_node error : %s.", strerror(errno));
-					goto close_file;
-				}
+			if (pwritev(fd, iov, stored_value_size > 0 ? 2 : 1, offset) < 0) {
+				hash_error("init node error.");
+				goto close_file;
+			}
+		}
 
-				first_physic_node.offsets.physic_prev = new_physic_node_offset;
+		// 头部、哈希槽信息、头部附加数据在文件中是连续的，一次写入
+		iov[0].iov_base = &header;
+		iov[0].iov_len = sizeof(hash_header_t);
+		iov[1].iov_base = header.slots;
+		iov[1].iov_len = slot_cnt * sizeof(slot_info_t);
+		iov[2].iov_base = header.data.value;
+		iov[2].iov_len = header_data_value_size;
 
-				// 再次回到节点开头写回
-				lseek(fd, first_physic_node_offset, SEEK_SET);
+		if (pwritev(fd, iov, header_data_value_size > 0 ? 3 : 2, 0) < 0) {
+			hash_error("write header error.");
+			goto close_file;
+		}
+	}
 
-				if (write(fd, &first_physic_node, sizeof(hash_node_t)) < 0) {
-					hash_error("write first_physic_node error : %s.", strerror(errno));
-					goto close_file;
-				}
-				/**** 2. END 修改 头 节点的prev_offset值，指向新节点 ****/
+	ret = 0;
 
-				/**** 3. START 修改 新 节点的prev和next指针 ****/
-				lseek(fd, 0, SEEK_END);		// 新节点在尾部
+close_file:
+	if (fd >= 0) {
+		close(fd);
+	}
 
-				curr_physic_node.offsets.physic_prev = physic_offset;
-				curr_physic_node.offsets.physic_next = first_physic_node_offset;
-				/**** 3. END 修改 新 节点的prev和next指针 ****/
+exit:
+	safe_free(slots);
+	safe_free(header_data_value);
+	safe_free(node_data_value);
+	safe_free(index_entries);
+	return ret;
+}
 
-#if DEBUG_ADD_NODE
-				hash_debug(" (TAIL) <0x%lX> (0x%lX : %d) <0x%lX>",
-						curr_physic_node.offsets.physic_prev, new_physic_node_offset, input_curr_node_data->key, curr_physic_node.offsets.physic_next);
-#endif
-			}
+int init_hash_engine(const char* path, init_method_t rebuild,
+		int slot_cnt, int node_data_value_size, int header_data_value_size) {
+	hash_config_t config;
 
-			/**** 4. START 写入新节点的其他信息 ****/
-			++header.slots[which_slot].node_cnt;
+	memset(&config, 0, sizeof(hash_config_t));
 
-			curr_physic_node.used = 1;
+	config.slot_cnt = slot_cnt;
+	config.node_data_value_size = node_data_value_size;
+	config.header_data_value_size = header_data_value_size;
 
-			addr = curr_physic_node.data.value;
-			memcpy(&(curr_physic_node.data), input_curr_node_data, sizeof(hash_node_data_t));
+	return init_hash_engine_ex(path, rebuild, &config);
+}
 
-			curr_physic_node.data.value = addr;
-			memcpy(curr_physic_node.data.value, input_curr_node_data->value, node_data_value_size);
+/************************************************
+ * 快照：把哈希文件导出成紧凑的顺序格式，开机时整体导入成可以直接使用的哈希文件，不用逐个节点重建
+ * 格式：快照头部 | 各哈希槽节点个数 | 头部附加数据 | 各附加数据的长度及内容 | 节点
+ * 节点按哈希槽、逻辑顺序依次排列，每个节点是 hash_snapshot_node_t 加上节点数据，变长存储时只保存有效长度
+ * 空闲节点、数据块、索引表都不导出，导入时重新生成。按本机字节序保存，不能在大小端不同的机器间共用
+ ***********************************************/
+
+#define HASH_SNAPSHOT_MAGIC 0x504E5348		// "HSNP"
+#define HASH_SNAPSHOT_VERSION 2		// 2：CRC 同时覆盖头部
+#define HASH_SNAPSHOT_BUF_SIZE (64 * 1024)	// 导出时的写缓冲区
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t crc;				// 先算头部之后的所有内容，再接着算 crc 清0后的头部
+	uint32_t slot_cnt;			// 导出时的哈希槽个数，导入时分裂到这个个数
+	uint64_t body_size;			// 头部之后的长度
+	uint32_t node_cnt;			// 节点总数
+	hash_config_t config;		// 其中 slot_cnt 为初始化时的哈希槽个数
+} hash_snapshot_header_t;
+
+// 快照的 CRC32，body_crc 为头部之后所有内容的 CRC32。配置等头部字段也要校验，导入时直接用它们初始化文件
+uint32_t _snapshot_crc(const hash_snapshot_header_t* snapshot, uint32_t body_crc) {
+	hash_snapshot_header_t header;
+
+	// 按字节复制，结构体中的填充也和文件中的一致
+	memcpy(&header, snapshot, sizeof(hash_snapshot_header_t));
+	header.crc = 0;
+
+	return _crc32(body_crc, &header, sizeof(hash_snapshot_header_t));
+}
 
-			/* START 调整逻辑链表。上面已完成调整物理链表 */
-			// 第一个节点。
-			if (true == is_first_node) {
-				header.slots[which_slot].first_logic_node_offset = physic_offset;
-				curr_physic_node.offsets.logic_prev = curr_physic_node.offsets.logic_next = new_physic_node_offset;
-#if DEBUG_ADD_NODE
-				hash_debug("first node offset 0x%lX.", new_physic_node_offset);
-#endif
-			} else {
-				/*
-				 * 双向链表插入，curr为待插入节点
-				 * nextNode->prev = curr;
-				 * prevNode->next = curr;
-				 * currNode->next = nextNode;
-				 * currNode->prev = prevNode;
-				 */
-
-				/* START 4.1. 读取 next prev 节点操作 */
-#if DEBUG_ADD_NODE
-				hash_debug("new node 0x%lX inset behind 0x%lX, before add 0x%lX <- 0x%lX -> 0x%lX.",
-						new_physic_node_offset, prev_logic_node_offset,
-						prev_logic_node.offsets.logic_prev, prev_logic_node_offset, prev_logic_node.offsets.logic_next);
-#endif
+typedef struct {
+	off_t offset;				// 节点在原文件中的位置，导入后据此换算上层记录的位置
+	uint64_t index_key;
+	uint32_t key;
+	uint32_t len;				// 之后节点数据的长度
+} hash_snapshot_node_t;
+
+// 导出时顺序写入，缓冲区写满才落盘一次
+typedef struct {
+	int fd;
+	char* buf;
+	uint32_t len;
+	off_t offset;				// 缓冲区对应的文件位置
+	uint32_t crc;
+} hash_snapshot_writer_t;
+
+// 导入时从映射区依次取出各个部分
+typedef struct {
+	const char* cur;
+	const char* end;
+} hash_snapshot_reader_t;
+
+// 导入附加数据时交给 hash_update_aux 的回调
+typedef struct {
+	const void* data;
+	uint32_t len;
+} hash_snapshot_chunk_t;
+
+int _snapshot_flush(hash_snapshot_writer_t* writer) {
+	if (writer->len > 0 && pwrite(writer->fd, writer->buf, writer->len, writer->offset) < 0) {
+		return -1;
+	}
 
-				// prev 节点
-				if (lseek(fd, prev_logic_node_offset, SEEK_SET) < 0) {
-					hash_error("seek to %ld fail : %s.", physic_offset, strerror(errno));
-					goto close_file;
-				}
+	writer->offset += writer->len;
+	writer->len = 0;
+	return 0;
+}
 
-				if (read(fd, &prev_logic_node, sizeof(hash_node_t)) < 0) {
-					hash_error("read next_logic_node error : %s.", strerror(errno));
-					goto close_file;
-				}
+int _snapshot_write(hash_snapshot_writer_t* writer, const void* data, size_t len) {
+	const char* p = (const char*)data;
+	size_t n = 0;
 
-				// next 节点。如果prev和next相等，说明当前只有一个节点，后面会有多个这种判断
-				if (prev_logic_node_offset != (next_logic_node_offset = prev_logic_node.offsets.logic_next)) {
-					if (lseek(fd, next_logic_node_offset, SEEK_SET) < 0) {
-						hash_error("seek to %ld fail : %s.", next_logic_node_offset, strerror(errno));
-						goto close_file;
-					}
-
-					if (read(fd, &next_logic_node, sizeof(hash_node_t)) < 0) {
-						hash_error("read next_logic_node error : %s.", strerror(errno));
-						goto close_file;
-					}
-				}
-				/* END 4.1. 读取 next prev 节点操作 */
+	if (0 == len) {
+		return 0;
+	}
 
-				/* START 4.2. 重新建立节点链接 */
-				prev_logic_node.offsets.logic_next = new_physic_node_offset;
+	writer->crc = _crc32(writer->crc, data, len);
 
-				if (prev_logic_node_offset != next_logic_node_offset) {
-					next_logic_node.offsets.logic_prev = new_physic_node_offset;
-				} else {		// 在只有一个节点的情况下插入
-					prev_logic_node.offsets.logic_next = new_physic_node_offset;
-					prev_logic_node.offsets.logic_prev = new_physic_node_offset;
-				}
+	while (len > 0) {
+		if (HASH_SNAPSHOT_BUF_SIZE == writer->len && _snapshot_flush(writer) < 0) {
+			return -1;
+		}
 
-				curr_physic_node.offsets.logic_next = next_logic_node_offset;
-				curr_physic_node.offsets.logic_prev = prev_logic_node_offset;
-				/* END 4.2. 重新建立节点链接 */
+		n = HASH_SNAPSHOT_BUF_SIZE - writer->len < len ? HASH_SNAPSHOT_BUF_SIZE - writer->len : len;
+		memcpy(writer->buf + writer->len, p, n);
+		writer->len += n;
+		p += n;
+		len -= n;
+	}
 
-#if DEBUG_ADD_NODE
-				hash_debug("prevNode : 0x%lX <- (0x%lX) -> 0x%lX",
-						prev_logic_node.offsets.logic_prev, prev_logic_node_offset, prev_logic_node.offsets.logic_next);
+	return 0;
+}
 
-				hash_debug("currNode : 0x%lX <- (0x%lX) -> 0x%lX",
-						curr_physic_node.offsets.logic_prev, new_physic_node_offset, curr_physic_node.offsets.logic_next);
+// 取出接下来的 len 字节，快照不完整时返回NULL
+const void* _snapshot_read(hash_snapshot_reader_t* reader, size_t len) {
+	const char* p = reader->cur;
 
-				// 超过一个节点的情况下插入
-				if (prev_logic_node_offset != next_logic_node_offset) {
-					hash_debug("nextNode : 0x%lX <- (0x%lX) -> 0x%lX",
-							next_logic_node.offsets.logic_prev, next_logic_node_offset, next_logic_node.offsets.logic_next);
-				}
-#endif
-				/* START 4.3. 写回到文件 */
-				if (lseek(fd, prev_logic_node_offset, SEEK_SET) < 0) {
-					hash_error("seek to %ld fail : %s.", prev_logic_node_offset, strerror(errno));
-					goto close_file;
-				}
+	if ((size_t)(reader->end - reader->cur) < len) {
+		hash_error("snapshot is truncated.");
+		return NULL;
+	}
 
-				if (write(fd, &prev_logic_node, sizeof(hash_node_t)) < 0) {
-					hash_error("write prev_logic_node error : %s.", strerror(errno));
-					goto close_file;
-				}
+	reader->cur += len;
+	return p;
+}
 
-				if (prev_logic_node_offset != next_logic_node_offset) {
-					if (lseek(fd, next_logic_node_offset, SEEK_SET) < 0) {
-						hash_error("seek to %ld fail : %s.", next_logic_node_offset, strerror(errno));
-						goto close_file;
-					}
+// 按逻辑顺序导出一个哈希槽中使用中的节点，调用者已经锁住这个哈希槽
+int _export_slot(hash_handle_t* handle, uint32_t which_slot, hash_snapshot_writer_t* writer,
+		hash_readahead_t* ra, hash_node_t* node) {
+	int ret = -1;
+	uint32_t cnt = 0;
+	uint32_t visited = 0;
+	slot_info_t* slot = &handle->header.slots[which_slot];
+	off_t offset = slot->first_logic_node_offset;
+	hash_snapshot_node_t record;
 
-					if (write(fd, &next_logic_node, sizeof(hash_node_t)) < 0) {
-						hash_error("write next_logic_node error : %s.", strerror(errno));
-						goto close_file;
-					}
-				}
-				/* END 4.3. 写回到文件 */
-			}
+	memset(&record, 0, sizeof(hash_snapshot_node_t));
 
-			/* END 完成调整逻辑链表 */
+	// 空槽里留下的节点不导出；链表损坏时最多走 node_cnt + 1 个节点
+	do {
+		if (_ra_read_node(handle, ra, offset, node) < 0) {
+			hash_error("read node 0x%lX failed.", offset);
+			goto exit;
+		}
 
-			if (lseek(fd, new_physic_node_offset, SEEK_SET) < 0) {
-				hash_error("seek to %ld fail : %s.", new_physic_node_offset, strerror(errno));
-				goto close_file;
-			}
+		if (1 == node->used) {
+			record.offset = offset;
+			record.index_key = node->data.index_key;
+			record.key = node->data.key;
+			record.len = handle->header.varlen_value ?
+				_value_len(handle, node->data.value) : handle->header.node_data_value_size;
 
-			if (write(fd, &curr_physic_node, sizeof(hash_node_t)) < 0) {
-				hash_error("write curr_physic_node error : %s.", strerror(errno));
-				goto close_file;
+			if (_snapshot_write(writer, &record, sizeof(hash_snapshot_node_t)) < 0
+					|| _snapshot_write(writer, node->data.value, record.len) < 0) {
+				goto exit;
 			}
 
-			if (node_data_value_size > 0
-					&& write(fd, curr_physic_node.data.value, node_data_value_size) < 0) {
-				hash_error("write curr_physic_node.data.value error : %s.", strerror(errno));
-				goto close_file;
-			}
-			/**** 4. END 写入新节点的其他信息 ****/
-			break;
-		} else {
-			physic_offset = curr_physic_node.offsets.physic_next;
+			++cnt;
 		}
-	}  while (physic_offset != first_physic_node_offset);
 
-	/* START 保存头部信息 */
-	if (lseek(fd, sizeof(hash_header_t), SEEK_SET) < 0) {
-		hash_error("seek to %ld fail : %s.", sizeof(hash_header_t), strerror(errno));
-		goto close_file;
-	}
+		offset = node->offsets.logic_next;
+	} while (offset != slot->first_logic_node_offset && ++visited <= slot->node_cnt);
 
-	if (write(fd, header.slots, slot_cnt * sizeof(slot_info_t)) < 0) {
-		hash_error("write header.slots error : %s.", strerror(errno));
-		goto close_file;
+	if (cnt != slot->node_cnt) {
+		hash_error("slot %d should have %d nodes, but found %d.", which_slot, slot->node_cnt, cnt);
+		goto exit;
 	}
-	/* END 保存头部信息 */
 
 	ret = 0;
 
-close_file:
-	close(fd);
-
 exit:
-	safe_free(header.slots);
-	safe_free(node_data_value);
 	return ret;
 }
-#undef DEBUG_ADD_NODE
 
-#define DEBUG_DEL_NODE 0
-int _del_node_hepler(int fd, off_t curr_node_offset, uint32_t which_slot, hash_node_t *node, hash_header_t *header) {
+int hash_export_snapshot(hash_handle_t* handle, const char* snapshot_path) {
 	int ret = -1;
+	int err = 0;
+	uint32_t i = 0;
+	uint32_t locked_cnt = 0;
 	uint32_t slot_cnt = 0;
-	uint32_t node_data_value_size = 0;
-	hash_node_t prev_logic_node;
-	hash_node_t next_logic_node;
-	off_t first_logic_node_offset = 0;
-	off_t prev_logic_node_offset = 0;
-	off_t next_logic_node_offset = 0;
-	void *addr = NULL;	// 防止在memcpy中，文件中保存的上一次指针值覆盖了当前正在运行的指针
+	uint32_t aux_lens[HASH_AUX_CNT];
+	uint32_t header_data_value_size = handle->header.header_data_value_size;
+	uint32_t node_data_value_size = handle->header.node_data_value_size;
+	char* tmp_path = NULL;
+	char* aux_values[HASH_AUX_CNT];
+	void* header_data_value = NULL;
+	void* node_data_value = NULL;
+	hash_header_t* header = &handle->header;
+	hash_snapshot_header_t snapshot;
+	hash_snapshot_writer_t writer;
+	hash_readahead_t ra;
+	hash_node_t node;
 
-	slot_cnt = header->slot_cnt;
-	node_data_value_size = header->node_data_value_size;
-	first_logic_node_offset = header->slots[which_slot].first_logic_node_offset;
+	memset(aux_lens, 0, sizeof(aux_lens));
+	memset(aux_values, 0, sizeof(aux_values));
+	memset(&snapshot, 0, sizeof(hash_snapshot_header_t));
+	memset(&writer, 0, sizeof(hash_snapshot_writer_t));
+	memset(&node, 0, sizeof(hash_node_t));
 
-	node->used = 0;
-	--header->slots[which_slot].node_cnt;
+	writer.fd = -1;
+	_ra_init(handle, &ra);
 
-	/*
-	 * 双向链表删除，curr为待插入节点
-	 * nextNode->prev = prevNode;
-	 * prevNode->next = nextNode;
-	 */
-	/* START 调整逻辑链表 */
-	/* START 1. 读取 prev next 节点信息*/
-	// prev 节点
-	prev_logic_node_offset = node->offsets.logic_prev;
-	if (lseek(fd, prev_logic_node_offset, SEEK_SET) < 0) {
-		hash_error("seek to %ld fail : %s.", prev_logic_node_offset, strerror(errno));
+	if (NULL == (tmp_path = (char*)malloc(strlen(snapshot_path) + 5))
+			|| NULL == (writer.buf = (char*)malloc(HASH_SNAPSHOT_BUF_SIZE))
+			|| (header_data_value_size > 0 && NULL == (header_data_value = calloc(1, header_data_value_size)))
+			|| (node_data_value_size > 0 && NULL == (node_data_value = calloc(1, node_data_value_size)))) {
+		hash_error("malloc failed.");
 		goto exit;
 	}
 
-	if (read(fd, &prev_logic_node, sizeof(hash_node_t)) < 0) {
-		hash_error("read prev_logic_node error : %s.", strerror(errno));
-		goto exit;
-	}
+	node.data.value = node_data_value;
 
-	// next 节点。如果prev和next相等，说明当前只有一个节点，后面会有多个这种判断
-	next_logic_node_offset = node->offsets.logic_next;
-	if (lseek(fd, next_logic_node_offset, SEEK_SET) < 0) {
-		hash_error("seek to %ld fail : %s.", next_logic_node_offset, strerror(errno));
+	// 导出期间目录和所有哈希槽都不会变化，得到的是同一时刻的内容
+	if (_lock_dir(handle, F_RDLCK) < 0) {
 		goto exit;
 	}
 
-	if (read(fd, &next_logic_node, sizeof(hash_node_t)) < 0) {
-		hash_error("read next_logic_node error : %s.", strerror(errno));
-		goto exit;
-	}
-	/* END 1. 读取 prev next 节点信息*/
-	/* START 2. 修改节点链式关系 */
+	slot_cnt = header->slot_cnt;
 
-	// 仅剩 一个 节点
-	if (curr_node_offset == prev_logic_node_offset && curr_node_offset == next_logic_node_offset) {
-#if DEBUG_DEL_NODE
-		hash_debug("only 1 node 0x%lX left.", curr_node_offset);
-#endif
-		header->slots[which_slot].first_logic_node_offset = node->offsets.logic_next;
-		goto clear_node;
-	} else {
-		if (curr_node_offset == first_logic_node_offset) {	// 删除逻辑第一个节点
-#if DEBUG_DEL_NODE
-			hash_debug("delete first logic node 0x%lX, update first logic node to 0x%lX.",
-					curr_node_offset, node->offsets.logic_next);
-#endif
-			header->slots[which_slot].first_logic_node_offset = node->offsets.logic_next;
-		} else {
-#if DEBUG_DEL_NODE
-			hash_debug("delete normal node 0x%lX.", curr_node_offset);
-#endif
+	for (locked_cnt = 0; locked_cnt < slot_cnt; locked_cnt++) {
+		if (_lock_slot(handle, locked_cnt, F_RDLCK) < 0) {
+			goto unlock_slots;
 		}
+	}
 
-		// 剩两个节点
-		if (prev_logic_node_offset == next_logic_node_offset) {
-#if DEBUG_DEL_NODE
-			hash_debug("2 nodes left.");
-#endif
-			prev_logic_node.offsets.logic_prev = prev_logic_node_offset;
-			prev_logic_node.offsets.logic_next = prev_logic_node_offset;
+	if (header_data_value_size > 0) {
+		if (_lock_header_data(handle, F_RDLCK) < 0) {
+			goto unlock_slots;
 		}
-		
-		// 更多节点
-		else {
-			next_logic_node.offsets.logic_prev = prev_logic_node_offset;
-			prev_logic_node.offsets.logic_next = next_logic_node_offset;
+
+		err = _read_at(handle, _header_data_offset(handle), header_data_value, header_data_value_size);
+		_unlock_header_data(handle);
+
+		if (err < 0) {
+			hash_error("read header data error.");
+			goto unlock_slots;
 		}
 	}
 
-	/* END 2. 修改节点链式关系 */
-#if DEBUG_DEL_NODE
-	// 节点等于2时，只需看prev即可
-	hash_info("after del 0x%lX, prev = ( 0x%lX <- 0x%lX -> 0x%lX ), next = ( 0x%lX <- 0x%lX -> 0x%lX ).", curr_node_offset,
-			prev_logic_node.offsets.logic_prev, prev_logic_node_offset, prev_logic_node.offsets.logic_next,
-			next_logic_node.offsets.logic_prev, next_logic_node_offset, next_logic_node.offsets.logic_next);
-#endif
-	/* START 3. 写回到文件 */
-	if (lseek(fd, prev_logic_node_offset, SEEK_SET) < 0) {
-		hash_error("seek to %ld fail : %s.", prev_logic_node_offset, strerror(errno));
-		goto exit;
+	if (_lock_header(handle, F_RDLCK) < 0) {
+		goto unlock_slots;
 	}
 
-	if (write(fd, &prev_logic_node, sizeof(hash_node_t)) < 0) {
-		hash_error("write prev_logic_node error : %s.", strerror(errno));
-		goto exit;
-	}
+	snapshot.config.slot_cnt = header->base_slot_cnt;
+	snapshot.config.node_data_value_size = node_data_value_size;
+	snapshot.config.header_data_value_size = header_data_value_size;
+	snapshot.config.index_cap = header->index_cap;
+	snapshot.config.split_threshold = header->split_threshold;
+	snapshot.config.key_field_offset = header->key_field_offset;
+	snapshot.config.key_field_size = header->key_field_size;
+	snapshot.config.key_field_flags = header->key_field_flags;
+	snapshot.config.varlen_value = header->varlen_value;
+	snapshot.config.value_tail_offset = header->value_tail_offset;
+	snapshot.config.rank_index = header->rank_index;
+
+	for (i = 0; i < HASH_AUX_CNT; i++) {
+		if (0 == (aux_lens[i] = header->aux[i].len)) {
+			continue;
+		}
 
-	// 剩余节点大于 2 时
-	if (prev_logic_node_offset != next_logic_node_offset) {
-		if (lseek(fd, next_logic_node_offset, SEEK_SET) < 0) {
-			hash_error("seek to %ld fail : %s.", next_logic_node_offset, strerror(errno));
-			goto exit;
+		if (NULL == (aux_values[i] = (char*)malloc(aux_lens[i]))) {
+			hash_error("malloc failed.");
+			break;
 		}
 
-		if (write(fd, &next_logic_node, sizeof(hash_node_t)) < 0) {
-			hash_error("write next_logic_node error : %s.", strerror(errno));
-			goto exit;
+		if (_read_tail_at(handle, header->aux[i].offset, aux_values[i], aux_lens[i]) < 0) {
+			hash_error("read aux %d error.", i);
+			break;
 		}
 	}
-	/* END 3. 写回到文件 */
-	/* END 完成调整逻辑链表 */
 
-clear_node:
-	/* START 清空当前节点 */
-	// 移到节点起始位置
-	if (lseek(fd, curr_node_offset, SEEK_SET) < 0) {
-		hash_error("seek back to %ld fail : %s.", curr_node_offset, strerror(errno));
-		goto exit;
+	_unlock_header(handle);
+
+	if (i < HASH_AUX_CNT) {
+		goto unlock_slots;
 	}
 
-	addr = node->data.value;
-	node->used = 0;
-	memset(&(node->data), 0, sizeof(hash_node_data_t));
-	if (write(fd, node, sizeof(hash_node_t)) < 0) {
-		hash_error("del node error : %s.", strerror(errno));
-		goto exit;
+	// 先写到临时文件，完整写好后再换掉旧快照，中途断电不会留下半个快照
+	sprintf(tmp_path, "%s.tmp", snapshot_path);
+
+	if ((writer.fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+		hash_error("create file %s fail : %s.", tmp_path, strerror(errno));
+		goto unlock_slots;
 	}
 
-	node->data.value = addr;
-	memset(node->data.value, 0, node_data_value_size);
-	if (node_data_value_size > 0
-			&& write(fd, node->data.value, node_data_value_size) < 0) {
-		hash_error("del node.data.value error : %s.", strerror(errno));
-		goto exit;
+	writer.offset = sizeof(hash_snapshot_header_t);
+
+	for (i = 0; i < slot_cnt; i++) {
+		snapshot.node_cnt += header->slots[i].node_cnt;
+
+		if (_snapshot_write(&writer, &header->slots[i].node_cnt, sizeof(uint32_t)) < 0) {
+			goto unlock_slots;
+		}
 	}
-	/* END 清空当前节点 */
 
-	/* START 保存头部信息 */
-	if (lseek(fd, sizeof(hash_header_t), SEEK_SET) < 0) {
-		hash_error("seek to %ld fail : %s.", sizeof(hash_header_t), strerror(errno));
-		goto exit;
+	if (_snapshot_write(&writer, header_data_value, header_data_value_size) < 0
+			|| _snapshot_write(&writer, aux_lens, sizeof(aux_lens)) < 0) {
+		goto unlock_slots;
 	}
 
-	if (write(fd, header->slots, slot_cnt * sizeof(slot_info_t)) < 0) {
-		hash_error("write header.slots error : %s.", strerror(errno));
-		goto exit;
+	for (i = 0; i < HASH_AUX_CNT; i++) {
+		if (_snapshot_write(&writer, aux_values[i], aux_lens[i]) < 0) {
+			goto unlock_slots;
+		}
 	}
-	/* END 保存头部信息 */
 
-	ret = 0;
+	for (i = 0; i < slot_cnt; i++) {
+		if (_export_slot(handle, i, &writer, &ra, &node) < 0) {
+			goto unlock_slots;
+		}
+	}
 
-exit:
-	return ret;
-}
-#undef DEBUG_DEL_NODE
+	if (_snapshot_flush(&writer) < 0) {
+		goto unlock_slots;
+	}
 
-int del_node(const char* path, hash_node_data_t* input_node_data,
-		bool (*cb)(hash_node_data_t*, hash_node_data_t*)) {
-	int ret = -1;
-	int fd = 0;
-	uint32_t which_slot = 0;
-	off_t offset = 0;
-	off_t first_logic_node_offset = 0;
-	hash_header_t header;
-	slot_info_t* slots = NULL;
-	hash_node_t node;
-	void* node_data_value = NULL;
-	uint32_t slot_cnt = 0;
-	uint32_t node_data_value_size = 0;
+	snapshot.magic = HASH_SNAPSHOT_MAGIC;
+	snapshot.version = HASH_SNAPSHOT_VERSION;
+	snapshot.slot_cnt = slot_cnt;
+	snapshot.body_size = writer.offset - sizeof(hash_snapshot_header_t);
+	snapshot.crc = _snapshot_crc(&snapshot, writer.crc);
 
-	memset(&header, 0, sizeof(hash_header_t));
-	memset(&node, 0, sizeof(hash_node_t));
+	if (pwrite(writer.fd, &snapshot, sizeof(hash_snapshot_header_t), 0) < 0) {
+		goto unlock_slots;
+	}
 
-	if ((fd = open(path, O_RDWR)) < 0) {
-		hash_error("open file %s fail : %s.", path, strerror(errno));
-		goto exit;
+	if (fsync(writer.fd) < 0) {
+		hash_error("sync %s error : %s.", tmp_path, strerror(errno));
+		goto unlock_slots;
 	}
 
-	// 先读取头部的哈希信息
-	if (read(fd, &header, sizeof(hash_header_t)) < 0) {
-		hash_error("read header error : %s.", strerror(errno));
-		goto close_file;
+	if (rename(tmp_path, snapshot_path) < 0) {
+		hash_error("rename %s to %s error : %s.", tmp_path, snapshot_path, strerror(errno));
+		goto unlock_slots;
+	}
+
+	close(writer.fd);
+	writer.fd = -1;
+
+	hash_info("export %s to %s, %d slots, %d nodes, %lu bytes.", handle->path, snapshot_path,
+			slot_cnt, snapshot.node_cnt, writer.offset);
+	ret = 0;
+
+unlock_slots:
+	while (locked_cnt > 0) {
+		_unlock_slot(handle, --locked_cnt);
 	}
 
-	slot_cnt = header.slot_cnt;
-	node_data_value_size = header.node_data_value_size;
+	_unlock_dir(handle);
 
-	if (NULL == (slots = (void*)calloc(slot_cnt, sizeof(slot_info_t)))) {
-		hash_error("calloc failed.");
-		goto exit;
+exit:
+	if (writer.fd >= 0) {
+		close(writer.fd);
+		unlink(tmp_path);
 	}
 
-	if (read(fd, slots, slot_cnt * sizeof(slot_info_t)) < 0) {
-		hash_error("read slot_info error : %s.", strerror(errno));
-		goto close_file;
+	for (i = 0; i < HASH_AUX_CNT; i++) {
+		safe_free(aux_values[i]);
 	}
 
-	header.slots = slots;
+	_ra_free(&ra);
+	safe_free(tmp_path);
+	safe_free(writer.buf);
+	safe_free(header_data_value);
+	safe_free(node_data_value);
+	return ret;
+}
 
-	which_slot = input_node_data->key % slot_cnt;
-	first_logic_node_offset = header.slots[which_slot].first_logic_node_offset;
+int export_snapshot(const char* path, const char* snapshot_path) {
+	int ret = -1;
+	hash_handle_t* handle = NULL;
 
-	if (node_data_value_size > 0
-			&& NULL == (node_data_value = (void*)calloc(1, node_data_value_size))) {
-		hash_error("calloc failed.");
+	if (NULL == (handle = hash_open(path, HASH_OPEN_RDONLY))) {
 		goto exit;
 	}
 
-	offset = first_logic_node_offset;
-	do {
-		if (lseek(fd, offset, SEEK_SET) < 0) {
-			hash_error("seek to %ld fail : %s.", offset, strerror(errno));
-			goto close_file;
-		}
-
-		if (read(fd, &node, sizeof(hash_node_t)) < 0) {
-			hash_error("read node failed : %s.", strerror(errno));
-			goto close_file;
-		}
+	ret = hash_export_snapshot(handle, snapshot_path);
 
-		if (node_data_value_size > 0
-				&& read(fd, node_data_value, node_data_value_size) < 0) {
-			hash_error("read node_data_value failed : %s.", strerror(errno));
-			goto close_file;
-		}
+	hash_close(handle);
 
-		// 建立关联，方便后面使用。之后不要破坏这种关联（比如read调用）
-		node.data.value = node_data_value;
+exit:
+	return ret;
+}
 
-		// 找到了节点
-		if (true == cb(&(node.data), input_node_data)) {
-			if ((ret = _del_node_hepler(fd, offset, which_slot, &node, &header)) < 0) {
-				goto close_file;
-			}
-			break;
-		}
+int _snapshot_aux_cb(void* buf, uint32_t len, void* input_arg) {
+	hash_snapshot_chunk_t* chunk = (hash_snapshot_chunk_t*)input_arg;
 
-		offset = node.offsets.logic_next;
-	} while (offset != first_logic_node_offset);
+	memcpy(buf, chunk->data, chunk->len);
+	return chunk->len;
+}
 
-close_file:
-	close(fd);
+int _offset_pair_cmp(const void* a, const void* b) {
+	off_t x = ((const hash_offset_pair_t*)a)->old_offset;
+	off_t y = ((const hash_offset_pair_t*)b)->old_offset;
 
-exit:
-	safe_free(slots);
-	safe_free(node_data_value);
-	return ret;
+	return x < y ? -1 : (x > y ? 1 : 0);
 }
 
-// which_slot小于slot_cnt则遍历指定哈希槽，如果大于slot_cnt则遍历所有哈希槽
-uint8_t traverse_nodes(const char* list_path, traverse_by_what_t by_what,
-		uint32_t which_slot, printable_t printable, void* input_arg,
-		traverse_action_t (*cb)(hash_node_data_t* file_node_data, void* input_arg)) {
-	traverse_action_t action = TRAVERSE_ACTION_DO_NOTHING;
-	uint8_t i = 0;
-	int fd = 0;
-	off_t offset = 0;
-	off_t first_node_offset = 0;
-	off_t first_physic_node_offset = 0;
-	off_t first_logic_node_offset = 0;
-	off_t prev_offset = 0;
-	off_t next_offset = 0;
-	hash_header_t header;
-	slot_info_t* slots = NULL;
-	hash_node_t node;
-	void* node_data_value = NULL;
-	uint32_t slot_cnt = 0;
-	uint32_t header_data_value_size = 0;
-	uint32_t node_data_value_size = 0;
-	uint8_t break_or_not = 0;
-	static uint8_t s_first_node = 1;
-
-	memset(&header, 0, sizeof(hash_header_t));
-	memset(&node, 0, sizeof(hash_node_t));
+off_t hash_snapshot_map_offset(const hash_snapshot_map_t* map, off_t old_offset) {
+	hash_offset_pair_t key;
+	hash_offset_pair_t* pair = NULL;
 
-	if ((fd = open(list_path, O_RDWR)) < 0) {
-		hash_error("open %s fail : %s.", list_path, strerror(errno));
-		goto exit;
+	if (0 == old_offset || 0 == map->cnt) {
+		return 0;
 	}
 
-	// 先读取头部的哈希信息
-	if (read(fd, &header, sizeof(hash_header_t)) < 0) {
-		hash_error("read header error : %s.", strerror(errno));
-		goto close_file;
-	}
+	key.old_offset = old_offset;
+	pair = (hash_offset_pair_t*)bsearch(&key, map->pairs, map->cnt, sizeof(hash_offset_pair_t), _offset_pair_cmp);
 
-	slot_cnt = header.slot_cnt;
-	header_data_value_size = header.header_data_value_size;
-	node_data_value_size = header.node_data_value_size;
+	return NULL == pair ? 0 : pair->new_offset;
+}
 
-	if (NULL == (slots = (void*)calloc(slot_cnt, sizeof(slot_info_t)))) {
-		hash_error("calloc failed.");
-		goto exit;
-	}
+/*
+ * 导入一个哈希槽的 cnt 个节点：槽是空的，所有节点在末尾连续分配、一次写入
+ * 新旧位置记到 pairs 中，values 是变长存储时展开节点数据的缓冲区
+ */
+int _import_slot(hash_handle_t* handle, uint32_t which_slot, uint32_t cnt, hash_snapshot_reader_t* reader,
+		hash_node_data_t* node_datas, char* values, off_t* offsets, hash_offset_pair_t* pairs) {
+	int ret = -1;
+	uint32_t i = 0;
+	uint32_t node_data_value_size = handle->header.node_data_value_size;
+	bool varlen = handle->header.varlen_value;
+	const void* p = NULL;
+	hash_snapshot_node_t record;
 
-	if (read(fd, slots, slot_cnt * sizeof(slot_info_t)) < 0) {
-		hash_error("read slot_info error : %s.", strerror(errno));
-		goto close_file;
-	}
+	for (i = 0; i < cnt; i++) {
+		if (NULL == (p = _snapshot_read(reader, sizeof(hash_snapshot_node_t)))) {
+			goto exit;
+		}
 
-	header.slots = slots;
+		memcpy(&record, p, sizeof(hash_snapshot_node_t));
 
-	if (node_data_value_size > 0
-			&& NULL == (node_data_value = (void*)calloc(1, node_data_value_size))) {
-		hash_error("calloc failed.");
-		goto exit;
-	}
+		if (varlen ? record.len > node_data_value_size : record.len != node_data_value_size) {
+			hash_error("node %d in slot %d has bad length %d.", i, which_slot, record.len);
+			goto exit;
+		}
 
-	for (i = 0; i < slot_cnt; i++) {
-		s_first_node = 1;
+		if (NULL == (p = _snapshot_read(reader, record.len))) {
+			goto exit;
+		}
 
-		// TODO: hash_key和i的关系不一定可以直接比较，后续版本需要完善
-		if (which_slot < slot_cnt && i != (which_slot % slot_cnt)) {
-			continue;
+		// 定长存储时直接使用映射区中的数据
+		if (varlen) {
+			memset(values + (size_t)i * node_data_value_size, 0, node_data_value_size);
+			memcpy(values + (size_t)i * node_data_value_size, p, record.len);
+			p = values + (size_t)i * node_data_value_size;
 		}
 
-		first_physic_node_offset = sizeof(hash_header_t) + slot_cnt * sizeof(slot_info_t) + header_data_value_size\
-			 + i * (sizeof(hash_node_t) + node_data_value_size);
-		first_logic_node_offset = header.slots[i].first_logic_node_offset;
+		node_datas[i].key = record.key;
+		node_datas[i].index_key = record.index_key;
+		node_datas[i].value = (void*)p;
+		pairs[i].old_offset = record.offset;
 
-		first_node_offset = TRAVERSE_BY_LOGIC == by_what ? first_logic_node_offset : first_physic_node_offset;
+		_fill_key(handle, &node_datas[i]);
 
-		if (WITH_PRINT == printable) { printf("[%d] (%d) %s  ", i, header.slots[i].node_cnt,
-				TRAVERSE_BY_LOGIC == by_what ? " \e[7;32mLOGIC\e[0m" : "\e[7;34mPHYSIC\e[0m"); }
+		if (which_slot != _slot_of(handle, node_datas[i].key)) {
+			hash_error("node %d (key %d) is not in slot %d.", i, node_datas[i].key, which_slot);
+			goto exit;
+		}
+	}
 
-		offset = first_node_offset;
-		do {
-			if (lseek(fd, offset, SEEK_SET) < 0) {
-				hash_error("seek to %ld fail : %s.", offset, strerror(errno));
-				goto close_file;
-			}
+	if (_lock_dir(handle, F_RDLCK) < 0) {
+		goto exit;
+	}
 
-			if (read(fd, &node, sizeof(hash_node_t)) < 0) {
-				hash_error("read node failed : %s.", strerror(errno));
-				goto close_file;
-			}
+	if (_lock_slot(handle, which_slot, F_WRLCK) < 0) {
+		_unlock_dir(handle);
+		goto exit;
+	}
 
-			if (node_data_value_size > 0
-					&& read(fd, node_data_value, node_data_value_size) < 0) {
-				hash_error("read node_data_value failed : %s.", strerror(errno));
-				goto close_file;
-			}
+	ret = _insert_nodes(handle, NULL, node_datas, cnt, NULL, offsets);
 
-			node.data.value = node_data_value;
+	_unlock_slot(handle, which_slot);
+	_unlock_dir(handle);
 
-			first_logic_node_offset = header.slots[i].first_logic_node_offset;
+	for (i = 0; 0 == ret && i < cnt; i++) {
+		pairs[i].new_offset = offsets[i];
+	}
 
-			// 遍历过程中的删除操作有可能会改变第 一个 逻辑节点的位置
-			if (TRAVERSE_BY_LOGIC == by_what) { first_node_offset = first_logic_node_offset; }
+exit:
+	return ret;
+}
 
-			prev_offset = TRAVERSE_BY_LOGIC == by_what ? node.offsets.logic_prev : node.offsets.physic_prev;
-			next_offset = TRAVERSE_BY_LOGIC == by_what ? node.offsets.logic_next : node.offsets.physic_next;
+int hash_import_snapshot(const char* snapshot_path, const char* path,
+		int (*cb)(hash_handle_t* handle, const hash_snapshot_map_t* map, void* input_arg), void* input_arg) {
+	int ret = -1;
+	int err = 0;
+	int fd = -1;
+	bool created = false;
+	uint32_t i = 0;
+	uint32_t max_cnt = 0;
+	uint32_t node_cnt = 0;
+	uint32_t aux_lens[HASH_AUX_CNT];
+	uint32_t* slot_node_cnts = NULL;
+	char* addr = MAP_FAILED;
+	char* tmp_path = NULL;
+	char* values = NULL;
+	const void* p = NULL;
+	off_t* offsets = NULL;
+	struct stat st;
+	struct stat file_st;
+	hash_handle_t* handle = NULL;
+	hash_node_data_t* node_datas = NULL;
+	hash_header_data_t header_data;
+	hash_config_t config;
+	hash_snapshot_header_t snapshot;
+	hash_snapshot_reader_t reader;
+	hash_snapshot_chunk_t chunk;
+	hash_snapshot_map_t map;
+
+	memset(&map, 0, sizeof(hash_snapshot_map_t));
+
+	if ((fd = open(snapshot_path, O_RDONLY)) < 0) {
+		hash_error("open %s fail : %s.", snapshot_path, strerror(errno));
+		goto exit;
+	}
 
-			if (s_first_node) {
-				s_first_node = 0;
-			} else {
-				if (WITH_PRINT == printable) { printf(" --- "); }
-			}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(hash_snapshot_header_t)) {
+		hash_error("%s is not a snapshot.", snapshot_path);
+		goto exit;
+	}
 
-			if (WITH_PRINT == printable) { printf("<0x%lX> ( 0x%lX : ", prev_offset, offset); }
+	// 整个快照映射到内存，之后只是顺序地从映射区取数据
+	if (MAP_FAILED == (addr = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))) {
+		hash_error("mmap %s error : %s.", snapshot_path, strerror(errno));
+		goto exit;
+	}
 
-			if (0 == node.used) {
-				if (WITH_PRINT == printable) { printf("* ) <0x%lX>", next_offset); }
-				goto next_loop;
-			}
+	memcpy(&snapshot, addr, sizeof(hash_snapshot_header_t));
 
-			action = cb(&(node.data), input_arg);
+	if (HASH_SNAPSHOT_MAGIC != snapshot.magic || HASH_SNAPSHOT_VERSION != snapshot.version
+			|| snapshot.body_size != (uint64_t)st.st_size - sizeof(hash_snapshot_header_t)) {
+		hash_error("%s is not a snapshot of version %d.", snapshot_path, HASH_SNAPSHOT_VERSION);
+		goto exit;
+	}
 
-			if (WITH_PRINT == printable) { printf(" ) <0x%lX>", next_offset); }
+	if (snapshot.crc != _snapshot_crc(&snapshot, _crc32(0, addr + sizeof(hash_snapshot_header_t), snapshot.body_size))) {
+		hash_error("%s is corrupted, crc mismatch.", snapshot_path);
+		goto exit;
+	}
 
-			if (TRAVERSE_ACTION_UPDATE & action) {
-				// 跳回到节点头部
-				if (lseek(fd, offset, SEEK_SET) < 0) {
-					hash_error("seek to %ld fail : %s.", offset, strerror(errno));
-					goto close_file;
-				}
+	config = snapshot.config;
 
-				if (write(fd, &node, sizeof(hash_node_t)) < 0) {
-					hash_error("write node error : %s.", strerror(errno));
-					goto close_file;
-				}
+	if (snapshot.slot_cnt < config.slot_cnt || snapshot.slot_cnt > HASH_MAX_SLOT_CNT) {
+		hash_error("bad slot_cnt %d (base %d).", snapshot.slot_cnt, config.slot_cnt);
+		goto exit;
+	}
 
-				if (node_data_value_size > 0
-						&& write(fd, node.data.value, node_data_value_size) < 0) {
-					hash_error("write node.data.value error : %s.", strerror(errno));
-					goto close_file;
-				}
-			}
+	reader.cur = addr + sizeof(hash_snapshot_header_t);
+	reader.end = addr + st.st_size;
 
-			if (TRAVERSE_ACTION_DELETE & action) {
-			// 跳回到节点头部
-				if (lseek(fd, offset, SEEK_SET) < 0) {
-					hash_error("seek to %ld fail : %s.", offset, strerror(errno));
-					goto close_file;
-				}
-				_del_node_hepler(fd, offset, i, &node, &header);
-			}
+	if (NULL == (slot_node_cnts = (uint32_t*)malloc(snapshot.slot_cnt * sizeof(uint32_t)))
+			|| NULL == (tmp_path = (char*)malloc(strlen(path) + 5))
+			|| NULL == (map.pairs = (hash_offset_pair_t*)malloc(((size_t)snapshot.node_cnt + 1) * sizeof(hash_offset_pair_t)))) {
+		hash_error("malloc failed.");
+		goto exit;
+	}
 
-			if (TRAVERSE_ACTION_BREAK & action) {
-				break_or_not = 1;
-				goto close_file;
-			}
+	if (NULL == (p = _snapshot_read(&reader, snapshot.slot_cnt * sizeof(uint32_t)))) {
+		goto exit;
+	}
 
-next_loop:
-			offset = next_offset;
-		} while (offset != first_node_offset);
+	memcpy(slot_node_cnts, p, snapshot.slot_cnt * sizeof(uint32_t));
 
-		if (WITH_PRINT == printable) { printf("\n"); }
+	for (i = 0; i < snapshot.slot_cnt; i++) {
+		node_cnt += slot_node_cnts[i];
+		max_cnt = slot_node_cnts[i] > max_cnt ? slot_node_cnts[i] : max_cnt;
 	}
 
-close_file:
-	close(fd);
+	if (node_cnt != snapshot.node_cnt) {
+		hash_error("slots have %d nodes in total, expect %d.", node_cnt, snapshot.node_cnt);
+		goto exit;
+	}
 
-exit:
-	safe_free(slots);
-	safe_free(node_data_value);
-	return break_or_not;
-}
+	if (NULL == (node_datas = (hash_node_data_t*)calloc(max_cnt + 1, sizeof(hash_node_data_t)))
+			|| NULL == (offsets = (off_t*)calloc(max_cnt + 1, sizeof(off_t)))
+			|| (config.varlen_value && NULL == (values = (char*)malloc((size_t)max_cnt * config.node_data_value_size + 1)))) {
+		hash_error("malloc failed.");
+		goto exit;
+	}
 
-int init_hash_engine(const char* path, init_method_t rebuild,
-		int slot_cnt, int node_data_value_size, int header_data_value_size) {
-	int ret = -1;
-	int fd = 0;
-	uint32_t i = 0;
-	uint8_t file_exist = 0;
-	hash_header_t header;
-	slot_info_t* slots = NULL;
-	void* header_data_value = NULL;
-	hash_node_t node;
-	void* node_data_value = NULL;
-	off_t offset = 0;
+	// 在临时文件中建好再换掉旧文件，导入失败时旧文件不受影响
+	sprintf(tmp_path, "%s.tmp", path);
+	created = true;
 
-	hash_info("path = %s, rebuild = %d, "
-			"slot_cnt = %d, node_data_value_size = %d, header_data_value_size = %d.",
-			path, rebuild, slot_cnt, node_data_value_size, header_data_value_size);
+	// 导入过程中不自动分裂，哈希槽个数和导出时一致，最后再恢复阈值
+	config.split_threshold = 0;
 
-	memset(&header, 0, sizeof(hash_header_t));
-	memset(&node, 0, sizeof(hash_node_t));
+	if (init_hash_engine_ex(tmp_path, FORCE_INIT, &config) < 0) {
+		goto exit;
+	}
 
-	if (access(path, F_OK) < 0) {
-		hash_debug("%s not exist.", path);
-		file_exist = 0;
-	} else {
-		file_exist = 1;
+	// 临时文件只有自己在用，不加多进程锁
+	if (NULL == (handle = hash_open(tmp_path, HASH_OPEN_RDWR | HASH_OPEN_NOLOCK))) {
+		goto exit;
 	}
 
-	if (1 == file_exist && 1 == rebuild) {
-		if (unlink(path) < 0) {
-			hash_error("delete '%s' error : %s.", path, strerror(errno));
-			goto exit;
-		} else {
-			hash_info("delete old hash file '%s' success.", path);
-			file_exist = 0;
-		}
+	if (snapshot.slot_cnt > config.slot_cnt
+			&& hash_split_slots(handle, snapshot.slot_cnt - config.slot_cnt) != (int)snapshot.slot_cnt) {
+		hash_error("split to %d slots failed.", snapshot.slot_cnt);
+		goto exit;
 	}
 
-	if (0 == file_exist) {
-		if ((fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
-			hash_error("create file %s fail : %s.", path, strerror(errno));
+	if (config.header_data_value_size > 0) {
+		if (NULL == (p = _snapshot_read(&reader, config.header_data_value_size))) {
 			goto exit;
 		}
 
-		// 先写入头部信息
-		if (NULL == (slots = (void*)calloc(slot_cnt, sizeof(slot_info_t)))) {
-			hash_error("calloc failed.");
+		header_data.value = (void*)p;
+
+		if (hash_set_header_data(handle, &header_data) < 0) {
 			goto exit;
 		}
+	}
 
-		if (header_data_value_size > 0
-				&& NULL == (header_data_value = (void*)calloc(1, header_data_value_size))) {
-			hash_error("calloc failed.");
+	if (NULL == (p = _snapshot_read(&reader, sizeof(aux_lens)))) {
+		goto exit;
+	}
+
+	memcpy(aux_lens, p, sizeof(aux_lens));
+
+	for (i = 0; i < HASH_AUX_CNT; i++) {
+		if (0 == aux_lens[i]) {
+			continue;
+		}
+
+		if (NULL == (chunk.data = _snapshot_read(&reader, aux_lens[i]))) {
 			goto exit;
 		}
 
-		header.slot_cnt = slot_cnt;
-		header.header_data_value_size = header_data_value_size;
-		header.node_data_value_size = node_data_value_size;
-		header.slots = slots;
-		header.data.value = header_data_value;
+		chunk.len = aux_lens[i];
 
-		if (node_data_value_size > 0
-				&& NULL == (node_data_value = (void*)calloc(1, node_data_value_size))) {
-			hash_error("calloc failed.");
-			goto close_file;
+		if (hash_update_aux(handle, i, chunk.len, _snapshot_aux_cb, &chunk) < 0) {
+			goto exit;
 		}
+	}
 
-		node.data.value = node_data_value;
+	for (i = 0, node_cnt = 0; i < snapshot.slot_cnt; i++) {
+		if (slot_node_cnts[i] > 0 && _import_slot(handle, i, slot_node_cnts[i], &reader,
+					node_datas, values, offsets, map.pairs + node_cnt) < 0) {
+			goto exit;
+		}
 
-		for (i = 0; i < slot_cnt; i++) {
-			offset = sizeof(hash_header_t) + slot_cnt * sizeof(slot_info_t) + header_data_value_size\
-				 + i * (sizeof(hash_node_t) + node_data_value_size);
-			node.offsets.physic_prev = node.offsets.physic_next = offset;
-			node.offsets.logic_prev = node.offsets.logic_next = offset;
+		node_cnt += slot_node_cnts[i];
+	}
 
-			header.slots[i].first_logic_node_offset = offset;
+	if (reader.cur != reader.end) {
+		hash_error("%ld bytes left in %s.", reader.end - reader.cur, snapshot_path);
+		goto exit;
+	}
 
-			if (lseek(fd, offset, SEEK_SET) < 0) {
-				hash_error("seek to %ld fail : %s.", offset, strerror(errno));
-				goto close_file;
-			}
+	map.cnt = node_cnt;
+	qsort(map.pairs, map.cnt, sizeof(hash_offset_pair_t), _offset_pair_cmp);
 
-			if (write(fd, &node, sizeof(hash_node_t)) < 0) {
-				hash_error("init node error : %s.", strerror(errno));
-				goto close_file;
-			}
+	if (NULL != cb && cb(handle, &map, input_arg) < 0) {
+		hash_error("remap offsets failed.");
+		goto exit;
+	}
 
-			if (node_data_value_size > 0
-					&& write(fd, node.data.value, node_data_value_size) < 0) {
-				hash_error("init node.data.value error : %s.", strerror(errno));
-				goto close_file;
-			}
+	if (snapshot.config.split_threshold > 0) {
+		if (_lock_dir(handle, F_WRLCK) < 0) {
+			goto exit;
 		}
 
-		if (lseek(fd, 0, SEEK_SET) < 0) {
-			hash_error("seek to head fail : %s.", strerror(errno));
-			goto close_file;
+		if (_lock_header(handle, F_WRLCK) < 0) {
+			_unlock_dir(handle);
+			goto exit;
 		}
 
-		if (write(fd, &header, sizeof(hash_header_t)) < 0) {
-			hash_error("write header error : %s.", strerror(errno));
-			goto close_file;
-		}
+		handle->header.split_threshold = snapshot.config.split_threshold;
+		err = _save_header(handle);
 
-		if (write(fd, header.slots, slot_cnt * sizeof(slot_info_t)) < 0) {
-			hash_error("write header.slots error : %s.", strerror(errno));
-			goto close_file;
-		}
+		_unlock_header(handle);
+		_unlock_dir(handle);
 
-		if (header_data_value_size > 0
-				&& write(fd, header.data.value, header_data_value_size) < 0) {
-			hash_error("write header.data.value error : %s.", strerror(errno));
-			goto close_file;
+		if (err < 0) {
+			goto exit;
 		}
 	}
 
-	ret = 0;
+	// 末尾的数据块只写了实际长度，文件补齐到 file_size，只读句柄映射整个数据块时不会越界
+	if (fstat(handle->fd, &file_st) < 0
+			|| (file_st.st_size < handle->header.file_size && ftruncate(handle->fd, handle->header.file_size) < 0)) {
+		hash_error("grow %s to %ld bytes fail : %s.", tmp_path, handle->header.file_size, strerror(errno));
+		goto exit;
+	}
 
-close_file:
-	close(fd);
+	if (fsync(handle->fd) < 0) {
+		hash_error("sync %s error : %s.", tmp_path, strerror(errno));
+		goto exit;
+	}
+
+	hash_close(handle);
+	handle = NULL;
+
+	if (rename(tmp_path, path) < 0) {
+		hash_error("rename %s to %s error : %s.", tmp_path, path, strerror(errno));
+		goto exit;
+	}
+
+	hash_info("import %s to %s, %d slots, %d nodes.", snapshot_path, path, snapshot.slot_cnt, node_cnt);
+	ret = 0;
 
 exit:
-	safe_free(slots);
-	safe_free(header_data_value);
-	safe_free(node_data_value);
+	if (NULL != handle) {
+		hash_close(handle);
+	}
+
+	if (0 != ret && created) {
+		unlink(tmp_path);
+	}
+
+	if (MAP_FAILED != addr) {
+		munmap(addr, st.st_size);
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	safe_free(slot_node_cnts);
+	safe_free(tmp_path);
+	safe_free(values);
+	safe_free(offsets);
+	safe_free(node_datas);
+	safe_free(map.pairs);
 	return ret;
 }
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "hash_log.h"
+
+#define HASH_LOG_IDLE_MIN_US 100		// 缓冲区为空时后台线程的休眠时间，逐次翻倍
+#define HASH_LOG_IDLE_MAX_US 10000
+
+// 定长记录，seq 用于生产者和消费者之间的同步：
+// seq == pos 表示空闲可写，seq == pos + 1 表示已写好可读
+typedef struct {
+	uint32_t seq;
+	uint8_t level;
+	uint32_t line;
+	const char* module;
+	const char* func;
+	char msg[HASH_LOG_MSG_SIZE];
+} hash_log_record_t;
+
+static hash_log_record_t s_records[HASH_LOG_RING_SIZE];
+static uint32_t s_enqueue_pos;		// 生产者之间通过 CAS 竞争
+static uint32_t s_dequeue_pos;		// 只在持有 s_drain_mutex 时访问
+static uint64_t s_dropped;
+static uint64_t s_reported_dropped;	// 已经提示过的丢弃条数
+
+static pthread_once_t s_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t s_drain_mutex = PTHREAD_MUTEX_INITIALIZER;	// 后台线程和 hash_log_flush 都会取日志
+static bool s_started = false;		// 后台线程在第一次写日志时启动
+static bool s_stopped = false;		// 进程退出时停止后台线程，之后的日志同步输出
+static pthread_t s_thread;
+
+static const char* s_level_names[] = { "DBUG", "INFO", "WARN", "EROR" };
+static const char* s_level_colors[] = { "\e[0m", "\e[0;32m", "\e[0;33m", "\e[0;31m" };
+
+static void _reset_ring() {
+	uint32_t i = 0;
+
+	for (i = 0; i < HASH_LOG_RING_SIZE; i++) {
+		s_records[i].seq = i;
+	}
+
+	s_enqueue_pos = 0;
+	s_dequeue_pos = 0;
+}
+
+static void _print(uint8_t level, const char* module, const char* func, uint32_t line, const char* msg) {
+	printf("%s[%s_%s] [%s %u] : %s\e[0m\n", s_level_colors[level], module, s_level_names[level], func, line, msg);
+}
+
+// 取出缓冲区中已写好的全部记录，调用者持有 s_drain_mutex
+static uint32_t _drain() {
+	uint32_t cnt = 0;
+	uint64_t dropped = 0;
+	hash_log_record_t* record = NULL;
+
+	while (true) {
+		record = &s_records[s_dequeue_pos & (HASH_LOG_RING_SIZE - 1)];
+
+		if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != s_dequeue_pos + 1) {
+			break;
+		}
+
+		_print(record->level, record->module, record->func, record->line, record->msg);
+
+		__atomic_store_n(&record->seq, s_dequeue_pos + HASH_LOG_RING_SIZE, __ATOMIC_RELEASE);
+		++s_dequeue_pos;
+		++cnt;
+	}
+
+	dropped = __atomic_load_n(&s_dropped, __ATOMIC_RELAXED);
+	if (dropped != s_reported_dropped) {
+		printf("\e[0;33m[HASH_LOG_WARN] : %lu records dropped, ring buffer full\e[0m\n", dropped - s_reported_dropped);
+		s_reported_dropped = dropped;
+		++cnt;
+	}
+
+	if (cnt > 0) {
+		fflush(stdout);
+	}
+
+	return cnt;
+}
+
+static void* _drain_thread(void* arg) {
+	uint32_t idle_us = HASH_LOG_IDLE_MIN_US;
+	uint32_t cnt = 0;
+
+	while (!__atomic_load_n(&s_stopped, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&s_drain_mutex);
+		cnt = _drain();
+		pthread_mutex_unlock(&s_drain_mutex);
+
+		if (cnt > 0) {
+			idle_us = HASH_LOG_IDLE_MIN_US;
+		} else {
+			usleep(idle_us);
+			if (idle_us < HASH_LOG_IDLE_MAX_US) { idle_us <<= 1; }
+		}
+	}
+
+	return NULL;
+}
+
+static void _start_thread() {
+	bool expected = false;
+
+	if (__atomic_load_n(&s_started, __ATOMIC_RELAXED)
+			|| !__atomic_compare_exchange_n(&s_started, &expected, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	// 进程已经在退出，不再启动线程
+	pthread_mutex_lock(&s_drain_mutex);
+
+	if (!__atomic_load_n(&s_stopped, __ATOMIC_ACQUIRE) && 0 != pthread_create(&s_thread, NULL, _drain_thread, NULL)) {
+		__atomic_store_n(&s_stopped, true, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&s_drain_mutex);
+}
+
+// 进程退出时由 atexit 调用：先停下后台线程并等它退出，再由当前线程输出剩下的日志，stdout 只有一个使用者
+static void _stop_thread() {
+	bool started = false;
+
+	pthread_mutex_lock(&s_drain_mutex);
+	__atomic_store_n(&s_stopped, true, __ATOMIC_RELEASE);
+	started = __atomic_load_n(&s_started, __ATOMIC_ACQUIRE);
+	pthread_mutex_unlock(&s_drain_mutex);
+
+	if (started) {
+		pthread_join(s_thread, NULL);
+	}
+
+	hash_log_flush();
+}
+
+static void _prepare_fork() {
+	pthread_mutex_lock(&s_drain_mutex);
+}
+
+static void _parent_fork() {
+	pthread_mutex_unlock(&s_drain_mutex);
+}
+
+// 子进程里没有后台线程，缓冲区中父进程的日志由父进程输出，子进程清空后在下次写日志时重新启动线程
+static void _child_fork() {
+	_reset_ring();
+	s_started = false;
+	s_stopped = false;
+	pthread_mutex_unlock(&s_drain_mutex);
+}
+
+static void _init() {
+	_reset_ring();
+	pthread_atfork(_prepare_fork, _parent_fork, _child_fork);
+	atexit(_stop_thread);
+}
+
+/*
+ * 缓冲区已满或后台线程已经停止时直接输出。先输出缓冲区中的日志，保持先后顺序
+ * 警告和错误往往是唯一的线索，不能像调试信息那样丢掉
+ */
+static void _write_sync(uint8_t level, const char* module, const char* func, uint32_t line, const char* fmt, va_list args) {
+	char msg[HASH_LOG_MSG_SIZE];
+
+	vsnprintf(msg, sizeof(msg), fmt, args);
+
+	pthread_mutex_lock(&s_drain_mutex);
+	_drain();
+	_print(level > HASH_LOG_LEVEL_ERROR ? HASH_LOG_LEVEL_ERROR : level, module, func, line, msg);
+	fflush(stdout);
+	pthread_mutex_unlock(&s_drain_mutex);
+}
+
+void hash_log_write(uint8_t level, const char* module, const char* func, uint32_t line, const char* fmt, ...) {
+	int32_t diff = 0;
+	uint32_t pos = 0;
+	uint32_t seq = 0;
+	va_list args;
+	hash_log_record_t* record = NULL;
+
+	pthread_once(&s_once, _init);
+	_start_thread();
+
+	if (__atomic_load_n(&s_stopped, __ATOMIC_ACQUIRE)) {
+		va_start(args, fmt);
+		_write_sync(level, module, func, line, fmt, args);
+		va_end(args);
+		return;
+	}
+
+	pos = __atomic_load_n(&s_enqueue_pos, __ATOMIC_RELAXED);
+	while (true) {
+		record = &s_records[pos & (HASH_LOG_RING_SIZE - 1)];
+		seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+		diff = (int32_t)(seq - pos);
+
+		if (0 == diff) {
+			if (__atomic_compare_exchange_n(&s_enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			// 缓冲区已满：调试信息丢掉计数，不阻塞调用者；警告、错误同步输出
+			if (level >= HASH_LOG_LEVEL_WARN) {
+				va_start(args, fmt);
+				_write_sync(level, module, func, line, fmt, args);
+				va_end(args);
+			} else {
+				__atomic_add_fetch(&s_dropped, 1, __ATOMIC_RELAXED);
+			}
+
+			return;
+		} else {
+			pos = __atomic_load_n(&s_enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	record->level = level > HASH_LOG_LEVEL_ERROR ? HASH_LOG_LEVEL_ERROR : level;
+	record->line = line;
+	record->module = module;
+	record->func = func;
+
+	va_start(args, fmt);
+	vsnprintf(record->msg, sizeof(record->msg), fmt, args);
+	va_end(args);
+
+	__atomic_store_n(&record->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+void hash_log_flush(void) {
+	pthread_once(&s_once, _init);
+
+	pthread_mutex_lock(&s_drain_mutex);
+	_drain();
+	pthread_mutex_unlock(&s_drain_mutex);
+}
+
+uint64_t hash_log_dropped(void) {
+	return __atomic_load_n(&s_dropped, __ATOMIC_RELAXED);
+}
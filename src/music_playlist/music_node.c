@@ -1,51 +1,408 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include "music_node.h"
+#include "hash_log.h"
 
-#define MUSIC_INFO 1
-#define MUSIC_DBUG 1
-#define MUSIC_WARN 1
-#define MUSIC_EROR 1
+#define music_debug(fmt, ...) hash_log_debug("MUSIC", fmt, ##__VA_ARGS__)
+#define music_info(fmt, ...) hash_log_info("MUSIC", fmt, ##__VA_ARGS__)
+#define music_warn(fmt, ...) hash_log_warn("MUSIC", fmt, ##__VA_ARGS__)
+#define music_error(fmt, ...) hash_log_error("MUSIC", fmt, ##__VA_ARGS__)
 
-#if MUSIC_INFO
-#define music_info(fmt, ...) printf("\e[0;32m[MUSIC_INFO] [%s %d] : "fmt"\e[0m\n", __func__, __LINE__, ##__VA_ARGS__);
-#else
-#define music_info(fmt, ...)
-#endif
+#define MUSIC_INDEX_CAP 64	// 索引表初始容量，装满前引擎会自动扩展
 
-#if MUSIC_DBUG
-#define music_debug(fmt, ...) printf("\e[0m[MUSIC_DBUG] [%s %d] : "fmt"\e[0m\n", __func__, __LINE__, ##__VA_ARGS__);
-#else
-#define music_debug(fmt, ...)
-#endif
+typedef struct {
+	music_data_value_t* musics;
+	uint32_t cnt;
+	uint32_t cap;
+} music_array_t;
+
+/************************************************
+ * 路径前缀压缩：同一个文件中歌曲所在的目录记录在目录表（附加数据）中，节点里只保存
+ * MUSIC_DIR_MARK + 两字节目录编号 + 文件名。编码后仍是不含'\0'的字符串，同一路径的编码总是相同，
+ * 比较、建索引、变长存储都直接作用于编码后的形式；只有交给上层时才还原成完整路径
+ * 目录表只增不减，满了以后新目录下的歌曲按原路径保存，已有编号不会变化
+ ***********************************************/
+
+#define MUSIC_AUX_DIRS 0			// 目录表保存在第0个附加数据中
+#define MUSIC_MAX_DIR_CNT 1024
+#define MUSIC_MIN_DIR_LEN 4			// 目录不比编码长时不压缩
+#define MUSIC_DIR_MARK '\x01'
 
-#if MUSIC_WARN
-#define music_warn(fmt, ...) printf("\e[0;33m[MUSIC_WARN] [%s %d] : "fmt"\e[0m\n", __func__, __LINE__, ##__VA_ARGS__);
-#else
-#define music_warn(fmt, ...)
-#endif
+typedef struct {
+	char* buf;			// 依次保存以'\0'结尾的目录（含末尾的'/'），编号从1开始
+	const char** dirs;	// dirs[id - 1] 指向 buf 中的目录
+	uint32_t cnt;
+	uint16_t* ids;		// 开放寻址，目录 -> 编号，0表示空位
+	uint32_t cap;
+} music_dir_table_t;
+
+// 新目录，添加到目录表时使用
+typedef struct {
+	const music_data_value_t* musics;
+	uint32_t cnt;
+	uint32_t size;		// 目录表的最大长度
+} music_new_dirs_t;
+
+// 路径中目录部分（含最后一个'/'）的长度，没有目录时为0
+uint32_t __dir_len(const char* path) {
+	const char* slash = NULL;
+	uint32_t len = strnlen(path, MAX_MUSIC_PATH_LEN);
+	uint32_t i = 0;
+
+	for (i = 0; i < len; i++) {
+		if ('/' == path[i]) { slash = &path[i]; }
+	}
 
-#if MUSIC_EROR
-#define music_error(fmt, ...) printf("\e[0;31m[MUSIC_EROR] [%s %d] : "fmt"\e[0m\n", __func__, __LINE__, ##__VA_ARGS__);
-#else
-#define music_error(fmt, ...)
-#endif
+	return NULL == slash ? 0 : slash - path + 1;
+}
+
+uint32_t __dir_pos(music_dir_table_t* table, const char* dir, uint32_t dir_len) {
+	uint32_t pos = (uint32_t)hash_key64(dir, dir_len) & (table->cap - 1);
+	const char* curr = NULL;
+
+	while (0 != table->ids[pos]) {
+		curr = table->dirs[table->ids[pos] - 1];
+
+		if (0 == strncmp(curr, dir, dir_len) && '\0' == curr[dir_len]) {
+			break;
+		}
+
+		pos = (pos + 1) & (table->cap - 1);
+	}
+
+	return pos;
+}
+
+// 目录的编号，不在目录表中返回0
+uint16_t __dir_id(music_dir_table_t* table, const char* dir, uint32_t dir_len) {
+	return 0 == table->cnt ? 0 : table->ids[__dir_pos(table, dir, dir_len)];
+}
+
+void __free_dirs(music_dir_table_t* table) {
+	safe_free(table->buf);
+	safe_free(table->dirs);
+	safe_free(table->ids);
+	table->cnt = table->cap = 0;
+}
+
+// 把 buf 中的目录加到查找表末尾，编号为加入后的个数
+void __add_dir(music_dir_table_t* table, const char* dir, uint32_t dir_len) {
+	table->dirs[table->cnt++] = dir;
+	table->ids[__dir_pos(table, dir, dir_len)] = table->cnt;
+}
+
+/*
+ * 在 buf 中的目录上建立查找表，buf 仍归调用者所有，只用其中完整的部分。
+ * 之后还要继续加入目录时，max_cnt 传目录个数的上限，查找表按上限分配
+ */
+int __index_dirs(music_dir_table_t* table, char* buf, uint32_t len, uint32_t max_cnt) {
+	char* dir = NULL;
+	char* end = buf + len;
+	uint32_t cnt = 0;
+
+	for (dir = buf; dir < end && cnt < MUSIC_MAX_DIR_CNT; dir += strlen(dir) + 1) {
+		// 最后一个目录没有读完整
+		if (NULL == memchr(dir, '\0', end - dir)) {
+			break;
+		}
+
+		++cnt;
+	}
+
+	if (max_cnt < cnt) { max_cnt = cnt; }
+
+	// 容量取2的幂，装载因子不超过一半
+	for (table->cap = 16; table->cap < max_cnt * 2; table->cap <<= 1);
+
+	if (NULL == (table->dirs = (const char**)calloc(MUSIC_MAX_DIR_CNT, sizeof(const char*)))
+			|| NULL == (table->ids = (uint16_t*)calloc(table->cap, sizeof(uint16_t)))) {
+		music_error("calloc failed.");
+		return -1;
+	}
+
+	for (dir = buf; table->cnt < cnt; dir += strlen(dir) + 1) {
+		__add_dir(table, dir, strlen(dir));
+	}
+
+	return 0;
+}
+
+/*
+ * 读入目录表。两次读取之间其他句柄可能追加了目录，只用第一次得到的长度内完整的部分，
+ * 目录表只增不减，读到的总是某个时刻的目录表
+ */
+int __load_dirs(hash_handle_t* handle, music_dir_table_t* table) {
+	int ret = -1;
+	int len = 0;
+
+	memset(table, 0, sizeof(music_dir_table_t));
+
+	if ((len = hash_get_aux(handle, MUSIC_AUX_DIRS, NULL, 0)) < 0) {
+		goto exit;
+	}
+
+	if (NULL == (table->buf = (char*)calloc(1, len + 1))) {
+		music_error("calloc failed.");
+		goto exit;
+	}
+
+	if (len > 0 && hash_get_aux(handle, MUSIC_AUX_DIRS, table->buf, len) < 0) {
+		goto exit;
+	}
+
+	if (__index_dirs(table, table->buf, len, 0) < 0) {
+		goto exit;
+	}
+
+	ret = 0;
+
+exit:
+	if (ret < 0) { __free_dirs(table); }
+	return ret;
+}
+
+/*
+ * 在目录表末尾追加还没有的目录，在 hash_update_aux 中独占目录表时调用。
+ * 独占时读到的目录表可能比调用者的新，在它上面建查找表，新加的目录也放进去，同一批中重复的目录只加一次
+ */
+int __add_dirs_cb(void* buf, uint32_t len, void* input_arg) {
+	music_new_dirs_t* new_dirs = (music_new_dirs_t*)input_arg;
+	music_dir_table_t table;
+	const char* path = NULL;
+	char* dir = NULL;
+	uint32_t dir_len = 0;
+	uint32_t i = 0;
+	bool changed = false;
+
+	memset(&table, 0, sizeof(music_dir_table_t));
+
+	if (__index_dirs(&table, (char*)buf, len, MUSIC_MAX_DIR_CNT) < 0) {
+		goto exit;
+	}
 
+	for (i = 0; i < new_dirs->cnt && table.cnt < MUSIC_MAX_DIR_CNT; i++) {
+		path = new_dirs->musics[i].path;
+
+		if ((dir_len = __dir_len(path)) < MUSIC_MIN_DIR_LEN || 0 != __dir_id(&table, path, dir_len)) {
+			continue;
+		}
+
+		// 放不下目录和结尾的'\0'
+		if (len + dir_len + 1 > new_dirs->size) {
+			break;
+		}
+
+		dir = (char*)buf + len;
+		memcpy(dir, path, dir_len);
+		dir[dir_len] = '\0';
+		len += dir_len + 1;
+		__add_dir(&table, dir, dir_len);
+		changed = true;
+	}
+
+exit:
+	__free_dirs(&table);
+	return changed ? (int)len : -1;
+}
+
+// 插入前把歌曲的目录加到目录表中，有新目录时重新读入目录表
+int __prepare_dirs(hash_handle_t* handle, music_dir_table_t* table, const music_data_value_t* musics, uint32_t cnt) {
+	uint32_t i = 0;
+	uint32_t dir_len = 0;
+	music_new_dirs_t new_dirs;
+
+	new_dirs.musics = musics;
+	new_dirs.cnt = cnt;
+	new_dirs.size = MUSIC_MAX_DIR_CNT * (MAX_MUSIC_PATH_LEN + 1);
+
+	if (table->cnt >= MUSIC_MAX_DIR_CNT) {
+		return 0;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		dir_len = __dir_len(musics[i].path);
+
+		if (dir_len >= MUSIC_MIN_DIR_LEN && 0 == __dir_id(table, musics[i].path, dir_len)) {
+			break;
+		}
+	}
+
+	if (i == cnt) {
+		return 0;
+	}
+
+	if (hash_update_aux(handle, MUSIC_AUX_DIRS, new_dirs.size, __add_dirs_cb, &new_dirs) < 0) {
+		return -1;
+	}
+
+	__free_dirs(table);
+
+	return __load_dirs(handle, table);
+}
+
+// 编码路径，目录不在目录表中时按原样保存。path 和 output 都是 MAX_MUSIC_PATH_LEN 字节，不能是同一块内存
+void __encode_path(music_dir_table_t* table, const char* path, char* output) {
+	uint32_t dir_len = __dir_len(path);
+	uint32_t len = strnlen(path, MAX_MUSIC_PATH_LEN);
+	uint16_t id = 0;
+
+	memset(output, 0, MAX_MUSIC_PATH_LEN);
+
+	if (dir_len < MUSIC_MIN_DIR_LEN || 0 == (id = __dir_id(table, path, dir_len))) {
+		memcpy(output, path, len);
+		return;
+	}
+
+	// 编号的两个字节都不为0，编码后仍是字符串
+	output[0] = MUSIC_DIR_MARK;
+	output[1] = id / 255 + 1;
+	output[2] = id % 255 + 1;
+	memcpy(output + 3, path + dir_len, len - dir_len);
+}
+
+void __decode_path(music_dir_table_t* table, const char* encoded, char* output) {
+	uint32_t id = 0;
+	uint32_t dir_len = 0;
+	uint32_t len = strnlen(encoded, MAX_MUSIC_PATH_LEN);
+
+	memset(output, 0, MAX_MUSIC_PATH_LEN);
+
+	if (len >= 3 && MUSIC_DIR_MARK == encoded[0]) {
+		id = ((uint8_t)encoded[1] - 1) * 255 + ((uint8_t)encoded[2] - 1);
+	}
+
+	if (0 == id || id > table->cnt) {
+		memcpy(output, encoded, len);
+		return;
+	}
+
+	dir_len = strlen(table->dirs[id - 1]);
+	len = dir_len + len - 3 > MAX_MUSIC_PATH_LEN ? MAX_MUSIC_PATH_LEN - dir_len : len - 3;
+	memcpy(output, table->dirs[id - 1], dir_len);
+	memcpy(output + dir_len, encoded + 3, len);
+}
+
+void __encode_music(music_dir_table_t* table, const music_data_value_t* music_data_value, music_data_value_t* output) {
+	memcpy(output, music_data_value, sizeof(music_data_value_t));
+	__encode_path(table, music_data_value->path, output->path);
+}
+
+void __decode_music(music_dir_table_t* table, music_data_value_t* music_data_value) {
+	char path[MAX_MUSIC_PATH_LEN];
+
+	__decode_path(table, music_data_value->path, path);
+	memcpy(music_data_value->path, path, MAX_MUSIC_PATH_LEN);
+}
+
+// 遍历时先把需要下载、删除的歌曲收集起来，遍历完一个哈希槽后再批量插入
 typedef struct {
-	uint32_t which_slot;
-	char *download_list_path;
-	char *delete_list_path;
+	music_array_t download_musics;
+	music_array_t delete_musics;
+	music_dir_table_t* dirs;		// 源文件的目录表，收集时还原成完整路径，插入目标文件时再按目标文件的目录表编码
 } download_and_delete_info_t;
 
-traverse_action_t __clean_playlist_cb(hash_node_data_t* file_node_data, void* input_arg) {
-	return TRAVERSE_ACTION_DELETE;
+int __append_music(music_array_t* array, const music_data_value_t* music_data_value) {
+	int ret = -1;
+	uint32_t new_cap = 0;
+	music_data_value_t* musics = NULL;
+
+	if (array->cnt == array->cap) {
+		new_cap = 0 == array->cap ? 16 : array->cap * 2;
+
+		if (NULL == (musics = (music_data_value_t*)realloc(array->musics, new_cap * sizeof(music_data_value_t)))) {
+			music_error("realloc failed.");
+			goto exit;
+		}
+
+		array->musics = musics;
+		array->cap = new_cap;
+	}
+
+	memcpy(&array->musics[array->cnt++], music_data_value, sizeof(music_data_value_t));
+
+	ret = 0;
+
+exit:
+	return ret;
+}
+
+// 歌曲路径集合，开放寻址，只保存指针，调用方保证路径在使用期间有效
+typedef struct {
+	const char** paths;
+	uint32_t cap;
+	uint32_t cnt;
+} music_path_set_t;
+
+int __path_set_init(music_path_set_t* set, uint32_t cnt) {
+	int ret = -1;
+
+	memset(set, 0, sizeof(music_path_set_t));
+
+	// 容量取2的幂，装载因子不超过一半
+	for (set->cap = 16; set->cap < cnt * 2; set->cap <<= 1);
+
+	if (NULL == (set->paths = (const char**)calloc(set->cap, sizeof(const char*)))) {
+		music_error("calloc failed.");
+		goto exit;
+	}
+
+	ret = 0;
+
+exit:
+	return ret;
+}
+
+void __path_set_free(music_path_set_t* set) {
+	safe_free(set->paths);
+	set->cap = set->cnt = 0;
+}
+
+// 返回路径所在的位置，不存在时返回应该放入的空位
+uint32_t __path_set_pos(music_path_set_t* set, const char* path) {
+	uint32_t pos = (uint32_t)hash_key64(path, strnlen(path, MAX_MUSIC_PATH_LEN)) & (set->cap - 1);
+
+	while (NULL != set->paths[pos] && 0 != strncmp(set->paths[pos], path, MAX_MUSIC_PATH_LEN)) {
+		pos = (pos + 1) & (set->cap - 1);
+	}
+
+	return pos;
+}
+
+void __path_set_add(music_path_set_t* set, const char* path) {
+	uint32_t pos = __path_set_pos(set, path);
+
+	if (NULL == set->paths[pos]) {
+		set->paths[pos] = path;
+		++set->cnt;
+	}
+}
+
+bool __path_set_has(music_path_set_t* set, const char* path) {
+	return NULL != set->paths[__path_set_pos(set, path)];
+}
+
+bool __clean_playlist_cb(hash_node_data_t* file_node_data, void* input_arg) {
+	return true;
+}
+
+bool __delete_musics_cb(hash_node_data_t* file_node_data, void* input_arg) {
+	music_data_value_t* file_music_data_value = (music_data_value_t*)(file_node_data->value);
+
+	return __path_set_has((music_path_set_t*)input_arg, file_music_data_value->path);
 }
 
 #define DEBUG_LIST 0
 traverse_action_t __show_playlist_cb(hash_node_data_t* file_node_data, void* input_arg) {
 	music_data_value_t* music_data_value = (music_data_value_t*)(file_node_data->value);
 
+	__decode_music((music_dir_table_t*)input_arg, music_data_value);
+
 #if DEBUG_LIST
 	if (MUSIC_TO_BE_DELETE == music_data_value->delete_or_not) {
 		printf("{ 删除 : %s }", music_data_value->path);
@@ -72,26 +429,17 @@ traverse_action_t __pre_diff_playlist_cb(hash_node_data_t* file_node_data, void*
 traverse_action_t __build_download_and_delete_list_cb(hash_node_data_t* file_node_data, void* input_arg) {
 	music_data_value_t* file_music_data_value = (music_data_value_t*)(file_node_data->value);
 	download_and_delete_info_t* info = (download_and_delete_info_t*)input_arg;
-	uint32_t which_slot = info->which_slot;
-	char* download_list_path = info->download_list_path;
-	char* delete_list_path = info->delete_list_path;
+
+	__decode_music(info->dirs, file_music_data_value);
 
 	if (MUSIC_TO_BE_DELETE == file_music_data_value->delete_or_not) {
 		music_debug("删除 %s.", file_music_data_value->path);
-		music_data_value_t prev_music_data_value;
-
-		memset(&prev_music_data_value, 0, sizeof(music_data_value_t));
-
-		_insert_music(delete_list_path, which_slot, &prev_music_data_value, file_music_data_value);
+		__append_music(&info->delete_musics, file_music_data_value);
 	}
 
 	else if (MUSIC_TO_BE_DOWNLOAD == file_music_data_value->delete_or_not) {
 		music_debug("下载 %s.", file_music_data_value->path);
-		music_data_value_t prev_music_data_value;
-
-		memset(&prev_music_data_value, 0, sizeof(music_data_value_t));
-
-		_insert_music(download_list_path, which_slot, &prev_music_data_value, file_music_data_value);
+		__append_music(&info->download_musics, file_music_data_value);
 	}
 
 	else if (MUSIC_KEEP == file_music_data_value->delete_or_not) {
@@ -101,18 +449,45 @@ traverse_action_t __build_download_and_delete_list_cb(hash_node_data_t* file_nod
 	return TRAVERSE_ACTION_DO_NOTHING;
 }
 
-// 找到节点后，会将节点标记为MUSIC_KEEP
-traverse_action_t __find_music_cb(hash_node_data_t* file_node_data, void* input_arg) {
-	int action = TRAVERSE_ACTION_DO_NOTHING;
+// 同步时遍历一个哈希槽，把老列表中的歌曲和新列表比较
+typedef struct {
+	music_path_set_t* new_paths;			// 新列表中这个哈希槽的歌曲，编码后的路径
+	bool* kept;								// 和 new_paths->paths 一一对应，老列表中已经有的歌曲
+	music_array_t delete_musics;
+	music_dir_table_t* dirs;
+	char last_path[MAX_MUSIC_PATH_LEN];		// 老列表最后一首的编码，新歌曲从这里往后接
+} music_diff_info_t;
+
+traverse_action_t __diff_playlist_cb(hash_node_data_t* file_node_data, void* input_arg) {
 	music_data_value_t* file_music_data_value = (music_data_value_t*)(file_node_data->value);
-	music_data_value_t* input_music_data_value = (music_data_value_t*)input_arg;
+	music_diff_info_t* info = (music_diff_info_t*)input_arg;
+	uint32_t pos = __path_set_pos(info->new_paths, file_music_data_value->path);
+	action_t delete_or_not = MUSIC_KEEP;
+	music_data_value_t music_data_value;
+
+	memcpy(info->last_path, file_music_data_value->path, MAX_MUSIC_PATH_LEN);
 
-	if (0 == strcmp(file_music_data_value->path, input_music_data_value->path)) {
-		file_music_data_value->delete_or_not = MUSIC_KEEP;
-		action = TRAVERSE_ACTION_UPDATE | TRAVERSE_ACTION_BREAK;
+	if (NULL == info->new_paths->paths[pos]) {
+		delete_or_not = MUSIC_TO_BE_DELETE;
+
+		memcpy(&music_data_value, file_music_data_value, sizeof(music_data_value_t));
+		music_data_value.delete_or_not = MUSIC_TO_BE_DELETE;
+		__decode_music(info->dirs, &music_data_value);
+
+		music_debug("删除 %s.", music_data_value.path);
+		__append_music(&info->delete_musics, &music_data_value);
+	} else {
+		info->kept[pos] = true;
+	}
+
+	// 标记没有变化时不用写回
+	if (delete_or_not == file_music_data_value->delete_or_not) {
+		return TRAVERSE_ACTION_DO_NOTHING;
 	}
 
-	return action;
+	file_music_data_value->delete_or_not = delete_or_not;
+
+	return TRAVERSE_ACTION_UPDATE;
 }
 
 bool __add_music_cb(hash_node_data_t* file_node_data, hash_node_data_t* input_prev_node_data) {
@@ -129,113 +504,493 @@ bool __del_music_cb(hash_node_data_t* file_node_data, hash_node_data_t* input_no
 	return 0 == strncmp(file_music_data_value->path, input_music_data_value->path, MAX_MUSIC_PATH_LEN);
 }
 
-void _clean_playlist(const char* list_path) {
-	music_warn("清空链表 %s ...", list_path);
+int __read_playlist_header(hash_handle_t* handle, playlist_header_data_value_t* header_data_value) {
+	hash_header_data_t header_data;
 
-	traverse_nodes(list_path, TRAVERSE_BY_LOGIC,
-			MAX_HASH_SLOT_CNT, WITHOUT_PRINT, NULL, __clean_playlist_cb);
-}
+	memset(&header_data, 0, sizeof(hash_header_data_t));
 
-void _show_playlist(const char* list_path) {
-	traverse_nodes(list_path, TRAVERSE_BY_LOGIC,
-			MAX_HASH_SLOT_CNT, WITH_PRINT, NULL, __show_playlist_cb);
+	header_data.value = header_data_value;
+
+	return hash_get_header_data(handle, &header_data);
 }
 
-// 将music的delete_or_not标记设置为MUSIC_DELETE
-void _pre_diff_playlist(const char* list_path,
-		uint32_t slot_cnt,
-		const char* download_list_path,
-		const char* delete_list_path) {
-	traverse_nodes(list_path, TRAVERSE_BY_LOGIC,
-			MAX_HASH_SLOT_CNT, WITHOUT_PRINT, NULL, __pre_diff_playlist_cb);
+int __write_playlist_header(hash_handle_t* handle, playlist_header_data_value_t* header_data_value) {
+	hash_header_data_t header_data;
 
-	_init_music_hash_engine(download_list_path, slot_cnt);
-	_init_music_hash_engine(delete_list_path, slot_cnt);
+	memset(&header_data, 0, sizeof(hash_header_data_t));
+
+	header_data_value->which_playlist_to_handle %= header_data_value->playlist_cnt;
+	header_data.value = header_data_value;
+
+	return hash_set_header_data(handle, &header_data);
 }
 
-void _post_diff_playlist(const char* list_path,
-		const char* download_list_path,
-		const char* delete_list_path) {
-	download_and_delete_info_t input_arg;
-	playlist_header_data_value_t playlist_header;
+/************************************************
+ * 随机播放：第 which_slot 个播放列表的随机排列（节点偏移量数组）保存在第 MUSIC_AUX_SHUFFLE + which_slot 个
+ * 附加数据中。打开随机播放时用 Fisher-Yates 生成一次，之后插入、删除歌曲时就地调整，切歌只读排列中的一项
+ * 新歌曲只放到还没播放的部分，删除时保持其余歌曲的先后顺序。
+ * 关闭随机播放时清空排列；排列和哈希槽的节点数对不上（比如直接调用了引擎接口）时重新生成
+ ***********************************************/
 
-	memset(&playlist_header, 0, sizeof(playlist_header));
-	memset(&input_arg, 0, sizeof(download_and_delete_info_t));
+#define MUSIC_AUX_SHUFFLE 1
 
-	_get_playlist_header(__func__, __LINE__, list_path, &playlist_header);
+#if MUSIC_AUX_SHUFFLE + MAX_HASH_SLOT_CNT > HASH_AUX_CNT
+#error "not enough aux for shuffle"
+#endif
 
-	// 生成链表
-	for (int i = 0; i < playlist_header.playlist_cnt; ++i) {
-		input_arg.which_slot = i;
-		input_arg.download_list_path = (char*)download_list_path;
-		input_arg.delete_list_path = (char*)delete_list_path;
-		traverse_nodes(list_path, TRAVERSE_BY_LOGIC,
-				i, WITHOUT_PRINT, &input_arg, __build_download_and_delete_list_cb);
-	}
+typedef struct {
+	const off_t* offsets;	// 删除时已排好序
+	uint32_t cnt;
+	uint32_t size;			// 调整后排列的长度（字节），和现有排列对不上时不调整
+	int64_t pos;			// 当前歌曲在排列中的位置，删除后更新
+	uint32_t seed;			// 插入时用的随机数状态，调整后写回头部
+} music_shuffle_arg_t;
+
+// 打开随机播放时的种子，和以前的状态混在一起，同一秒内反复打开也不会得到相同的排列
+uint32_t __shuffle_seed(uint32_t seed) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return seed ^ (uint32_t)ts.tv_nsec ^ ((uint32_t)ts.tv_sec << 16) ^ ((uint32_t)getpid() << 8);
 }
 
-int _get_playlist_music_cnt(const char* list_path, uint32_t which_slot) {
-	return get_slot_node_cnt(list_path, which_slot);
+/*
+ * [0, n) 中的随机数。xorshift32，状态保存在各个播放列表的头部，不动 libc 的全局 rand 状态，多线程也互不影响
+ * 落在 2^32 除以 n 的余数部分的结果丢掉重取，每个数的概率相同
+ */
+uint32_t __shuffle_rand(uint32_t* seed, uint32_t n) {
+	uint32_t x = 0 == *seed ? 0x9E3779B9 : *seed;
+	uint32_t bound = (uint32_t)(-n) % n;
+
+	do {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+	} while (x < bound);
+
+	*seed = x;
+	return x % n;
 }
 
-uint8_t _find_music(const char* list_path, uint32_t which_slot, const char* music_path) {
-	music_data_value_t music_data_value;
+int __offset_cmp(const void* a, const void* b) {
+	off_t x = *(const off_t*)a;
+	off_t y = *(const off_t*)b;
 
-	memset(&music_data_value, 0, sizeof(music_data_value));
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
 
-	strncpy(music_data_value.path, music_path, MAX_MUSIC_PATH_LEN);
+int __set_shuffle_cb(void* buf, uint32_t len, void* input_arg) {
+	music_shuffle_arg_t* arg = (music_shuffle_arg_t*)input_arg;
+
+	memcpy(buf, arg->offsets, arg->cnt * sizeof(off_t));
 
-	return traverse_nodes(list_path, TRAVERSE_BY_PHYSIC,
-			which_slot, WITHOUT_PRINT, &music_data_value, __find_music_cb);
+	return arg->cnt * sizeof(off_t);
 }
 
-int _get_playlist_header(const char* func, const int line, const char* path, playlist_header_data_value_t* header_data_value) {
-	hash_header_data_t header_data;
+// 新歌曲依次和当前歌曲之后的随机一项交换，排列仍然是均匀的
+int __shuffle_add_cb(void* buf, uint32_t len, void* input_arg) {
+	music_shuffle_arg_t* arg = (music_shuffle_arg_t*)input_arg;
+	off_t* perm = (off_t*)buf;
+	uint32_t n = len / sizeof(off_t);
+	uint32_t from = 0;
+	uint32_t i = 0;
+	uint32_t j = 0;
+
+	if (len + arg->cnt * sizeof(off_t) != arg->size) {
+		return -1;
+	}
 
-	memset(&header_data, 0, sizeof(hash_header_data_t));
+	from = arg->pos + 1 < n ? arg->pos + 1 : n;
 
-	header_data.value = header_data_value;
+	for (i = 0; i < arg->cnt; i++, n++) {
+		j = from + __shuffle_rand(&arg->seed, n - from + 1);
+		perm[n] = perm[j];
+		perm[j] = arg->offsets[i];
+	}
 
-	get_header_data(path, &header_data);
+	return n * sizeof(off_t);
+}
 
-#if 0
-	printf("-------------------------- \e[7;32m<GET> %s : %d\e[0m --------------------------\n"
-			"saved_offset_for_all = 0x%lX, which_playlist_to_handle = %d, playlist_cnt = %d.\n",
-			func, line,
-			header_data_value->saved_offset_for_all,
-			header_data_value->which_playlist_to_handle,
-			header_data_value->playlist_cnt);
+// 删除的歌曲在当前歌曲之前（含当前歌曲）时，当前位置跟着前移，下一首仍是原来的下一首
+int __shuffle_del_cb(void* buf, uint32_t len, void* input_arg) {
+	music_shuffle_arg_t* arg = (music_shuffle_arg_t*)input_arg;
+	off_t* perm = (off_t*)buf;
+	uint32_t n = len / sizeof(off_t);
+	uint32_t kept = 0;
+	uint32_t i = 0;
+	int64_t pos = arg->pos;
+
+	if (len != arg->size + arg->cnt * sizeof(off_t)) {
+		return -1;
+	}
 
-	for (int i = 0; i < header_data_value->playlist_cnt; i++) {
-		printf("[%d]  prev = 0x%lX, next = 0x%lX, playlist_name = %s.\n", i,
-				header_data_value->playlist[i].prev,
-				header_data_value->playlist[i].next,
-				header_data_value->playlist[i].name);
+	for (i = 0; i < n; i++) {
+		if (NULL != bsearch(&perm[i], arg->offsets, arg->cnt, sizeof(off_t), __offset_cmp)) {
+			if (i <= arg->pos) { --pos; }
+			continue;
+		}
+
+		perm[kept++] = perm[i];
 	}
 
-	printf("---------------------------------------"
-			"---------------------------------------\n");
-#endif
+	arg->pos = pos < 0 && kept > 0 ? kept - 1 : pos;
 
-	return 0;
+	return kept * sizeof(off_t);
 }
 
+/*
+ * 重新生成随机排列，当前歌曲放在第一个，没有播放过时从第一个开始播放
+ * 返回排列中的歌曲数，出错返回-1
+ */
+int __shuffle_playlist(hash_handle_t* handle, uint32_t which_slot, playlist_t* playlist) {
+	int ret = -1;
+	off_t offset = 0;
+	off_t* offsets = NULL;
+	off_t* grown = NULL;
+	uint32_t cnt = 0;
+	uint32_t cap = 0;
+	uint32_t i = 0;
+	uint32_t j = 0;
+	hash_cursor_t* cursor = NULL;
+	hash_node_t node;
+	music_data_value_t music_data_value;
+	music_shuffle_arg_t arg;
 
-int _set_playlist_header(const char* func, const int line, const char* path, playlist_header_data_value_t* header_data_value) {
-	hash_header_data_t header_data;
+	memset(&node, 0, sizeof(hash_node_t));
+	memset(&arg, 0, sizeof(music_shuffle_arg_t));
 
-	memset(&header_data, 0, sizeof(hash_header_data_t));
+	node.data.value = &music_data_value;
 
-	header_data_value->which_playlist_to_handle %= header_data_value->playlist_cnt;
-	header_data.value = header_data_value;
+	if (NULL == (cursor = hash_cursor_open(handle, which_slot, TRAVERSE_BY_LOGIC))) {
+		goto exit;
+	}
 
-	set_header_data(path, &header_data);
+	while ((offset = hash_cursor_next(cursor, &node)) > 0) {
+		if (cnt == cap) {
+			cap = 0 == cap ? 64 : cap * 2;
 
-#if 0
-	printf("-------------------------- \e[7;31m<SET> %s : %d\e[0m --------------------------\n"
-			"saved_offset_for_all = 0x%lX, which_playlist_to_handle = %d, playlist_cnt = %d.\n",
-			func, line,
-			header_data_value->saved_offset_for_all,
+			if (NULL == (grown = (off_t*)realloc(offsets, cap * sizeof(off_t)))) {
+				music_error("realloc failed.");
+				goto close_cursor;
+			}
+
+			offsets = grown;
+		}
+
+		offsets[cnt++] = offset;
+	}
+
+	if (offset < 0) {
+		goto close_cursor;
+	}
+
+	for (i = cnt; i > 1; i--) {
+		j = __shuffle_rand(&playlist->shuffle_seed, i);
+		offset = offsets[i - 1];
+		offsets[i - 1] = offsets[j];
+		offsets[j] = offset;
+	}
+
+	playlist->shuffle_pos = 0 == cnt ? 0 : cnt - 1;
+
+	for (i = 0; i < cnt; i++) {
+		if (offsets[i] == playlist->saved_offset) {
+			offsets[i] = offsets[0];
+			offsets[0] = playlist->saved_offset;
+			playlist->shuffle_pos = 0;
+			break;
+		}
+	}
+
+	arg.offsets = offsets;
+	arg.cnt = cnt;
+
+	if (hash_update_aux(handle, MUSIC_AUX_SHUFFLE + which_slot, cnt * sizeof(off_t), __set_shuffle_cb, &arg) < 0) {
+		goto close_cursor;
+	}
+
+	music_debug("shuffle %d musics in slot %d.", cnt, which_slot);
+
+	ret = cnt;
+
+close_cursor:
+	hash_cursor_close(cursor);
+
+exit:
+	safe_free(offsets);
+	return ret;
+}
+
+// 随机播放时往前或往后走一首，返回要播放的歌曲位置，出错返回-1
+off_t __shuffle_step(hash_handle_t* handle, uint32_t which_slot, playlist_t* playlist, direction_t next_or_prev) {
+	int len = 0;
+	int cnt = hash_get_slot_node_cnt(handle, which_slot);
+	off_t offset = 0;
+	uint32_t pos = 0;
+
+	if ((len = hash_get_aux(handle, MUSIC_AUX_SHUFFLE + which_slot, NULL, 0)) < 0) {
+		return -1;
+	}
+
+	if (cnt <= 0 || len != cnt * (int)sizeof(off_t) || playlist->shuffle_pos >= (uint32_t)cnt) {
+		music_warn("shuffle of slot %d is out of date, reshuffle.", which_slot);
+
+		if ((cnt = __shuffle_playlist(handle, which_slot, playlist)) <= 0) {
+			return -1;
+		}
+	}
+
+	pos = NEXT_MUSIC == next_or_prev ? (playlist->shuffle_pos + 1) % cnt : (playlist->shuffle_pos + cnt - 1) % cnt;
+
+	if (hash_get_aux_at(handle, MUSIC_AUX_SHUFFLE + which_slot, pos * sizeof(off_t), &offset, sizeof(off_t)) < 0) {
+		return -1;
+	}
+
+	playlist->shuffle_pos = pos;
+
+	return offset;
+}
+
+/*
+ * 插入、删除歌曲后调整随机排列，offsets 为这些歌曲的位置，调用者先确认已经打开了随机播放
+ * 删除时当前歌曲的位置可能变化，会写回头部
+ */
+int __update_shuffle(hash_handle_t* handle, uint32_t which_slot, playlist_header_data_value_t* playlist_header,
+		off_t* offsets, uint32_t cnt, bool add) {
+	int ret = -1;
+	playlist_t* playlist = NULL;
+	music_shuffle_arg_t arg;
+
+	memset(&arg, 0, sizeof(music_shuffle_arg_t));
+
+	which_slot %= playlist_header->playlist_cnt;
+	playlist = &playlist_header->playlist[which_slot];
+
+	if (0 == cnt) {
+		ret = 0;
+		goto exit;
+	}
+
+	if (!add) {
+		qsort(offsets, cnt, sizeof(off_t), __offset_cmp);
+	}
+
+	arg.offsets = offsets;
+	arg.cnt = cnt;
+	arg.size = hash_get_slot_node_cnt(handle, which_slot) * sizeof(off_t);
+	arg.pos = playlist->shuffle_pos;
+	arg.seed = playlist->shuffle_seed;
+
+	if (hash_update_aux(handle, MUSIC_AUX_SHUFFLE + which_slot, arg.size,
+				add ? __shuffle_add_cb : __shuffle_del_cb, &arg) < 0) {
+		goto exit;
+	}
+
+	if (arg.pos != playlist->shuffle_pos || arg.seed != playlist->shuffle_seed) {
+		playlist->shuffle_pos = arg.pos;
+		playlist->shuffle_seed = arg.seed;
+
+		if (__write_playlist_header(handle, playlist_header) < 0) {
+			goto exit;
+		}
+	}
+
+	ret = 0;
+
+exit:
+	return ret;
+}
+
+bool __shuffle_on(playlist_header_data_value_t* playlist_header, uint32_t which_slot) {
+	return playlist_header->playlist_cnt > 0 && playlist_header->playlist[which_slot % playlist_header->playlist_cnt].shuffle;
+}
+
+// 歌曲所在的位置，没找到返回0。music_path 是编码后的路径
+off_t __music_offset(hash_handle_t* handle, uint32_t which_slot, const char* music_path) {
+	hash_node_t node;
+	hash_node_data_t node_data;
+	music_data_value_t music_data_value;
+	music_data_value_t file_music_data_value;
+
+	memset(&node, 0, sizeof(node));
+	memset(&node_data, 0, sizeof(node_data));
+	memset(&music_data_value, 0, sizeof(music_data_value));
+
+	strncpy(music_data_value.path, music_path, MAX_MUSIC_PATH_LEN);
+
+	node_data.key = which_slot;
+	node_data.value = &music_data_value;
+	node.data.value = &file_music_data_value;
+
+	return hash_find_node(handle, &node_data, &node, __del_music_cb);
+}
+
+void _clean_playlist(const char* list_path) {
+	music_warn("清空链表 %s ...", list_path);
+
+	del_nodes(list_path, HASH_ALL_SLOTS, __clean_playlist_cb, NULL);
+}
+
+void _show_playlist(const char* list_path) {
+	hash_handle_t* handle = NULL;
+	music_dir_table_t dirs;
+
+	if (NULL == (handle = hash_open(list_path, HASH_OPEN_RDONLY))) {
+		music_error("open '%s' failed.", list_path);
+		return;
+	}
+
+	if (0 == __load_dirs(handle, &dirs)) {
+		hash_traverse_nodes(handle, TRAVERSE_BY_LOGIC,
+				HASH_ALL_SLOTS, WITH_PRINT, &dirs, __show_playlist_cb);
+		__free_dirs(&dirs);
+	}
+
+	hash_close(handle);
+}
+
+// 将music的delete_or_not标记设置为MUSIC_DELETE
+void _pre_diff_playlist(const char* list_path,
+		uint32_t slot_cnt,
+		const char* download_list_path,
+		const char* delete_list_path) {
+	// 各个播放列表互不相关，并行标记
+	traverse_nodes_parallel(list_path, TRAVERSE_BY_LOGIC, NULL, __pre_diff_playlist_cb);
+
+	_init_music_hash_engine(download_list_path, slot_cnt);
+	_init_music_hash_engine(delete_list_path, slot_cnt);
+}
+
+void _post_diff_playlist(const char* list_path,
+		const char* download_list_path,
+		const char* delete_list_path) {
+	hash_handle_t* handle = NULL;
+	download_and_delete_info_t input_arg;
+	playlist_header_data_value_t playlist_header;
+	music_data_value_t prev_music_data_value;
+	music_dir_table_t dirs;
+
+	memset(&playlist_header, 0, sizeof(playlist_header));
+	memset(&input_arg, 0, sizeof(download_and_delete_info_t));
+	memset(&prev_music_data_value, 0, sizeof(music_data_value_t));
+
+	if (NULL == (handle = hash_open(list_path, HASH_OPEN_RDWR))) {
+		music_error("open '%s' failed.", list_path);
+		return;
+	}
+
+	if (__load_dirs(handle, &dirs) < 0) {
+		hash_close(handle);
+		return;
+	}
+
+	input_arg.dirs = &dirs;
+
+	__read_playlist_header(handle, &playlist_header);
+
+	// 生成链表，每个哈希槽只打开、写入目标文件一次
+	for (int i = 0; i < playlist_header.playlist_cnt; ++i) {
+		input_arg.download_musics.cnt = 0;
+		input_arg.delete_musics.cnt = 0;
+
+		hash_traverse_nodes(handle, TRAVERSE_BY_LOGIC,
+				i, WITHOUT_PRINT, &input_arg, __build_download_and_delete_list_cb);
+
+		_insert_musics(delete_list_path, i, &prev_music_data_value,
+				input_arg.delete_musics.musics, input_arg.delete_musics.cnt);
+		_insert_musics(download_list_path, i, &prev_music_data_value,
+				input_arg.download_musics.musics, input_arg.download_musics.cnt);
+	}
+
+	hash_close(handle);
+
+	__free_dirs(&dirs);
+	safe_free(input_arg.download_musics.musics);
+	safe_free(input_arg.delete_musics.musics);
+}
+
+int _get_playlist_music_cnt(const char* list_path, uint32_t which_slot) {
+	return get_slot_node_cnt(list_path, which_slot);
+}
+
+// 找到后将节点标记为MUSIC_KEEP，返回1；没找到返回0。music_path 是编码后的路径
+uint8_t _find_music(hash_handle_t* handle, uint32_t which_slot, const char* music_path) {
+	uint8_t found = 0;
+	off_t offset = 0;
+	hash_node_t node;
+	hash_node_data_t node_data;
+	music_data_value_t music_data_value;
+	music_data_value_t file_music_data_value;
+
+	memset(&node, 0, sizeof(node));
+	memset(&node_data, 0, sizeof(node_data));
+	memset(&music_data_value, 0, sizeof(music_data_value));
+
+	strncpy(music_data_value.path, music_path, MAX_MUSIC_PATH_LEN);
+
+	node_data.key = which_slot;
+	node_data.value = &music_data_value;
+
+	node.data.value = &file_music_data_value;
+
+	// 通过索引定位，不再遍历整个哈希槽
+	if ((offset = hash_find_node(handle, &node_data, &node, __del_music_cb)) > 0) {
+		file_music_data_value.delete_or_not = MUSIC_KEEP;
+		hash_update_node(handle, offset, &node);
+		found = 1;
+	}
+
+	return found;
+}
+
+int _get_playlist_header(const char* func, const int line, const char* path, playlist_header_data_value_t* header_data_value) {
+	hash_header_data_t header_data;
+
+	memset(&header_data, 0, sizeof(hash_header_data_t));
+
+	header_data.value = header_data_value;
+
+	get_header_data(path, &header_data);
+
+#if 0
+	printf("-------------------------- \e[7;32m<GET> %s : %d\e[0m --------------------------\n"
+			"saved_offset_for_all = 0x%lX, which_playlist_to_handle = %d, playlist_cnt = %d.\n",
+			func, line,
+			header_data_value->saved_offset_for_all,
+			header_data_value->which_playlist_to_handle,
+			header_data_value->playlist_cnt);
+
+	for (int i = 0; i < header_data_value->playlist_cnt; i++) {
+		printf("[%d]  prev = 0x%lX, next = 0x%lX, playlist_name = %s.\n", i,
+				header_data_value->playlist[i].prev,
+				header_data_value->playlist[i].next,
+				header_data_value->playlist[i].name);
+	}
+
+	printf("---------------------------------------"
+			"---------------------------------------\n");
+#endif
+
+	return 0;
+}
+
+
+int _set_playlist_header(const char* func, const int line, const char* path, playlist_header_data_value_t* header_data_value) {
+	hash_header_data_t header_data;
+
+	memset(&header_data, 0, sizeof(hash_header_data_t));
+
+	header_data_value->which_playlist_to_handle %= header_data_value->playlist_cnt;
+	header_data.value = header_data_value;
+
+	set_header_data(path, &header_data);
+
+#if 0
+	printf("-------------------------- \e[7;31m<SET> %s : %d\e[0m --------------------------\n"
+			"saved_offset_for_all = 0x%lX, which_playlist_to_handle = %d, playlist_cnt = %d.\n",
+			func, line,
+			header_data_value->saved_offset_for_all,
 			header_data_value->which_playlist_to_handle,
 			header_data_value->playlist_cnt);
 
@@ -256,125 +1011,1168 @@ int _set_playlist_header(const char* func, const int line, const char* path, pla
 int _get_music(const char* list_path, uint32_t which_slot, direction_t next_or_prev) {
 	int ret = -1;
 	off_t offset = 0;
+	hash_handle_t* handle = NULL;
 	playlist_header_data_value_t playlist_header;
+	playlist_t* playlist = NULL;
 	uint32_t playlist_no = 0;
 	hash_node_t node;
 	music_data_value_t music_data_value;
+#if HASH_LOG_LEVEL <= HASH_LOG_LEVEL_INFO
+	music_dir_table_t dirs;
+#endif
 
 	memset(&node, 0, sizeof(hash_node_t));
 	memset(&playlist_header, 0, sizeof(playlist_header));
 
 	node.data.value = &music_data_value;
 
-	_get_playlist_header(__func__, __LINE__, list_path, &playlist_header);
+	// 一次打开完成读头部、读节点、写头部，避免反复打开解析文件
+	if (NULL == (handle = hash_open(list_path, HASH_OPEN_RDWR))) {
+		music_error("open '%s' failed.", list_path);
+		goto exit;
+	}
 
-	playlist_no = which_slot % playlist_header.playlist_cnt;
+	__read_playlist_header(handle, &playlist_header);
 
-	offset = NEXT_MUSIC == next_or_prev ? \
-		 playlist_header.playlist[playlist_no].next : \
-		 playlist_header.playlist[playlist_no].prev;
+	playlist_no = which_slot % playlist_header.playlist_cnt;
+	playlist = &playlist_header.playlist[playlist_no];
 
-	get_node(list_path, which_slot, offset, &node);
+	offset = NEXT_MUSIC == next_or_prev ? playlist->next : playlist->prev;
 
-	if (is_slot_empty(list_path, which_slot)) {
+	if (hash_is_slot_empty(handle, which_slot)) {
 		music_warn("no music in slot %d.", which_slot);
-		goto exit;
+		goto close_handle;
 	}
 
-	playlist_header.playlist[playlist_no].next = node.offsets.logic_next;
-	playlist_header.playlist[playlist_no].prev = node.offsets.logic_prev;
+	// 随机播放时按排列切歌，上下首仍按逻辑顺序记录，关闭随机播放后从当前歌曲接着顺序播放
+	if (playlist->shuffle && (offset = __shuffle_step(handle, playlist_no, playlist, next_or_prev)) < 0) {
+		goto close_handle;
+	}
+
+	if (hash_get_node(handle, which_slot, offset, &node) < 0) {
+		goto close_handle;
+	}
+
+	// 节点数碰巧对得上，但排列中的歌曲已经被删除，重新生成后再走一次
+	if (playlist->shuffle && !node.used) {
+		music_warn("0x%lX in shuffle of slot %d is deleted, reshuffle.", offset, which_slot);
 
-	playlist_header.playlist[playlist_no].saved_offset = offset;    // 保存当前播放列表播放进度
+		if (__shuffle_playlist(handle, playlist_no, playlist) <= 0
+				|| (offset = __shuffle_step(handle, playlist_no, playlist, next_or_prev)) < 0
+				|| hash_get_node(handle, which_slot, offset, &node) < 0) {
+			goto close_handle;
+		}
+	}
+
+	playlist->next = node.offsets.logic_next;
+	playlist->prev = node.offsets.logic_prev;
+
+	playlist->saved_offset = offset;                                // 保存当前播放列表播放进度
 	playlist_header.saved_offset_for_all = offset;                  // 保存所有播放列表中最新的播放进度
 
+#if HASH_LOG_LEVEL <= HASH_LOG_LEVEL_INFO
+	// 只为打印日志才读目录表
+	if (0 == __load_dirs(handle, &dirs)) {
+		__decode_music(&dirs, &music_data_value);
+		__free_dirs(&dirs);
+	}
+#endif
+
 	music_info("音乐名称 = %s.", music_data_value.path);
 
-	_set_playlist_header(__func__, __LINE__, list_path, &playlist_header);
+	__write_playlist_header(handle, &playlist_header);
 
 	ret = 0;
 
+close_handle:
+	hash_close(handle);
+
 exit:
 	return ret;
 }
 
-/* 该函数在 普通添加 和 diff链表可以复用
- * 普通添加将curr_music的delete_or_not标记设置为MUSIC_KEEP
- * diff链表将curr_music的delete_or_not标记设置为MUSIC_TO_BE_DOWNLOAD
+/*
+ * 打开或关闭随机播放。打开时重新生成随机排列，当前歌曲排在第一个；关闭时清空排列，
+ * 之后从当前歌曲开始按顺序播放
  */
-int _insert_music(const char* list_path, uint32_t which_slot,
-		const music_data_value_t* prev_music_data_value,
-		const music_data_value_t* curr_music_data_value) {
+int _set_shuffle(const char* list_path, uint32_t which_slot, bool shuffle) {
 	int ret = -1;
-	hash_node_data_t prev_node_data;
-	hash_node_data_t curr_node_data;
+	hash_handle_t* handle = NULL;
+	playlist_header_data_value_t playlist_header;
+	playlist_t* playlist = NULL;
+	music_shuffle_arg_t arg;
 
-	// 如果存在，会将对应节点标记为MUSIC_KEEP
-	if (_find_music(list_path, which_slot, curr_music_data_value->path) > 0) {
-		music_debug("already exist '%s'", curr_music_data_value->path);
-		ret = 0;
+	memset(&playlist_header, 0, sizeof(playlist_header));
+	memset(&arg, 0, sizeof(music_shuffle_arg_t));
+
+	if (NULL == (handle = hash_open(list_path, HASH_OPEN_RDWR))) {
+		music_error("open '%s' failed.", list_path);
 		goto exit;
 	}
 
-	memset(&prev_node_data, 0, sizeof(prev_node_data));
-	memset(&curr_node_data, 0, sizeof(curr_node_data));
+	__read_playlist_header(handle, &playlist_header);
 
-	prev_node_data.key = which_slot;
-	prev_node_data.value = (void*)prev_music_data_value;
+	which_slot %= playlist_header.playlist_cnt;
+	playlist = &playlist_header.playlist[which_slot];
 
-	curr_node_data.key = which_slot;
-	curr_node_data.value = (void*)curr_music_data_value;
+	if (shuffle) {
+		playlist->shuffle_seed = __shuffle_seed(playlist->shuffle_seed);
 
-	if (0 != (ret = insert_node(list_path, &prev_node_data, &curr_node_data, __add_music_cb))) {
-		music_error("[ + ] '%s' to '%s' failed!", curr_music_data_value->path, list_path);
-		goto exit;
+		if (__shuffle_playlist(handle, which_slot, playlist) < 0) {
+			goto close_handle;
+		}
+	} else if (hash_update_aux(handle, MUSIC_AUX_SHUFFLE + which_slot, 0, __set_shuffle_cb, &arg) < 0) {
+		goto close_handle;
 	}
 
-	music_info("[ + ] '%s' to '%s' success.", curr_music_data_value->path, list_path);
+	playlist->shuffle = shuffle;
+
+	music_info("slot %d of '%s' shuffle %s.", which_slot, list_path, shuffle ? "on" : "off");
+
+	ret = __write_playlist_header(handle, &playlist_header);
+
+close_handle:
+	hash_close(handle);
 
 exit:
 	return ret;
 }
 
-int _delete_music(const char* list_path, uint32_t which_slot, const char* path) {
+/*
+ * 直接跳到播放顺序中的第 index 首（从0开始），和切歌一样更新播放进度，歌曲信息读到 music_data_value
+ * 返回0；index 超出歌曲数返回1，出错返回-1
+ */
+int _get_music_at(const char* list_path, uint32_t which_slot, uint32_t index, music_data_value_t* music_data_value) {
 	int ret = -1;
-	hash_node_data_t node_data;
-	music_data_value_t music_data_value;
+	off_t offset = 0;
+	hash_handle_t* handle = NULL;
 	playlist_header_data_value_t playlist_header;
+	uint32_t playlist_no = 0;
+	hash_node_t node;
+	music_dir_table_t dirs;
 
-	memset(&node_data, 0, sizeof(node_data));
-	memset(&music_data_value, 0, sizeof(music_data_value));
+	memset(&node, 0, sizeof(hash_node_t));
 	memset(&playlist_header, 0, sizeof(playlist_header));
+	memset(&dirs, 0, sizeof(music_dir_table_t));
 
-	_get_playlist_header(__func__, __LINE__, list_path, &playlist_header);
-
-	music_data_value.delete_or_not = MUSIC_TO_BE_DELETE;
-	strncpy(music_data_value.path, path, MAX_MUSIC_PATH_LEN);
-
-	node_data.key = which_slot % playlist_header.playlist_cnt;
-	node_data.value = &music_data_value;
+	node.data.value = music_data_value;
 
-	if (0 != (ret = del_node(list_path, &node_data, __del_music_cb))) {
-		music_error("[ - ] '%s' from '%s' in slot '%d'.", path, list_path, node_data.key);
+	if (NULL == (handle = hash_open(list_path, HASH_OPEN_RDWR))) {
+		music_error("open '%s' failed.", list_path);
 		goto exit;
 	}
 
-	music_info("[ - ] '%s' from '%s' success.", path, list_path);
+	__read_playlist_header(handle, &playlist_header);
 
-exit:
-	return ret;
-}
+	playlist_no = which_slot % playlist_header.playlist_cnt;
 
-int _init_music_hash_engine(const char* list_path, uint32_t slot_cnt) {
-	playlist_header_data_value_t playlist_header;
+	if ((offset = hash_get_node_at(handle, which_slot, index, &node)) <= 0) {
+		if (0 == offset) {
+			music_warn("no music at %d in slot %d.", index, which_slot);
+			ret = 1;
+		}
+		goto close_handle;
+	}
 
-	memset(&playlist_header, 0, sizeof(playlist_header_data_value_t));
+	if (__load_dirs(handle, &dirs) < 0) {
+		goto close_handle;
+	}
+
+	__decode_music(&dirs, music_data_value);
+
+	playlist_header.playlist[playlist_no].next = node.offsets.logic_next;
+	playlist_header.playlist[playlist_no].prev = node.offsets.logic_prev;
+
+	playlist_header.playlist[playlist_no].saved_offset = offset;
+	playlist_header.saved_offset_for_all = offset;
+
+	music_info("第 %d 首 = %s.", index, music_data_value->path);
+
+	__write_playlist_header(handle, &playlist_header);
+
+	ret = 0;
+
+close_handle:
+	__free_dirs(&dirs);
+	hash_close(handle);
+
+exit:
+	return ret;
+}
+
+/*
+ * 分页读取，从 *from_offset 处的歌曲开始按播放顺序最多读 cnt 首，*from_offset 为0时从第一首开始
+ * 返回读到的歌曲数，*from_offset 更新为下一页的起始位置，已经读完时为0
+ */
+int _list_musics(const char* list_path, uint32_t which_slot, off_t* from_offset,
+		music_data_value_t* musics, uint32_t cnt) {
+	int ret = -1;
+	uint32_t i = 0;
+	off_t offset = 0;
+	hash_handle_t* handle = NULL;
+	hash_cursor_t* cursor = NULL;
+	hash_node_t node;
+	music_data_value_t next_music_data_value;
+	music_dir_table_t dirs;
+
+	memset(&node, 0, sizeof(hash_node_t));
+	memset(&dirs, 0, sizeof(music_dir_table_t));
+
+	// 游标每读一个节点都要加锁，预读缓冲区留不住，用mmap直接访问映射区
+	if (NULL == (handle = hash_open(list_path, HASH_OPEN_RDONLY | HASH_OPEN_MMAP))) {
+		music_error("open '%s' failed.", list_path);
+		goto exit;
+	}
+
+	if (__load_dirs(handle, &dirs) < 0) {
+		goto close_handle;
+	}
+
+	if (NULL == (cursor = hash_cursor_open(handle, which_slot % handle->header.slot_cnt, TRAVERSE_BY_LOGIC))) {
+		goto close_handle;
+	}
+
+	if (hash_cursor_seek(cursor, *from_offset) < 0) {
+		goto close_cursor;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		node.data.value = &musics[i];
+
+		if ((offset = hash_cursor_next(cursor, &node)) < 0) {
+			goto close_cursor;
+		}
+
+		if (0 == offset) {
+			break;
+		}
+
+		__decode_music(&dirs, &musics[i]);
+	}
+
+	// 再往后看一首，作为下一页的起点
+	*from_offset = 0;
+
+	if (i == cnt && cnt > 0) {
+		node.data.value = &next_music_data_value;
+
+		if ((offset = hash_cursor_next(cursor, &node)) < 0) {
+			goto close_cursor;
+		}
+
+		*from_offset = offset;
+	}
+
+	ret = i;
+
+close_cursor:
+	hash_cursor_close(cursor);
+
+close_handle:
+	__free_dirs(&dirs);
+	hash_close(handle);
+
+exit:
+	return ret;
+}
+
+/* 该函数在 普通添加 和 diff链表可以复用
+ * 普通添加将curr_music的delete_or_not标记设置为MUSIC_KEEP
+ * diff链表将curr_music的delete_or_not标记设置为MUSIC_TO_BE_DOWNLOAD
+ */
+int _insert_music(const char* list_path, uint32_t which_slot,
+		const music_data_value_t* prev_music_data_value,
+		const music_data_value_t* curr_music_data_value) {
+	int ret = -1;
+	off_t offset = 0;
+	hash_handle_t* handle = NULL;
+	hash_node_data_t prev_node_data;
+	hash_node_data_t curr_node_data;
+	music_data_value_t prev_music;
+	music_data_value_t curr_music;
+	playlist_header_data_value_t playlist_header;
+	music_dir_table_t dirs;
+
+	memset(&dirs, 0, sizeof(music_dir_table_t));
+	memset(&playlist_header, 0, sizeof(playlist_header));
+
+	if (NULL == (handle = hash_open(list_path, HASH_OPEN_RDWR | HASH_OPEN_MMAP))) {
+		music_error("open '%s' failed.", list_path);
+		goto exit;
+	}
+
+	if (__load_dirs(handle, &dirs) < 0 || __prepare_dirs(handle, &dirs, curr_music_data_value, 1) < 0) {
+		goto close_handle;
+	}
+
+	__encode_music(&dirs, prev_music_data_value, &prev_music);
+	__encode_music(&dirs, curr_music_data_value, &curr_music);
+
+	// 如果存在，会将对应节点标记为MUSIC_KEEP
+	if (_find_music(handle, which_slot, curr_music.path) > 0) {
+		music_debug("already exist '%s'", curr_music_data_value->path);
+		ret = 0;
+		goto close_handle;
+	}
+
+	memset(&prev_node_data, 0, sizeof(prev_node_data));
+	memset(&curr_node_data, 0, sizeof(curr_node_data));
+
+	prev_node_data.key = which_slot;
+	prev_node_data.value = &prev_music;
+
+	curr_node_data.key = which_slot;
+	curr_node_data.value = &curr_music;
+
+	if (0 != (ret = hash_insert_node(handle, &prev_node_data, &curr_node_data, __add_music_cb))) {
+		music_error("[ + ] '%s' to '%s' failed!", curr_music_data_value->path, list_path);
+		goto close_handle;
+	}
+
+	music_info("[ + ] '%s' to '%s' success.", curr_music_data_value->path, list_path);
+
+	// 随机播放时把新歌曲加到排列中还没播放的部分
+	if (0 == __read_playlist_header(handle, &playlist_header) && __shuffle_on(&playlist_header, which_slot)
+			&& (offset = __music_offset(handle, which_slot, curr_music.path)) > 0) {
+		__update_shuffle(handle, which_slot, &playlist_header, &offset, 1, true);
+	}
+
+close_handle:
+	__free_dirs(&dirs);
+	hash_close(handle);
+
+exit:
+	return ret;
+}
+
+// 在已经打开的文件中批量添加，目录表中已经有 musics 的目录（需要时先调用 __prepare_dirs）
+int __insert_musics(hash_handle_t* handle, music_dir_table_t* dirs, uint32_t which_slot,
+		const music_data_value_t* prev_music_data_value,
+		const music_data_value_t* musics, uint32_t cnt) {
+	int ret = -1;
+	uint32_t i = 0;
+	hash_node_data_t prev_node_data;
+	hash_node_data_t* node_datas = NULL;
+	music_data_value_t prev_music;
+	music_data_value_t* encoded_musics = NULL;
+	off_t* offsets = NULL;
+	playlist_header_data_value_t playlist_header;
 
-	init_hash_engine(list_path, FORCE_INIT,
-			slot_cnt, sizeof(music_data_value_t), sizeof(playlist_header_data_value_t));
+	memset(&prev_node_data, 0, sizeof(prev_node_data));
+	memset(&playlist_header, 0, sizeof(playlist_header));
+
+	if (0 == cnt) {
+		ret = 0;
+		goto exit;
+	}
 
-	_get_playlist_header(__func__, __LINE__, list_path, &playlist_header);
-	playlist_header.playlist_cnt = slot_cnt;
-	_set_playlist_header(__func__, __LINE__, list_path, &playlist_header);
+	if (NULL == (node_datas = (hash_node_data_t*)calloc(cnt, sizeof(hash_node_data_t)))
+			|| NULL == (encoded_musics = (music_data_value_t*)calloc(cnt, sizeof(music_data_value_t)))) {
+		music_error("calloc failed.");
+		goto exit;
+	}
+
+	__encode_music(dirs, prev_music_data_value, &prev_music);
+	prev_node_data.key = which_slot;
+	prev_node_data.value = &prev_music;
+
+	for (i = 0; i < cnt; i++) {
+		__encode_music(dirs, &musics[i], &encoded_musics[i]);
+		node_datas[i].key = which_slot;
+		node_datas[i].value = &encoded_musics[i];
+	}
+
+	if (0 != (ret = hash_insert_nodes(handle, &prev_node_data, node_datas, cnt, __add_music_cb))) {
+		music_error("[ + ] %d musics to '%s' failed!", cnt, handle->path);
+		goto exit;
+	}
+
+	music_info("[ + ] %d musics to '%s' success.", cnt, handle->path);
+
+	if (0 == __read_playlist_header(handle, &playlist_header) && __shuffle_on(&playlist_header, which_slot)) {
+		if (NULL == (offsets = (off_t*)calloc(cnt, sizeof(off_t)))) {
+			music_error("calloc failed.");
+			goto exit;
+		}
+
+		for (i = 0; i < cnt; i++) {
+			offsets[i] = __music_offset(handle, which_slot, encoded_musics[i].path);
+		}
+
+		__update_shuffle(handle, which_slot, &playlist_header, offsets, cnt, true);
+	}
+
+exit:
+	safe_free(node_datas);
+	safe_free(encoded_musics);
+	safe_free(offsets);
+	return ret;
+}
+
+/*
+ * 批量添加，musics 按顺序接在 prev_music_data_value 之后，不检查歌曲是否已经存在
+ * 所有歌曲一次写入，适合 diff 链表、初次建立播放列表等场景
+ */
+int _insert_musics(const char* list_path, uint32_t which_slot,
+		const music_data_value_t* prev_music_data_value,
+		const music_data_value_t* musics, uint32_t cnt) {
+	int ret = -1;
+	hash_handle_t* handle = NULL;
+	music_dir_table_t dirs;
+
+	memset(&dirs, 0, sizeof(music_dir_table_t));
+
+	if (0 == cnt) {
+		ret = 0;
+		goto exit;
+	}
+
+	if (NULL == (handle = hash_open(list_path, HASH_OPEN_RDWR | HASH_OPEN_MMAP))) {
+		music_error("open '%s' failed.", list_path);
+		goto exit;
+	}
+
+	// 新目录一次加到目录表中
+	if (__load_dirs(handle, &dirs) < 0 || __prepare_dirs(handle, &dirs, musics, cnt) < 0) {
+		goto close_handle;
+	}
+
+	ret = __insert_musics(handle, &dirs, which_slot, prev_music_data_value, musics, cnt);
+
+close_handle:
+	__free_dirs(&dirs);
+	hash_close(handle);
+
+exit:
+	return ret;
+}
+
+/*
+ * 一次完成播放列表同步：musics 为新列表，which_slot 指定歌曲所在的播放列表。
+ * 新列表中没有的歌曲标记为 MUSIC_TO_BE_DELETE 并写入删除列表；新增的歌曲按新列表的顺序接在前一首之后，
+ * 标记为 MUSIC_TO_BE_DOWNLOAD 并写入下载列表；其余的标记为 MUSIC_KEEP。
+ * 结果和 _pre_diff_playlist、逐首 _insert_music、_post_diff_playlist 相同（下载列表按新列表的顺序），
+ * 但新列表放在内存中的集合里，每个播放列表只遍历一次，连续的新歌曲一次插入。返回新增的歌曲数，出错返回-1
+ */
+int _diff_playlist(const char* list_path, const music_data_value_t* musics, uint32_t cnt,
+		const char* download_list_path, const char* delete_list_path) {
+	int ret = -1;
+	uint32_t i = 0;
+	uint32_t pos = 0;
+	uint32_t which_slot = 0;
+	uint32_t slot_cnt = 0;
+	uint32_t run_start = 0;
+	uint32_t download_cnt = 0;
+	uint32_t total = 0;
+	hash_handle_t* handle = NULL;
+	playlist_header_data_value_t playlist_header;
+	music_path_set_t new_paths;
+	music_diff_info_t info;
+	music_data_value_t prev_music;
+	music_data_value_t empty_music;
+	music_data_value_t* downloads = NULL;
+	music_dir_table_t dirs;
+	char (*encoded_paths)[MAX_MUSIC_PATH_LEN] = NULL;
+
+	memset(&dirs, 0, sizeof(music_dir_table_t));
+	memset(&new_paths, 0, sizeof(music_path_set_t));
+	memset(&info, 0, sizeof(music_diff_info_t));
+	memset(&playlist_header, 0, sizeof(playlist_header));
+	memset(&empty_music, 0, sizeof(music_data_value_t));
+
+	if (NULL == (handle = hash_open(list_path, HASH_OPEN_RDWR | HASH_OPEN_MMAP))) {
+		music_error("open '%s' failed.", list_path);
+		goto exit;
+	}
+
+	// 新目录一次加到目录表中，新列表按文件中的形式编码后比较
+	if (__load_dirs(handle, &dirs) < 0 || __prepare_dirs(handle, &dirs, musics, cnt) < 0) {
+		goto close_handle;
+	}
+
+	if (cnt > 0 && (NULL == (encoded_paths = calloc(cnt, MAX_MUSIC_PATH_LEN))
+			|| NULL == (downloads = (music_data_value_t*)calloc(cnt, sizeof(music_data_value_t))))) {
+		music_error("calloc failed.");
+		goto close_handle;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		__encode_path(&dirs, musics[i].path, encoded_paths[i]);
+	}
+
+	__read_playlist_header(handle, &playlist_header);
+	slot_cnt = playlist_header.playlist_cnt;
+
+	_init_music_hash_engine(download_list_path, slot_cnt);
+	_init_music_hash_engine(delete_list_path, slot_cnt);
+
+	info.dirs = &dirs;
+
+	for (which_slot = 0; which_slot < slot_cnt; which_slot++) {
+		if (__path_set_init(&new_paths, cnt) < 0) {
+			goto close_handle;
+		}
+
+		if (NULL == (info.kept = (bool*)calloc(new_paths.cap, sizeof(bool)))) {
+			music_error("calloc failed.");
+			goto close_handle;
+		}
+
+		for (i = 0; i < cnt; i++) {
+			if (musics[i].which_slot % slot_cnt == which_slot) {
+				__path_set_add(&new_paths, encoded_paths[i]);
+			}
+		}
+
+		info.new_paths = &new_paths;
+		info.delete_musics.cnt = 0;
+		info.last_path[0] = '\0';
+
+		hash_traverse_nodes(handle, TRAVERSE_BY_LOGIC, which_slot, WITHOUT_PRINT, &info, __diff_playlist_cb);
+
+		memset(&prev_music, 0, sizeof(music_data_value_t));
+		__decode_path(&dirs, info.last_path, prev_music.path);
+
+		// 已有的歌曲把新歌曲分成若干段，每段接在它前面的那首之后
+		for (i = 0, run_start = download_cnt = 0; i < cnt; i++) {
+			if (musics[i].which_slot % slot_cnt != which_slot) {
+				continue;
+			}
+
+			pos = __path_set_pos(&new_paths, encoded_paths[i]);
+
+			// 老列表中已有，或者新列表中重复出现
+			if (info.kept[pos]) {
+				if (__insert_musics(handle, &dirs, which_slot, &prev_music,
+							&downloads[run_start], download_cnt - run_start) < 0) {
+					goto close_handle;
+				}
+
+				run_start = download_cnt;
+				prev_music = musics[i];
+				continue;
+			}
+
+			info.kept[pos] = true;
+
+			music_debug("下载 %s.", musics[i].path);
+			downloads[download_cnt] = musics[i];
+			downloads[download_cnt].delete_or_not = MUSIC_TO_BE_DOWNLOAD;
+			++download_cnt;
+		}
+
+		if (__insert_musics(handle, &dirs, which_slot, &prev_music,
+					&downloads[run_start], download_cnt - run_start) < 0) {
+			goto close_handle;
+		}
+
+		if (_insert_musics(delete_list_path, which_slot, &empty_music,
+					info.delete_musics.musics, info.delete_musics.cnt) < 0
+				|| _insert_musics(download_list_path, which_slot, &empty_music, downloads, download_cnt) < 0) {
+			goto close_handle;
+		}
+
+		music_info("slot %d of '%s' : %d to download, %d to delete.", which_slot, list_path,
+				download_cnt, info.delete_musics.cnt);
+
+		total += download_cnt;
+
+		__path_set_free(&new_paths);
+		safe_free(info.kept);
+	}
+
+	ret = total;
+
+close_handle:
+	hash_close(handle);
+
+exit:
+	__free_dirs(&dirs);
+	__path_set_free(&new_paths);
+	safe_free(info.kept);
+	safe_free(info.delete_musics.musics);
+	safe_free(downloads);
+	safe_free(encoded_paths);
+	return ret;
+}
+
+/************************************************
+ * 批量导入：按块读入 M3U 或每行一首的文本文件，直接在读缓冲区中切行，不逐行分配内存。
+ * 以'#'开头的行（#EXTM3U、#EXTINF 等）和空行跳过；读到的歌曲按路径去重，
+ * 攒够一批后一次插入，新节点在文件末尾连续分配，物理顺序就是播放顺序，每批只保存一次哈希槽信息
+ ***********************************************/
+
+#define MUSIC_IMPORT_BUF_SIZE (64 * 1024)	// 每次从文件读入的长度，超过它的行直接丢弃
+#define MUSIC_IMPORT_BATCH 512				// 攒够这么多首歌曲一次插入
+
+// 去重用的集合，按路径的64位哈希值开放寻址，哈希值相同时再比较保存下来的路径
+typedef struct {
+	uint64_t key;		// 0表示空位
+	uint32_t pos;		// 路径在 paths 中的位置
+} music_key_t;
+
+typedef struct {
+	music_key_t* keys;
+	uint32_t cap;
+	uint32_t cnt;
+	char* paths;		// 依次保存以'\0'结尾的路径
+	uint32_t len;
+	uint32_t size;
+} music_key_set_t;
+
+typedef struct {
+	hash_handle_t* handle;
+	music_dir_table_t dirs;
+	uint32_t which_slot;
+	bool check_existing;			// 哈希槽原来不为空，还要和已有的歌曲去重
+	music_key_set_t keys;
+	music_data_value_t prev_music;	// 下一批接在它后面
+	music_data_value_t* batch;
+	uint32_t batch_cnt;
+	uint32_t total;
+	uint32_t dup_cnt;
+} music_import_t;
+
+// 路径不在集合中时加入并返回1，已经在集合中返回0，出错返回-1
+int __key_set_add(music_key_set_t* set, const char* path, uint32_t len) {
+	uint32_t i = 0;
+	uint32_t pos = 0;
+	uint32_t cap = 0;
+	uint64_t key = hash_key64(path, len);
+	music_key_t* keys = NULL;
+	char* paths = NULL;
+
+	key = 0 == key ? 1 : key;
+
+	// 装载因子不超过一半，满了以后容量翻倍重新放入
+	if ((set->cnt + 1) * 2 > set->cap) {
+		cap = 0 == set->cap ? 1024 : set->cap * 2;
+
+		if (NULL == (keys = (music_key_t*)calloc(cap, sizeof(music_key_t)))) {
+			music_error("calloc failed.");
+			return -1;
+		}
+
+		for (i = 0; i < set->cap; i++) {
+			if (0 == set->keys[i].key) { continue; }
+
+			for (pos = set->keys[i].key & (cap - 1); 0 != keys[pos].key; pos = (pos + 1) & (cap - 1));
+			keys[pos] = set->keys[i];
+		}
+
+		safe_free(set->keys);
+		set->keys = keys;
+		set->cap = cap;
+	}
+
+	// 64位哈希值也可能冲突，相同时比较路径，不同的歌曲接着往后找
+	for (pos = key & (set->cap - 1); 0 != set->keys[pos].key; pos = (pos + 1) & (set->cap - 1)) {
+		if (key == set->keys[pos].key && len == strnlen(set->paths + set->keys[pos].pos, len + 1)
+				&& 0 == memcmp(set->paths + set->keys[pos].pos, path, len)) {
+			return 0;
+		}
+	}
+
+	if (set->len + len + 1 > set->size) {
+		for (cap = 0 == set->size ? MUSIC_IMPORT_BUF_SIZE : set->size; cap < set->len + len + 1; cap *= 2);
+
+		if (NULL == (paths = (char*)realloc(set->paths, cap))) {
+			music_error("realloc failed.");
+			return -1;
+		}
+
+		set->paths = paths;
+		set->size = cap;
+	}
+
+	memcpy(set->paths + set->len, path, len);
+	set->paths[set->len + len] = '\0';
+
+	set->keys[pos].key = key;
+	set->keys[pos].pos = set->len;
+	set->len += len + 1;
+	++set->cnt;
+
+	return 1;
+}
+
+// 插入攒下的一批歌曲，新目录先加到目录表中
+int __import_flush(music_import_t* import) {
+	if (0 == import->batch_cnt) {
+		return 0;
+	}
+
+	if (__prepare_dirs(import->handle, &import->dirs, import->batch, import->batch_cnt) < 0
+			|| __insert_musics(import->handle, &import->dirs, import->which_slot, &import->prev_music,
+				import->batch, import->batch_cnt) < 0) {
+		return -1;
+	}
+
+	import->prev_music = import->batch[import->batch_cnt - 1];
+	import->total += import->batch_cnt;
+	import->batch_cnt = 0;
 
 	return 0;
 }
+
+// 处理一行，line 指向读缓冲区，不以'\0'结尾
+int __import_line(music_import_t* import, const char* line, uint32_t len) {
+	int ret = -1;
+	char encoded[MAX_MUSIC_PATH_LEN];
+	music_data_value_t* music_data_value = NULL;
+
+	// UTF-8 BOM、首尾空白、Windows 换行
+	if (len >= 3 && 0 == memcmp(line, "\xEF\xBB\xBF", 3)) {
+		line += 3;
+		len -= 3;
+	}
+
+	while (len > 0 && (' ' == line[0] || '\t' == line[0])) { ++line; --len; }
+	while (len > 0 && (' ' == line[len - 1] || '\t' == line[len - 1] || '\r' == line[len - 1])) { --len; }
+
+	if (0 == len || '#' == line[0]) {
+		ret = 0;
+		goto exit;
+	}
+
+	if (len >= MAX_MUSIC_PATH_LEN) {
+		music_warn("path too long (%d bytes), skip '%.*s...'.", len, 32, line);
+		ret = 0;
+		goto exit;
+	}
+
+	if ((ret = __key_set_add(&import->keys, line, len)) <= 0) {
+		import->dup_cnt += 0 == ret ? 1 : 0;
+		goto exit;
+	}
+
+	music_data_value = &import->batch[import->batch_cnt];
+	memset(music_data_value, 0, sizeof(music_data_value_t));
+
+	memcpy(music_data_value->path, line, len);
+	music_data_value->delete_or_not = MUSIC_KEEP;
+	music_data_value->which_slot = import->which_slot;
+
+	// 目录还不在目录表中时按原样编码，这时文件中也不可能有压缩过的同一首歌
+	if (import->check_existing) {
+		__encode_path(&import->dirs, music_data_value->path, encoded);
+
+		if (__music_offset(import->handle, import->which_slot, encoded) > 0) {
+			++import->dup_cnt;
+			ret = 0;
+			goto exit;
+		}
+	}
+
+	if (++import->batch_cnt == MUSIC_IMPORT_BATCH && __import_flush(import) < 0) {
+		ret = -1;
+		goto exit;
+	}
+
+	ret = 0;
+
+exit:
+	return ret;
+}
+
+/*
+ * 从 M3U 或每行一首的文本文件批量导入到第 which_slot 个播放列表，接在已有歌曲之后
+ * 文件内部重复的、播放列表中已有的歌曲跳过。返回导入的歌曲数，出错返回-1（出错前已导入的歌曲保留）
+ */
+int _import_playlist(const char* list_path, uint32_t which_slot, const char* file_path) {
+	int ret = -1;
+	int fd = -1;
+	int cnt = 0;
+	ssize_t n_r = 0;
+	size_t len = 0;
+	bool eof = false;
+	bool skip_line = false;		// 正在丢弃一个比读缓冲区还长的行
+	char* buf = NULL;
+	char* line = NULL;
+	char* end = NULL;
+	char* nl = NULL;
+	hash_node_t node;
+	playlist_header_data_value_t playlist_header;
+	music_import_t import;
+
+	memset(&node, 0, sizeof(hash_node_t));
+	memset(&playlist_header, 0, sizeof(playlist_header));
+	memset(&import, 0, sizeof(music_import_t));
+
+	if ((fd = open(file_path, O_RDONLY)) < 0) {
+		music_error("open '%s' failed : %s.", file_path, strerror(errno));
+		goto exit;
+	}
+
+	if (NULL == (buf = (char*)malloc(MUSIC_IMPORT_BUF_SIZE))
+			|| NULL == (import.batch = (music_data_value_t*)calloc(MUSIC_IMPORT_BATCH, sizeof(music_data_value_t)))) {
+		music_error("calloc failed.");
+		goto exit;
+	}
+
+	if (NULL == (import.handle = hash_open(list_path, HASH_OPEN_RDWR | HASH_OPEN_MMAP))) {
+		music_error("open '%s' failed.", list_path);
+		goto exit;
+	}
+
+	if (__load_dirs(import.handle, &import.dirs) < 0) {
+		goto close_handle;
+	}
+
+	__read_playlist_header(import.handle, &playlist_header);
+	import.which_slot = which_slot % playlist_header.playlist_cnt;
+
+	// 接在最后一首之后
+	if ((cnt = hash_get_slot_node_cnt(import.handle, import.which_slot)) > 0) {
+		node.data.value = &import.prev_music;
+
+		if (hash_get_node_at(import.handle, import.which_slot, cnt - 1, &node) <= 0) {
+			goto close_handle;
+		}
+
+		__decode_music(&import.dirs, &import.prev_music);
+		import.check_existing = true;
+	}
+
+	while (!eof) {
+		if ((n_r = read(fd, buf + len, MUSIC_IMPORT_BUF_SIZE - len)) < 0) {
+			if (EINTR == errno) { continue; }
+			music_error("read '%s' failed : %s.", file_path, strerror(errno));
+			goto close_handle;
+		}
+
+		len += n_r;
+		eof = 0 == n_r;
+
+		// 处理缓冲区中完整的行，文件末尾没有换行时最后一行也算
+		for (line = buf, end = buf + len; line < end; line = nl + 1) {
+			if (NULL == (nl = (char*)memchr(line, '\n', end - line))) {
+				if (!eof) { break; }
+				nl = end;
+			}
+
+			if (skip_line) {
+				skip_line = false;
+				continue;
+			}
+
+			if (__import_line(&import, line, nl - line) < 0) {
+				goto close_handle;
+			}
+		}
+
+		if (line >= end) {
+			len = 0;
+			continue;
+		}
+
+		// 剩下半行移到开头，整个缓冲区都放不下一行时丢弃到下一个换行
+		if (line == buf && len == MUSIC_IMPORT_BUF_SIZE) {
+			music_warn("line longer than %d bytes in '%s', skip.", MUSIC_IMPORT_BUF_SIZE, file_path);
+			skip_line = true;
+			len = 0;
+			continue;
+		}
+
+		len = end - line;
+		memmove(buf, line, len);
+	}
+
+	if (__import_flush(&import) < 0) {
+		goto close_handle;
+	}
+
+	music_info("import %d musics (%d duplicated) from '%s' to slot %d of '%s'.",
+			import.total, import.dup_cnt, file_path, import.which_slot, list_path);
+
+	ret = import.total;
+
+close_handle:
+	__free_dirs(&import.dirs);
+	hash_close(import.handle);
+
+exit:
+	if (fd >= 0) { close(fd); }
+	safe_free(buf);
+	safe_free(import.batch);
+	safe_free(import.keys.keys);
+	safe_free(import.keys.paths);
+	return ret;
+}
+
+int _delete_music(const char* list_path, uint32_t which_slot, const char* path) {
+	int ret = -1;
+	off_t offset = 0;
+	hash_handle_t* handle = NULL;
+	hash_node_data_t node_data;
+	music_data_value_t music_data_value;
+	playlist_header_data_value_t playlist_header;
+	music_dir_table_t dirs;
+
+	memset(&node_data, 0, sizeof(node_data));
+	memset(&music_data_value, 0, sizeof(music_data_value));
+	memset(&playlist_header, 0, sizeof(playlist_header));
+
+	if (NULL == (handle = hash_open(list_path, HASH_OPEN_RDWR | HASH_OPEN_MMAP))) {
+		music_error("open '%s' failed.", list_path);
+		goto exit;
+	}
+
+	if (__load_dirs(handle, &dirs) < 0) {
+		goto close_handle;
+	}
+
+	__read_playlist_header(handle, &playlist_header);
+
+	music_data_value.delete_or_not = MUSIC_TO_BE_DELETE;
+	__encode_path(&dirs, path, music_data_value.path);
+	__free_dirs(&dirs);
+
+	node_data.key = which_slot % playlist_header.playlist_cnt;
+	node_data.value = &music_data_value;
+
+	// 删除之前记下位置，之后从随机排列中去掉
+	if (__shuffle_on(&playlist_header, node_data.key)) {
+		offset = __music_offset(handle, node_data.key, music_data_value.path);
+	}
+
+	if (0 != (ret = hash_del_node(handle, &node_data, __del_music_cb))) {
+		music_error("[ - ] '%s' from '%s' in slot '%d'.", path, list_path, node_data.key);
+		goto close_handle;
+	}
+
+	music_info("[ - ] '%s' from '%s' success.", path, list_path);
+
+	if (offset > 0) {
+		__update_shuffle(handle, node_data.key, &playlist_header, &offset, 1, false);
+	}
+
+close_handle:
+	hash_close(handle);
+
+exit:
+	return ret;
+}
+
+// 批量删除，一次遍历删除 which_slot 中所有路径在 paths 里的歌曲，返回删除的个数
+int _delete_musics(const char* list_path, uint32_t which_slot, const char** paths, uint32_t cnt) {
+	int ret = -1;
+	uint32_t i = 0;
+	uint32_t found_cnt = 0;
+	off_t* offsets = NULL;
+	hash_handle_t* handle = NULL;
+	music_path_set_t path_set;
+	playlist_header_data_value_t playlist_header;
+	music_dir_table_t dirs;
+	char (*encoded_paths)[MAX_MUSIC_PATH_LEN] = NULL;
+
+	memset(&path_set, 0, sizeof(path_set));
+	memset(&playlist_header, 0, sizeof(playlist_header));
+
+	if (0 == cnt) {
+		ret = 0;
+		goto exit;
+	}
+
+	if (__path_set_init(&path_set, cnt) < 0) {
+		goto exit;
+	}
+
+	if (NULL == (encoded_paths = calloc(cnt, MAX_MUSIC_PATH_LEN))) {
+		music_error("calloc failed.");
+		goto exit;
+	}
+
+	if (NULL == (handle = hash_open(list_path, HASH_OPEN_RDWR | HASH_OPEN_MMAP))) {
+		music_error("open '%s' failed.", list_path);
+		goto exit;
+	}
+
+	if (__load_dirs(handle, &dirs) < 0) {
+		goto close_handle;
+	}
+
+	// 节点中保存的是编码后的路径，集合里也放编码后的
+	for (i = 0; i < cnt; i++) {
+		__encode_path(&dirs, paths[i], encoded_paths[i]);
+		__path_set_add(&path_set, encoded_paths[i]);
+	}
+
+	__free_dirs(&dirs);
+
+	__read_playlist_header(handle, &playlist_header);
+
+	which_slot %= playlist_header.playlist_cnt;
+
+	// 删除之前记下位置，之后从随机排列中去掉
+	if (__shuffle_on(&playlist_header, which_slot)) {
+		if (NULL == (offsets = (off_t*)calloc(cnt, sizeof(off_t)))) {
+			music_error("calloc failed.");
+			goto close_handle;
+		}
+
+		for (i = 0; i < cnt; i++) {
+			if ((offsets[found_cnt] = __music_offset(handle, which_slot, encoded_paths[i])) > 0) {
+				++found_cnt;
+			}
+		}
+	}
+
+	if ((ret = hash_del_nodes(handle, which_slot, __delete_musics_cb, &path_set)) < 0) {
+		music_error("[ - ] %d musics from '%s' failed!", cnt, list_path);
+		goto close_handle;
+	}
+
+	music_info("[ - ] %d musics from '%s' success.", ret, list_path);
+
+	__update_shuffle(handle, which_slot, &playlist_header, offsets, found_cnt, false);
+
+close_handle:
+	hash_close(handle);
+
+exit:
+	__path_set_free(&path_set);
+	safe_free(encoded_paths);
+	safe_free(offsets);
+	return ret;
+}
+
+/************************************************
+ * 快照：开机时从快照恢复播放列表，不用逐首重新插入。导入后歌曲节点的位置变了，
+ * 头部附加数据中的上下首、播放记录以及随机排列都要换成新的位置；目录表不含位置，原样导入
+ ***********************************************/
+
+int __remap_shuffle_cb(void* buf, uint32_t len, void* input_arg) {
+	const hash_snapshot_map_t* map = (const hash_snapshot_map_t*)input_arg;
+	off_t* perm = (off_t*)buf;
+	uint32_t i = 0;
+
+	for (i = 0; i < len / sizeof(off_t); i++) {
+		perm[i] = hash_snapshot_map_offset(map, perm[i]);
+	}
+
+	return len;
+}
+
+int __restore_playlist_cb(hash_handle_t* handle, const hash_snapshot_map_t* map, void* input_arg) {
+	int len = 0;
+	uint32_t i = 0;
+	playlist_header_data_value_t playlist_header;
+	playlist_t* playlist = NULL;
+
+	memset(&playlist_header, 0, sizeof(playlist_header));
+
+	if (__read_playlist_header(handle, &playlist_header) < 0) {
+		return -1;
+	}
+
+	if (playlist_header.playlist_cnt > MAX_HASH_SLOT_CNT) {
+		music_error("bad playlist_cnt %d.", playlist_header.playlist_cnt);
+		return -1;
+	}
+
+	playlist_header.saved_offset_for_all = hash_snapshot_map_offset(map, playlist_header.saved_offset_for_all);
+
+	for (i = 0; i < playlist_header.playlist_cnt; i++) {
+		playlist = &playlist_header.playlist[i];
+		playlist->prev = hash_snapshot_map_offset(map, playlist->prev);
+		playlist->next = hash_snapshot_map_offset(map, playlist->next);
+		playlist->saved_offset = hash_snapshot_map_offset(map, playlist->saved_offset);
+
+		if ((len = hash_get_aux(handle, MUSIC_AUX_SHUFFLE + i, NULL, 0)) < 0) {
+			return -1;
+		}
+
+		if (len > 0 && hash_update_aux(handle, MUSIC_AUX_SHUFFLE + i, len, __remap_shuffle_cb, (void*)map) < 0) {
+			return -1;
+		}
+	}
+
+	return __write_playlist_header(handle, &playlist_header);
+}
+
+// 把播放列表导出成快照，见 hash_export_snapshot
+int _save_playlist(const char* list_path, const char* snapshot_path) {
+	int ret = -1;
+
+	if ((ret = export_snapshot(list_path, snapshot_path)) < 0) {
+		music_error("save '%s' to '%s' failed.", list_path, snapshot_path);
+	} else {
+		music_info("save '%s' to '%s'.", list_path, snapshot_path);
+	}
+
+	return ret;
+}
+
+// 用快照重建播放列表，代替 _init_music_hash_engine 之后逐首插入。快照损坏时播放列表保持原样
+int _restore_playlist(const char* list_path, const char* snapshot_path) {
+	int ret = -1;
+
+	if ((ret = hash_import_snapshot(snapshot_path, list_path, __restore_playlist_cb, NULL)) < 0) {
+		music_error("restore '%s' from '%s' failed.", list_path, snapshot_path);
+	} else {
+		music_info("restore '%s' from '%s'.", list_path, snapshot_path);
+	}
+
+	return ret;
+}
+
+int __init_music_hash_engine(const char* list_path, uint32_t slot_cnt, init_method_t rebuild) {
+	int ret = -1;
+	hash_handle_t* handle = NULL;
+	hash_config_t config;
+	playlist_header_data_value_t playlist_header;
+
+	memset(&config, 0, sizeof(hash_config_t));
+	memset(&playlist_header, 0, sizeof(playlist_header_data_value_t));
+
+	config.slot_cnt = slot_cnt;
+	config.node_data_value_size = sizeof(music_data_value_t);
+	config.header_data_value_size = sizeof(playlist_header_data_value_t);
+	config.index_cap = MUSIC_INDEX_CAP;
+
+	// 索引键由引擎根据路径计算。同一首歌可以出现在不同的哈希槽中，引擎查索引时会再比对槽号
+	config.key_field_offset = offsetof(music_data_value_t, path);
+	config.key_field_size = MAX_MUSIC_PATH_LEN;
+	config.key_field_flags = HASH_KEY_FIELD_STRING;
+
+	// 路径大多远短于 MAX_MUSIC_PATH_LEN，按实际长度保存
+	config.varlen_value = true;
+	config.value_tail_offset = offsetof(music_data_value_t, path);
+
+	// 按序号点歌、拖动进度条时直接定位第几首
+	config.rank_index = true;
+
+	if (init_hash_engine_ex(list_path, rebuild, &config) < 0) {
+		goto exit;
+	}
+
+	if (NULL == (handle = hash_open(list_path, HASH_OPEN_RDWR))) {
+		music_error("open '%s' failed.", list_path);
+		goto exit;
+	}
+
+	// 沿用已有文件时头部已经写好，不用再写
+	__read_playlist_header(handle, &playlist_header);
+
+	if (playlist_header.playlist_cnt != slot_cnt) {
+		playlist_header.playlist_cnt = slot_cnt;
+		__write_playlist_header(handle, &playlist_header);
+	}
+
+	hash_close(handle);
+
+	ret = 0;
+
+exit:
+	return ret;
+}
+
+int _init_music_hash_engine(const char* list_path, uint32_t slot_cnt) {
+	return __init_music_hash_engine(list_path, slot_cnt, FORCE_INIT);
+}
+
+// 开机时调用：已有的播放列表格式正确就直接使用，只读一次头部；不存在、版本或格式不对时才重建为空列表
+int _load_music_hash_engine(const char* list_path, uint32_t slot_cnt) {
+	return __init_music_hash_engine(list_path, slot_cnt, GENTLE_INIT);
+}
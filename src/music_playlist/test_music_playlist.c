@@ -1,6 +1,10 @@
 #include <stdio.h>
 #include <string.h>
 #include "music_node.h"
+#include "hash_log.h"
+
+// 引擎日志由后台线程异步输出，演示程序直接打印前先输出已有的日志，保持先后顺序
+#define demo_printf(...) do { hash_log_flush(); printf(__VA_ARGS__); } while (0)
 
 // 返回对应的哈希槽
 uint32_t find_slot_no_by_chan_name(const char* name) {
@@ -79,9 +83,9 @@ void diff_story_playlist() {
 	}
 #endif
 
-	printf("-- 原始故事列表 ---------------------------------------\n");
+	demo_printf("-- 原始故事列表 ---------------------------------------\n");
 	show_story_playlist();
-	printf("----------------------------------------------------------\n");
+	demo_printf("----------------------------------------------------------\n");
 
 	// 里面会把将节点的 delete_or_not 标记是 MUSIC_TO_BE_DELETE
 	pre_diff_story_playlist();
@@ -99,22 +103,194 @@ void diff_story_playlist() {
 		prev_music_data_value = curr_music_data_value;
 	}
 
-	printf("-- diff ---------------------------------------\n");
+	demo_printf("-- diff ---------------------------------------\n");
 	show_story_playlist();
-	printf("----------------------------------------------------------\n");
+	demo_printf("----------------------------------------------------------\n");
 
 	post_diff_story_playlist();
 
-	printf("-- post-diff ---------------------------------------\n");
+	demo_printf("-- post-diff ---------------------------------------\n");
 	show_story_playlist();
-	printf("----------------------------------------------------------\n");
+	demo_printf("----------------------------------------------------------\n");
 
-	printf("删除列表 : ");
+	demo_printf("删除列表 : ");
 	show_story_delete_list();
-	printf("下载列表 : ");
+	demo_printf("下载列表 : ");
 	show_story_download_list();
 }
 
+// 按播放顺序读出列表，和预期的歌曲逐首比较
+bool check_playlist(const char* list_path, const char** expected, uint32_t cnt) {
+	music_data_value_t musics[16];
+	off_t from_offset = 0;
+	int music_cnt = _list_musics(list_path, 0, &from_offset, musics, sizeof(musics) / sizeof(musics[0]));
+	bool same = (int)cnt == music_cnt;
+
+	for (uint32_t i = 0; same && i < cnt; i++) {
+		same = 0 == strncmp(musics[i].path, expected[i], MAX_MUSIC_PATH_LEN);
+	}
+
+	demo_printf("%s : %d 首，%s\n", list_path, music_cnt, same ? "和预期一致" : "和预期不一致");
+
+	return same;
+}
+
+/*
+ * 一次同步到新列表，结果和 diff_story_playlist 中 pre_diff、逐首插入、post_diff 相同：
+ * 新歌曲接在新列表中的前一首之后，不在新列表中的歌曲留在原处，标记为删除
+ */
+void sync_story_playlist_once() {
+	const char* playlist_1[] = {
+		"AAA",
+		"BBB",
+		"CCC",
+		"DDD",
+	};
+	const char* playlist_2[] = {
+		"BBB",
+		"EEE",
+		"CCC",
+		"FFF",
+	};
+	const char* synced_playlist[] = {
+		"AAA",
+		"BBB",
+		"EEE",
+		"CCC",
+		"FFF",
+		"DDD",
+	};
+	const char* download_list[] = {
+		"EEE",
+		"FFF",
+	};
+	const char* delete_list[] = {
+		"AAA",
+		"DDD",
+	};
+
+	music_data_value_t prev_music_data_value;
+	music_data_value_t musics[sizeof(playlist_2) / sizeof(char*)];
+
+	memset(&prev_music_data_value, 0, sizeof(music_data_value_t));
+	memset(musics, 0, sizeof(musics));
+
+	init_story_playlist_hash_engine();
+
+	for (int i = 0; i < sizeof(playlist_1) / sizeof(char*); i++) {
+		musics[0].delete_or_not = MUSIC_KEEP;
+		strncpy(musics[0].path, playlist_1[i], sizeof(musics[0].path));
+		insert_story_music(&prev_music_data_value, &musics[0]);
+		prev_music_data_value = musics[0];
+	}
+
+	for (int i = 0; i < sizeof(playlist_2) / sizeof(char*); i++) {
+		memset(&musics[i], 0, sizeof(music_data_value_t));
+		strncpy(musics[i].path, playlist_2[i], sizeof(musics[i].path));
+	}
+
+	demo_printf("-- sync 前 ---------------------------------------\n");
+	show_story_playlist();
+
+	// 删除列表、下载列表也一起生成，不用再调 post_diff
+	demo_printf("sync 新增 %d 首\n", sync_story_playlist(musics, sizeof(playlist_2) / sizeof(char*)));
+
+	demo_printf("-- sync 后 ---------------------------------------\n");
+	show_story_playlist();
+	demo_printf("----------------------------------------------------------\n");
+
+	check_playlist(STORY_PLAYLIST_PATH, synced_playlist, sizeof(synced_playlist) / sizeof(char*));
+	check_playlist(STORY_DOWNLOAD_LIST_PATH, download_list, sizeof(download_list) / sizeof(char*));
+	check_playlist(STORY_DELETE_LIST_PATH, delete_list, sizeof(delete_list) / sizeof(char*));
+}
+
+// 导入带 BOM、Windows 换行、注释行和重复行的 M3U，重复的歌曲只导入一次，顺序和文件中相同
+void import_story_m3u() {
+	const char* m3u_path = "story_import.m3u";
+	const char* expected[] = {
+		"/sdcard/story/a.mp3",
+		"/sdcard/story/b.mp3",
+		"/sdcard/story/c.mp3",
+	};
+	FILE* fp = NULL;
+
+	if (NULL == (fp = fopen(m3u_path, "w"))) {
+		demo_printf("create %s failed.\n", m3u_path);
+		return;
+	}
+
+	fputs("\xEF\xBB\xBF#EXTM3U\r\n"
+			"#EXTINF:120,a\r\n"
+			"/sdcard/story/a.mp3\r\n"
+			"\r\n"
+			"#EXTINF:95,b\r\n"
+			"  /sdcard/story/b.mp3  \r\n"
+			"/sdcard/story/a.mp3\r\n"
+			"/sdcard/story/c.mp3", fp);
+	fclose(fp);
+
+	init_story_playlist_hash_engine();
+
+	demo_printf("导入 %d 首\n", import_story_playlist(m3u_path));
+	show_story_playlist();
+
+	check_playlist(STORY_PLAYLIST_PATH, expected, sizeof(expected) / sizeof(char*));
+
+	remove(m3u_path);
+}
+
+// 保存快照后改动列表，再从快照恢复，恢复后的列表应该和保存时相同
+void save_and_restore_story_playlist() {
+	const char* snapshot_path = "story_playlist.snap";
+	const char* playlist[] = {
+		"/sdcard/story/a.mp3",
+		"/sdcard/story/b.mp3",
+		"/sdcard/story/c.mp3",
+		"/sdcard/story/d.mp3",
+	};
+	music_data_value_t prev_music_data_value;
+	music_data_value_t curr_music_data_value;
+
+	memset(&prev_music_data_value, 0, sizeof(music_data_value_t));
+	memset(&curr_music_data_value, 0, sizeof(music_data_value_t));
+
+	init_story_playlist_hash_engine();
+
+	for (int i = 0; i < sizeof(playlist) / sizeof(char*); i++) {
+		curr_music_data_value.delete_or_not = MUSIC_KEEP;
+		strncpy(curr_music_data_value.path, playlist[i], sizeof(curr_music_data_value.path));
+		insert_story_music(&prev_music_data_value, &curr_music_data_value);
+		prev_music_data_value = curr_music_data_value;
+	}
+
+	demo_printf("-- 保存前 ---------------------------------------\n");
+	show_story_playlist();
+
+	if (save_story_playlist(snapshot_path) < 0) {
+		demo_printf("save %s failed.\n", snapshot_path);
+		return;
+	}
+
+	delete_story_music(playlist[1]);
+	delete_story_music(playlist[3]);
+
+	demo_printf("-- 删除两首后 ---------------------------------------\n");
+	show_story_playlist();
+
+	if (restore_story_playlist(snapshot_path) < 0) {
+		demo_printf("restore %s failed.\n", snapshot_path);
+		return;
+	}
+
+	demo_printf("-- 恢复后 ---------------------------------------\n");
+	show_story_playlist();
+	demo_printf("----------------------------------------------------------\n");
+
+	check_playlist(STORY_PLAYLIST_PATH, playlist, sizeof(playlist) / sizeof(char*));
+
+	remove(snapshot_path);
+}
+
 void diff_album_playlist() {
 	const char* channel_1_0 = "chan_1_0";
 	const char* playlist_1_0[] = {
@@ -177,7 +353,7 @@ void diff_album_playlist() {
 
 	// 开始第一次添加歌曲
 	which_slot = 0;
-	printf("添加 %s 到 %d 哈希槽\n", channel_1_0, which_slot);
+	demo_printf("添加 %s 到 %d 哈希槽\n", channel_1_0, which_slot);
 	for (int i = 0; i < sizeof(playlist_1_0) / sizeof(char*); i++) {
 		curr_music_data_value.delete_or_not = MUSIC_KEEP;
 		strncpy(curr_music_data_value.path, playlist_1_0[i], sizeof(curr_music_data_value.path));
@@ -187,7 +363,7 @@ void diff_album_playlist() {
 	}
 
 	which_slot = 1;
-	printf("添加 %s 到 %d 哈希槽\n", channel_1_1, which_slot);
+	demo_printf("添加 %s 到 %d 哈希槽\n", channel_1_1, which_slot);
 	for (int i = 0; i < sizeof(playlist_1_1) / sizeof(char*); i++) {
 		curr_music_data_value.delete_or_not = MUSIC_KEEP;
 		strncpy(curr_music_data_value.path, playlist_1_1[i], sizeof(curr_music_data_value.path));
@@ -197,7 +373,7 @@ void diff_album_playlist() {
 	}
 
 	which_slot = 2;
-	printf("添加 %s 到 %d 哈希槽\n", channel_1_2, which_slot);
+	demo_printf("添加 %s 到 %d 哈希槽\n", channel_1_2, which_slot);
 	for (int i = 0; i < sizeof(playlist_1_2) / sizeof(char*); i++) {
 		curr_music_data_value.delete_or_not = MUSIC_KEEP;
 		strncpy(curr_music_data_value.path, playlist_1_2[i], sizeof(curr_music_data_value.path));
@@ -206,16 +382,16 @@ void diff_album_playlist() {
 		prev_music_data_value = curr_music_data_value;
 	}
 
-	printf("-- 原始专辑歌曲 ---------------------------------------\n");
+	demo_printf("-- 原始专辑歌曲 ---------------------------------------\n");
 	show_album_playlist();
-	printf("----------------------------------------------------------\n");
+	demo_printf("----------------------------------------------------------\n");
 
 	// 预处理
 	pre_diff_album_playlist();
 
 	// 开始第二次增加歌曲
 	which_slot = 0;
-	printf("添加 %s 到 %d 哈希槽\n", channel_2_0, which_slot);
+	demo_printf("添加 %s 到 %d 哈希槽\n", channel_2_0, which_slot);
 	for (int i = 0; i < sizeof(playlist_2_0) / sizeof(char*); i++) {
 		curr_music_data_value.delete_or_not = MUSIC_TO_BE_DOWNLOAD;
 		strncpy(curr_music_data_value.path, playlist_2_0[i], sizeof(curr_music_data_value.path));
@@ -225,7 +401,7 @@ void diff_album_playlist() {
 	}
 
 	which_slot = 1;
-	printf("添加 %s 到 %d 哈希槽\n", channel_2_1, which_slot);
+	demo_printf("添加 %s 到 %d 哈希槽\n", channel_2_1, which_slot);
 	for (int i = 0; i < sizeof(playlist_2_1) / sizeof(char*); i++) {
 		curr_music_data_value.delete_or_not = MUSIC_TO_BE_DOWNLOAD;
 		strncpy(curr_music_data_value.path, playlist_2_1[i], sizeof(curr_music_data_value.path));
@@ -235,7 +411,7 @@ void diff_album_playlist() {
 	}
 
 	which_slot = 2;
-	printf("添加 %s 到 %d 哈希槽\n", channel_2_2, which_slot);
+	demo_printf("添加 %s 到 %d 哈希槽\n", channel_2_2, which_slot);
 	for (int i = 0; i < sizeof(playlist_2_2) / sizeof(char*); i++) {
 		curr_music_data_value.delete_or_not = MUSIC_TO_BE_DOWNLOAD;
 		strncpy(curr_music_data_value.path, playlist_2_2[i], sizeof(curr_music_data_value.path));
@@ -244,24 +420,24 @@ void diff_album_playlist() {
 		prev_music_data_value = curr_music_data_value;
 	}
 
-	printf("-- diff专辑歌曲 ---------------------------------------\n");
+	demo_printf("-- diff专辑歌曲 ---------------------------------------\n");
 	show_album_playlist();
-	printf("----------------------------------------------------------\n");
+	demo_printf("----------------------------------------------------------\n");
 
 	// 处理完了后
 	post_diff_album_playlist();
 
-	printf("-- post-diff专辑歌曲 ---------------------------------------\n");
+	demo_printf("-- post-diff专辑歌曲 ---------------------------------------\n");
 	show_album_playlist();
-	printf("----------------------------------------------------------\n");
+	demo_printf("----------------------------------------------------------\n");
 
-	printf("-- 下载列表 ---------------------------------------\n");
+	demo_printf("-- 下载列表 ---------------------------------------\n");
 	show_album_download_list();
-	printf("----------------------------------------------------------\n");
+	demo_printf("----------------------------------------------------------\n");
 
-	printf("-- 删除列表 ---------------------------------------\n");
+	demo_printf("-- 删除列表 ---------------------------------------\n");
 	show_album_delete_list();
-	printf("----------------------------------------------------------\n");
+	demo_printf("----------------------------------------------------------\n");
 }
 
 void build_story_favorite_playlist() {
@@ -330,18 +506,15 @@ void build_story_favorite_playlist() {
 		prev_music_data_value = curr_music_data_value;
 	}
 
-	printf("-- 第 1 次添加歌曲 ---------------------------------------\n");
+	demo_printf("-- 第 1 次添加歌曲 ---------------------------------------\n");
 	show_story_playlist();
-	printf("----------------------------------------------------------\n");
+	demo_printf("----------------------------------------------------------\n");
 
-	for (int i = 0; i < sizeof(del_playlist_1) / sizeof(char*); i++) {
-		delete_story_music(del_playlist_1[i]);
-		prev_music_data_value = curr_music_data_value;
-	}
+	delete_story_musics(del_playlist_1, sizeof(del_playlist_1) / sizeof(char*));
 
-	printf("-- 第 1 次删除歌曲 ---------------------------------------\n");
+	demo_printf("-- 第 1 次删除歌曲 ---------------------------------------\n");
 	show_story_playlist();
-	printf("----------------------------------------------------------\n");
+	demo_printf("----------------------------------------------------------\n");
 
 	strncpy(prev_music_data_value.path, "DDD", sizeof(prev_music_data_value.path));
 	for (int i = 0; i < sizeof(playlist_2) / sizeof(char*); i++) {
@@ -352,16 +525,16 @@ void build_story_favorite_playlist() {
 		prev_music_data_value = curr_music_data_value;
 	}
 
-	printf("-- 第 2 次增加歌曲 ---------------------------------------\n");
+	demo_printf("-- 第 2 次增加歌曲 ---------------------------------------\n");
 	show_story_playlist();
-	printf("----------------------------------------------------------\n");
+	demo_printf("----------------------------------------------------------\n");
 
 	// 清空链表
 	clean_story_playlist();
 
-	printf("-- 清空链表后 --------------------------------------------\n");
+	demo_printf("-- 清空链表后 --------------------------------------------\n");
 	show_story_playlist();
-	printf("----------------------------------------------------------\n");
+	demo_printf("----------------------------------------------------------\n");
 
 	strncpy(prev_music_data_value.path, "XXX new", sizeof(prev_music_data_value.path));
 	for (int i = 0; i < sizeof(playlist_3) / sizeof(char*); i++) {
@@ -372,20 +545,20 @@ void build_story_favorite_playlist() {
 		prev_music_data_value = curr_music_data_value;
 	}
 
-	printf("-- 第 3 次增加歌曲 ---------------------------------------\n");
+	demo_printf("-- 第 3 次增加歌曲 ---------------------------------------\n");
 	show_story_playlist();
-	printf("----------------------------------------------------------\n");
+	demo_printf("----------------------------------------------------------\n");
 
 	music_cnt = get_story_playlist_music_cnt();
-	printf("-- [%d]\n", music_cnt);
+	demo_printf("-- [%d]\n", music_cnt);
 	for (int j = 0; j < music_cnt; j++) {
 		get_story_next_music();
 	}
-	printf("-------------\n");
+	demo_printf("-------------\n");
 	for (int j = 0; j < music_cnt; j++) {
 		get_story_prev_music();
 	}
-	printf("---------------------------------------\n");
+	demo_printf("---------------------------------------\n");
 }
 
 void build_album_favorite_playlist() {
@@ -470,7 +643,7 @@ void build_album_favorite_playlist() {
 	get_album_playlist_header(&header_data_value);
 
 	which_slot = find_slot_no_by_chan_name(channel_1_0);
-	printf("添加 %s 到 %d 哈希槽\n", channel_1_0, which_slot);
+	demo_printf("添加 %s 到 %d 哈希槽\n", channel_1_0, which_slot);
 	for (int i = 0; i < sizeof(playlist_1_0) / sizeof(char*); i++) {
 		curr_music_data_value.delete_or_not = MUSIC_KEEP;
 		strncpy(curr_music_data_value.path, playlist_1_0[i], sizeof(curr_music_data_value.path));
@@ -480,7 +653,7 @@ void build_album_favorite_playlist() {
 	}
 
 	which_slot = find_slot_no_by_chan_name(channel_1_1);
-	printf("添加 %s 到 %d 哈希槽\n", channel_1_1, which_slot);
+	demo_printf("添加 %s 到 %d 哈希槽\n", channel_1_1, which_slot);
 	for (int i = 0; i < sizeof(playlist_1_1) / sizeof(char*); i++) {
 		curr_music_data_value.delete_or_not = MUSIC_KEEP;
 		strncpy(curr_music_data_value.path, playlist_1_1[i], sizeof(curr_music_data_value.path));
@@ -490,7 +663,7 @@ void build_album_favorite_playlist() {
 	}
 
 	which_slot = find_slot_no_by_chan_name(channel_1_2);
-	printf("添加 %s 到 %d 哈希槽\n", channel_1_2, which_slot);
+	demo_printf("添加 %s 到 %d 哈希槽\n", channel_1_2, which_slot);
 	for (int i = 0; i < sizeof(playlist_1_2) / sizeof(char*); i++) {
 		curr_music_data_value.delete_or_not = MUSIC_KEEP;
 		strncpy(curr_music_data_value.path, playlist_1_2[i], sizeof(curr_music_data_value.path));
@@ -499,9 +672,9 @@ void build_album_favorite_playlist() {
 		prev_music_data_value = curr_music_data_value;
 	}
 
-	printf("-- 第 1 次添加歌曲 ---------------------------------------\n");
+	demo_printf("-- 第 1 次添加歌曲 ---------------------------------------\n");
 	show_album_playlist();
-	printf("----------------------------------------------------------\n");
+	demo_printf("----------------------------------------------------------\n");
 
 
 #if 0
@@ -514,15 +687,15 @@ void build_album_favorite_playlist() {
 	clean_album_playlist();
 #endif
 
-	printf("-- 第 1 次删除歌曲 ---------------------------------------\n");
+	demo_printf("-- 第 1 次删除歌曲 ---------------------------------------\n");
 	show_album_playlist();
-	printf("----------------------------------------------------------\n");
+	demo_printf("----------------------------------------------------------\n");
 
 	// 开始第二次增加歌曲
 	get_album_playlist_header(&header_data_value);
 
 	which_slot = find_slot_no_by_chan_name(channel_2_0);
-	printf("添加 %s 到 %d 哈希槽\n", channel_2_0, which_slot);
+	demo_printf("添加 %s 到 %d 哈希槽\n", channel_2_0, which_slot);
 	for (int i = 0; i < sizeof(playlist_2_0) / sizeof(char*); i++) {
 		curr_music_data_value.delete_or_not = MUSIC_KEEP;
 		strncpy(curr_music_data_value.path, playlist_2_0[i], sizeof(curr_music_data_value.path));
@@ -533,7 +706,7 @@ void build_album_favorite_playlist() {
 
 	strncpy(prev_music_data_value.path, "1E", sizeof(prev_music_data_value.path));
 	which_slot = find_slot_no_by_chan_name(channel_2_1);
-	printf("添加 %s 到 %d 哈希槽\n", channel_2_1, which_slot);
+	demo_printf("添加 %s 到 %d 哈希槽\n", channel_2_1, which_slot);
 	for (int i = 0; i < sizeof(playlist_2_1) / sizeof(char*); i++) {
 		curr_music_data_value.delete_or_not = MUSIC_KEEP;
 		strncpy(curr_music_data_value.path, playlist_2_1[i], sizeof(curr_music_data_value.path));
@@ -544,7 +717,7 @@ void build_album_favorite_playlist() {
 
 	strncpy(prev_music_data_value.path, "2J", sizeof(prev_music_data_value.path));
 	which_slot = find_slot_no_by_chan_name(channel_2_2);
-	printf("添加 %s 到 %d 哈希槽\n", channel_2_2, which_slot);
+	demo_printf("添加 %s 到 %d 哈希槽\n", channel_2_2, which_slot);
 	for (int i = 0; i < sizeof(playlist_2_2) / sizeof(char*); i++) {
 		curr_music_data_value.delete_or_not = MUSIC_KEEP;
 		strncpy(curr_music_data_value.path, playlist_2_2[i], sizeof(curr_music_data_value.path));
@@ -553,29 +726,29 @@ void build_album_favorite_playlist() {
 		prev_music_data_value = curr_music_data_value;
 	}
 
-	printf("-- 第 2 次增加歌曲 ---------------------------------------\n");
+	demo_printf("-- 第 2 次增加歌曲 ---------------------------------------\n");
 	show_album_playlist();
-	printf("----------------------------------------------------------\n");
+	demo_printf("----------------------------------------------------------\n");
 
 	get_album_playlist_header(&header_data_value);
 
 	// 打印
 	for (int i = 0; i < header_data_value.playlist_cnt; ++i) {
 		music_cnt = get_album_music_cnt_in_slot(i);
-		printf("---- album [%d] is %s, has %d music.\n", i, header_data_value.playlist[i].name, music_cnt);
+		demo_printf("---- album [%d] is %s, has %d music.\n", i, header_data_value.playlist[i].name, music_cnt);
 		for (int j = 0; j < music_cnt; ++j) {
 			get_album_next_music_in_slot(i);
 		}
 	}
-	printf("\n-------------\n\n");
+	demo_printf("\n-------------\n\n");
 	for (int i = 0; i < header_data_value.playlist_cnt; ++i) {
 		music_cnt = get_album_music_cnt_in_slot(i);
-		printf("---- album [%d] is %s, has %d music.\n", i, header_data_value.playlist[i].name, music_cnt);
+		demo_printf("---- album [%d] is %s, has %d music.\n", i, header_data_value.playlist[i].name, music_cnt);
 		for (int j = 0; j < music_cnt; j++) {
 			get_album_prev_music_in_slot(i);
 		}
 	}
-	printf("---------------------------------------\n");
+	demo_printf("---------------------------------------\n");
 }
 
 int test_music_playlist_main() {
@@ -583,6 +756,9 @@ int test_music_playlist_main() {
 	//diff_album_playlist();
 	//build_story_favorite_playlist();
 	build_album_favorite_playlist();
+	sync_story_playlist_once();
+	import_story_m3u();
+	save_and_restore_story_playlist();
 
 	return 0;
 }